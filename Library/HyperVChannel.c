@@ -0,0 +1,291 @@
+//
+//  HyperVChannel.c
+//  Userspace VMBus channel library
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVChannel.h"
+
+#include <string.h>
+
+#define kHyperVVMBusDeviceClass   "HyperVVMBusDevice"
+#define kHyperVVMBusInstanceKey   "HVInstance"
+
+#define HV_PACKETALIGN(a)         (((a) + (sizeof (uint64_t) - 1)) & ~(sizeof (uint64_t) - 1))
+
+static uint32_t getAvailableRxSpace(HyperVChannel *channel, uint32_t readIndex) {
+  uint32_t writeIndex = channel->rxRing->writeIndex;
+  return writeIndex >= readIndex ? channel->rxDataSize - (writeIndex - readIndex) : readIndex - writeIndex;
+}
+
+static uint32_t copyToRing(HyperVChannel *channel, uint32_t writeIndex, const void *data, uint32_t length) {
+  //
+  // Check for wraparound.
+  //
+  if (length > channel->txDataSize - writeIndex) {
+    uint32_t fragmentLength = channel->txDataSize - writeIndex;
+    memcpy(&channel->txData[writeIndex], data, fragmentLength);
+    memcpy(channel->txData, (const uint8_t *)data + fragmentLength, length - fragmentLength);
+  } else {
+    memcpy(&channel->txData[writeIndex], data, length);
+  }
+  return (writeIndex + length) % channel->txDataSize;
+}
+
+static uint32_t copyFromRing(HyperVChannel *channel, uint32_t readIndex, void *data, uint32_t length) {
+  //
+  // Check for wraparound.
+  //
+  if (length > channel->rxDataSize - readIndex) {
+    uint32_t fragmentLength = channel->rxDataSize - readIndex;
+    memcpy(data, &channel->rxData[readIndex], fragmentLength);
+    memcpy((uint8_t *)data + fragmentLength, channel->rxData, length - fragmentLength);
+  } else {
+    memcpy(data, &channel->rxData[readIndex], length);
+  }
+  return (readIndex + length) % channel->rxDataSize;
+}
+
+kern_return_t HyperVChannelOpen(const char *instance, uint32_t txSize, uint32_t rxSize, HyperVChannel *channel) {
+  kern_return_t status;
+
+  memset(channel, 0, sizeof (*channel));
+
+  //
+  // Find the device nub for the channel instance.
+  //
+  CFMutableDictionaryRef matching = IOServiceMatching(kHyperVVMBusDeviceClass);
+  if (matching == NULL) {
+    return kIOReturnNoMemory;
+  }
+  CFStringRef instanceKey    = CFSTR(kHyperVVMBusInstanceKey);
+  CFStringRef instanceString = CFStringCreateWithCString(kCFAllocatorDefault, instance, kCFStringEncodingUTF8);
+  if (instanceString == NULL) {
+    CFRelease(matching);
+    return kIOReturnBadArgument;
+  }
+  CFDictionaryRef propertyMatch = CFDictionaryCreate(kCFAllocatorDefault, (const void **)&instanceKey, (const void **)&instanceString, 1,
+                                                     &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  CFRelease(instanceString);
+  if (propertyMatch == NULL) {
+    CFRelease(matching);
+    return kIOReturnNoMemory;
+  }
+  CFDictionarySetValue(matching, CFSTR(kIOPropertyMatchKey), propertyMatch);
+  CFRelease(propertyMatch);
+
+  io_service_t service = IOServiceGetMatchingService(kIOMasterPortDefault, matching);
+  if (service == IO_OBJECT_NULL) {
+    return kIOReturnNotFound;
+  }
+  status = IOServiceOpen(service, mach_task_self(), 0, &channel->connect);
+  IOObjectRelease(service);
+  if (status != kIOReturnSuccess) {
+    return status;
+  }
+
+  //
+  // Open the channel, and map the control page and rings.
+  //
+  uint64_t input[2] = { txSize, rxSize };
+  status = IOConnectCallScalarMethod(channel->connect, kHyperVVMBusDeviceUserClientMethodOpen, input, 2, NULL, NULL);
+  if (status == kIOReturnSuccess) {
+    status = IOConnectMapMemory64(channel->connect, kHyperVVMBusDeviceMemoryTypeControl, mach_task_self(),
+                                  &channel->controlAddress, &channel->controlSize, kIOMapAnywhere);
+  }
+  if (status == kIOReturnSuccess) {
+    status = IOConnectMapMemory64(channel->connect, kHyperVVMBusDeviceMemoryTypeRings, mach_task_self(),
+                                  &channel->ringAddress, &channel->ringSize, kIOMapAnywhere);
+  }
+  if (status != kIOReturnSuccess) {
+    HyperVChannelClose(channel);
+    return status;
+  }
+
+  HyperVVMBusDeviceControl *control = (HyperVVMBusDeviceControl *)channel->controlAddress;
+  channel->control    = control;
+  channel->txRing     = (HyperVChannelRingState *)(channel->ringAddress + control->txRingOffset);
+  channel->txData     = (uint8_t *)channel->txRing + control->pageSize;
+  channel->txDataSize = control->txDataSize;
+  channel->rxRing     = (HyperVChannelRingState *)(channel->ringAddress + control->rxRingOffset);
+  channel->rxData     = (uint8_t *)channel->rxRing + control->pageSize;
+  channel->rxDataSize = control->rxDataSize;
+  return kIOReturnSuccess;
+}
+
+void HyperVChannelClose(HyperVChannel *channel) {
+  if (channel->connect == IO_OBJECT_NULL) {
+    return;
+  }
+
+  if (channel->ringAddress != 0) {
+    IOConnectUnmapMemory64(channel->connect, kHyperVVMBusDeviceMemoryTypeRings, mach_task_self(), channel->ringAddress);
+  }
+  if (channel->controlAddress != 0) {
+    IOConnectUnmapMemory64(channel->connect, kHyperVVMBusDeviceMemoryTypeControl, mach_task_self(), channel->controlAddress);
+  }
+  IOConnectCallScalarMethod(channel->connect, kHyperVVMBusDeviceUserClientMethodClose, NULL, 0, NULL, NULL);
+  IOServiceClose(channel->connect);
+
+  memset(channel, 0, sizeof (*channel));
+}
+
+kern_return_t HyperVChannelWritePacket(HyperVChannel *channel, uint16_t type, uint16_t flags, uint64_t transactionId,
+                                       const void *data, uint32_t dataLength) {
+  HyperVChannelPacketHeader header;
+  static const uint8_t      padding[sizeof (uint64_t)] = { 0 };
+
+  uint32_t packetLength        = sizeof (header) + dataLength;
+  uint32_t packetLengthAligned = HV_PACKETALIGN(packetLength);
+  if (dataLength > channel->txDataSize || (packetLengthAligned >> kHyperVChannelPacketSizeShift) > UINT16_MAX) {
+    return kIOReturnBadArgument;
+  }
+
+  //
+  // Packet is followed by the previous write index.
+  // The ring cannot be filled completely, as read index == write index indicates an empty ring.
+  //
+  uint32_t writeIndexOld = channel->txRing->writeIndex;
+  uint32_t readIndex     = channel->txRing->readIndex;
+  uint32_t available     = writeIndexOld >= readIndex
+                           ? channel->txDataSize - (writeIndexOld - readIndex) : readIndex - writeIndexOld;
+  if (available <= packetLengthAligned + sizeof (uint64_t)) {
+    return kIOReturnNoSpace;
+  }
+
+  header.type          = type;
+  header.headerLength  = sizeof (header) >> kHyperVChannelPacketSizeShift;
+  header.totalLength   = packetLengthAligned >> kHyperVChannelPacketSizeShift;
+  header.flags         = flags;
+  header.transactionId = transactionId;
+
+  uint64_t writeIndexShifted = ((uint64_t)writeIndexOld) << 32;
+  uint32_t writeIndexNew     = copyToRing(channel, writeIndexOld, &header, sizeof (header));
+  writeIndexNew = copyToRing(channel, writeIndexNew, data, dataLength);
+  writeIndexNew = copyToRing(channel, writeIndexNew, padding, packetLengthAligned - packetLength);
+  writeIndexNew = copyToRing(channel, writeIndexNew, &writeIndexShifted, sizeof (writeIndexShifted));
+
+  //
+  // Packet contents must be visible before the new write index.
+  // Hyper-V only needs to be signaled if it had read everything before this packet, otherwise it picks this one up too.
+  //
+  __sync_synchronize();
+  channel->txRing->writeIndex = writeIndexNew;
+  __sync_synchronize();
+  if (channel->txRing->readIndex == writeIndexOld) {
+    channel->isSignalPending = true;
+  }
+  return kIOReturnSuccess;
+}
+
+kern_return_t HyperVChannelFlush(HyperVChannel *channel) {
+  if (!channel->isSignalPending) {
+    return kIOReturnSuccess;
+  }
+  channel->isSignalPending = false;
+
+  //
+  // Host sets the TX interrupt mask while it is already polling the ring.
+  //
+  if (channel->txRing->interruptMask != 0) {
+    return kIOReturnSuccess;
+  }
+  return IOConnectCallScalarMethod(channel->connect, kHyperVVMBusDeviceUserClientMethodSignal, NULL, 0, NULL, NULL);
+}
+
+kern_return_t HyperVChannelSendInband(HyperVChannel *channel, const void *data, uint32_t dataLength,
+                                      uint64_t transactionId, bool responseRequired) {
+  kern_return_t status = HyperVChannelWritePacket(channel, kHyperVChannelPacketTypeDataInband,
+                                                  responseRequired ? kHyperVChannelPacketFlagResponseRequired : 0,
+                                                  transactionId, data, dataLength);
+  if (status != kIOReturnSuccess) {
+    return status;
+  }
+  return HyperVChannelFlush(channel);
+}
+
+kern_return_t HyperVChannelPeekPacket(HyperVChannel *channel, HyperVChannelPacketHeader *header) {
+  uint32_t readIndex = channel->rxRing->readIndex;
+  if (readIndex == channel->rxRing->writeIndex) {
+    return kIOReturnNotFound;
+  }
+
+  //
+  // Packet contents are only valid once the write index covering them has been seen.
+  //
+  __sync_synchronize();
+  copyFromRing(channel, readIndex, header, sizeof (*header));
+  return kIOReturnSuccess;
+}
+
+kern_return_t HyperVChannelReadPacket(HyperVChannel *channel, HyperVChannelPacketHeader *header, void *buffer, uint32_t *bufferLength) {
+  kern_return_t status = HyperVChannelPeekPacket(channel, header);
+  if (status != kIOReturnSuccess) {
+    return status;
+  }
+
+  uint32_t headerLength = (uint32_t)header->headerLength << kHyperVChannelPacketSizeShift;
+  uint32_t totalLength  = (uint32_t)header->totalLength << kHyperVChannelPacketSizeShift;
+  if (headerLength < sizeof (*header) || totalLength < headerLength || totalLength + sizeof (uint64_t) > channel->rxDataSize) {
+    return kIOReturnBadMedia;
+  }
+
+  //
+  // Extended headers, such as transfer page ranges, are skipped. Callers needing them can read them with the data by peeking.
+  //
+  uint32_t dataLength = totalLength - headerLength;
+  if (*bufferLength < dataLength) {
+    *bufferLength = dataLength;
+    return kIOReturnNoSpace;
+  }
+
+  uint32_t readIndex = channel->rxRing->readIndex;
+  copyFromRing(channel, (readIndex + headerLength) % channel->rxDataSize, buffer, dataLength);
+  *bufferLength = dataLength;
+
+  //
+  // Packet must be copied out before its space is handed back to Hyper-V.
+  //
+  uint32_t readIndexNew = (readIndex + totalLength + sizeof (uint64_t)) % channel->rxDataSize;
+  uint32_t rxSpaceOld   = getAvailableRxSpace(channel, readIndex);
+  __sync_synchronize();
+  channel->rxRing->readIndex = readIndexNew;
+
+  //
+  // Hyper-V may be waiting for space to write its next packet, signal it only when this read freed enough.
+  //
+  __sync_synchronize();
+  uint32_t pendingSendSize = channel->rxRing->pendingSendSize;
+  if (pendingSendSize != 0 && rxSpaceOld <= pendingSendSize && getAvailableRxSpace(channel, readIndexNew) > pendingSendSize) {
+    return IOConnectCallScalarMethod(channel->connect, kHyperVVMBusDeviceUserClientMethodSignal, NULL, 0, NULL, NULL);
+  }
+  return kIOReturnSuccess;
+}
+
+void HyperVChannelSetInterruptMask(HyperVChannel *channel, bool masked) {
+  channel->rxRing->interruptMask = masked ? 1 : 0;
+  __sync_synchronize();
+}
+
+kern_return_t HyperVChannelWait(HyperVChannel *channel, uint32_t timeoutMS) {
+  while (true) {
+    //
+    // Packets may have arrived while interrupts were masked, no interrupt is raised for them.
+    //
+    uint32_t interruptCount = channel->control->interruptCount;
+    HyperVChannelSetInterruptMask(channel, false);
+    if (channel->rxRing->readIndex != channel->rxRing->writeIndex) {
+      return kIOReturnSuccess;
+    }
+
+    uint64_t input[2]    = { interruptCount, timeoutMS };
+    uint64_t output      = 0;
+    uint32_t outputCount = 1;
+    kern_return_t status = IOConnectCallScalarMethod(channel->connect, kHyperVVMBusDeviceUserClientMethodWaitInterrupt,
+                                                     input, 2, &output, &outputCount);
+    if (status != kIOReturnSuccess) {
+      return status;
+    }
+  }
+}
@@ -0,0 +1,117 @@
+//
+//  HyperVChannel.h
+//  Userspace VMBus channel library
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Packets are read from and written to the channel rings mapped from HyperVVMBusDeviceUserClient,
+// only signaling Hyper-V and waiting for interrupts go through the kernel.
+//
+// Only channels that are not used by a driver can be opened, and only by administrators.
+// A channel is not thread safe, use one reader and one writer thread at most.
+//
+
+#ifndef HyperVChannel_h
+#define HyperVChannel_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <IOKit/IOKitLib.h>
+
+#include "../MacHyperVSupport/VMBusDevice/HyperVVMBusDeviceShared.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Packet types and flags, from VMBus.hpp.
+//
+#define kHyperVChannelPacketTypeDataInband      6
+#define kHyperVChannelPacketTypeCompletion      11
+
+#define kHyperVChannelPacketFlagResponseRequired  1
+
+#define kHyperVChannelPacketSizeShift           3
+
+//
+// Packet header, lengths are multiples of 8 bytes and include the header itself.
+//
+typedef struct __attribute__((packed)) {
+  uint16_t  type;
+  uint16_t  headerLength;
+  uint16_t  totalLength;
+  uint16_t  flags;
+  uint64_t  transactionId;
+} HyperVChannelPacketHeader;
+
+//
+// Ring state at the start of each ring, the ring data follows one page later.
+//
+typedef struct __attribute__((packed)) {
+  volatile uint32_t writeIndex;
+  volatile uint32_t readIndex;
+  volatile uint32_t interruptMask;
+  volatile uint32_t pendingSendSize;
+  uint32_t          reserved[12];
+  uint32_t          features;
+} HyperVChannelRingState;
+
+typedef struct {
+  io_connect_t              connect;
+
+  HyperVVMBusDeviceControl  *control;
+  mach_vm_address_t         controlAddress;
+  mach_vm_size_t            controlSize;
+  mach_vm_address_t         ringAddress;
+  mach_vm_size_t            ringSize;
+
+  HyperVChannelRingState    *txRing;
+  uint8_t                   *txData;
+  uint32_t                  txDataSize;
+  HyperVChannelRingState    *rxRing;
+  uint8_t                   *rxData;
+  uint32_t                  rxDataSize;
+
+  //
+  // Set when Hyper-V had read everything before a packet was written, and needs a signal on flush.
+  //
+  bool                      isSignalPending;
+} HyperVChannel;
+
+//
+// Opens the channel with the given HVInstance property, ring sizes must be a multiple of the page size.
+//
+kern_return_t HyperVChannelOpen(const char *instance, uint32_t txSize, uint32_t rxSize, HyperVChannel *channel);
+void HyperVChannelClose(HyperVChannel *channel);
+
+//
+// Writes a packet to the TX ring, returns kIOReturnNoSpace if the ring is full.
+// Written packets are seen by Hyper-V once HyperVChannelFlush is called, batches need only a single flush.
+//
+kern_return_t HyperVChannelWritePacket(HyperVChannel *channel, uint16_t type, uint16_t flags, uint64_t transactionId,
+                                       const void *data, uint32_t dataLength);
+kern_return_t HyperVChannelFlush(HyperVChannel *channel);
+kern_return_t HyperVChannelSendInband(HyperVChannel *channel, const void *data, uint32_t dataLength,
+                                      uint64_t transactionId, bool responseRequired);
+
+//
+// Reads the next packet from the RX ring, returns kIOReturnNotFound if the ring is empty.
+// Data after the packet header is copied, returns kIOReturnNoSpace with the required length if the buffer is too small.
+//
+kern_return_t HyperVChannelPeekPacket(HyperVChannel *channel, HyperVChannelPacketHeader *header);
+kern_return_t HyperVChannelReadPacket(HyperVChannel *channel, HyperVChannelPacketHeader *header, void *buffer, uint32_t *bufferLength);
+
+//
+// Masking RX interrupts is preferred while polling, waiting unmasks them.
+// Waits until a packet is in the RX ring, or the timeout in milliseconds elapses. A timeout of 0 waits indefinitely.
+//
+void HyperVChannelSetInterruptMask(HyperVChannel *channel, bool masked);
+kern_return_t HyperVChannelWait(HyperVChannel *channel, uint32_t timeoutMS);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,190 @@
+//
+//  HyperVDynamicMemory.cpp
+//  Hyper-V Dynamic Memory driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVDynamicMemory.hpp"
+
+OSDefineMetaClassAndStructors(HyperVDynamicMemory, super);
+
+bool HyperVDynamicMemory::start(IOService *provider) {
+  bool channelOpen = false;
+
+  if (!super::start(provider)) {
+    return false;
+  }
+
+  //
+  // Get parent VMBus device object.
+  //
+  hvDevice = OSDynamicCast(HyperVVMBusDevice, provider);
+  if (hvDevice == NULL) {
+    super::stop(provider);
+    return false;
+  }
+  hvDevice->retain();
+
+  do {
+    dmLock            = IOLockAlloc();
+    balloonResponse   = (HyperVDynamicMemoryMessageBalloonResponse *)IOMalloc(kHyperVDynamicMemoryMaxResponseSize);
+    balloonThreadCall = thread_call_allocate(&HyperVDynamicMemory::handleBalloonThreadCall, this);
+    if (dmLock == NULL || balloonResponse == NULL || balloonThreadCall == NULL) {
+      SYSLOG("Failed to allocate Dynamic Memory resources");
+      break;
+    }
+
+    //
+    // Configure interrupt and status report timer.
+    //
+    interruptSource =
+      IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &HyperVDynamicMemory::handleInterrupt), provider, 0);
+    timerSource = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &HyperVDynamicMemory::handleTimer));
+    if (interruptSource == NULL || timerSource == NULL) {
+      SYSLOG("Failed to create event sources");
+      break;
+    }
+    getWorkLoop()->addEventSource(interruptSource);
+    getWorkLoop()->addEventSource(timerSource);
+    interruptSource->enable();
+
+    //
+    // Configure the channel and report capabilities to Hyper-V.
+    //
+    if (!hvDevice->openChannel(kHyperVDynamicMemoryRingBufferSize, kHyperVDynamicMemoryRingBufferSize)) {
+      break;
+    }
+    channelOpen = true;
+
+    if (!negotiateProtocolVersion() || !sendCapabilities()) {
+      break;
+    }
+
+    //
+    // Hyper-V uses periodic status reports to decide when to balloon or add memory.
+    //
+    updateStatistics();
+    timerSource->enable();
+    timerSource->setTimeoutMS(kHyperVDynamicMemoryStatusIntervalMS);
+
+    SYSLOG("Initialized Hyper-V Dynamic Memory with protocol version 0x%X", protocolVersion);
+    return true;
+  } while (false);
+
+  if (channelOpen) {
+    hvDevice->closeChannel();
+  }
+  freeDynamicMemory();
+  super::stop(provider);
+  return false;
+}
+
+void HyperVDynamicMemory::stop(IOService *provider) {
+  DBGLOG("Hyper-V Dynamic Memory is stopping");
+
+  if (timerSource != NULL) {
+    timerSource->cancelTimeout();
+    timerSource->disable();
+  }
+
+  //
+  // Wait for any balloon request in progress to stop.
+  //
+  if (dmLock != NULL) {
+    IOLockLock(dmLock);
+    isStopping = true;
+    if (balloonThreadCall != NULL && thread_call_cancel(balloonThreadCall)) {
+      isBallooning = false;
+    }
+    while (isBallooning) {
+      IOLockSleep(dmLock, &isBallooning, THREAD_UNINT);
+    }
+    IOLockUnlock(dmLock);
+  }
+
+  if (hvDevice != NULL) {
+    hvDevice->closeChannel();
+  }
+  freeDynamicMemory();
+  super::stop(provider);
+}
+
+void HyperVDynamicMemory::freeDynamicMemory() {
+  if (interruptSource != NULL) {
+    interruptSource->disable();
+    getWorkLoop()->removeEventSource(interruptSource);
+    OSSafeReleaseNULL(interruptSource);
+  }
+  if (timerSource != NULL) {
+    timerSource->cancelTimeout();
+    timerSource->disable();
+    getWorkLoop()->removeEventSource(timerSource);
+    OSSafeReleaseNULL(timerSource);
+  }
+
+  //
+  // Any pages still in the balloon are returned to the system.
+  //
+  freeBalloon();
+
+  if (balloonThreadCall != NULL) {
+    thread_call_free(balloonThreadCall);
+    balloonThreadCall = NULL;
+  }
+  if (balloonResponse != NULL) {
+    IOFree(balloonResponse, kHyperVDynamicMemoryMaxResponseSize);
+    balloonResponse = NULL;
+  }
+  if (dmLock != NULL) {
+    IOLockFree(dmLock);
+    dmLock = NULL;
+  }
+  OSSafeReleaseNULL(hvDevice);
+}
+
+void HyperVDynamicMemory::handleTimer(IOTimerEventSource *sender) {
+  sendStatusReport();
+  updateStatistics();
+  sender->setTimeoutMS(kHyperVDynamicMemoryStatusIntervalMS);
+}
+
+void HyperVDynamicMemory::updateStatistics() {
+  OSDictionary *stats = OSDictionary::withCapacity(14);
+  if (stats == NULL) {
+    return;
+  }
+
+  IOLockLock(dmLock);
+  const struct {
+    const char  *key;
+    UInt64      value;
+  } values[] = {
+    { "BalloonPages",               balloonPageCount },
+    { "BalloonChunks",              balloonChunkCount },
+    { "StatusReportCount",          statusReportCount },
+    { "BalloonRequestCount",        balloonRequestCount },
+    { "UnballoonRequestCount",      unballoonRequestCount },
+    { "LastBalloonRequestPages",    lastBalloonRequestPages },
+    { "LastBalloonPages",           lastBalloonPages },
+    { "LastBalloonUS",              lastBalloonUS },
+    { "LastUnballoonPages",         lastUnballoonPages },
+    { "LastUnballoonUS",            lastUnballoonUS },
+    { "SinglePageAllocationCount",  singlePageAllocationCount },
+    { "HotAddRequestCount",         hotAddRequestCount },
+    { "HotAddRequestedPages",       hotAddRequestedPages },
+    { "LastHotAddUS",               lastHotAddUS }
+  };
+  IOLockUnlock(dmLock);
+
+  for (UInt32 i = 0; i < ARRAY_SIZE(values); i++) {
+    OSNumber *number = OSNumber::withNumber(values[i].value, 64);
+    if (number != NULL) {
+      stats->setObject(values[i].key, number);
+      number->release();
+    }
+  }
+
+  setProperty(kHyperVDynamicMemoryStatisticsKey, stats);
+  stats->release();
+}
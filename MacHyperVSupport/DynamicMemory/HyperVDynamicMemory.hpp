@@ -0,0 +1,130 @@
+//
+//  HyperVDynamicMemory.hpp
+//  Hyper-V Dynamic Memory driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVDynamicMemory_hpp
+#define HyperVDynamicMemory_hpp
+
+#include "HyperVVMBusDevice.hpp"
+#include "HyperVDynamicMemoryRegs.hpp"
+#include "HyperV.hpp"
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <kern/thread_call.h>
+
+#define super IOService
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVDynamicMemory", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVDynamicMemory", str, ## __VA_ARGS__)
+
+#define kHyperVDynamicMemoryStatisticsKey   "DynamicMemoryStatistics"
+
+//
+// Pages given to Hyper-V, freed once all of their pages have been returned.
+//
+typedef struct {
+  IOBufferMemoryDescriptor  *memoryDescriptor;
+  UInt64                    startPage;
+  UInt32                    pageCount;
+  UInt32                    returnedPageCount;
+} HyperVDynamicMemoryBalloonChunk;
+
+class HyperVDynamicMemory : public IOService {
+  OSDeclareDefaultStructors(HyperVDynamicMemory);
+
+private:
+  //
+  // Parent VMBus device.
+  //
+  HyperVVMBusDevice       *hvDevice;
+  IOInterruptEventSource  *interruptSource;
+  IOTimerEventSource      *timerSource;
+  IOLock                  *dmLock;
+  bool                    isStopping;
+
+  HyperVDynamicMemoryProtocolVersion  protocolVersion;
+  volatile UInt32                     nextTransactionId;
+
+  //
+  // Version and capabilities responses are received as separate messages during startup.
+  //
+  bool                            isWaitingResponse;
+  HyperVDynamicMemoryMessageType  waitingResponseType;
+  HyperVDynamicMemoryMessage      responseMessage;
+
+  //
+  // Balloon state, chunks are protected by dmLock.
+  // Balloon requests are handled on a thread call, as allocating pages can take a while.
+  //
+  HyperVDynamicMemoryBalloonChunk           *balloonChunks;
+  UInt32                                    balloonChunkCount;
+  UInt32                                    balloonChunkCapacity;
+  bool                                      isBalloonSorted;
+  UInt64                                    balloonPageCount;
+  thread_call_t                             balloonThreadCall;
+  bool                                      isBallooning;
+  bool                                      isBalloonRequestPending;
+  UInt32                                    pendingBalloonPageCount;
+  HyperVDynamicMemoryMessageBalloonResponse *balloonResponse;
+
+  //
+  // Unballoon requests may be split over multiple messages.
+  //
+  bool                    isUnballooning;
+  UInt64                  unballoonStartTime;
+  UInt64                  unballoonPageCount;
+
+  //
+  // Statistics, times are in microseconds.
+  //
+  UInt64                  statusReportCount;
+  UInt64                  balloonRequestCount;
+  UInt64                  unballoonRequestCount;
+  UInt64                  lastBalloonRequestPages;
+  UInt64                  lastBalloonPages;
+  UInt64                  lastBalloonUS;
+  UInt64                  lastUnballoonPages;
+  UInt64                  lastUnballoonUS;
+  UInt64                  singlePageAllocationCount;
+  UInt64                  hotAddRequestCount;
+  UInt64                  hotAddRequestedPages;
+  UInt64                  lastHotAddUS;
+
+  void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
+  void handleTimer(IOTimerEventSource *sender);
+  void handleIncomingMessage(HyperVDynamicMemoryMessage *dmMessage, UInt32 messageLength);
+  void handleBalloonRequest(HyperVDynamicMemoryMessageBalloonRequest *balloonRequest);
+  void handleUnballoonRequest(HyperVDynamicMemoryMessageUnballoonRequest *unballoonRequest, UInt32 messageLength);
+  void handleHotAddRequest(HyperVDynamicMemoryMessageHotAddRequest *hotAddRequest, UInt32 messageLength);
+
+  bool sendDynamicMemoryMessage(HyperVDynamicMemoryMessage *dmMessage, UInt16 messageLength);
+  bool sendDynamicMemoryMessageWithResponse(HyperVDynamicMemoryMessage *dmMessage, UInt16 messageLength, HyperVDynamicMemoryMessageType responseType);
+  bool negotiateProtocolVersion();
+  bool sendCapabilities();
+  void sendStatusReport();
+
+  static void handleBalloonThreadCall(thread_call_param_t param0, thread_call_param_t param1);
+  void inflateBalloon(UInt32 pageCount);
+  bool allocateBalloonChunk(UInt32 pageCount, HyperVDynamicMemoryBalloonChunk *chunk);
+  bool addBalloonChunk(HyperVDynamicMemoryBalloonChunk *chunk);
+  UInt64 releaseBalloonRange(UInt64 startPage, UInt64 pageCount);
+  void compactBalloonChunks();
+  void freeBalloon();
+  UInt64 getBalloonFloor(UInt64 totalPages);
+
+  void updateStatistics();
+  void freeDynamicMemory();
+
+public:
+  //
+  // IOService overrides.
+  //
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+};
+
+#endif
@@ -0,0 +1,596 @@
+//
+//  HyperVDynamicMemoryPrivate.cpp
+//  Hyper-V Dynamic Memory driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVPlatformProvider.hpp"
+#include "HyperVDynamicMemory.hpp"
+
+#define kHyperVDynamicMemoryMBToPages(mb)   ((UInt64)(mb) * (1024 * 1024 / PAGE_SIZE))
+
+static inline UInt64 getElapsedMicroseconds(UInt64 startTime, UInt64 endTime) {
+  UInt64 elapsedNS;
+  absolutetime_to_nanoseconds(endTime - startTime, &elapsedNS);
+  return elapsedNS / 1000;
+}
+
+static int compareBalloonChunks(const void *a, const void *b) {
+  UInt64 startA = ((const HyperVDynamicMemoryBalloonChunk *)a)->startPage;
+  UInt64 startB = ((const HyperVDynamicMemoryBalloonChunk *)b)->startPage;
+  return startA < startB ? -1 : (startA > startB ? 1 : 0);
+}
+
+void HyperVDynamicMemory::handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count) {
+  UInt32 pktDataLength;
+
+  while (hvDevice->nextInbandPacketAvailable(&pktDataLength)) {
+    HyperVDynamicMemoryMessage *dmMessage = (HyperVDynamicMemoryMessage *)IOMalloc(pktDataLength);
+    if (dmMessage == NULL) {
+      SYSLOG("Failed to allocate packet of %u bytes", pktDataLength);
+      break;
+    }
+    if (hvDevice->readInbandCompletionPacket(dmMessage, pktDataLength, NULL) != kIOReturnSuccess) {
+      IOFree(dmMessage, pktDataLength);
+      break;
+    }
+
+    if (pktDataLength >= sizeof (dmMessage->header)) {
+      handleIncomingMessage(dmMessage, pktDataLength);
+    }
+    IOFree(dmMessage, pktDataLength);
+  }
+}
+
+void HyperVDynamicMemory::handleIncomingMessage(HyperVDynamicMemoryMessage *dmMessage, UInt32 messageLength) {
+  switch (dmMessage->header.type) {
+    case kHyperVDynamicMemoryMessageTypeVersionResponse:
+    case kHyperVDynamicMemoryMessageTypeCapabilitiesResponse:
+      IOLockLock(dmLock);
+      if (isWaitingResponse && waitingResponseType == dmMessage->header.type) {
+        memset(&responseMessage, 0, sizeof (responseMessage));
+        memcpy(&responseMessage, dmMessage, messageLength < sizeof (responseMessage) ? messageLength : sizeof (responseMessage));
+        isWaitingResponse = false;
+        IOLockWakeup(dmLock, &isWaitingResponse, true);
+      }
+      IOLockUnlock(dmLock);
+      break;
+
+    case kHyperVDynamicMemoryMessageTypeBalloonRequest:
+      if (messageLength >= sizeof (dmMessage->balloonRequest)) {
+        handleBalloonRequest(&dmMessage->balloonRequest);
+      }
+      break;
+
+    case kHyperVDynamicMemoryMessageTypeUnballoonRequest:
+      handleUnballoonRequest(&dmMessage->unballoonRequest, messageLength);
+      break;
+
+    case kHyperVDynamicMemoryMessageTypeHotAddRequest:
+      handleHotAddRequest(&dmMessage->hotAddRequest, messageLength);
+      break;
+
+    case kHyperVDynamicMemoryMessageTypeInfo:
+      DBGLOG("Ignoring info message");
+      break;
+
+    default:
+      DBGLOG("Unknown message type %u", dmMessage->header.type);
+      break;
+  }
+}
+
+void HyperVDynamicMemory::handleBalloonRequest(HyperVDynamicMemoryMessageBalloonRequest *balloonRequest) {
+  DBGLOG("Balloon request for %u pages", balloonRequest->pageCount);
+
+  //
+  // All responses are sent from the balloon thread call, including for empty requests, as they share balloonResponse.
+  // Requests received while ballooning are added together and handled once the current one completes.
+  //
+  IOLockLock(dmLock);
+  if (balloonRequest->pageCount != 0) {
+    balloonRequestCount++;
+    lastBalloonRequestPages = balloonRequest->pageCount;
+  }
+  if (pendingBalloonPageCount > UINT32_MAX - balloonRequest->pageCount) {
+    pendingBalloonPageCount = UINT32_MAX;
+  } else {
+    pendingBalloonPageCount += balloonRequest->pageCount;
+  }
+  isBalloonRequestPending = true;
+  if (!isBallooning && !isStopping) {
+    isBallooning = true;
+    thread_call_enter(balloonThreadCall);
+  }
+  IOLockUnlock(dmLock);
+}
+
+void HyperVDynamicMemory::handleUnballoonRequest(HyperVDynamicMemoryMessageUnballoonRequest *unballoonRequest, UInt32 messageLength) {
+  HyperVDynamicMemoryMessage  dmMessage;
+  UInt64                      currentTime;
+
+  if (messageLength < sizeof (*unballoonRequest)
+      || (messageLength - sizeof (*unballoonRequest)) / sizeof (unballoonRequest->ranges[0]) < unballoonRequest->rangeCount) {
+    SYSLOG("Invalid unballoon request of %u bytes", messageLength);
+    return;
+  }
+
+  clock_get_uptime(&currentTime);
+  if (!isUnballooning) {
+    isUnballooning     = true;
+    unballoonStartTime = currentTime;
+    unballoonPageCount = 0;
+  }
+
+  IOLockLock(dmLock);
+  for (UInt32 i = 0; i < unballoonRequest->rangeCount; i++) {
+    unballoonPageCount += releaseBalloonRange(kHyperVDynamicMemoryPageRangeStart(unballoonRequest->ranges[i]),
+                                              kHyperVDynamicMemoryPageRangeCount(unballoonRequest->ranges[i]));
+  }
+  compactBalloonChunks();
+  IOLockUnlock(dmLock);
+
+  //
+  // Only the last message of an unballoon request is answered.
+  //
+  if (unballoonRequest->flags & kHyperVDynamicMemoryMorePages) {
+    return;
+  }
+
+  clock_get_uptime(&currentTime);
+  IOLockLock(dmLock);
+  isUnballooning     = false;
+  unballoonRequestCount++;
+  lastUnballoonPages = unballoonPageCount;
+  lastUnballoonUS    = getElapsedMicroseconds(unballoonStartTime, currentTime);
+  IOLockUnlock(dmLock);
+  SYSLOG("Returned %llu pages to the system in %llu ms", lastUnballoonPages, lastUnballoonUS / 1000);
+
+  memset(&dmMessage, 0, sizeof (dmMessage));
+  dmMessage.header.type = kHyperVDynamicMemoryMessageTypeUnballoonResponse;
+  sendDynamicMemoryMessage(&dmMessage, sizeof (dmMessage.unballoonResponse));
+  updateStatistics();
+}
+
+void HyperVDynamicMemory::handleHotAddRequest(HyperVDynamicMemoryMessageHotAddRequest *hotAddRequest, UInt32 messageLength) {
+  HyperVDynamicMemoryMessage  dmMessage;
+  UInt64                      startTime;
+  UInt64                      endTime;
+
+  if (messageLength < __offsetof(HyperVDynamicMemoryMessageHotAddRequest, region)) {
+    SYSLOG("Invalid hot add request of %u bytes", messageLength);
+    return;
+  }
+  clock_get_uptime(&startTime);
+
+  UInt64 startPage = kHyperVDynamicMemoryPageRangeStart(hotAddRequest->range);
+  UInt64 pageCount = kHyperVDynamicMemoryPageRangeCount(hotAddRequest->range);
+  DBGLOG("Hot add request for %llu pages at page 0x%llX", pageCount, startPage);
+
+  //
+  // XNU cannot bring memory outside of the boot memory map online, so no pages are added.
+  // Reporting success with no pages added marks the failure as permanent, and Hyper-V stops retrying.
+  // Hot add is not advertised, this only answers hosts that send requests regardless.
+  //
+  memset(&dmMessage, 0, sizeof (dmMessage));
+  dmMessage.header.type              = kHyperVDynamicMemoryMessageTypeHotAddResponse;
+  dmMessage.hotAddResponse.pageCount = 0;
+  dmMessage.hotAddResponse.result    = kHyperVDynamicMemoryHotAddResultSuccess;
+  sendDynamicMemoryMessage(&dmMessage, sizeof (dmMessage.hotAddResponse));
+
+  clock_get_uptime(&endTime);
+  IOLockLock(dmLock);
+  if (hotAddRequestCount == 0) {
+    SYSLOG("Hot add is not supported, set startup memory to the maximum to let Hyper-V balloon instead");
+  }
+  hotAddRequestCount++;
+  hotAddRequestedPages += pageCount;
+  lastHotAddUS          = getElapsedMicroseconds(startTime, endTime);
+  IOLockUnlock(dmLock);
+
+  updateStatistics();
+}
+
+bool HyperVDynamicMemory::sendDynamicMemoryMessage(HyperVDynamicMemoryMessage *dmMessage, UInt16 messageLength) {
+  dmMessage->header.size          = messageLength;
+  dmMessage->header.transactionId = (UInt32) OSIncrementAtomic((volatile SInt32 *) &nextTransactionId);
+
+  IOReturn status = hvDevice->writeInbandPacket(dmMessage, messageLength, false);
+  if (status != kIOReturnSuccess) {
+    DBGLOG("Failed to send message type %u with status 0x%X", dmMessage->header.type, status);
+    return false;
+  }
+  return true;
+}
+
+bool HyperVDynamicMemory::sendDynamicMemoryMessageWithResponse(HyperVDynamicMemoryMessage *dmMessage, UInt16 messageLength,
+                                                               HyperVDynamicMemoryMessageType responseType) {
+  IOLockLock(dmLock);
+  isWaitingResponse   = true;
+  waitingResponseType = responseType;
+  IOLockUnlock(dmLock);
+
+  //
+  // Responses are sent as a separate message, not as a completion.
+  //
+  bool result = sendDynamicMemoryMessage(dmMessage, messageLength);
+
+  IOLockLock(dmLock);
+  if (result) {
+    AbsoluteTime deadline;
+    clock_interval_to_deadline(kHyperVDynamicMemoryResponseTimeoutMS, kMillisecondScale, &deadline);
+    while (isWaitingResponse) {
+      if (IOLockSleepDeadline(dmLock, &isWaitingResponse, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
+        break;
+      }
+    }
+    result = !isWaitingResponse;
+  }
+  isWaitingResponse = false;
+  IOLockUnlock(dmLock);
+
+  if (!result) {
+    SYSLOG("No response of type %u received", responseType);
+  }
+  return result;
+}
+
+bool HyperVDynamicMemory::negotiateProtocolVersion() {
+  HyperVDynamicMemoryMessage dmMessage;
+
+  static const HyperVDynamicMemoryProtocolVersion protocolVersions[] = {
+    kHyperVDynamicMemoryProtocolVersionWin10,
+    kHyperVDynamicMemoryProtocolVersionWin8,
+    kHyperVDynamicMemoryProtocolVersionWin7
+  };
+
+  //
+  // Negotiate newest version supported by Hyper-V.
+  //
+  for (UInt32 i = 0; i < ARRAY_SIZE(protocolVersions); i++) {
+    memset(&dmMessage, 0, sizeof (dmMessage));
+    dmMessage.header.type            = kHyperVDynamicMemoryMessageTypeVersionRequest;
+    dmMessage.versionRequest.version = protocolVersions[i];
+    dmMessage.versionRequest.flags   = (i == ARRAY_SIZE(protocolVersions) - 1) ? kHyperVDynamicMemoryVersionLastAttempt : 0;
+
+    if (!sendDynamicMemoryMessageWithResponse(&dmMessage, sizeof (dmMessage.versionRequest), kHyperVDynamicMemoryMessageTypeVersionResponse)) {
+      break;
+    }
+    if (responseMessage.versionResponse.flags & kHyperVDynamicMemoryVersionAccepted) {
+      protocolVersion = protocolVersions[i];
+      DBGLOG("Using Dynamic Memory protocol version 0x%X", protocolVersion);
+      return true;
+    }
+  }
+
+  SYSLOG("Failed to negotiate Dynamic Memory protocol version");
+  return false;
+}
+
+bool HyperVDynamicMemory::sendCapabilities() {
+  HyperVDynamicMemoryMessage dmMessage;
+
+  //
+  // Ballooning needs memory status to avoid taking pages the guest needs.
+  // Hot add is not advertised, as XNU cannot use memory added after boot.
+  //
+  memset(&dmMessage, 0, sizeof (dmMessage));
+  dmMessage.header.type                     = kHyperVDynamicMemoryMessageTypeCapabilitiesReport;
+  dmMessage.capabilitiesReport.capabilities = HyperVPlatformProvider::getInstance()->canGetMemoryStatus() ? kHyperVDynamicMemoryCapBalloon : 0;
+  dmMessage.capabilitiesReport.minPageCount  = 0;
+  dmMessage.capabilitiesReport.maxPageNumber = -1ULL;
+
+  if (!sendDynamicMemoryMessageWithResponse(&dmMessage, sizeof (dmMessage.capabilitiesReport), kHyperVDynamicMemoryMessageTypeCapabilitiesResponse)) {
+    return false;
+  }
+  if ((responseMessage.capabilitiesResponse.flags & kHyperVDynamicMemoryCapsResponseAccepted) == 0) {
+    SYSLOG("Capabilities were not accepted by Hyper-V");
+    return false;
+  }
+  return true;
+}
+
+void HyperVDynamicMemory::sendStatusReport() {
+  HyperVDynamicMemoryMessage dmMessage;
+  UInt64 totalPages;
+  UInt64 availablePages;
+
+  HyperVPlatformProvider::getInstance()->getMemoryStatus(&totalPages, &availablePages);
+  if (totalPages == 0) {
+    return;
+  }
+
+  //
+  // Pages in the balloon are wired, so are already counted as committed.
+  // The balloon floor is included so Hyper-V leaves some headroom.
+  //
+  memset(&dmMessage, 0, sizeof (dmMessage));
+  dmMessage.header.type                   = kHyperVDynamicMemoryMessageTypeStatusReport;
+  dmMessage.statusReport.availablePages   = availablePages;
+  dmMessage.statusReport.committedPages   = (totalPages > availablePages ? totalPages - availablePages : 0) + getBalloonFloor(totalPages);
+
+  if (sendDynamicMemoryMessage(&dmMessage, sizeof (dmMessage.statusReport))) {
+    statusReportCount++;
+  }
+}
+
+UInt64 HyperVDynamicMemory::getBalloonFloor(UInt64 totalPages) {
+  //
+  // Minimum memory kept by the guest, scaled to the size of the VM.
+  //
+  if (totalPages < kHyperVDynamicMemoryMBToPages(128)) {
+    return kHyperVDynamicMemoryMBToPages(8) + (totalPages >> 1);
+  } else if (totalPages < kHyperVDynamicMemoryMBToPages(512)) {
+    return kHyperVDynamicMemoryMBToPages(40) + (totalPages >> 2);
+  } else if (totalPages < kHyperVDynamicMemoryMBToPages(2048)) {
+    return kHyperVDynamicMemoryMBToPages(104) + (totalPages >> 3);
+  } else if (totalPages < kHyperVDynamicMemoryMBToPages(8192)) {
+    return kHyperVDynamicMemoryMBToPages(232) + (totalPages >> 4);
+  }
+  return kHyperVDynamicMemoryMBToPages(488) + (totalPages >> 5);
+}
+
+void HyperVDynamicMemory::handleBalloonThreadCall(thread_call_param_t param0, thread_call_param_t param1) {
+  HyperVDynamicMemory *dynamicMemory = (HyperVDynamicMemory *)param0;
+
+  //
+  // Handle requests until none are left.
+  //
+  while (true) {
+    IOLockLock(dynamicMemory->dmLock);
+    bool   isRequestPending = dynamicMemory->isBalloonRequestPending;
+    UInt32 pageCount        = dynamicMemory->pendingBalloonPageCount;
+    dynamicMemory->isBalloonRequestPending = false;
+    dynamicMemory->pendingBalloonPageCount = 0;
+    if (!isRequestPending || dynamicMemory->isStopping) {
+      dynamicMemory->isBallooning = false;
+      IOLockWakeup(dynamicMemory->dmLock, &dynamicMemory->isBallooning, false);
+      IOLockUnlock(dynamicMemory->dmLock);
+      break;
+    }
+    IOLockUnlock(dynamicMemory->dmLock);
+
+    dynamicMemory->inflateBalloon(pageCount);
+    dynamicMemory->updateStatistics();
+  }
+}
+
+void HyperVDynamicMemory::inflateBalloon(UInt32 pageCount) {
+  UInt64 startTime;
+  UInt64 endTime;
+  UInt64 totalPages;
+  UInt64 availablePages;
+
+  clock_get_uptime(&startTime);
+
+  //
+  // Never balloon below the floor, the guest would start paging or run out of memory.
+  //
+  HyperVPlatformProvider::getInstance()->getMemoryStatus(&totalPages, &availablePages);
+  UInt64 floorPages = getBalloonFloor(totalPages);
+  if (availablePages < pageCount || availablePages - pageCount < floorPages) {
+    UInt32 limitedPageCount = availablePages > floorPages ? (UInt32) (availablePages - floorPages) : 0;
+    SYSLOG("Balloon request for %u pages limited to %u pages", pageCount, limitedPageCount);
+    pageCount = limitedPageCount;
+  }
+
+  //
+  // Pages are given to Hyper-V as ranges, each response holds as many ranges as fit in a page.
+  // Allocations start at 2 MB so most requests are answered with few ranges and messages.
+  //
+  UInt32 maxRangeCount    = (kHyperVDynamicMemoryMaxResponseSize - sizeof (*balloonResponse)) / sizeof (balloonResponse->ranges[0]);
+  UInt32 allocationPages  = kHyperVDynamicMemoryChunkPages;
+  UInt32 remainingPages   = pageCount;
+  UInt32 balloonedPages   = 0;
+  bool   allocationFailed = false;
+
+  while (true) {
+    UInt32 rangeCount = 0;
+    while (remainingPages > 0 && rangeCount < maxRangeCount && !allocationFailed && !isStopping) {
+      HyperVDynamicMemoryBalloonChunk chunk;
+      UInt32 chunkPages = remainingPages < allocationPages ? remainingPages : allocationPages;
+
+      //
+      // Contiguous allocations fail once memory is fragmented, use single pages from then on.
+      //
+      if (!allocateBalloonChunk(chunkPages, &chunk)) {
+        if (chunkPages == 1) {
+          allocationFailed = true;
+        }
+        allocationPages = 1;
+        continue;
+      }
+      if (!addBalloonChunk(&chunk)) {
+        chunk.memoryDescriptor->complete();
+        chunk.memoryDescriptor->release();
+        allocationFailed = true;
+        break;
+      }
+
+      balloonResponse->ranges[rangeCount++] = kHyperVDynamicMemoryPageRange(chunk.startPage, chunk.pageCount);
+      remainingPages -= chunkPages;
+      balloonedPages += chunkPages;
+    }
+
+    bool morePages = remainingPages > 0 && !allocationFailed && !isStopping;
+    memset(balloonResponse, 0, sizeof (*balloonResponse));
+    balloonResponse->header.type = kHyperVDynamicMemoryMessageTypeBalloonResponse;
+    balloonResponse->flags       = (morePages ? kHyperVDynamicMemoryMorePages : 0) | kHyperVDynamicMemoryBalloonRangeCount(rangeCount);
+
+    //
+    // The ring may be full while Hyper-V processes earlier responses, retry briefly.
+    //
+    bool sent = false;
+    for (UInt32 retry = 0; retry < 5 && !sent; retry++) {
+      sent = sendDynamicMemoryMessage((HyperVDynamicMemoryMessage *)balloonResponse,
+                                      sizeof (*balloonResponse) + rangeCount * sizeof (balloonResponse->ranges[0]));
+      if (!sent) {
+        IOSleep(20);
+      }
+    }
+
+    //
+    // Pages Hyper-V does not know about are returned to the system.
+    //
+    if (!sent) {
+      SYSLOG("Failed to send balloon response, releasing %u ranges", rangeCount);
+      IOLockLock(dmLock);
+      for (UInt32 i = 0; i < rangeCount; i++) {
+        balloonedPages -= (UInt32) releaseBalloonRange(kHyperVDynamicMemoryPageRangeStart(balloonResponse->ranges[i]),
+                                                       kHyperVDynamicMemoryPageRangeCount(balloonResponse->ranges[i]));
+      }
+      compactBalloonChunks();
+      IOLockUnlock(dmLock);
+      break;
+    }
+
+    if (!morePages) {
+      break;
+    }
+  }
+
+  clock_get_uptime(&endTime);
+  IOLockLock(dmLock);
+  lastBalloonPages = balloonedPages;
+  lastBalloonUS    = getElapsedMicroseconds(startTime, endTime);
+  IOLockUnlock(dmLock);
+  SYSLOG("Ballooned %u of %u pages in %llu ms", balloonedPages, pageCount, lastBalloonUS / 1000);
+}
+
+bool HyperVDynamicMemory::allocateBalloonChunk(UInt32 pageCount, HyperVDynamicMemoryBalloonChunk *chunk) {
+  IOBufferMemoryDescriptor *memoryDescriptor =
+    IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryMapperNone,
+                                                     pageCount * PAGE_SIZE, 0xFFFFFFFFFFFFF000ULL);
+  if (memoryDescriptor == NULL) {
+    return false;
+  }
+  if (memoryDescriptor->prepare() != kIOReturnSuccess) {
+    memoryDescriptor->release();
+    return false;
+  }
+
+  chunk->memoryDescriptor  = memoryDescriptor;
+  chunk->startPage         = memoryDescriptor->getPhysicalAddress() >> PAGE_SHIFT;
+  chunk->pageCount         = pageCount;
+  chunk->returnedPageCount = 0;
+  return true;
+}
+
+bool HyperVDynamicMemory::addBalloonChunk(HyperVDynamicMemoryBalloonChunk *chunk) {
+  IOLockLock(dmLock);
+  if (balloonChunkCount == balloonChunkCapacity) {
+    UInt32 newCapacity = balloonChunkCapacity == 0 ? 64 : balloonChunkCapacity * 2;
+    HyperVDynamicMemoryBalloonChunk *newChunks = (HyperVDynamicMemoryBalloonChunk *)IOMalloc(newCapacity * sizeof (*newChunks));
+    if (newChunks == NULL) {
+      IOLockUnlock(dmLock);
+      SYSLOG("Failed to grow balloon to %u chunks", newCapacity);
+      return false;
+    }
+
+    if (balloonChunks != NULL) {
+      memcpy(newChunks, balloonChunks, balloonChunkCount * sizeof (*newChunks));
+      IOFree(balloonChunks, balloonChunkCapacity * sizeof (*balloonChunks));
+    }
+    balloonChunks        = newChunks;
+    balloonChunkCapacity = newCapacity;
+  }
+
+  balloonChunks[balloonChunkCount++] = *chunk;
+  balloonPageCount += chunk->pageCount;
+  isBalloonSorted   = false;
+  if (chunk->pageCount == 1) {
+    singlePageAllocationCount++;
+  }
+  IOLockUnlock(dmLock);
+  return true;
+}
+
+UInt64 HyperVDynamicMemory::releaseBalloonRange(UInt64 startPage, UInt64 pageCount) {
+  UInt64 endPage       = startPage + pageCount;
+  UInt64 page          = startPage;
+  UInt64 returnedPages = 0;
+
+  //
+  // Chunks never overlap, so once sorted by start page they are also sorted by end page.
+  //
+  if (!isBalloonSorted) {
+    qsort(balloonChunks, balloonChunkCount, sizeof (*balloonChunks), compareBalloonChunks);
+    isBalloonSorted = true;
+  }
+
+  while (page < endPage) {
+    //
+    // Find the first chunk ending after the current page.
+    //
+    UInt32 low  = 0;
+    UInt32 high = balloonChunkCount;
+    while (low < high) {
+      UInt32 mid = (low + high) / 2;
+      if (balloonChunks[mid].startPage + balloonChunks[mid].pageCount <= page) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    if (low == balloonChunkCount || balloonChunks[low].startPage >= endPage) {
+      break;
+    }
+
+    HyperVDynamicMemoryBalloonChunk *chunk = &balloonChunks[low];
+    UInt64 chunkEndPage = chunk->startPage + chunk->pageCount;
+    if (chunk->startPage > page) {
+      page = chunk->startPage;
+    }
+    UInt64 overlapPages = (endPage < chunkEndPage ? endPage : chunkEndPage) - page;
+
+    //
+    // Chunks are freed once Hyper-V has returned all of their pages.
+    //
+    if (chunk->memoryDescriptor != NULL) {
+      chunk->returnedPageCount += overlapPages;
+      returnedPages            += overlapPages;
+      if (chunk->returnedPageCount >= chunk->pageCount) {
+        chunk->memoryDescriptor->complete();
+        OSSafeReleaseNULL(chunk->memoryDescriptor);
+      }
+    }
+    page += overlapPages;
+  }
+
+  balloonPageCount = balloonPageCount > returnedPages ? balloonPageCount - returnedPages : 0;
+  return returnedPages;
+}
+
+void HyperVDynamicMemory::compactBalloonChunks() {
+  UInt32 count = 0;
+
+  //
+  // Order is preserved, the balloon stays sorted.
+  //
+  for (UInt32 i = 0; i < balloonChunkCount; i++) {
+    if (balloonChunks[i].memoryDescriptor != NULL) {
+      balloonChunks[count++] = balloonChunks[i];
+    }
+  }
+  balloonChunkCount = count;
+}
+
+void HyperVDynamicMemory::freeBalloon() {
+  if (balloonChunks == NULL) {
+    return;
+  }
+
+  for (UInt32 i = 0; i < balloonChunkCount; i++) {
+    if (balloonChunks[i].memoryDescriptor != NULL) {
+      balloonChunks[i].memoryDescriptor->complete();
+      OSSafeReleaseNULL(balloonChunks[i].memoryDescriptor);
+    }
+  }
+  IOFree(balloonChunks, balloonChunkCapacity * sizeof (*balloonChunks));
+
+  balloonChunks        = NULL;
+  balloonChunkCount    = 0;
+  balloonChunkCapacity = 0;
+  balloonPageCount     = 0;
+}
@@ -0,0 +1,198 @@
+//
+//  HyperVDynamicMemoryRegs.hpp
+//  Hyper-V Dynamic Memory driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVDynamicMemoryRegs_hpp
+#define HyperVDynamicMemoryRegs_hpp
+
+#define kHyperVDynamicMemoryRingBufferSize      (5 * PAGE_SIZE)
+#define kHyperVDynamicMemoryResponseTimeoutMS   5000
+
+//
+// Hyper-V expects a status report every second, but no more often.
+//
+#define kHyperVDynamicMemoryStatusIntervalMS    1000
+
+//
+// Balloon pages are allocated in 2 MB chunks, falling back to single pages when memory is fragmented.
+//
+#define kHyperVDynamicMemoryChunkPages          512
+#define kHyperVDynamicMemoryMaxResponseSize     PAGE_SIZE
+
+//
+// Protocol versions.
+//
+#define kHyperVDynamicMemoryVersion(major, minor)   (((major) << 16) | (minor))
+
+typedef enum : UInt32 {
+  kHyperVDynamicMemoryProtocolVersionWin7   = kHyperVDynamicMemoryVersion(0, 3),
+  kHyperVDynamicMemoryProtocolVersionWin8   = kHyperVDynamicMemoryVersion(1, 0),
+  kHyperVDynamicMemoryProtocolVersionWin10  = kHyperVDynamicMemoryVersion(2, 0)
+} HyperVDynamicMemoryProtocolVersion;
+
+//
+// Message types.
+//
+typedef enum : UInt16 {
+  kHyperVDynamicMemoryMessageTypeError                  = 0,
+  kHyperVDynamicMemoryMessageTypeVersionRequest         = 1,
+  kHyperVDynamicMemoryMessageTypeVersionResponse        = 2,
+  kHyperVDynamicMemoryMessageTypeCapabilitiesReport     = 3,
+  kHyperVDynamicMemoryMessageTypeCapabilitiesResponse   = 4,
+  kHyperVDynamicMemoryMessageTypeStatusReport           = 5,
+  kHyperVDynamicMemoryMessageTypeBalloonRequest         = 6,
+  kHyperVDynamicMemoryMessageTypeBalloonResponse        = 7,
+  kHyperVDynamicMemoryMessageTypeUnballoonRequest       = 8,
+  kHyperVDynamicMemoryMessageTypeUnballoonResponse      = 9,
+  kHyperVDynamicMemoryMessageTypeHotAddRequest          = 10,
+  kHyperVDynamicMemoryMessageTypeHotAddResponse         = 11,
+  kHyperVDynamicMemoryMessageTypeInfo                   = 12
+} HyperVDynamicMemoryMessageType;
+
+//
+// Page ranges, start page in bits 0-39 and page count in bits 40-63.
+//
+#define kHyperVDynamicMemoryPageRange(start, count)   (((start) & 0xFFFFFFFFFFULL) | ((UInt64)(count) << 40))
+#define kHyperVDynamicMemoryPageRangeStart(range)     ((range) & 0xFFFFFFFFFFULL)
+#define kHyperVDynamicMemoryPageRangeCount(range)     ((range) >> 40)
+#define kHyperVDynamicMemoryPageRangeMaxCount         0xFFFFFF
+
+//
+// Capability bits.
+// Hot add alignment is in 2^n MB units.
+//
+#define kHyperVDynamicMemoryCapBalloon                BIT(0)
+#define kHyperVDynamicMemoryCapHotAdd                 BIT(1)
+#define kHyperVDynamicMemoryCapHotAddAlignment(n)     (((UInt64)(n) & 0xF) << 2)
+
+#define kHyperVDynamicMemoryCapsResponseAccepted      BIT(0)
+#define kHyperVDynamicMemoryCapsResponseHotRemove     BIT(1)
+#define kHyperVDynamicMemoryCapsResponseNoPressure    BIT(2)
+
+#define kHyperVDynamicMemoryVersionLastAttempt        BIT(0)
+#define kHyperVDynamicMemoryVersionAccepted           BIT(0)
+#define kHyperVDynamicMemoryMorePages                 BIT(0)
+
+//
+// Message header, size includes the header.
+//
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageType  type;
+  UInt16                          size;
+  UInt32                          transactionId;
+} HyperVDynamicMemoryMessageHeader;
+
+//
+// Messages sent to Hyper-V.
+//
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader    header;
+  HyperVDynamicMemoryProtocolVersion  version;
+  UInt32                              flags;
+} HyperVDynamicMemoryMessageVersionRequest;
+
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader  header;
+  UInt64                            capabilities;
+  UInt64                            minPageCount;
+  UInt64                            maxPageNumber;
+} HyperVDynamicMemoryMessageCapabilitiesReport;
+
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader  header;
+  UInt64                            availablePages;
+  UInt64                            committedPages;
+  UInt64                            pageFileSize;
+  UInt64                            zeroFreePages;
+  UInt32                            pageFileWrites;
+  UInt32                            ioDiff;
+} HyperVDynamicMemoryMessageStatusReport;
+
+//
+// Balloon responses contain a variable number of page ranges, split over multiple messages if needed.
+// Range count is in bits 1-31 of flags.
+//
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader  header;
+  UInt32                            reserved;
+  UInt32                            flags;
+  UInt64                            ranges[];
+} HyperVDynamicMemoryMessageBalloonResponse;
+
+#define kHyperVDynamicMemoryBalloonRangeCount(count)  ((UInt32)(count) << 1)
+
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader  header;
+} HyperVDynamicMemoryMessageUnballoonResponse;
+
+//
+// Hot add responses with no pages added and a successful result mark the failure as permanent.
+//
+#define kHyperVDynamicMemoryHotAddResultFailure   0
+#define kHyperVDynamicMemoryHotAddResultSuccess   1
+
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader  header;
+  UInt32                            pageCount;
+  UInt32                            result;
+} HyperVDynamicMemoryMessageHotAddResponse;
+
+//
+// Messages received from Hyper-V.
+//
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader  header;
+  UInt8                             flags;
+} HyperVDynamicMemoryMessageVersionResponse;
+
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader  header;
+  UInt64                            flags;
+} HyperVDynamicMemoryMessageCapabilitiesResponse;
+
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader  header;
+  UInt32                            pageCount;
+  UInt32                            reserved;
+} HyperVDynamicMemoryMessageBalloonRequest;
+
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader  header;
+  UInt32                            flags;
+  UInt32                            rangeCount;
+  UInt64                            ranges[];
+} HyperVDynamicMemoryMessageUnballoonRequest;
+
+//
+// Hot add requests specify the pages to add, and on protocol 1.0 and newer the region they are part of.
+//
+typedef struct __attribute__((packed)) {
+  HyperVDynamicMemoryMessageHeader  header;
+  UInt64                            range;
+  UInt64                            region;
+} HyperVDynamicMemoryMessageHotAddRequest;
+
+//
+// Main message structure.
+//
+typedef struct __attribute__((packed)) {
+  union {
+    HyperVDynamicMemoryMessageHeader                header;
+    HyperVDynamicMemoryMessageVersionRequest        versionRequest;
+    HyperVDynamicMemoryMessageVersionResponse       versionResponse;
+    HyperVDynamicMemoryMessageCapabilitiesReport    capabilitiesReport;
+    HyperVDynamicMemoryMessageCapabilitiesResponse  capabilitiesResponse;
+    HyperVDynamicMemoryMessageStatusReport          statusReport;
+    HyperVDynamicMemoryMessageBalloonRequest        balloonRequest;
+    HyperVDynamicMemoryMessageBalloonResponse       balloonResponse;
+    HyperVDynamicMemoryMessageUnballoonRequest      unballoonRequest;
+    HyperVDynamicMemoryMessageUnballoonResponse     unballoonResponse;
+    HyperVDynamicMemoryMessageHotAddRequest         hotAddRequest;
+    HyperVDynamicMemoryMessageHotAddResponse        hotAddResponse;
+  };
+} HyperVDynamicMemoryMessage;
+
+#endif
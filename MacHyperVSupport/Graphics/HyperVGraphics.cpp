@@ -10,6 +10,7 @@
 
 #include <IOKit/IOPlatformExpert.h>
 #include <IOKit/IODeviceTreeSupport.h>
+#include <IOKit/IOUserClient.h>
 
 OSDefineMetaClassAndStructors(HyperVGraphics, super);
 
@@ -29,9 +30,12 @@ void HyperVGraphics::fillFakePCIDeviceSpace() {
 }
 
 bool HyperVGraphics::configure(IOService *provider) {
-  UInt32 fbSize = (UInt32)(consoleInfo.v_height * consoleInfo.v_rowBytes);
-  
-  addBridgeMemoryRange(consoleInfo.v_baseAddr, fbSize, true);
+  //
+  // VRAM in guest RAM is not MMIO space, and must not be handed out by the bridge.
+  //
+  if (guestVRAMBuffer == NULL) {
+    addBridgeMemoryRange(consoleInfo.v_baseAddr, vramSize, true);
+  }
   return true;
 }
 
@@ -56,8 +60,9 @@ bool HyperVGraphics::start(IOService *provider) {
   }
   
   //
-  // Pull console info.
-  // TODO: Use actual info from Hyper-V VMBus device for this.
+  // Pull console info for the framebuffer set up by the firmware.
+  // SynthVid reports VRAM size and supported resolutions but not the current mode, so the
+  // boot framebuffer location and geometry come from here. VRAM size is replaced once connected.
   //
   if (getPlatform()->getConsoleInfo(&consoleInfo) != kIOReturnSuccess) {
     SYSLOG("Failed to get console info");
@@ -66,7 +71,29 @@ bool HyperVGraphics::start(IOService *provider) {
   DBGLOG("Console is at 0x%X (%ux%u, bpp: %u, bytes/row: %u)",
          consoleInfo.v_baseAddr, consoleInfo.v_height, consoleInfo.v_width, consoleInfo.v_depth, consoleInfo.v_rowBytes);
   
-  pciLock = IOSimpleLockAlloc();
+  bootConsoleInfo = consoleInfo;
+  
+  //
+  // BAR0 must be a power of two in size, default to one large enough for the boot framebuffer.
+  // This is replaced by the VRAM size once SynthVid is connected.
+  //
+  UInt32 fbSize = (UInt32)(consoleInfo.v_height * consoleInfo.v_rowBytes);
+  vramSize = PAGE_SIZE;
+  while (vramSize < fbSize) {
+    vramSize <<= 1;
+  }
+  
+  //
+  // Connect to SynthVid device.
+  // Console will continue to work without this, but Hyper-V will need to scan the framebuffer for changes.
+  //
+  if (!startGraphics(provider)) {
+    SYSLOG("Failed to connect to SynthVid device, dirty rectangle updates will be unavailable");
+  }
+  
+  //
+  // VRAM may have been relocated by SynthVid, fill config space afterwards.
+  //
   fillFakePCIDeviceSpace();
   
   DBGLOG("PCI bridge started");
@@ -95,114 +122,281 @@ bool HyperVGraphics::start(IOService *provider) {
   return true;
 }
 
-UInt32 HyperVGraphics::configRead32(IOPCIAddressSpace space, UInt8 offset) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
+void HyperVGraphics::stop(IOService *provider) {
+  if (refreshTimerSource != NULL) {
+    refreshTimerSource->cancelTimeout();
+    getWorkLoop()->removeEventSource(refreshTimerSource);
+    OSSafeReleaseNULL(refreshTimerSource);
+  }
   
-  UInt32 data;
-  IOInterruptState ints;
+  if (commandGate != NULL) {
+    getWorkLoop()->removeEventSource(commandGate);
+    OSSafeReleaseNULL(commandGate);
+  }
   
-  if (space.es.deviceNum != 0 || space.es.functionNum != 0) {
-    return 0xFFFFFFFF;
+  if (hvDevice != NULL) {
+    hvDevice->closeChannel();
   }
   
-  ints = IOSimpleLockLockDisableInterrupt(pciLock);
-  data = OSReadLittleInt32(fakePCIDeviceSpace, offset);
+  if (interruptSource != NULL) {
+    interruptSource->disable();
+    getWorkLoop()->removeEventSource(interruptSource);
+    OSSafeReleaseNULL(interruptSource);
+  }
+  OSSafeReleaseNULL(hvDevice);
+  freeDamageTracking();
+  freeCursor();
   
-  if (offset == kIOPCIConfigurationOffsetBaseAddress0) {
-    DBGLOG("gonna read %X", data);
+  //
+  // Guest RAM VRAM may still be mapped by the framebuffer, it is only freed once the driver is released.
+  //
+  restoreBootConsole();
+  
+  if (responseLock != NULL) {
+    IOLockFree(responseLock);
+    responseLock = NULL;
   }
   
-  IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
-  return data;
+  super::stop(provider);
 }
 
-void HyperVGraphics::configWrite32(IOPCIAddressSpace space, UInt8 offset, UInt32 data) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
-  IOInterruptState ints;
+void HyperVGraphics::free() {
+  freeGuestVRAM();
+  super::free();
+}
+
+IOReturn HyperVGraphics::setProperties(OSObject *properties) {
+  //
+  // Resolution can be changed by setting a dictionary with the new width and height.
+  // This affects the entire display, only allow administrators.
+  //
+  if (IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) != kIOReturnSuccess) {
+    return kIOReturnNotPrivileged;
+  }
+
+  OSDictionary *propertiesDict = OSDynamicCast(OSDictionary, properties);
+  if (propertiesDict == NULL) {
+    return kIOReturnBadArgument;
+  }
+
+  OSDictionary *resolutionDict = OSDynamicCast(OSDictionary, propertiesDict->getObject("CurrentResolution"));
+  if (resolutionDict == NULL) {
+    return kIOReturnUnsupported;
+  }
+
+  OSNumber *width  = OSDynamicCast(OSNumber, resolutionDict->getObject("Width"));
+  OSNumber *height = OSDynamicCast(OSNumber, resolutionDict->getObject("Height"));
+  if (width == NULL || height == NULL) {
+    return kIOReturnBadArgument;
+  }
+  return setResolution(width->unsigned32BitValue(), height->unsigned32BitValue());
+}
+
+bool HyperVGraphics::startGraphics(IOService *provider) {
+  bool initialized  = false;
+  bool channelOpen  = false;
+  UInt32 bootVRAMSize = vramSize;
+  
+  do {
+    //
+    // Get parent VMBus device object.
+    //
+    hvDevice = OSDynamicCast(HyperVVMBusDevice, provider);
+    if (hvDevice == NULL) {
+      break;
+    }
+    hvDevice->retain();
+    
+    responseLock = IOLockAlloc();
+    if (responseLock == NULL) {
+      break;
+    }
+    
+    //
+    // Configure interrupt.
+    //
+    interruptSource =
+      IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &HyperVGraphics::handleInterrupt), provider, 0);
+    if (interruptSource == NULL) {
+      break;
+    }
+    getWorkLoop()->addEventSource(interruptSource);
+    interruptSource->enable();
+    
+    //
+    // Configure the channel and connect to SynthVid.
+    //
+    if (!hvDevice->openChannel(kHyperVGraphicsRingBufferSize, kHyperVGraphicsRingBufferSize)) {
+      break;
+    }
+    channelOpen = true;
+    
+    //
+    // Relocate VRAM to guest RAM if requested, Hyper-V is informed of the new location during connection.
+    //
+    allocateGuestVRAM();
+    if (!allocateCursor()) {
+      break;
+    }
+    if (!connectGraphics()) {
+      break;
+    }
+    
+    if (guestVRAMBuffer != NULL) {
+      //
+      // Move console to the new VRAM.
+      //
+      getPlatform()->setConsoleInfo(&consoleInfo, kPEBaseAddressChange);
+      setProperty("VRAMInGuestRAM", true);
+    } else {
+      //
+      // Use VRAM size from the channel offer if present, otherwise use the size for the negotiated version.
+      // BAR0 is sized from this, so it is rounded down to a power of two.
+      //
+      OSNumber *mmioSizeNumber = OSDynamicCast(OSNumber, hvDevice->getProperty(kHyperVVMBusDeviceChannelMMIOSizeKey));
+      if (mmioSizeNumber != NULL) {
+        vramSize = mmioSizeNumber->unsigned32BitValue() * 1024 * 1024;
+      } else {
+        vramSize = graphicsVersion >= kHyperVGraphicsVersionV3_2 ? kHyperVGraphicsVRAMSizeV3_2 : kHyperVGraphicsVRAMSizeV3_0;
+      }
+      while ((vramSize & (vramSize - 1)) != 0) {
+        vramSize &= vramSize - 1;
+      }
+    }
+    DBGLOG("VRAM size is %u bytes", vramSize);
+    publishResolutions();
+    
+    commandGate = IOCommandGate::commandGate(this);
+    if (commandGate == NULL) {
+      break;
+    }
+    getWorkLoop()->addEventSource(commandGate);
+    
+    //
+    // Damage tracking is optional, the entire screen will be refreshed each time if unavailable.
+    //
+    if (!initDamageTracking()) {
+      SYSLOG("Failed to initialize damage tracking, full screen updates will be used");
+    }
+    
+    //
+    // Get refresh rate from boot arguments if specified.
+    //
+    UInt32 bootRefreshRate;
+    if (PE_parse_boot_argn(kHyperVGraphicsRefreshRateBootArg, &bootRefreshRate, sizeof (bootRefreshRate)) && bootRefreshRate != 0) {
+      refreshRate = bootRefreshRate > kHyperVGraphicsRefreshRateMax ? kHyperVGraphicsRefreshRateMax : bootRefreshRate;
+    }
+    setProperty("RefreshRate", refreshRate, 32);
+    DBGLOG("Using refresh rate of %u Hz", refreshRate);
+    
+    //
+    // Start refresh timer for sending dirty rectangles.
+    //
+    refreshTimerSource =
+      IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &HyperVGraphics::handleRefreshTimer));
+    if (refreshTimerSource == NULL) {
+      break;
+    }
+    getWorkLoop()->addEventSource(refreshTimerSource);
+    refreshTimerSource->setTimeoutMS(1000 / refreshRate);
+    
+    initialized = true;
+  } while (false);
+  
+  if (!initialized) {
+    isGraphicsConnected = false;
+    freeDamageTracking();
+    if (commandGate != NULL) {
+      getWorkLoop()->removeEventSource(commandGate);
+      OSSafeReleaseNULL(commandGate);
+    }
+    if (channelOpen) {
+      hvDevice->closeChannel();
+    }
+    if (interruptSource != NULL) {
+      interruptSource->disable();
+      getWorkLoop()->removeEventSource(interruptSource);
+      OSSafeReleaseNULL(interruptSource);
+    }
+    if (responseLock != NULL) {
+      IOLockFree(responseLock);
+      responseLock = NULL;
+    }
+    OSSafeReleaseNULL(hvDevice);
+    
+    //
+    // Framebuffer has not been started yet, guest RAM VRAM can be freed right away.
+    //
+    restoreBootConsole();
+    freeGuestVRAM();
+    freeCursor();
+    vramSize = bootVRAMSize;
+    return false;
+  }
   
-  if (space.es.deviceNum != 0 || space.es.functionNum != 0 || (offset > kIOPCIConfigurationOffsetBaseAddress0 && offset <= kIOPCIConfigurationOffsetBaseAddress5) || offset == kIOPCIConfigurationOffsetExpansionROMBase) {
-    DBGLOG("ignoring offset %X", offset);
+  SYSLOG("Connected to SynthVid device");
+  return true;
+}
+
+//
+// Config space is a snapshot built at start, reads do not need any locking.
+// BARs and the expansion ROM are read-only, except for BAR0 size probing.
+//
+static inline bool isConfigOffsetReadOnly(UInt8 offset) {
+  return (offset >= kIOPCIConfigurationOffsetBaseAddress0 && offset <= kIOPCIConfigurationOffsetBaseAddress5)
+    || offset == kIOPCIConfigurationOffsetExpansionROMBase;
+}
+
+UInt32 HyperVGraphics::configRead32(IOPCIAddressSpace space, UInt8 offset) {
+  if (space.es.deviceNum != 0 || space.es.functionNum != 0) {
+    return 0xFFFFFFFF;
+  }
+  return readEmulatedConfigSpace(fakePCIDeviceSpace, offset, sizeof (UInt32));
+}
+
+void HyperVGraphics::configWrite32(IOPCIAddressSpace space, UInt8 offset, UInt32 data) {
+  if (space.es.deviceNum != 0 || space.es.functionNum != 0) {
     return;
   }
   
   if (offset == kIOPCIConfigurationOffsetBaseAddress0) {
-    DBGLOG("gonna write %X", data);
-  }
-  
-  if (offset == kIOPCIConfigurationOffsetBaseAddress0 && data == 0xFFFFFFFF) {
-    DBGLOG("Got bar size request");
-    UInt32 fbSize = (UInt32)(consoleInfo.v_height * consoleInfo.v_rowBytes);
-    OSWriteLittleInt32(fakePCIDeviceSpace, offset, (0xFFFFFFFF - fbSize) + 1);
+    //
+    // Return VRAM size on BAR size probe, otherwise allow BAR0 to be set.
+    //
+    if (data == 0xFFFFFFFF) {
+      DBGLOG("Got BAR0 size request");
+      data = (0xFFFFFFFF - vramSize) + 1;
+    }
+  } else if (isConfigOffsetReadOnly(offset)) {
     return;
   }
-  
-  ints = IOSimpleLockLockDisableInterrupt(pciLock);
-  OSWriteLittleInt32(fakePCIDeviceSpace, offset, data);
-  
-  IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
+  writeEmulatedConfigSpace(fakePCIDeviceSpace, offset, sizeof (UInt32), data);
 }
 
 UInt16 HyperVGraphics::configRead16(IOPCIAddressSpace space, UInt8 offset) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
-  UInt16 data;
-  IOInterruptState ints;
-  
   if (space.es.deviceNum != 0 || space.es.functionNum != 0) {
     return 0xFFFF;
   }
-  
-  ints = IOSimpleLockLockDisableInterrupt(pciLock);
-  data = OSReadLittleInt16(fakePCIDeviceSpace, offset);
-  
-  IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
-  return data;
+  return readEmulatedConfigSpace(fakePCIDeviceSpace, offset, sizeof (UInt16));
 }
 
 void HyperVGraphics::configWrite16(IOPCIAddressSpace space, UInt8 offset, UInt16 data) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
-  IOInterruptState ints;
-  
-  if (space.es.deviceNum != 0 || space.es.functionNum != 0 || (offset >= kIOPCIConfigurationOffsetBaseAddress0 && offset <= kIOPCIConfigurationOffsetBaseAddress5) || offset == kIOPCIConfigurationOffsetExpansionROMBase) {
+  if (space.es.deviceNum != 0 || space.es.functionNum != 0 || isConfigOffsetReadOnly(offset & 0xFC)) {
     return;
   }
-  
-  ints = IOSimpleLockLockDisableInterrupt(pciLock);
-  OSWriteLittleInt16(fakePCIDeviceSpace, offset, data);
-  
-  IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
+  writeEmulatedConfigSpace(fakePCIDeviceSpace, offset, sizeof (UInt16), data);
 }
 
 UInt8 HyperVGraphics::configRead8(IOPCIAddressSpace space, UInt8 offset) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
-  UInt8 data;
-  IOInterruptState ints;
-  
   if (space.es.deviceNum != 0 || space.es.functionNum != 0) {
     return 0xFF;
   }
-  
-  ints = IOSimpleLockLockDisableInterrupt(pciLock);
-  data = fakePCIDeviceSpace[offset];
-  
-  IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
-  return data;
+  return readEmulatedConfigSpace(fakePCIDeviceSpace, offset, sizeof (UInt8));
 }
 
 void HyperVGraphics::configWrite8(IOPCIAddressSpace space, UInt8 offset, UInt8 data) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
-  IOInterruptState ints;
-  
-  if (space.es.deviceNum != 0 || space.es.functionNum != 0 || (offset >= kIOPCIConfigurationOffsetBaseAddress0 && offset <= kIOPCIConfigurationOffsetBaseAddress5) || offset == kIOPCIConfigurationOffsetExpansionROMBase) {
+  if (space.es.deviceNum != 0 || space.es.functionNum != 0 || isConfigOffsetReadOnly(offset & 0xFC)) {
     return;
   }
-  
-  ints = IOSimpleLockLockDisableInterrupt(pciLock);
-  fakePCIDeviceSpace[offset] = data;
-  
-  IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
+  writeEmulatedConfigSpace(fakePCIDeviceSpace, offset, sizeof (UInt8), data);
 }
@@ -9,9 +9,15 @@
 #define HyperVGraphics_hpp
 
 #include "HyperVVMBusDevice.hpp"
+#include "HyperVGraphicsRegs.hpp"
 #include "HyperV.hpp"
 
 #include <IOKit/pci/IOPCIBridge.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+class IOFramebuffer;
 
 #define super IOPCIBridge
 
@@ -22,18 +28,121 @@ class HyperVGraphics : public IOPCIBridge {
   OSDeclareDefaultStructors(HyperVGraphics);
   
 private:
-  IOSimpleLock *pciLock;
-  UInt8 fakePCIDeviceSpace[256];
+  //
+  // Parent VMBus device.
+  //
+  HyperVVMBusDevice       *hvDevice;
+  IOInterruptEventSource  *interruptSource;
+  IOTimerEventSource      *refreshTimerSource;
+  IOCommandGate           *commandGate;
+  
+  UInt8 fakePCIDeviceSpace[256] __attribute__((aligned(4)));
   
   void fillFakePCIDeviceSpace();
   
   PE_Video consoleInfo;
+  PE_Video bootConsoleInfo;
+  
+  //
+  // SynthVid state.
+  //
+  HyperVGraphicsVersion   graphicsVersion;
+  bool                    isGraphicsConnected = false;
+  bool                    isDirtNeeded        = true;
+  UInt32                  refreshRate         = kHyperVGraphicsRefreshRateDefault;
+  UInt32                  vramSize;
+  IOBufferMemoryDescriptor *guestVRAMBuffer;
+  
+  HyperVGraphicsScreenResolution  supportedResolutions[kHyperVGraphicsMaxResolutionCount];
+  UInt32                          supportedResolutionCount;
+  
+  //
+  // Damage tracking.
+  //
+  IOMemoryDescriptor      *fbMemoryDescriptor;
+  IOMemoryMap             *fbMemoryMap;
+  UInt8                   *fbAddress;
+  UInt8                   *fbShadow;
+  size_t                  fbShadowSize;
+  UInt32                  damageTilesX;
+  UInt32                  damageTilesY;
+  UInt8                   *damageTileMap;
+  UInt8                   *damageTileHeat;
+  size_t                  damageTileMapSize;
+  UInt32                  damageScanPhase;
+  HyperVGraphicsRect      damageRects[kHyperVGraphicsDamageMaxRects];
+  
+  //
+  // Cursor state reported to Hyper-V.
+  // Framebuffer cursor calls may come from contexts that cannot block, changes are staged under
+  // cursorLock and sent from the workloop.
+  //
+  HyperVGraphicsMessage   *cursorShapeMessage;
+  size_t                  cursorShapeMessageSize;
+  IOInterruptEventSource  *cursorEventSource;
+  IOSimpleLock            *cursorLock;
+  UInt32                  *cursorStagedImage;
+  UInt32                  cursorStagedWidth;
+  UInt32                  cursorStagedHeight;
+  UInt32                  cursorStagedHotX;
+  UInt32                  cursorStagedHotY;
+  bool                    isCursorShapeStaged     = false;
+  SInt32                  cursorX;
+  SInt32                  cursorY;
+  bool                    isCursorVisible         = false;
+  bool                    isPointerPositionNeeded = true;
+  bool                    isPointerShapeNeeded    = true;
+  
+  //
+  // Response waiting for SynthVid requests.
+  //
+  IOLock                    *responseLock;
+  bool                      isWaitingResponse = false;
+  HyperVGraphicsMessageType waitResponseType;
+  HyperVGraphicsMessage     *waitResponseMessage;
+  
+  void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
+  void handleRefreshTimer(OSObject *owner, IOTimerEventSource *sender);
+  void handleFeatureChange(HyperVGraphicsMessageFeatureChange *featureChange);
+  
+  bool sendGraphicsMessage(HyperVGraphicsMessage *gfxMessage, HyperVGraphicsMessageType responseType = kHyperVGraphicsMessageTypeError,
+                           HyperVGraphicsMessage *gfxMessageResponse = NULL);
+  bool negotiateVersion(HyperVGraphicsVersion version);
+  bool updateVRAMLocation();
+  bool updateSituation();
+  bool connectGraphics();
+  bool allocateGuestVRAM();
+  void restoreBootConsole();
+  void freeGuestVRAM();
+  bool getSupportedResolutions();
+  void publishResolutions();
+  bool isResolutionSupported(UInt32 width, UInt32 height);
+  IOReturn setResolutionGated(UInt32 *width, UInt32 *height);
+  IOFramebuffer *copyFramebuffer();
+  bool startGraphics(IOService *provider);
+  
+  bool initDamageTracking();
+  void freeDamageTracking();
+  bool scanDamageTile(UInt32 tileX, UInt32 tileY);
+  UInt32 buildDamageRects();
+  void updateDamage();
+  
+  bool allocateCursor();
+  void freeCursor();
+  bool sendCursorShape();
+  bool sendCursorPosition();
+  void handleCursorUpdate(OSObject *owner, IOInterruptEventSource *sender, int count);
+  IOReturn setCursorImage(IOFramebuffer *framebuffer, void *cursorImage);
+  IOReturn setCursorState(SInt32 x, SInt32 y, bool visible);
   
 public:
   //
   // IOService overrides.
   //
   virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void free() APPLE_KEXT_OVERRIDE;
+  virtual IOReturn setProperties(OSObject *properties) APPLE_KEXT_OVERRIDE;
   
   //
   // IOPCIBridge overrides.
@@ -62,6 +171,12 @@ public:
     DBGLOG("start");
     return kHyperVPCIBusSyntheticGraphics;
   }
+  
+  //
+  // SynthVid functions.
+  //
+  IOReturn updateDirtyRects(const HyperVGraphicsRect *rects, UInt32 rectCount);
+  IOReturn setResolution(UInt32 width, UInt32 height);
 };
 
 #endif
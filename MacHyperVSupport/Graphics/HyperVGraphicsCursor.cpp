@@ -0,0 +1,236 @@
+//
+//  HyperVGraphicsCursor.cpp
+//  Hyper-V basic graphics driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVPlatformProvider.hpp"
+#include "HyperVGraphics.hpp"
+
+#include <IOKit/graphics/IOFramebuffer.h>
+
+bool HyperVGraphics::allocateCursor() {
+  //
+  // Shape message is preallocated at the maximum size, as the shape is resent when Hyper-V requests it.
+  //
+  cursorShapeMessageSize = __offsetof(HyperVGraphicsMessage, pointerShape.data) + kHyperVGraphicsCursorMaxSize;
+  cursorShapeMessage     = (HyperVGraphicsMessage *)IOMalloc(cursorShapeMessageSize);
+  if (cursorShapeMessage == NULL) {
+    SYSLOG("Failed to allocate cursor shape message");
+    return false;
+  }
+  memset(cursorShapeMessage, 0, cursorShapeMessageSize);
+
+  cursorStagedImage = (UInt32 *)IOMalloc(kHyperVGraphicsCursorMaxSize);
+  if (cursorStagedImage == NULL) {
+    SYSLOG("Failed to allocate cursor image buffer");
+    freeCursor();
+    return false;
+  }
+  cursorLock = IOSimpleLockAlloc();
+  if (cursorLock == NULL) {
+    SYSLOG("Failed to allocate cursor lock");
+    freeCursor();
+    return false;
+  }
+
+  //
+  // Staged cursor changes are sent to Hyper-V from the workloop.
+  //
+  cursorEventSource =
+    IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &HyperVGraphics::handleCursorUpdate));
+  if (cursorEventSource == NULL) {
+    SYSLOG("Failed to create cursor event source");
+    freeCursor();
+    return false;
+  }
+  getWorkLoop()->addEventSource(cursorEventSource);
+  cursorEventSource->enable();
+
+  //
+  // Use a transparent cursor until the framebuffer sets an image, the guest may still draw its own cursor into the framebuffer.
+  // This prevents Hyper-V from drawing its own cursor over it.
+  //
+  cursorShapeMessage->header.type             = kHyperVGraphicsMessageTypePointerShape;
+  cursorShapeMessage->pointerShape.partIndex  = kHyperVGraphicsCursorPartComplete;
+  cursorShapeMessage->pointerShape.isARGB     = 1;
+  cursorShapeMessage->pointerShape.width      = 1;
+  cursorShapeMessage->pointerShape.height     = 1;
+  cursorShapeMessage->pointerShape.hotX       = 0;
+  cursorShapeMessage->pointerShape.hotY       = 0;
+  cursorShapeMessage->header.size = (UInt32)(sizeof (cursorShapeMessage->header)
+                                             + __offsetof(HyperVGraphicsMessagePointerShape, data)
+                                             + kHyperVGraphicsCursorARGBPixelSize);
+
+  cursorStagedHotX = 0;
+  cursorStagedHotY = 0;
+  cursorX          = 0;
+  cursorY          = 0;
+  isCursorVisible  = true;
+
+  //
+  // Take over the framebuffer hardware cursor, this must be done before the framebuffer is started.
+  //
+  HyperVPlatformProvider *platformProvider = HyperVPlatformProvider::getInstance();
+  if (platformProvider->canRouteFramebufferCursor()) {
+    platformProvider->registerFramebufferCursor(this,
+                                                OSMemberFunctionCast(HyperVCursorImageAction, this, &HyperVGraphics::setCursorImage),
+                                                OSMemberFunctionCast(HyperVCursorStateAction, this, &HyperVGraphics::setCursorState));
+  } else {
+    SYSLOG("Framebuffer cursor functions are unavailable, the cursor will be drawn into the framebuffer");
+  }
+  return true;
+}
+
+void HyperVGraphics::freeCursor() {
+  HyperVPlatformProvider::getInstance()->unregisterFramebufferCursor(this);
+
+  if (cursorEventSource != NULL) {
+    cursorEventSource->disable();
+    getWorkLoop()->removeEventSource(cursorEventSource);
+    OSSafeReleaseNULL(cursorEventSource);
+  }
+  if (cursorLock != NULL) {
+    IOSimpleLockFree(cursorLock);
+    cursorLock = NULL;
+  }
+  if (cursorStagedImage != NULL) {
+    IOFree(cursorStagedImage, kHyperVGraphicsCursorMaxSize);
+    cursorStagedImage = NULL;
+  }
+  if (cursorShapeMessage != NULL) {
+    IOFree(cursorShapeMessage, cursorShapeMessageSize);
+    cursorShapeMessage = NULL;
+  }
+}
+
+bool HyperVGraphics::sendCursorShape() {
+  if (!isPointerShapeNeeded) {
+    return true;
+  }
+
+  DBGLOG("Sending cursor shape of %ux%u, hot spot %u, %u", cursorShapeMessage->pointerShape.width, cursorShapeMessage->pointerShape.height,
+         cursorShapeMessage->pointerShape.hotX, cursorShapeMessage->pointerShape.hotY);
+  return sendGraphicsMessage(cursorShapeMessage);
+}
+
+bool HyperVGraphics::sendCursorPosition() {
+  HyperVGraphicsMessage gfxMessage;
+
+  if (!isPointerPositionNeeded) {
+    return true;
+  }
+
+  gfxMessage.header.type = kHyperVGraphicsMessageTypePointerPosition;
+  gfxMessage.header.size = sizeof (gfxMessage.header) + sizeof (gfxMessage.pointerPosition);
+  gfxMessage.pointerPosition.videoOutput = 0;
+
+  IOSimpleLockLock(cursorLock);
+  gfxMessage.pointerPosition.isVisible   = isCursorVisible;
+  gfxMessage.pointerPosition.imageX      = cursorX;
+  gfxMessage.pointerPosition.imageY      = cursorY;
+  IOSimpleLockUnlock(cursorLock);
+  return sendGraphicsMessage(&gfxMessage);
+}
+
+void HyperVGraphics::handleCursorUpdate(OSObject *owner, IOInterruptEventSource *sender, int count) {
+  //
+  // Move a staged shape into the shape message, which is only accessed from the workloop.
+  //
+  IOSimpleLockLock(cursorLock);
+  bool isShapeChanged = isCursorShapeStaged;
+  if (isShapeChanged) {
+    UInt32 imageSize = cursorStagedWidth * cursorStagedHeight * kHyperVGraphicsCursorARGBPixelSize;
+    cursorShapeMessage->pointerShape.width  = cursorStagedWidth;
+    cursorShapeMessage->pointerShape.height = cursorStagedHeight;
+    cursorShapeMessage->pointerShape.hotX   = cursorStagedHotX;
+    cursorShapeMessage->pointerShape.hotY   = cursorStagedHotY;
+    cursorShapeMessage->header.size = (UInt32)(sizeof (cursorShapeMessage->header)
+                                               + __offsetof(HyperVGraphicsMessagePointerShape, data) + imageSize);
+    memcpy(cursorShapeMessage->pointerShape.data, cursorStagedImage, imageSize);
+    isCursorShapeStaged = false;
+  }
+  IOSimpleLockUnlock(cursorLock);
+
+  if (!isGraphicsConnected) {
+    return;
+  }
+  if (isShapeChanged) {
+    sendCursorShape();
+  }
+  sendCursorPosition();
+}
+
+IOReturn HyperVGraphics::setCursorImage(IOFramebuffer *framebuffer, void *cursorImage) {
+  IOHardwareCursorDescriptor cursorDescriptor;
+  IOHardwareCursorInfo       cursorInfo;
+
+  //
+  // Use the software cursor if Hyper-V will not draw the shape.
+  //
+  if (!isGraphicsConnected || !isPointerShapeNeeded) {
+    return kIOReturnUnsupported;
+  }
+
+  //
+  // Have IOFramebuffer convert the cursor to 32-bit ARGB, the largest shape SynthVid accepts is 96x96.
+  // Conversion reads the framebuffer's shared cursor memory, it must be done in this context.
+  //
+  memset(&cursorDescriptor, 0, sizeof (cursorDescriptor));
+  cursorDescriptor.majorVersion = kHardwareCursorDescriptorMajorVersion;
+  cursorDescriptor.minorVersion = kHardwareCursorDescriptorMinorVersion;
+  cursorDescriptor.width        = kHyperVGraphicsCursorMaxWidth;
+  cursorDescriptor.height       = kHyperVGraphicsCursorMaxHeight;
+  cursorDescriptor.bitDepth     = 32;
+
+  IOSimpleLockLock(cursorLock);
+  memset(&cursorInfo, 0, sizeof (cursorInfo));
+  cursorInfo.majorVersion       = kHardwareCursorInfoMajorVersion;
+  cursorInfo.minorVersion       = kHardwareCursorInfoMinorVersion;
+  cursorInfo.hardwareCursorData = (UInt8 *)cursorStagedImage;
+  if (!framebuffer->convertCursorImage(cursorImage, &cursorDescriptor, &cursorInfo)
+      || cursorInfo.cursorWidth == 0 || cursorInfo.cursorWidth > kHyperVGraphicsCursorMaxWidth
+      || cursorInfo.cursorHeight == 0 || cursorInfo.cursorHeight > kHyperVGraphicsCursorMaxHeight) {
+    //
+    // Software cursor is used for this image, go back to a transparent shape so Hyper-V does not draw the previous one.
+    //
+    cursorStagedImage[0] = 0;
+    cursorStagedWidth    = 1;
+    cursorStagedHeight   = 1;
+    cursorStagedHotX     = 0;
+    cursorStagedHotY     = 0;
+    isCursorShapeStaged  = true;
+    IOSimpleLockUnlock(cursorLock);
+
+    cursorEventSource->interruptOccurred(NULL, NULL, 0);
+    return kIOReturnUnsupported;
+  }
+  cursorStagedWidth   = cursorInfo.cursorWidth;
+  cursorStagedHeight  = cursorInfo.cursorHeight;
+  cursorStagedHotX    = cursorInfo.cursorHotSpotX;
+  cursorStagedHotY    = cursorInfo.cursorHotSpotY;
+  isCursorShapeStaged = true;
+  IOSimpleLockUnlock(cursorLock);
+
+  cursorEventSource->interruptOccurred(NULL, NULL, 0);
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVGraphics::setCursorState(SInt32 x, SInt32 y, bool visible) {
+  if (!isGraphicsConnected) {
+    return kIOReturnNotReady;
+  }
+
+  //
+  // IOFramebuffer passes the top left of the cursor image, Hyper-V positions the shape by its hot spot.
+  //
+  IOSimpleLockLock(cursorLock);
+  cursorX         = x + cursorStagedHotX;
+  cursorY         = y + cursorStagedHotY;
+  isCursorVisible = visible;
+  IOSimpleLockUnlock(cursorLock);
+
+  cursorEventSource->interruptOccurred(NULL, NULL, 0);
+  return kIOReturnSuccess;
+}
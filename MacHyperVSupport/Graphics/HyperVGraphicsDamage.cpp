@@ -0,0 +1,280 @@
+//
+//  HyperVGraphicsDamage.cpp
+//  Hyper-V basic graphics driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVGraphics.hpp"
+
+//
+// Compares a row of a tile against the shadow copy.
+// SSE/AVX cannot be used here as kernel code does not preserve FPU state,
+// 64-bit words are compared four at a time instead.
+//
+static inline bool isTileRowChanged(const UInt8 *fbRow, const UInt8 *shadowRow, size_t length) {
+  const UInt64 *fbWords     = (const UInt64 *)fbRow;
+  const UInt64 *shadowWords = (const UInt64 *)shadowRow;
+  size_t wordCount          = length / sizeof (UInt64);
+  UInt64 diff               = 0;
+
+  size_t i = 0;
+  for (; i + 4 <= wordCount; i += 4) {
+    diff |= (fbWords[i] ^ shadowWords[i]) | (fbWords[i + 1] ^ shadowWords[i + 1])
+          | (fbWords[i + 2] ^ shadowWords[i + 2]) | (fbWords[i + 3] ^ shadowWords[i + 3]);
+    if (diff != 0) {
+      return true;
+    }
+  }
+  for (; i < wordCount; i++) {
+    diff |= fbWords[i] ^ shadowWords[i];
+  }
+  if (diff != 0) {
+    return true;
+  }
+
+  //
+  // Compare any remaining bytes.
+  //
+  for (size_t b = wordCount * sizeof (UInt64); b < length; b++) {
+    if (fbRow[b] != shadowRow[b]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HyperVGraphics::initDamageTracking() {
+  UInt32 bytesPerPixel = consoleInfo.v_depth / 8;
+  if (bytesPerPixel == 0 || consoleInfo.v_width == 0 || consoleInfo.v_height == 0) {
+    SYSLOG("Unsupported framebuffer layout for damage tracking");
+    return false;
+  }
+
+  //
+  // VRAM in guest RAM is not scanned, Hyper-V reads it directly from guest memory on each full screen update.
+  // Scanning it would be as slow as MMIO VRAM, as it is also mapped write-combined.
+  //
+  if (guestVRAMBuffer != NULL) {
+    DBGLOG("VRAM is in guest RAM, damage tracking is not used");
+    return true;
+  }
+
+  do {
+    //
+    // Map framebuffer for reading.
+    // The framebuffer is also mapped write-combined by the graphics stack, the same cache mode must be used here
+    // as mismatched attributes on the same pages are not coherent.
+    //
+    fbShadowSize       = consoleInfo.v_height * consoleInfo.v_rowBytes;
+    fbMemoryDescriptor = IOMemoryDescriptor::withPhysicalAddress(consoleInfo.v_baseAddr, fbShadowSize, kIODirectionIn);
+    if (fbMemoryDescriptor == NULL) {
+      SYSLOG("Failed to create framebuffer memory descriptor");
+      break;
+    }
+    fbMemoryMap = fbMemoryDescriptor->createMappingInTask(kernel_task, 0, kIOMapAnywhere | kIOMapReadOnly | kIOMapWriteCombineCache);
+    if (fbMemoryMap == NULL) {
+      SYSLOG("Failed to map framebuffer");
+      break;
+    }
+    fbAddress = (UInt8 *)fbMemoryMap->getVirtualAddress();
+
+    //
+    // Allocate shadow copy and tile map.
+    // Shadow copy is only accessed from the workloop, so it can be pageable.
+    //
+    fbShadow = (UInt8 *)IOMallocPageable(fbShadowSize, PAGE_SIZE);
+    if (fbShadow == NULL) {
+      SYSLOG("Failed to allocate %lu bytes for framebuffer shadow copy", fbShadowSize);
+      break;
+    }
+    memcpy(fbShadow, fbAddress, fbShadowSize);
+
+    damageTilesX      = (UInt32)((consoleInfo.v_width + kHyperVGraphicsDamageTileSize - 1) / kHyperVGraphicsDamageTileSize);
+    damageTilesY      = (UInt32)((consoleInfo.v_height + kHyperVGraphicsDamageTileSize - 1) / kHyperVGraphicsDamageTileSize);
+    damageTileMapSize = damageTilesX * damageTilesY;
+    damageTileMap     = (UInt8 *)IOMalloc(damageTileMapSize);
+    if (damageTileMap == NULL) {
+      SYSLOG("Failed to allocate damage tile map");
+      break;
+    }
+    memset(damageTileMap, 0, damageTileMapSize);
+    damageTileHeat = (UInt8 *)IOMalloc(damageTileMapSize);
+    if (damageTileHeat == NULL) {
+      SYSLOG("Failed to allocate damage tile heat map");
+      break;
+    }
+    memset(damageTileHeat, 0, damageTileMapSize);
+    damageScanPhase = 0;
+
+    DBGLOG("Damage tracking initialized with %ux%u tiles of %u pixels", damageTilesX, damageTilesY, kHyperVGraphicsDamageTileSize);
+    return true;
+  } while (false);
+
+  freeDamageTracking();
+  return false;
+}
+
+void HyperVGraphics::freeDamageTracking() {
+  if (damageTileHeat != NULL) {
+    IOFree(damageTileHeat, damageTileMapSize);
+    damageTileHeat = NULL;
+  }
+  if (damageTileMap != NULL) {
+    IOFree(damageTileMap, damageTileMapSize);
+    damageTileMap = NULL;
+  }
+  if (fbShadow != NULL) {
+    IOFreePageable(fbShadow, fbShadowSize);
+    fbShadow = NULL;
+  }
+  fbAddress = NULL;
+  OSSafeReleaseNULL(fbMemoryMap);
+  OSSafeReleaseNULL(fbMemoryDescriptor);
+}
+
+bool HyperVGraphics::scanDamageTile(UInt32 tileX, UInt32 tileY) {
+  UInt32 bytesPerPixel = consoleInfo.v_depth / 8;
+  UInt32 pixelX        = tileX * kHyperVGraphicsDamageTileSize;
+  UInt32 pixelY        = tileY * kHyperVGraphicsDamageTileSize;
+  UInt32 tileWidth     = (consoleInfo.v_width - pixelX) < kHyperVGraphicsDamageTileSize
+                         ? (UInt32)(consoleInfo.v_width - pixelX) : kHyperVGraphicsDamageTileSize;
+  UInt32 tileHeight    = (consoleInfo.v_height - pixelY) < kHyperVGraphicsDamageTileSize
+                         ? (UInt32)(consoleInfo.v_height - pixelY) : kHyperVGraphicsDamageTileSize;
+  size_t rowLength     = tileWidth * bytesPerPixel;
+  size_t offset        = (pixelY * consoleInfo.v_rowBytes) + (pixelX * bytesPerPixel);
+
+  //
+  // Find the first changed row, and refresh the shadow copy from there on.
+  // Rows before it are already identical.
+  //
+  for (UInt32 row = 0; row < tileHeight; row++, offset += consoleInfo.v_rowBytes) {
+    if (isTileRowChanged(&fbAddress[offset], &fbShadow[offset], rowLength)) {
+      for (; row < tileHeight; row++, offset += consoleInfo.v_rowBytes) {
+        memcpy(&fbShadow[offset], &fbAddress[offset], rowLength);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+UInt32 HyperVGraphics::buildDamageRects() {
+  UInt32 rectCount  = 0;
+  bool   overBudget = false;
+
+  HyperVGraphicsRect bounds;
+  bounds.x1 = damageTilesX;
+  bounds.y1 = damageTilesY;
+  bounds.x2 = 0;
+  bounds.y2 = 0;
+
+  for (UInt32 tileY = 0; tileY < damageTilesY; tileY++) {
+    UInt8 *tileRow = &damageTileMap[tileY * damageTilesX];
+
+    for (UInt32 tileX = 0; tileX < damageTilesX;) {
+      if (tileRow[tileX] == 0) {
+        tileX++;
+        continue;
+      }
+
+      //
+      // Get horizontal run of changed tiles.
+      //
+      UInt32 runStart = tileX;
+      while (tileX < damageTilesX && tileRow[tileX] != 0) {
+        tileRow[tileX++] = 0;
+      }
+
+      if (runStart < (UInt32)bounds.x1) { bounds.x1 = runStart; }
+      if (tileX > (UInt32)bounds.x2)    { bounds.x2 = tileX; }
+      if (tileY < (UInt32)bounds.y1)    { bounds.y1 = tileY; }
+      bounds.y2 = tileY + 1;
+      if (overBudget) {
+        continue;
+      }
+
+      //
+      // Extend a rectangle ending at the previous tile row with the same span, otherwise start a new one.
+      //
+      bool merged = false;
+      for (UInt32 i = 0; i < rectCount; i++) {
+        if (damageRects[i].x1 == (SInt32)runStart && damageRects[i].x2 == (SInt32)tileX && damageRects[i].y2 == (SInt32)tileY) {
+          damageRects[i].y2 = tileY + 1;
+          merged = true;
+          break;
+        }
+      }
+      if (merged) {
+        continue;
+      }
+
+      if (rectCount >= kHyperVGraphicsDamageMaxRects) {
+        overBudget = true;
+        continue;
+      }
+      damageRects[rectCount].x1 = runStart;
+      damageRects[rectCount].y1 = tileY;
+      damageRects[rectCount].x2 = tileX;
+      damageRects[rectCount].y2 = tileY + 1;
+      rectCount++;
+    }
+  }
+
+  //
+  // Fall back to a single bounding rectangle if over the per-frame budget.
+  //
+  if (overBudget) {
+    damageRects[0] = bounds;
+    rectCount      = 1;
+  }
+
+  //
+  // Convert from tiles to pixels, clamping to the screen.
+  //
+  for (UInt32 i = 0; i < rectCount; i++) {
+    damageRects[i].x1 *= kHyperVGraphicsDamageTileSize;
+    damageRects[i].y1 *= kHyperVGraphicsDamageTileSize;
+    damageRects[i].x2 *= kHyperVGraphicsDamageTileSize;
+    damageRects[i].y2 *= kHyperVGraphicsDamageTileSize;
+    if (damageRects[i].x2 > (SInt32)consoleInfo.v_width) {
+      damageRects[i].x2 = (SInt32)consoleInfo.v_width;
+    }
+    if (damageRects[i].y2 > (SInt32)consoleInfo.v_height) {
+      damageRects[i].y2 = (SInt32)consoleInfo.v_height;
+    }
+  }
+  return rectCount;
+}
+
+void HyperVGraphics::updateDamage() {
+  //
+  // Scan one interleaved set of tile rows and any recently changed tiles for changes against the shadow copy.
+  // Reading the whole framebuffer each refresh through the write-combined mapping is too slow.
+  //
+  bool isDamaged = false;
+  for (UInt32 tileY = 0; tileY < damageTilesY; tileY++) {
+    bool isScanRow = (tileY % kHyperVGraphicsDamageScanInterleave) == damageScanPhase;
+
+    for (UInt32 tileX = 0; tileX < damageTilesX; tileX++) {
+      UInt32 tileIndex = (tileY * damageTilesX) + tileX;
+      if (!isScanRow && damageTileHeat[tileIndex] == 0) {
+        continue;
+      }
+
+      if (scanDamageTile(tileX, tileY)) {
+        damageTileMap[tileIndex]  = 1;
+        damageTileHeat[tileIndex] = kHyperVGraphicsDamageHotRefreshes;
+        isDamaged = true;
+      } else if (damageTileHeat[tileIndex] != 0) {
+        damageTileHeat[tileIndex]--;
+      }
+    }
+  }
+  damageScanPhase = (damageScanPhase + 1) % kHyperVGraphicsDamageScanInterleave;
+
+  if (isDamaged) {
+    UInt32 rectCount = buildDamageRects();
+    updateDirtyRects(damageRects, rectCount);
+  }
+}
@@ -0,0 +1,575 @@
+//
+//  HyperVGraphicsPrivate.cpp
+//  Hyper-V basic graphics driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVGraphics.hpp"
+
+#include <IOKit/IOPlatformExpert.h>
+#include <IOKit/graphics/IOFramebuffer.h>
+
+void HyperVGraphics::handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count) {
+  HyperVGraphicsMessage gfxMessageStack;
+
+  do {
+    //
+    // Check for available inband packets.
+    // Large packets will be allocated as needed.
+    //
+    HyperVGraphicsMessage *gfxMessage;
+    UInt32 pktDataLength;
+    if (!hvDevice->nextInbandPacketAvailable(&pktDataLength)) {
+      break;
+    }
+
+    if (pktDataLength <= sizeof (gfxMessageStack)) {
+      gfxMessage = &gfxMessageStack;
+    } else {
+      DBGLOG("Allocating large packet of %u bytes", pktDataLength);
+      gfxMessage = (HyperVGraphicsMessage*)IOMalloc(pktDataLength);
+      if (gfxMessage == NULL) {
+        SYSLOG("Failed to allocate large packet of %u bytes", pktDataLength);
+        break;
+      }
+    }
+
+    //
+    // Read next packet.
+    //
+    if (hvDevice->readInbandCompletionPacket((void *)gfxMessage, pktDataLength) == kIOReturnSuccess
+        && pktDataLength >= sizeof (HyperVGraphicsPipeHeader) + sizeof (HyperVGraphicsMessageHeader)
+        && gfxMessage->pipeHeader.type == kHyperVGraphicsPipeMessageTypeData) {
+      DBGLOG("Received message type %u of %u bytes", gfxMessage->header.type, gfxMessage->header.size);
+
+      //
+      // Wake up any thread waiting for this message type.
+      //
+      IOLockLock(responseLock);
+      if (isWaitingResponse && gfxMessage->header.type == waitResponseType) {
+        memcpy(waitResponseMessage, gfxMessage,
+               pktDataLength < sizeof (*waitResponseMessage) ? pktDataLength : sizeof (*waitResponseMessage));
+        isWaitingResponse = false;
+        IOLockWakeup(responseLock, &isWaitingResponse, true);
+      }
+      IOLockUnlock(responseLock);
+
+      if (gfxMessage->header.type == kHyperVGraphicsMessageTypeFeatureChange) {
+        handleFeatureChange(&gfxMessage->featureChange);
+      }
+    }
+
+    //
+    // Free allocated packet if needed.
+    //
+    if (gfxMessage != &gfxMessageStack) {
+      IOFree(gfxMessage, pktDataLength);
+    }
+  } while (true);
+}
+
+void HyperVGraphics::handleRefreshTimer(OSObject *owner, IOTimerEventSource *sender) {
+  //
+  // Send changed areas of the screen, or the entire screen if damage tracking is unavailable or VRAM is in guest RAM.
+  //
+  if (isGraphicsConnected && isDirtNeeded && fbShadow != NULL) {
+    updateDamage();
+  } else if (isGraphicsConnected && isDirtNeeded) {
+    HyperVGraphicsRect rect;
+    rect.x1 = 0;
+    rect.y1 = 0;
+    rect.x2 = consoleInfo.v_width;
+    rect.y2 = consoleInfo.v_height;
+    updateDirtyRects(&rect, 1);
+  }
+
+  refreshTimerSource->setTimeoutMS(1000 / refreshRate);
+}
+
+void HyperVGraphics::handleFeatureChange(HyperVGraphicsMessageFeatureChange *featureChange) {
+  DBGLOG("Feature change: dirt %u, pointer position %u, pointer shape %u, situation %u",
+         featureChange->isDirtNeeded, featureChange->isPointerPositionNeeded,
+         featureChange->isPointerShapeNeeded, featureChange->isSituationNeeded);
+
+  isDirtNeeded            = featureChange->isDirtNeeded != 0;
+  isPointerPositionNeeded = featureChange->isPointerPositionNeeded != 0;
+  isPointerShapeNeeded    = featureChange->isPointerShapeNeeded != 0;
+  if (featureChange->isSituationNeeded && isGraphicsConnected) {
+    updateSituation();
+  }
+
+  //
+  // Resend current cursor state if Hyper-V now wants it.
+  //
+  if (isGraphicsConnected) {
+    sendCursorShape();
+    sendCursorPosition();
+  }
+}
+
+bool HyperVGraphics::sendGraphicsMessage(HyperVGraphicsMessage *gfxMessage, HyperVGraphicsMessageType responseType,
+                                         HyperVGraphicsMessage *gfxMessageResponse) {
+  //
+  // Only one request waiting on a response can be outstanding at a time.
+  //
+  if (gfxMessageResponse != NULL) {
+    IOLockLock(responseLock);
+    waitResponseType    = responseType;
+    waitResponseMessage = gfxMessageResponse;
+    isWaitingResponse   = true;
+    IOLockUnlock(responseLock);
+  }
+
+  gfxMessage->pipeHeader.type = kHyperVGraphicsPipeMessageTypeData;
+  gfxMessage->pipeHeader.size = gfxMessage->header.size;
+
+  IOReturn status = hvDevice->writeInbandPacket(gfxMessage, sizeof (gfxMessage->pipeHeader) + gfxMessage->header.size, false);
+  if (gfxMessageResponse == NULL) {
+    return status == kIOReturnSuccess;
+  }
+
+  //
+  // Wait for response message from Hyper-V.
+  //
+  bool result = false;
+  IOLockLock(responseLock);
+  if (status == kIOReturnSuccess) {
+    AbsoluteTime deadline;
+    clock_interval_to_deadline(kHyperVGraphicsResponseTimeoutMS, kMillisecondScale, &deadline);
+    while (isWaitingResponse) {
+      if (IOLockSleepDeadline(responseLock, &isWaitingResponse, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
+        break;
+      }
+    }
+    result = !isWaitingResponse;
+  }
+  isWaitingResponse = false;
+  IOLockUnlock(responseLock);
+
+  if (!result) {
+    SYSLOG("Failed to get response of type %u for message type %u", responseType, gfxMessage->header.type);
+  }
+  return result;
+}
+
+bool HyperVGraphics::negotiateVersion(HyperVGraphicsVersion version) {
+  HyperVGraphicsMessage gfxMessage;
+  HyperVGraphicsMessage gfxMessageResponse;
+
+  memset(&gfxMessage, 0, sizeof (gfxMessage));
+  gfxMessage.header.type = kHyperVGraphicsMessageTypeVersionRequest;
+  gfxMessage.header.size = sizeof (gfxMessage.header) + sizeof (gfxMessage.versionRequest);
+  gfxMessage.versionRequest.version = version;
+
+  DBGLOG("Trying SynthVid version %u.%u", kHyperVGraphicsVersionMajor(version), kHyperVGraphicsVersionMinor(version));
+  if (!sendGraphicsMessage(&gfxMessage, kHyperVGraphicsMessageTypeVersionResponse, &gfxMessageResponse)) {
+    return false;
+  }
+
+  DBGLOG("SynthVid version %u.%u accepted: %u, max video outputs %u", kHyperVGraphicsVersionMajor(version), kHyperVGraphicsVersionMinor(version),
+         gfxMessageResponse.versionResponse.isAccepted, gfxMessageResponse.versionResponse.maxVideoOutputs);
+  return gfxMessageResponse.versionResponse.isAccepted != 0;
+}
+
+bool HyperVGraphics::updateVRAMLocation() {
+  HyperVGraphicsMessage gfxMessage;
+  HyperVGraphicsMessage gfxMessageResponse;
+
+  //
+  // Context is echoed back by Hyper-V, use the VRAM address for this.
+  //
+  memset(&gfxMessage, 0, sizeof (gfxMessage));
+  gfxMessage.header.type = kHyperVGraphicsMessageTypeVRAMLocation;
+  gfxMessage.header.size = sizeof (gfxMessage.header) + sizeof (gfxMessage.vramLocation);
+  gfxMessage.vramLocation.context            = consoleInfo.v_baseAddr;
+  gfxMessage.vramLocation.isVRAMGPASpecified = 1;
+  gfxMessage.vramLocation.vramGPA            = consoleInfo.v_baseAddr;
+
+  if (!sendGraphicsMessage(&gfxMessage, kHyperVGraphicsMessageTypeVRAMLocationAck, &gfxMessageResponse)) {
+    return false;
+  }
+  if (gfxMessageResponse.vramLocationAck.context != consoleInfo.v_baseAddr) {
+    SYSLOG("Invalid VRAM location acknowledgement 0x%llX", gfxMessageResponse.vramLocationAck.context);
+    return false;
+  }
+
+  DBGLOG("VRAM location set to 0x%llX", gfxMessage.vramLocation.vramGPA);
+  return true;
+}
+
+bool HyperVGraphics::updateSituation() {
+  HyperVGraphicsMessage gfxMessage;
+
+  //
+  // Situation update does not need to wait for acknowledgement.
+  //
+  memset(&gfxMessage, 0, sizeof (gfxMessage));
+  gfxMessage.header.type = kHyperVGraphicsMessageTypeSituationUpdate;
+  gfxMessage.header.size = sizeof (gfxMessage.header) + sizeof (gfxMessage.situationUpdate);
+  gfxMessage.situationUpdate.context          = 0;
+  gfxMessage.situationUpdate.videoOutputCount = 1;
+  gfxMessage.situationUpdate.videoOutput[0].active       = 1;
+  gfxMessage.situationUpdate.videoOutput[0].vramOffset   = 0;
+  gfxMessage.situationUpdate.videoOutput[0].depthBits    = consoleInfo.v_depth;
+  gfxMessage.situationUpdate.videoOutput[0].widthPixels  = (UInt32)consoleInfo.v_width;
+  gfxMessage.situationUpdate.videoOutput[0].heightPixels = (UInt32)consoleInfo.v_height;
+  gfxMessage.situationUpdate.videoOutput[0].pitchBytes   = (UInt32)consoleInfo.v_rowBytes;
+
+  DBGLOG("Updating situation to %ux%u, bpp: %u, bytes/row: %u", consoleInfo.v_width, consoleInfo.v_height,
+         consoleInfo.v_depth, consoleInfo.v_rowBytes);
+  return sendGraphicsMessage(&gfxMessage);
+}
+
+bool HyperVGraphics::connectGraphics() {
+  //
+  // Negotiate newest version supported by Hyper-V.
+  //
+  static const HyperVGraphicsVersion graphicsVersions[] = {
+    kHyperVGraphicsVersionV3_5,
+    kHyperVGraphicsVersionV3_2,
+    kHyperVGraphicsVersionV3_0
+  };
+
+  bool foundVersion = false;
+  for (UInt32 i = 0; i < ARRAY_SIZE(graphicsVersions); i++) {
+    if (negotiateVersion(graphicsVersions[i])) {
+      graphicsVersion = graphicsVersions[i];
+      foundVersion = true;
+      break;
+    }
+  }
+  if (!foundVersion) {
+    SYSLOG("Failed to negotiate a SynthVid version with Hyper-V");
+    return false;
+  }
+  DBGLOG("Using SynthVid version %u.%u", kHyperVGraphicsVersionMajor(graphicsVersion), kHyperVGraphicsVersionMinor(graphicsVersion));
+
+  //
+  // Report VRAM location and current framebuffer layout.
+  //
+  if (!updateVRAMLocation()) {
+    return false;
+  }
+  if (!updateSituation()) {
+    return false;
+  }
+
+  //
+  // Send initial cursor state.
+  //
+  if (!sendCursorShape() || !sendCursorPosition()) {
+    return false;
+  }
+
+  //
+  // Get supported resolutions, this is only available on newer versions.
+  // Resolution changes are still allowed within VRAM limits if this fails.
+  //
+  if (graphicsVersion >= kHyperVGraphicsVersionV3_5 && !getSupportedResolutions()) {
+    SYSLOG("Failed to get supported resolutions from Hyper-V");
+  }
+
+  isGraphicsConnected = true;
+  return true;
+}
+
+bool HyperVGraphics::allocateGuestVRAM() {
+  //
+  // Guest RAM VRAM is only used if requested, as a large physically contiguous allocation is required.
+  //
+  UInt32 requestedSizeMB;
+  if (!PE_parse_boot_argn(kHyperVGraphicsGuestVRAMBootArg, &requestedSizeMB, sizeof (requestedSizeMB)) || requestedSizeMB == 0) {
+    return false;
+  }
+
+  UInt64 requestedSize = (UInt64)requestedSizeMB * 1024 * 1024;
+  UInt32 fbSize        = (UInt32)(consoleInfo.v_height * consoleInfo.v_rowBytes);
+  if (requestedSize > kHyperVGraphicsGuestVRAMSizeMax) {
+    requestedSize = kHyperVGraphicsGuestVRAMSizeMax;
+  }
+  if (requestedSize < fbSize) {
+    requestedSize = fbSize;
+  }
+
+  //
+  // BAR0 is sized from VRAM, round up to a power of two.
+  //
+  UInt32 guestVRAMSize = PAGE_SIZE;
+  while (guestVRAMSize < requestedSize) {
+    guestVRAMSize <<= 1;
+  }
+
+  //
+  // VRAM must be below 4GB as BAR0 is 32-bit, and naturally aligned to its size like any BAR.
+  // Hyper-V reads it directly on dirty rectangle updates. It is allocated write-combined to match the framebuffer's
+  // mapping of the same pages, as mismatched cache attributes are not coherent.
+  //
+  guestVRAMBuffer = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
+                                                                     kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryMapperNone
+                                                                     | kIOMapWriteCombineCache,
+                                                                     guestVRAMSize, 0xFFFFFFFFULL & ~((UInt64)guestVRAMSize - 1));
+  if (guestVRAMBuffer == NULL) {
+    SYSLOG("Failed to allocate %u bytes of VRAM from guest RAM", guestVRAMSize);
+    return false;
+  }
+  guestVRAMBuffer->prepare();
+  memset(guestVRAMBuffer->getBytesNoCopy(), 0, guestVRAMSize);
+
+  //
+  // Copy current framebuffer contents into new VRAM.
+  //
+  IOMemoryDescriptor *fbDesc = IOMemoryDescriptor::withPhysicalAddress(consoleInfo.v_baseAddr, fbSize, kIODirectionIn);
+  if (fbDesc != NULL) {
+    IOMemoryMap *fbMap = fbDesc->createMappingInTask(kernel_task, 0, kIOMapAnywhere | kIOMapReadOnly | kIOMapWriteCombineCache);
+    if (fbMap != NULL) {
+      memcpy(guestVRAMBuffer->getBytesNoCopy(), (void *)fbMap->getVirtualAddress(), fbSize);
+      fbMap->release();
+    }
+    fbDesc->release();
+  }
+
+  consoleInfo.v_baseAddr = (unsigned long)guestVRAMBuffer->getPhysicalAddress();
+  vramSize               = guestVRAMSize;
+  DBGLOG("Allocated %u bytes of VRAM from guest RAM at 0x%llX", guestVRAMSize, guestVRAMBuffer->getPhysicalAddress());
+  return true;
+}
+
+void HyperVGraphics::restoreBootConsole() {
+  if (guestVRAMBuffer == NULL) {
+    return;
+  }
+
+  //
+  // Move console back to the legacy framebuffer, guest RAM VRAM must not be used by the console once freed.
+  //
+  consoleInfo = bootConsoleInfo;
+  getPlatform()->setConsoleInfo(&consoleInfo, kPEBaseAddressChange);
+}
+
+void HyperVGraphics::freeGuestVRAM() {
+  if (guestVRAMBuffer == NULL) {
+    return;
+  }
+
+  guestVRAMBuffer->complete();
+  OSSafeReleaseNULL(guestVRAMBuffer);
+}
+
+bool HyperVGraphics::getSupportedResolutions() {
+  HyperVGraphicsMessage gfxMessage;
+  HyperVGraphicsMessage gfxMessageResponse;
+
+  memset(&gfxMessage, 0, sizeof (gfxMessage));
+  gfxMessage.header.type = kHyperVGraphicsMessageTypeResolutionRequest;
+  gfxMessage.header.size = sizeof (gfxMessage.header) + sizeof (gfxMessage.resolutionRequest);
+  gfxMessage.resolutionRequest.maxResolutionCount = kHyperVGraphicsMaxResolutionCount;
+
+  if (!sendGraphicsMessage(&gfxMessage, kHyperVGraphicsMessageTypeResolutionResponse, &gfxMessageResponse)) {
+    return false;
+  }
+
+  HyperVGraphicsMessageResolutionResponse *resolutionResponse = &gfxMessageResponse.resolutionResponse;
+  if (resolutionResponse->resolutionCount == 0 || resolutionResponse->resolutionCount > kHyperVGraphicsMaxResolutionCount) {
+    SYSLOG("Invalid supported resolution count %u", resolutionResponse->resolutionCount);
+    return false;
+  }
+
+  supportedResolutionCount = resolutionResponse->resolutionCount;
+  memcpy(supportedResolutions, resolutionResponse->resolutions, supportedResolutionCount * sizeof (HyperVGraphicsScreenResolution));
+  DBGLOG("Got %u supported resolutions, default is %ux%u", supportedResolutionCount,
+         resolutionResponse->defaultResolutionIndex < supportedResolutionCount ? supportedResolutions[resolutionResponse->defaultResolutionIndex].width : 0,
+         resolutionResponse->defaultResolutionIndex < supportedResolutionCount ? supportedResolutions[resolutionResponse->defaultResolutionIndex].height : 0);
+  return true;
+}
+
+void HyperVGraphics::publishResolutions() {
+  //
+  // Publish current resolution.
+  //
+  OSDictionary *currentDict = OSDictionary::withCapacity(2);
+  if (currentDict != NULL) {
+    OSNumber *width  = OSNumber::withNumber(consoleInfo.v_width, 32);
+    OSNumber *height = OSNumber::withNumber(consoleInfo.v_height, 32);
+    if (width != NULL && height != NULL) {
+      currentDict->setObject("Width", width);
+      currentDict->setObject("Height", height);
+      setProperty("CurrentResolution", currentDict);
+    }
+    OSSafeReleaseNULL(width);
+    OSSafeReleaseNULL(height);
+    currentDict->release();
+  }
+
+  //
+  // Publish resolutions supported by Hyper-V.
+  //
+  if (supportedResolutionCount == 0) {
+    return;
+  }
+  OSArray *resolutionsArray = OSArray::withCapacity(supportedResolutionCount);
+  if (resolutionsArray == NULL) {
+    return;
+  }
+  for (UInt32 i = 0; i < supportedResolutionCount; i++) {
+    OSDictionary *resolutionDict = OSDictionary::withCapacity(2);
+    OSNumber *width  = OSNumber::withNumber(supportedResolutions[i].width, 32);
+    OSNumber *height = OSNumber::withNumber(supportedResolutions[i].height, 32);
+    if (resolutionDict != NULL && width != NULL && height != NULL) {
+      resolutionDict->setObject("Width", width);
+      resolutionDict->setObject("Height", height);
+      resolutionsArray->setObject(resolutionDict);
+    }
+    OSSafeReleaseNULL(width);
+    OSSafeReleaseNULL(height);
+    OSSafeReleaseNULL(resolutionDict);
+  }
+  setProperty("SupportedResolutions", resolutionsArray);
+  resolutionsArray->release();
+}
+
+bool HyperVGraphics::isResolutionSupported(UInt32 width, UInt32 height) {
+  //
+  // Use list from Hyper-V if present, otherwise check against version limits.
+  //
+  if (supportedResolutionCount != 0) {
+    for (UInt32 i = 0; i < supportedResolutionCount; i++) {
+      if (supportedResolutions[i].width == width && supportedResolutions[i].height == height) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  if (width < kHyperVGraphicsMinWidth || height < kHyperVGraphicsMinHeight) {
+    return false;
+  }
+  if (graphicsVersion < kHyperVGraphicsVersionV3_2
+      && (width > kHyperVGraphicsMaxWidthV3_0 || height > kHyperVGraphicsMaxHeightV3_0)) {
+    return false;
+  }
+  return true;
+}
+
+IOReturn HyperVGraphics::setResolutionGated(UInt32 *width, UInt32 *height) {
+  UInt32 bytesPerPixel = consoleInfo.v_depth / 8;
+  UInt32 rowBytes      = *width * bytesPerPixel;
+
+  if (!isResolutionSupported(*width, *height)) {
+    SYSLOG("Resolution %ux%u is not supported", *width, *height);
+    return kIOReturnUnsupported;
+  }
+  if ((UInt64)rowBytes * *height > vramSize) {
+    SYSLOG("Resolution %ux%u exceeds VRAM size of %u bytes", *width, *height, vramSize);
+    return kIOReturnNoSpace;
+  }
+
+  //
+  // Damage tracking state depends on framebuffer layout and must be rebuilt.
+  //
+  IOFramebuffer *framebuffer = copyFramebuffer();
+  if (framebuffer != NULL) {
+    framebuffer->handleEvent(kIOFBNotifyDisplayModeWillChange);
+  }
+  freeDamageTracking();
+
+  PE_Video oldConsoleInfo = consoleInfo;
+  consoleInfo.v_width     = *width;
+  consoleInfo.v_height    = *height;
+  consoleInfo.v_rowBytes  = rowBytes;
+
+  IOReturn status = kIOReturnSuccess;
+  if (updateSituation()) {
+    //
+    // Update kernel console with new framebuffer layout.
+    //
+    getPlatform()->setConsoleInfo(&consoleInfo, kPEBaseAddressChange);
+    publishResolutions();
+    SYSLOG("Resolution changed to %ux%u", *width, *height);
+  } else {
+    //
+    // Hyper-V is still using the old layout, restore it.
+    //
+    SYSLOG("Failed to change resolution to %ux%u", *width, *height);
+    consoleInfo = oldConsoleInfo;
+    status      = kIOReturnIOError;
+  }
+
+  if (!initDamageTracking()) {
+    SYSLOG("Failed to initialize damage tracking, full screen updates will be used");
+  }
+
+  //
+  // Framebuffer clients such as WindowServer pick up the new geometry from this notification.
+  //
+  if (framebuffer != NULL) {
+    framebuffer->handleEvent(kIOFBNotifyDisplayModeDidChange);
+    framebuffer->release();
+  }
+  return status;
+}
+
+IOFramebuffer* HyperVGraphics::copyFramebuffer() {
+  //
+  // Framebuffer is attached to the PCI device produced by this bridge.
+  //
+  OSIterator *iterator = IORegistryIterator::iterateOver(this, gIOServicePlane, kIORegistryIterateRecursively);
+  if (iterator == NULL) {
+    return NULL;
+  }
+
+  IOFramebuffer *framebuffer = NULL;
+  OSObject      *object;
+  while ((object = iterator->getNextObject()) != NULL) {
+    framebuffer = OSDynamicCast(IOFramebuffer, object);
+    if (framebuffer != NULL) {
+      framebuffer->retain();
+      break;
+    }
+  }
+  iterator->release();
+  return framebuffer;
+}
+
+IOReturn HyperVGraphics::updateDirtyRects(const HyperVGraphicsRect *rects, UInt32 rectCount) {
+  HyperVGraphicsMessage gfxMessage;
+
+  if (!isGraphicsConnected) {
+    return kIOReturnNotReady;
+  }
+  if (!isDirtNeeded) {
+    return kIOReturnSuccess;
+  }
+
+  //
+  // Send rectangles in as few messages as possible.
+  //
+  while (rectCount > 0) {
+    UInt32 messageRectCount = rectCount > kHyperVGraphicsDirtMaxRects ? kHyperVGraphicsDirtMaxRects : rectCount;
+
+    gfxMessage.header.type = kHyperVGraphicsMessageTypeDirt;
+    gfxMessage.header.size = (UInt32)(sizeof (gfxMessage.header) + __offsetof(HyperVGraphicsMessageDirt, rects[messageRectCount]));
+    gfxMessage.dirt.videoOutput = 0;
+    gfxMessage.dirt.dirtCount   = messageRectCount;
+    memcpy(gfxMessage.dirt.rects, rects, messageRectCount * sizeof (HyperVGraphicsRect));
+
+    if (!sendGraphicsMessage(&gfxMessage)) {
+      return kIOReturnIOError;
+    }
+
+    rects     += messageRectCount;
+    rectCount -= messageRectCount;
+  }
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVGraphics::setResolution(UInt32 width, UInt32 height) {
+  if (!isGraphicsConnected) {
+    return kIOReturnNotReady;
+  }
+
+  //
+  // Framebuffer layout is used by the refresh timer, change it on the workloop.
+  //
+  return commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVGraphics::setResolutionGated), &width, &height);
+}
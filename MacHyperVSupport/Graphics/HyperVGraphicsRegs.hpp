@@ -0,0 +1,258 @@
+//
+//  HyperVGraphicsRegs.hpp
+//  Hyper-V basic graphics driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVGraphicsRegs_hpp
+#define HyperVGraphicsRegs_hpp
+
+#define kHyperVGraphicsRingBufferSize       (256 * 1024)
+#define kHyperVGraphicsResponseTimeoutMS    10000
+
+//
+// Refresh rate used for sending dirty rectangles to Hyper-V.
+//
+#define kHyperVGraphicsRefreshRateDefault   20
+#define kHyperVGraphicsRefreshRateMax       60
+#define kHyperVGraphicsRefreshRateBootArg   "hvgfxrefresh"
+
+//
+// Damage tracking tile size in pixels, and maximum rectangles sent per frame.
+// If a frame produces more rectangles, they are merged into a single bounding rectangle.
+//
+#define kHyperVGraphicsDamageTileSize       32
+#define kHyperVGraphicsDamageMaxRects       16
+
+//
+// Framebuffer reads are uncached, so only every Nth tile row is scanned each refresh.
+// Tiles that changed recently are scanned on every refresh for the given number of refreshes.
+//
+#define kHyperVGraphicsDamageScanInterleave 4
+#define kHyperVGraphicsDamageHotRefreshes   16
+
+//
+// SynthVid protocol versions.
+//
+#define kHyperVGraphicsVersion(major, minor)    (((minor) << 16) | (major))
+#define kHyperVGraphicsVersionMajor(version)    ((version) & 0xFFFF)
+#define kHyperVGraphicsVersionMinor(version)    (((version) >> 16) & 0xFFFF)
+
+typedef enum : UInt32 {
+  kHyperVGraphicsVersionV3_0  = kHyperVGraphicsVersion(3, 0),   // Windows Server 2008 R2 / Windows 7
+  kHyperVGraphicsVersionV3_2  = kHyperVGraphicsVersion(3, 2),   // Windows Server 2012 / Windows 8
+  kHyperVGraphicsVersionV3_5  = kHyperVGraphicsVersion(3, 5)    // Windows Server 2016 / Windows 10
+} HyperVGraphicsVersion;
+
+#define kHyperVGraphicsVRAMSizeV3_0   (4 * 1024 * 1024)
+#define kHyperVGraphicsVRAMSizeV3_2   (8 * 1024 * 1024)
+
+//
+// VRAM can optionally be allocated from guest RAM, size is specified in megabytes with boot argument.
+//
+#define kHyperVGraphicsGuestVRAMBootArg   "hvgfxvram"
+#define kHyperVGraphicsGuestVRAMSizeMax   (128 * 1024 * 1024)
+
+//
+// Resolution limits for runtime resolution changes.
+//
+#define kHyperVGraphicsMinWidth       640
+#define kHyperVGraphicsMinHeight      480
+#define kHyperVGraphicsMaxWidthV3_0   1600
+#define kHyperVGraphicsMaxHeightV3_0  1200
+
+typedef enum : UInt32 {
+  kHyperVGraphicsPipeMessageTypeInvalid = 0,
+  kHyperVGraphicsPipeMessageTypeData    = 1
+} HyperVGraphicsPipeMessageType;
+
+//
+// SynthVid message types.
+//
+typedef enum : UInt32 {
+  kHyperVGraphicsMessageTypeError               = 0,
+  kHyperVGraphicsMessageTypeVersionRequest      = 1,
+  kHyperVGraphicsMessageTypeVersionResponse     = 2,
+  kHyperVGraphicsMessageTypeVRAMLocation        = 3,
+  kHyperVGraphicsMessageTypeVRAMLocationAck     = 4,
+  kHyperVGraphicsMessageTypeSituationUpdate     = 5,
+  kHyperVGraphicsMessageTypeSituationUpdateAck  = 6,
+  kHyperVGraphicsMessageTypePointerPosition     = 7,
+  kHyperVGraphicsMessageTypePointerShape        = 8,
+  kHyperVGraphicsMessageTypeFeatureChange       = 9,
+  kHyperVGraphicsMessageTypeDirt                = 10,
+  kHyperVGraphicsMessageTypeResolutionRequest   = 13,
+  kHyperVGraphicsMessageTypeResolutionResponse  = 14
+} HyperVGraphicsMessageType;
+
+//
+// Pipe header, size is the size of the SynthVid message that follows.
+//
+typedef struct __attribute__((packed)) {
+  HyperVGraphicsPipeMessageType type;
+  UInt32                        size;
+} HyperVGraphicsPipeHeader;
+
+//
+// SynthVid message header, size includes this header.
+//
+typedef struct __attribute__((packed)) {
+  HyperVGraphicsMessageType     type;
+  UInt32                        size;
+} HyperVGraphicsMessageHeader;
+
+//
+// Version request and response.
+//
+typedef struct __attribute__((packed)) {
+  HyperVGraphicsVersion version;
+} HyperVGraphicsMessageVersionRequest;
+
+typedef struct __attribute__((packed)) {
+  HyperVGraphicsVersion version;
+  UInt8                 isAccepted;
+  UInt8                 maxVideoOutputs;
+} HyperVGraphicsMessageVersionResponse;
+
+//
+// VRAM location and acknowledgement.
+// User context is echoed back by Hyper-V in the acknowledgement.
+//
+typedef struct __attribute__((packed)) {
+  UInt64  context;
+  UInt8   isVRAMGPASpecified;
+  UInt64  vramGPA;
+} HyperVGraphicsMessageVRAMLocation;
+
+typedef struct __attribute__((packed)) {
+  UInt64  context;
+} HyperVGraphicsMessageVRAMLocationAck;
+
+//
+// Situation update and acknowledgement.
+//
+typedef struct __attribute__((packed)) {
+  UInt8   active;
+  UInt32  vramOffset;
+  UInt8   depthBits;
+  UInt32  widthPixels;
+  UInt32  heightPixels;
+  UInt32  pitchBytes;
+} HyperVGraphicsVideoOutputSituation;
+
+typedef struct __attribute__((packed)) {
+  UInt64                              context;
+  UInt8                               videoOutputCount;
+  HyperVGraphicsVideoOutputSituation  videoOutput[1];
+} HyperVGraphicsMessageSituationUpdate;
+
+typedef struct __attribute__((packed)) {
+  UInt64  context;
+} HyperVGraphicsMessageSituationUpdateAck;
+
+//
+// Feature change, sent by Hyper-V to indicate which updates it wants.
+//
+typedef struct __attribute__((packed)) {
+  UInt8 isDirtNeeded;
+  UInt8 isPointerPositionNeeded;
+  UInt8 isPointerShapeNeeded;
+  UInt8 isSituationNeeded;
+} HyperVGraphicsMessageFeatureChange;
+
+//
+// Pointer position, coordinates are in pixels relative to the screen.
+//
+typedef struct __attribute__((packed)) {
+  UInt8   isVisible;
+  UInt8   videoOutput;
+  SInt32  imageX;
+  SInt32  imageY;
+} HyperVGraphicsMessagePointerPosition;
+
+//
+// Pointer shape, data is 32-bit ARGB followed by the image.
+// Shapes can be sent in parts, a part index of kHyperVGraphicsCursorPartComplete indicates the entire shape is present.
+//
+#define kHyperVGraphicsCursorMaxWidth       96
+#define kHyperVGraphicsCursorMaxHeight      96
+#define kHyperVGraphicsCursorARGBPixelSize  4
+#define kHyperVGraphicsCursorMaxSize        (kHyperVGraphicsCursorMaxWidth * kHyperVGraphicsCursorMaxHeight * kHyperVGraphicsCursorARGBPixelSize)
+#define kHyperVGraphicsCursorPartComplete   0xFF
+
+typedef struct __attribute__((packed)) {
+  UInt8   partIndex;
+  UInt8   isARGB;
+  UInt32  width;
+  UInt32  height;
+  UInt32  hotX;
+  UInt32  hotY;
+  UInt8   data[4];
+} HyperVGraphicsMessagePointerShape;
+
+//
+// Dirty rectangles, bottom right corner is exclusive.
+//
+#define kHyperVGraphicsDirtMaxRects   8
+
+typedef struct __attribute__((packed)) {
+  SInt32  x1;
+  SInt32  y1;
+  SInt32  x2;
+  SInt32  y2;
+} HyperVGraphicsRect;
+
+typedef struct __attribute__((packed)) {
+  UInt8               videoOutput;
+  UInt8               dirtCount;
+  HyperVGraphicsRect  rects[kHyperVGraphicsDirtMaxRects];
+} HyperVGraphicsMessageDirt;
+
+//
+// Supported resolutions request and response, only available on SynthVid 3.5 and newer.
+//
+#define kHyperVGraphicsEDIDBlockSize          128
+#define kHyperVGraphicsMaxResolutionCount     64
+
+typedef struct __attribute__((packed)) {
+  UInt8 maxResolutionCount;
+} HyperVGraphicsMessageResolutionRequest;
+
+typedef struct __attribute__((packed)) {
+  UInt16  width;
+  UInt16  height;
+} HyperVGraphicsScreenResolution;
+
+typedef struct __attribute__((packed)) {
+  UInt8                           edidBlock[kHyperVGraphicsEDIDBlockSize];
+  UInt8                           resolutionCount;
+  UInt8                           defaultResolutionIndex;
+  UInt8                           isStandard;
+  HyperVGraphicsScreenResolution  resolutions[kHyperVGraphicsMaxResolutionCount];
+} HyperVGraphicsMessageResolutionResponse;
+
+//
+// Main message structure.
+//
+typedef struct __attribute__((packed)) {
+  HyperVGraphicsPipeHeader    pipeHeader;
+  HyperVGraphicsMessageHeader header;
+
+  union {
+    HyperVGraphicsMessageVersionRequest     versionRequest;
+    HyperVGraphicsMessageVersionResponse    versionResponse;
+    HyperVGraphicsMessageVRAMLocation       vramLocation;
+    HyperVGraphicsMessageVRAMLocationAck    vramLocationAck;
+    HyperVGraphicsMessageSituationUpdate    situationUpdate;
+    HyperVGraphicsMessageSituationUpdateAck situationUpdateAck;
+    HyperVGraphicsMessagePointerPosition    pointerPosition;
+    HyperVGraphicsMessagePointerShape       pointerShape;
+    HyperVGraphicsMessageFeatureChange      featureChange;
+    HyperVGraphicsMessageDirt               dirt;
+    HyperVGraphicsMessageResolutionRequest  resolutionRequest;
+    HyperVGraphicsMessageResolutionResponse resolutionResponse;
+  };
+} HyperVGraphicsMessage;
+
+#endif /* HyperVGraphicsRegs_hpp */
@@ -0,0 +1,100 @@
+//
+//  HyperVInputStatistics.cpp
+//  Hyper-V input latency statistics
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVInputStatistics.hpp"
+#include "HyperV.hpp"
+
+void HyperVInputStatistics::recordEvent(UInt64 receiveTime, UInt64 dispatchTime) {
+  UInt64 latencyNS;
+  absolutetime_to_nanoseconds(dispatchTime - receiveTime, &latencyNS);
+
+  //
+  // Bucket by power of two microseconds.
+  //
+  UInt64 latencyUS = latencyNS / 1000;
+  UInt32 bucket    = latencyUS == 0 ? 0 : 64 - __builtin_clzll(latencyUS);
+  if (bucket >= kHyperVInputLatencyBucketCount) {
+    bucket = kHyperVInputLatencyBucketCount - 1;
+  }
+  latencyBuckets[bucket]++;
+  latencyTotalNS += latencyNS;
+  if (latencyNS > latencyMaxNS) {
+    latencyMaxNS = latencyNS;
+  }
+
+  //
+  // Jitter is the smoothed difference between consecutive intervals, as in RFC 3550.
+  //
+  if (eventCount != 0) {
+    UInt64 intervalNS;
+    absolutetime_to_nanoseconds(dispatchTime - lastDispatchTime, &intervalNS);
+    if (intervalCount != 0) {
+      UInt64 difference = intervalNS > lastIntervalNS ? intervalNS - lastIntervalNS : lastIntervalNS - intervalNS;
+      jitterNS = difference > jitterNS ? jitterNS + ((difference - jitterNS) / 16) : jitterNS - ((jitterNS - difference) / 16);
+    }
+    lastIntervalNS   = intervalNS;
+    intervalTotalNS += intervalNS;
+    intervalCount++;
+  }
+  lastDispatchTime = dispatchTime;
+  eventCount++;
+}
+
+void HyperVInputStatistics::publish(IOService *service) {
+  OSDictionary *stats = OSDictionary::withCapacity(7);
+  if (stats == NULL) {
+    return;
+  }
+
+  OSArray *histogram = OSArray::withCapacity(kHyperVInputLatencyBucketCount);
+  if (histogram != NULL) {
+    for (UInt32 i = 0; i < kHyperVInputLatencyBucketCount; i++) {
+      OSNumber *number = OSNumber::withNumber(latencyBuckets[i], 64);
+      if (number != NULL) {
+        histogram->setObject(number);
+        number->release();
+      }
+    }
+    stats->setObject("LatencyHistogramUS", histogram);
+    histogram->release();
+  }
+
+  const struct {
+    const char  *key;
+    UInt64      value;
+  } values[] = {
+    { "EventCount",         eventCount },
+    { "LatencyAverageNS",   eventCount != 0 ? latencyTotalNS / eventCount : 0 },
+    { "LatencyMaxNS",       latencyMaxNS },
+    { "IntervalAverageNS",  intervalCount != 0 ? intervalTotalNS / intervalCount : 0 },
+    { "JitterNS",           jitterNS }
+  };
+  for (UInt32 i = 0; i < ARRAY_SIZE(values); i++) {
+    OSNumber *number = OSNumber::withNumber(values[i].value, 64);
+    if (number != NULL) {
+      stats->setObject(values[i].key, number);
+      number->release();
+    }
+  }
+
+  service->setProperty(kHyperVInputStatisticsKey, stats);
+  stats->release();
+}
+
+void HyperVInputStatistics::publishIfNeeded(IOService *service, UInt64 currentTime) {
+  //
+  // Limit IORegistry updates to avoid adding overhead to the input path.
+  //
+  UInt64 elapsedNS;
+  absolutetime_to_nanoseconds(currentTime - lastPublishTime, &elapsedNS);
+  if (lastPublishTime != 0 && elapsedNS < kHyperVInputStatisticsIntervalMS * 1000000ULL) {
+    return;
+  }
+
+  lastPublishTime = currentTime;
+  publish(service);
+}
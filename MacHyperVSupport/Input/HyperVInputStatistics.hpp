@@ -0,0 +1,46 @@
+//
+//  HyperVInputStatistics.hpp
+//  Hyper-V input latency statistics
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVInputStatistics_hpp
+#define HyperVInputStatistics_hpp
+
+#include <IOKit/IOService.h>
+
+//
+// Latency buckets are powers of two in microseconds, the first is under 1us and the last holds anything larger.
+//
+#define kHyperVInputLatencyBucketCount      16
+#define kHyperVInputStatisticsIntervalMS    1000
+
+#define kHyperVInputStatisticsKey           "InputLatencyStatistics"
+
+//
+// Tracks time between an input packet being read from the ring buffer and its event being dispatched,
+// along with the interval and jitter between events.
+//
+class HyperVInputStatistics {
+private:
+  UInt64  eventCount;
+  UInt64  latencyBuckets[kHyperVInputLatencyBucketCount];
+  UInt64  latencyTotalNS;
+  UInt64  latencyMaxNS;
+
+  UInt64  lastDispatchTime;
+  UInt64  lastIntervalNS;
+  UInt64  intervalCount;
+  UInt64  intervalTotalNS;
+  UInt64  jitterNS;
+
+  UInt64  lastPublishTime;
+
+public:
+  void recordEvent(UInt64 receiveTime, UInt64 dispatchTime);
+  void publish(IOService *service);
+  void publishIfNeeded(IOService *service, UInt64 currentTime);
+};
+
+#endif
@@ -0,0 +1,498 @@
+//
+//  HyperVFileCopy.cpp
+//  Hyper-V file copy driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVFileCopy.hpp"
+
+#include <sys/errno.h>
+
+#define super HyperVICService
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVFileCopy", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVFileCopy", str, ## __VA_ARGS__)
+
+OSDefineMetaClassAndStructors(HyperVFileCopy, super);
+
+//
+// Supported message versions, most preferred first.
+//
+static const UInt32 fileCopyVersions[] = {
+  kHyperVFileCopyVersionV1
+};
+
+const HyperVICMessageHandler HyperVFileCopy::messageHandlers[] = {
+  { kVMBusICMessageTypeFileCopy, (HyperVICMessageAction) &HyperVFileCopy::handleFileCopy }
+};
+
+static inline UInt64 getElapsedMicroseconds(UInt64 startTime, UInt64 endTime) {
+  UInt64 elapsedNS;
+  absolutetime_to_nanoseconds(endTime - startTime, &elapsedNS);
+  return elapsedNS / 1000;
+}
+
+//
+// Maps writer errno values to the status codes Hyper-V reports to the user.
+//
+static UInt32 getHostStatus(UInt32 error) {
+  switch (error) {
+    case 0:
+      return kHyperVStatusSuccess;
+    case EEXIST:
+      return kVMBusICFileCopyStatusAlreadyExists;
+    case ENOSPC:
+    case EDQUOT:
+      return kVMBusICFileCopyStatusDiskFull;
+    default:
+      return kHyperVStatusFail;
+  }
+}
+
+bool HyperVFileCopy::start(IOService *provider) {
+  DBGLOG("Initializing Hyper-V File Copy");
+
+  //
+  // Shared ring must exist before the channel is opened.
+  //
+  fcLock = IOLockAlloc();
+  if (fcLock == NULL) {
+    SYSLOG("Failed to allocate file copy lock");
+    return false;
+  }
+
+  sharedBuffer = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                       PAGE_SIZE + kHyperVFileCopySlotCount * kHyperVFileCopySlotSize, PAGE_SIZE);
+  if (sharedBuffer == NULL) {
+    SYSLOG("Failed to allocate file copy shared ring");
+    return false;
+  }
+  ringHeader = (HyperVFileCopyRingHeader *)sharedBuffer->getBytesNoCopy();
+  bzero(ringHeader, sharedBuffer->getLength());
+  ringHeader->slotCount   = kHyperVFileCopySlotCount;
+  ringHeader->slotSize    = kHyperVFileCopySlotSize;
+  ringHeader->slotsOffset = PAGE_SIZE;
+
+  setMessageHandlers(fileCopyVersions, ARRAY_SIZE(fileCopyVersions), messageHandlers, ARRAY_SIZE(messageHandlers));
+  if (!super::start(provider)) {
+    return false;
+  }
+
+  //
+  // Allow the userspace writer to find this service.
+  //
+  updateStatistics();
+  registerService();
+
+  SYSLOG("Initialized Hyper-V File Copy");
+  return true;
+}
+
+void HyperVFileCopy::stop(IOService *provider) {
+  DBGLOG("Hyper-V File Copy is stopping");
+
+  //
+  // Release any writer waiting for data.
+  //
+  IOLockLock(fcLock);
+  isStopping = true;
+  IOLockWakeup(fcLock, &producerIndex, false);
+  IOLockUnlock(fcLock);
+
+  super::stop(provider);
+}
+
+void HyperVFileCopy::free() {
+  //
+  // Writer threads and mappings may still reference these until the user client releases this service.
+  //
+  OSSafeReleaseNULL(sharedBuffer);
+  if (fcLock != NULL) {
+    IOLockFree(fcLock);
+    fcLock = NULL;
+  }
+
+  super::free();
+}
+
+void *HyperVFileCopy::getMessageBuffer(UInt32 *bufferLength) {
+  //
+  // Leave packets in the channel while the ring is full, they are read once the writer hands back slots.
+  //
+  if (producerIndex - consumerIndex >= kHyperVFileCopySlotCount) {
+    UInt32 pktDataLength;
+    if (!isRingFull && hvDevice->nextInbandPacketAvailable(&pktDataLength)) {
+      isRingFull = true;
+      ringFullCount++;
+    }
+    return NULL;
+  }
+
+  //
+  // Read inbound inband packets directly into the next slot, data is only copied once on its way to the writer.
+  //
+  HyperVFileCopySlot *slot = getSlot(producerIndex);
+  bzero(slot, sizeof (*slot));
+  *bufferLength = kHyperVFileCopySlotSize - sizeof (*slot);
+  return slot + 1;
+}
+
+bool HyperVFileCopy::handleFileCopy(HyperVFileCopy *target, VMBusICMessageFileCopy *fcMsg, UInt32 msgLength) {
+  HyperVFileCopySlot *slot = target->getSlot(target->producerIndex);
+
+  if (msgLength < sizeof (fcMsg->fileCopy)) {
+    DBGLOG("Invalid file copy message size %u", msgLength);
+    fcMsg->header.status = kHyperVStatusFail;
+    return true;
+  }
+
+  bool isDeferred = false;
+  switch (fcMsg->fileCopy.operation) {
+    case kVMBusICFileCopyOperationStart:
+      if (msgLength < sizeof (fcMsg->start)) {
+        DBGLOG("Invalid start message size %u", msgLength);
+        fcMsg->header.status = kHyperVStatusFail;
+        break;
+      }
+      fcMsg->header.status = target->handleStart(&fcMsg->start, slot);
+      isDeferred = fcMsg->header.status == kHyperVStatusSuccess;
+      break;
+
+    case kVMBusICFileCopyOperationWrite:
+      fcMsg->header.status = target->handleWrite(&fcMsg->write, msgLength, slot);
+      break;
+
+    case kVMBusICFileCopyOperationComplete:
+      if (!target->isTransferActive || !target->isHelperConnected) {
+        fcMsg->header.status = kHyperVStatusFail;
+        break;
+      }
+      target->publishSlot(slot, kHyperVFileCopyOperationComplete);
+      isDeferred = true;
+      break;
+
+    case kVMBusICFileCopyOperationCancel:
+      if (target->isTransferActive) {
+        SYSLOG("File copy was cancelled by the host");
+        if (target->isHelperConnected) {
+          target->publishSlot(slot, kHyperVFileCopyOperationCancel);
+        }
+        target->finishTransfer(false);
+        target->updateStatistics();
+      }
+      fcMsg->header.status = kHyperVStatusSuccess;
+      break;
+
+    default:
+      DBGLOG("Unsupported file copy operation %u", fcMsg->fileCopy.operation);
+      fcMsg->header.status = kHyperVStatusFail;
+      break;
+  }
+
+  //
+  // Start and complete are answered once the writer has processed their slot.
+  // The slot may be reused once handed back, so keep a copy of the message to respond with.
+  //
+  if (isDeferred) {
+    memcpy(target->pendingMsg, fcMsg, msgLength);
+    target->pendingMsgLength = msgLength;
+    target->pendingSlotIndex = target->producerIndex - 1;
+    return false;
+  }
+  return true;
+}
+
+HyperVFileCopySlot *HyperVFileCopy::getSlot(UInt32 index) {
+  //
+  // Layout comes from constants, the writer can modify the ring header.
+  //
+  return (HyperVFileCopySlot *)((UInt8 *)ringHeader + PAGE_SIZE + (index % kHyperVFileCopySlotCount) * kHyperVFileCopySlotSize);
+}
+
+UInt32 HyperVFileCopy::handleStart(VMBusICMessageFileCopyStart *startMsg, HyperVFileCopySlot *slot) {
+  if (!isHelperConnected || isStopping) {
+    SYSLOG("Unable to start file copy, writer is not running");
+    return kHyperVStatusFail;
+  }
+
+  //
+  // Full path is the destination directory followed by the file name.
+  //
+  char   *path = ringHeader->startPath;
+  size_t pathLength;
+  if (!convertUTF16ToUTF8((const UInt8 *)startMsg->pathName, sizeof (startMsg->pathName), path, kHyperVFileCopyMaxPathSize)) {
+    return kHyperVStatusFail;
+  }
+  pathLength = strnlen(path, kHyperVFileCopyMaxPathSize);
+  if (pathLength == 0 || pathLength + 1 >= kHyperVFileCopyMaxPathSize) {
+    return kHyperVStatusFail;
+  }
+  if (path[pathLength - 1] != '/') {
+    path[pathLength++] = '/';
+  }
+  if (!convertUTF16ToUTF8((const UInt8 *)startMsg->fileName, sizeof (startMsg->fileName), &path[pathLength], kHyperVFileCopyMaxPathSize - pathLength)
+      || path[pathLength] == '\0') {
+    return kHyperVStatusFail;
+  }
+
+  if (startMsg->copyFlags & kVMBusICFileCopyFlagOverwrite) {
+    slot->flags |= kHyperVFileCopyFlagOverwrite;
+  }
+  if (startMsg->copyFlags & kVMBusICFileCopyFlagCreatePath) {
+    slot->flags |= kHyperVFileCopyFlagCreatePath;
+  }
+  slot->fileSize = startMsg->fileSize;
+
+  //
+  // A new start replaces any transfer the host abandoned.
+  //
+  if (isTransferActive) {
+    finishTransfer(false);
+  }
+  isTransferActive = true;
+  transferError    = 0;
+  transferBytes    = 0;
+  clock_get_uptime(&transferStartTime);
+
+  DBGLOG("Starting copy of %s (%llu bytes)", path, startMsg->fileSize);
+  publishSlot(slot, kHyperVFileCopyOperationStart);
+  return kHyperVStatusSuccess;
+}
+
+UInt32 HyperVFileCopy::handleWrite(VMBusICMessageFileCopyWrite *writeMsg, UInt32 msgLength, HyperVFileCopySlot *slot) {
+  if (msgLength < __offsetof(VMBusICMessageFileCopyWrite, data) || writeMsg->size > kVMBusICFileCopyMaxFragmentSize
+      || msgLength < __offsetof(VMBusICMessageFileCopyWrite, data) + writeMsg->size) {
+    DBGLOG("Invalid write message size %u", msgLength);
+    return kHyperVStatusFail;
+  }
+  if (!isTransferActive || !isHelperConnected) {
+    return kHyperVStatusFail;
+  }
+
+  //
+  // Writes are acknowledged before they reach the file, earlier write errors are reported here instead.
+  //
+  if (transferError != 0) {
+    return getHostStatus(transferError);
+  }
+
+  slot->offset     = writeMsg->offset;
+  slot->size       = writeMsg->size;
+  slot->dataOffset = sizeof (*slot) + __offsetof(VMBusICMessageFileCopyWrite, data);
+  transferBytes   += writeMsg->size;
+
+  publishSlot(slot, kHyperVFileCopyOperationWrite);
+  return kHyperVStatusSuccess;
+}
+
+void HyperVFileCopy::publishSlot(HyperVFileCopySlot *slot, UInt32 operation) {
+  slot->operation = operation;
+
+  //
+  // Slot contents must be visible before the writer can see the new index.
+  //
+  IOLockLock(fcLock);
+  producerIndex++;
+  OSMemoryBarrier();
+  ringHeader->producerIndex = producerIndex;
+  IOLockWakeup(fcLock, &producerIndex, false);
+  IOLockUnlock(fcLock);
+}
+
+void HyperVFileCopy::respondPending(UInt32 status) {
+  if (pendingMsgLength == 0) {
+    return;
+  }
+
+  VMBusICMessageFileCopy *fcMsg = (VMBusICMessageFileCopy *)pendingMsg;
+  fcMsg->header.status = status;
+  sendResponse(&fcMsg->header, pendingMsgLength);
+  pendingMsgLength = 0;
+}
+
+void HyperVFileCopy::finishTransfer(bool success) {
+  UInt64 currentTime;
+  clock_get_uptime(&currentTime);
+
+  isTransferActive = false;
+  totalBytes      += transferBytes;
+  if (!success) {
+    failedTransferCount++;
+    SYSLOG("File copy failed after %llu bytes", transferBytes);
+    return;
+  }
+
+  transferCount++;
+  lastTransferBytes  = transferBytes;
+  lastTransferUS     = getElapsedMicroseconds(transferStartTime, currentTime);
+  lastThroughputKBps = lastTransferUS != 0 ? (transferBytes / 1024) * 1000000 / lastTransferUS : 0;
+  SYSLOG("Copied %llu bytes in %llu ms (%llu KB/s)", lastTransferBytes, lastTransferUS / 1000, lastThroughputKBps);
+}
+
+void HyperVFileCopy::resetRing() {
+  IOLockLock(fcLock);
+  consumerIndex              = producerIndex;
+  ringHeader->producerIndex  = producerIndex;
+  ringHeader->consumerIndex  = consumerIndex;
+  IOLockUnlock(fcLock);
+}
+
+IOReturn HyperVFileCopy::completeSlotsGated(UInt32 *completedIndex, UInt32 *completedStatus) {
+  if (!isHelperConnected) {
+    return kIOReturnNotAttached;
+  }
+  if (*completedIndex - consumerIndex > producerIndex - consumerIndex) {
+    DBGLOG("Invalid consumer index %u (consumer %u, producer %u)", *completedIndex, consumerIndex, producerIndex);
+    return kIOReturnBadArgument;
+  }
+
+  if (*completedStatus != 0 && transferError == 0 && isTransferActive) {
+    DBGLOG("Writer failed with error %u", *completedStatus);
+    transferError = *completedStatus;
+  }
+  bool isPendingCompleted = pendingMsgLength != 0 && pendingSlotIndex - consumerIndex < *completedIndex - consumerIndex;
+
+  IOLockLock(fcLock);
+  consumerIndex             = *completedIndex;
+  ringHeader->consumerIndex = consumerIndex;
+  IOLockUnlock(fcLock);
+
+  if (isPendingCompleted) {
+    VMBusICFileCopyOperation operation = ((VMBusICMessageFileCopy *)pendingMsg)->fileCopy.operation;
+    respondPending(getHostStatus(transferError));
+
+    if (operation == kVMBusICFileCopyOperationComplete) {
+      finishTransfer(transferError == 0);
+    } else if (transferError != 0) {
+      finishTransfer(false);
+    }
+    updateStatistics();
+  }
+
+  //
+  // Read any packets left in the channel while the ring was full.
+  //
+  if (isRingFull) {
+    isRingFull = false;
+    processMessages();
+  }
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVFileCopy::disconnectHelperGated() {
+  IOLockLock(fcLock);
+  isHelperConnected = false;
+  IOLockWakeup(fcLock, &producerIndex, false);
+  IOLockUnlock(fcLock);
+
+  //
+  // Nothing can complete an outstanding request or queued writes without the writer.
+  //
+  if (pendingMsgLength != 0) {
+    SYSLOG("Writer exited with a request outstanding");
+    respondPending(kHyperVStatusFail);
+  }
+  if (isTransferActive) {
+    finishTransfer(false);
+  }
+  resetRing();
+
+  if (isRingFull) {
+    isRingFull = false;
+    processMessages();
+  }
+
+  updateStatistics();
+  return kIOReturnSuccess;
+}
+
+void HyperVFileCopy::updateStatistics() {
+  OSDictionary *stats = OSDictionary::withCapacity(8);
+  if (stats == NULL) {
+    return;
+  }
+
+  const struct {
+    const char  *key;
+    UInt64      value;
+  } values[] = {
+    { "HelperConnected",      isHelperConnected ? 1 : 0 },
+    { "TransferCount",        transferCount },
+    { "FailedTransferCount",  failedTransferCount },
+    { "TotalBytes",           totalBytes },
+    { "RingFullCount",        ringFullCount },
+    { "LastTransferBytes",    lastTransferBytes },
+    { "LastTransferUS",       lastTransferUS },
+    { "LastThroughputKBps",   lastThroughputKBps }
+  };
+  for (UInt32 i = 0; i < ARRAY_SIZE(values); i++) {
+    OSNumber *number = OSNumber::withNumber(values[i].value, 64);
+    if (number != NULL) {
+      stats->setObject(values[i].key, number);
+      number->release();
+    }
+  }
+
+  setProperty(kHyperVFileCopyStatisticsKey, stats);
+  stats->release();
+}
+
+bool HyperVFileCopy::connectHelper() {
+  bool result;
+
+  IOLockLock(fcLock);
+  result = !isHelperConnected && !isStopping;
+  if (result) {
+    isHelperConnected = true;
+  }
+  IOLockUnlock(fcLock);
+
+  if (result) {
+    SYSLOG("File copy writer connected");
+    updateStatistics();
+  }
+  return result;
+}
+
+void HyperVFileCopy::disconnectHelper() {
+  SYSLOG("File copy writer disconnected");
+
+  IOWorkLoop *workLoop = getWorkLoop();
+  if (workLoop != NULL) {
+    workLoop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &HyperVFileCopy::disconnectHelperGated), this);
+  } else {
+    IOLockLock(fcLock);
+    isHelperConnected = false;
+    IOLockWakeup(fcLock, &producerIndex, false);
+    IOLockUnlock(fcLock);
+  }
+}
+
+IOReturn HyperVFileCopy::waitData(UInt32 *index) {
+  IOLockLock(fcLock);
+  while (!isStopping && isHelperConnected && producerIndex == consumerIndex) {
+    if (IOLockSleep(fcLock, &producerIndex, THREAD_ABORTSAFE) != THREAD_AWAKENED) {
+      IOLockUnlock(fcLock);
+      return kIOReturnAborted;
+    }
+  }
+
+  if (isStopping || !isHelperConnected) {
+    IOLockUnlock(fcLock);
+    return kIOReturnOffline;
+  }
+
+  *index = producerIndex;
+  IOLockUnlock(fcLock);
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVFileCopy::completeSlots(UInt32 completedIndex, UInt32 status) {
+  IOWorkLoop *workLoop = getWorkLoop();
+  if (workLoop == NULL) {
+    return kIOReturnOffline;
+  }
+  return workLoop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &HyperVFileCopy::completeSlotsGated),
+                             this, &completedIndex, &status);
+}
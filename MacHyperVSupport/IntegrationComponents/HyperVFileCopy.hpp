@@ -0,0 +1,100 @@
+//
+//  HyperVFileCopy.hpp
+//  Hyper-V file copy driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVFileCopy_hpp
+#define HyperVFileCopy_hpp
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+#include "HyperVICService.hpp"
+#include "HyperVFileCopyShared.h"
+
+//
+// Write fragments are larger than the default IC ring buffer.
+//
+#define kHyperVFileCopyRingBufferSize   (4 * PAGE_SIZE)
+
+#define kHyperVFileCopyVersionV1        1
+
+#define kHyperVFileCopyStatisticsKey    "FileCopyStatistics"
+
+class HyperVFileCopy : public HyperVICService {
+  OSDeclareDefaultStructors(HyperVFileCopy);
+
+private:
+  static const HyperVICMessageHandler messageHandlers[];
+
+  IOLock                    *fcLock;
+  IOBufferMemoryDescriptor  *sharedBuffer;
+  HyperVFileCopyRingHeader  *ringHeader;
+  bool                      isHelperConnected;
+  bool                      isStopping;
+
+  //
+  // Ring indexes, only changed on the workloop.
+  //
+  UInt32                    producerIndex;
+  UInt32                    consumerIndex;
+  bool                      isRingFull;
+
+  //
+  // Start or complete request waiting on the writer.
+  //
+  UInt8                     pendingMsg[sizeof (VMBusICMessageFileCopyStart)];
+  UInt32                    pendingMsgLength;
+  UInt32                    pendingSlotIndex;
+
+  //
+  // Transfer state and statistics, times are in microseconds.
+  //
+  bool                      isTransferActive;
+  UInt32                    transferError;
+  UInt64                    transferStartTime;
+  UInt64                    transferBytes;
+  UInt64                    transferCount;
+  UInt64                    failedTransferCount;
+  UInt64                    totalBytes;
+  UInt64                    ringFullCount;
+  UInt64                    lastTransferBytes;
+  UInt64                    lastTransferUS;
+  UInt64                    lastThroughputKBps;
+
+  static bool handleFileCopy(HyperVFileCopy *target, VMBusICMessageFileCopy *fcMsg, UInt32 msgLength);
+  HyperVFileCopySlot *getSlot(UInt32 index);
+  UInt32 handleStart(VMBusICMessageFileCopyStart *startMsg, HyperVFileCopySlot *slot);
+  UInt32 handleWrite(VMBusICMessageFileCopyWrite *writeMsg, UInt32 msgLength, HyperVFileCopySlot *slot);
+  void publishSlot(HyperVFileCopySlot *slot, UInt32 operation);
+  void respondPending(UInt32 status);
+  void finishTransfer(bool success);
+  void resetRing();
+  IOReturn completeSlotsGated(UInt32 *completedIndex, UInt32 *completedStatus);
+  IOReturn disconnectHelperGated();
+  void updateStatistics();
+
+protected:
+  void *getMessageBuffer(UInt32 *bufferLength) APPLE_KEXT_OVERRIDE;
+  UInt32 getRingBufferSize() APPLE_KEXT_OVERRIDE { return kHyperVFileCopyRingBufferSize; }
+
+public:
+  //
+  // IOService overrides.
+  //
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void free() APPLE_KEXT_OVERRIDE;
+
+  //
+  // Writer interface.
+  //
+  bool connectHelper();
+  void disconnectHelper();
+  IOBufferMemoryDescriptor *getSharedBuffer() { return sharedBuffer; }
+  IOReturn waitData(UInt32 *index);
+  IOReturn completeSlots(UInt32 completedIndex, UInt32 status);
+};
+
+#endif
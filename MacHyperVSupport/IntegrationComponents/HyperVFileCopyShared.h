@@ -0,0 +1,87 @@
+//
+//  HyperVFileCopyShared.h
+//  Hyper-V file copy driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Definitions shared between the file copy driver and the userspace file writer.
+//
+
+#ifndef HyperVFileCopyShared_h
+#define HyperVFileCopyShared_h
+
+#include <stdint.h>
+
+//
+// Shared ring, mapped into the writer with memory type kHyperVFileCopyMemoryTypeRing.
+//
+// The ring header is followed by kHyperVFileCopySlotCount slots of kHyperVFileCopySlotSize bytes each, starting at slotsOffset.
+// Indexes are free running, slot N is at slotsOffset + (N % slotCount) * slotSize.
+// The driver fills slots from producerIndex, the writer hands them back through the CompleteSlots method.
+//
+#define kHyperVFileCopyMemoryTypeRing   0
+
+#define kHyperVFileCopySlotCount        64
+#define kHyperVFileCopySlotSize         (8 * 1024)
+#define kHyperVFileCopyMaxPathSize      2048
+
+typedef struct {
+  volatile uint32_t producerIndex;
+  volatile uint32_t consumerIndex;
+  uint32_t          slotCount;
+  uint32_t          slotSize;
+  uint32_t          slotsOffset;
+  uint32_t          reserved[3];
+
+  //
+  // UTF-8 path of the file for the outstanding start request.
+  //
+  char              startPath[kHyperVFileCopyMaxPathSize];
+} HyperVFileCopyRingHeader;
+
+//
+// Slot operations.
+//
+// Start: close any file still open, then create the file at startPath, creating parent directories if kHyperVFileCopyFlagCreatePath is set.
+//   Fail with EEXIST if the file exists and kHyperVFileCopyFlagOverwrite is not set.
+// Write: write size bytes at dataOffset within the slot to the file at offset.
+// Complete: flush and close the file.
+// Cancel: close and remove the partially written file.
+//
+// Writes are acknowledged to Hyper-V as soon as they are queued, so write errors are reported on the next write or completion.
+// Start and complete are acknowledged once the writer completes their slot, and are always the last slot in the ring.
+//
+enum {
+  kHyperVFileCopyOperationStart     = 1,
+  kHyperVFileCopyOperationWrite     = 2,
+  kHyperVFileCopyOperationComplete  = 3,
+  kHyperVFileCopyOperationCancel    = 4
+};
+
+#define kHyperVFileCopyFlagOverwrite    0x00000001
+#define kHyperVFileCopyFlagCreatePath   0x00000002
+
+typedef struct {
+  uint32_t  operation;
+  uint32_t  flags;
+  uint64_t  fileSize;
+  uint64_t  offset;
+  uint32_t  size;
+  uint32_t  dataOffset;
+  uint8_t   reserved[32];
+} HyperVFileCopySlot;
+
+//
+// External methods.
+//
+// WaitData: blocks until slots are available. Scalar output 0 is the producer index.
+// CompleteSlots: scalar input 0 is the new consumer index, all slots before it are handed back.
+//   Scalar input 1 is 0 on success or the first errno value encountered in those slots.
+//
+enum {
+  kHyperVFileCopyUserClientMethodWaitData       = 0,
+  kHyperVFileCopyUserClientMethodCompleteSlots  = 1,
+  kHyperVFileCopyUserClientMethodCount
+};
+
+#endif
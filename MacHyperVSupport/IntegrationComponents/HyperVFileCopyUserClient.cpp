@@ -0,0 +1,135 @@
+//
+//  HyperVFileCopyUserClient.cpp
+//  Hyper-V file copy driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVFileCopyUserClient.hpp"
+
+#define super IOUserClient
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVFileCopyUserClient", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVFileCopyUserClient", str, ## __VA_ARGS__)
+
+OSDefineMetaClassAndStructors(HyperVFileCopyUserClient, super);
+
+const IOExternalMethodDispatch HyperVFileCopyUserClient::methods[kHyperVFileCopyUserClientMethodCount] = {
+  { // kHyperVFileCopyUserClientMethodWaitData
+    (IOExternalMethodAction) &HyperVFileCopyUserClient::methodWaitData,
+    0, 0, 1, 0
+  },
+  { // kHyperVFileCopyUserClientMethodCompleteSlots
+    (IOExternalMethodAction) &HyperVFileCopyUserClient::methodCompleteSlots,
+    2, 0, 0, 0
+  }
+};
+
+bool HyperVFileCopyUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
+  if (!super::initWithTask(owningTask, securityToken, type, properties)) {
+    return false;
+  }
+
+  //
+  // Files can be written anywhere, only allow administrators to act as the writer.
+  //
+  if (clientHasPrivilege(securityToken, kIOClientPrivilegeAdministrator) != kIOReturnSuccess) {
+    DBGLOG("Client is not an administrator");
+    return false;
+  }
+  return true;
+}
+
+bool HyperVFileCopyUserClient::start(IOService *provider) {
+  hvFileCopy = OSDynamicCast(HyperVFileCopy, provider);
+  if (hvFileCopy == NULL) {
+    return false;
+  }
+
+  if (!super::start(provider)) {
+    return false;
+  }
+  hvFileCopy->retain();
+
+  isHelperConnected = hvFileCopy->connectHelper();
+  if (!isHelperConnected) {
+    SYSLOG("Another file copy writer is already connected");
+    OSSafeReleaseNULL(hvFileCopy);
+    super::stop(provider);
+    return false;
+  }
+
+  DBGLOG("File copy user client started");
+  return true;
+}
+
+void HyperVFileCopyUserClient::stop(IOService *provider) {
+  DBGLOG("File copy user client stopping");
+  if (hvFileCopy != NULL) {
+    if (isHelperConnected) {
+      hvFileCopy->disconnectHelper();
+      isHelperConnected = false;
+    }
+    OSSafeReleaseNULL(hvFileCopy);
+  }
+  super::stop(provider);
+}
+
+IOReturn HyperVFileCopyUserClient::clientClose() {
+  terminate();
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVFileCopyUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch,
+                                                  OSObject *target, void *reference) {
+  if (selector >= kHyperVFileCopyUserClientMethodCount) {
+    return kIOReturnUnsupported;
+  }
+  return super::externalMethod(selector, arguments, (IOExternalMethodDispatch *) &methods[selector], this, reference);
+}
+
+IOReturn HyperVFileCopyUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
+  if (type != kHyperVFileCopyMemoryTypeRing) {
+    return kIOReturnBadArgument;
+  }
+  if (hvFileCopy == NULL || hvFileCopy->getSharedBuffer() == NULL) {
+    return kIOReturnNotAttached;
+  }
+
+  //
+  // Caller releases the returned descriptor.
+  //
+  IOMemoryDescriptor *ringDesc = hvFileCopy->getSharedBuffer();
+  ringDesc->retain();
+  *options = 0;
+  *memory  = ringDesc;
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVFileCopyUserClient::methodWaitData(HyperVFileCopyUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  UInt32 index;
+
+  HyperVFileCopy *hvFileCopy = target->hvFileCopy;
+  if (hvFileCopy == NULL) {
+    return kIOReturnNotAttached;
+  }
+
+  //
+  // Keep the service alive while blocked, the client may be stopped during the wait.
+  //
+  hvFileCopy->retain();
+  IOReturn status = hvFileCopy->waitData(&index);
+  hvFileCopy->release();
+  if (status == kIOReturnSuccess) {
+    args->scalarOutput[0] = index;
+  }
+  return status;
+}
+
+IOReturn HyperVFileCopyUserClient::methodCompleteSlots(HyperVFileCopyUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  HyperVFileCopy *hvFileCopy = target->hvFileCopy;
+  if (hvFileCopy == NULL) {
+    return kIOReturnNotAttached;
+  }
+  return hvFileCopy->completeSlots((UInt32) args->scalarInput[0], (UInt32) args->scalarInput[1]);
+}
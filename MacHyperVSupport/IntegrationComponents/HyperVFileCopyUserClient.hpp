@@ -0,0 +1,43 @@
+//
+//  HyperVFileCopyUserClient.hpp
+//  Hyper-V file copy driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVFileCopyUserClient_hpp
+#define HyperVFileCopyUserClient_hpp
+
+#include <IOKit/IOUserClient.h>
+
+#include "HyperVFileCopy.hpp"
+
+//
+// Userspace file writer interface, only one writer can be connected at a time.
+//
+class HyperVFileCopyUserClient : public IOUserClient {
+  OSDeclareDefaultStructors(HyperVFileCopyUserClient);
+
+private:
+  HyperVFileCopy *hvFileCopy;
+  bool           isHelperConnected;
+
+  static const IOExternalMethodDispatch methods[kHyperVFileCopyUserClientMethodCount];
+
+  static IOReturn methodWaitData(HyperVFileCopyUserClient *target, void *ref, IOExternalMethodArguments *args);
+  static IOReturn methodCompleteSlots(HyperVFileCopyUserClient *target, void *ref, IOExternalMethodArguments *args);
+
+public:
+  //
+  // IOUserClient overrides.
+  //
+  virtual bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) APPLE_KEXT_OVERRIDE;
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual IOReturn clientClose() APPLE_KEXT_OVERRIDE;
+  virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch,
+                                  OSObject *target, void *reference) APPLE_KEXT_OVERRIDE;
+  virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) APPLE_KEXT_OVERRIDE;
+};
+
+#endif
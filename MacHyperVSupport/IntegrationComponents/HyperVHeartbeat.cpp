@@ -16,58 +16,45 @@
 
 OSDefineMetaClassAndStructors(HyperVHeartbeat, super);
 
+//
+// Supported message versions and message handlers.
+//
+static const UInt32 heartbeatVersions[] = {
+  3
+};
+
+const HyperVICMessageHandler HyperVHeartbeat::messageHandlers[] = {
+  { kVMBusICMessageTypeHeartbeat, (HyperVICMessageAction) &HyperVHeartbeat::handleHeartbeat }
+};
+
 bool HyperVHeartbeat::start(IOService *provider) {
   DBGLOG("Initializing Hyper-V Heartbeat");
+
+  setMessageHandlers(heartbeatVersions, ARRAY_SIZE(heartbeatVersions), messageHandlers, ARRAY_SIZE(messageHandlers));
   return super::start(provider);
 }
 
-bool HyperVHeartbeat::processMessage() {
-  VMBusICMessageHeartbeat heartbeatMsg;
+void HyperVHeartbeat::handleNegotiation(UInt32 version) {
+  firstHeartbeatReceived = false;
+}
 
-  //
-  // Ignore errors and the acknowledgement interrupt (no data to read).
-  //
-  UInt32 pktDataLength;
-  if (!hvDevice->nextInbandPacketAvailable(&pktDataLength) || pktDataLength > sizeof (heartbeatMsg)) {
-    return false;
+bool HyperVHeartbeat::handleHeartbeat(HyperVHeartbeat *target, VMBusICMessageHeartbeat *heartbeatMsg, UInt32 msgLength) {
+  if (msgLength < __offsetof(VMBusICMessageHeartbeatSequence, reserved)) {
+    DBGLOG("Invalid heartbeat message size %u", msgLength);
+    heartbeatMsg->header.status = kHyperVStatusFail;
+    return true;
   }
 
   //
-  // Read and parse inbound inband packet.
+  // Increment sequence.
+  // Host will increment this further before sending a message back.
   //
-  if (hvDevice->readInbandCompletionPacket(&heartbeatMsg, sizeof (heartbeatMsg), NULL) != kIOReturnSuccess) {
-    return false;
-  }
-  switch (heartbeatMsg.header.type) {
-    case kVMBusICMessageTypeNegotiate:
-      firstHeartbeatReceived = false;
-      createNegotiationResponse(&heartbeatMsg.negotiate, 3, 3);
-      break;
-
-    case kVMBusICMessageTypeHeartbeat:
-      //
-      // Increment sequence.
-      // Host will increment this further before sending a message back.
-      //
-      //DBGLOG("Got heartbeat, seq = %u", heartbeatMsg.heartbeat.sequence);
-      heartbeatMsg.heartbeat.sequence++;
-
-      if (!firstHeartbeatReceived) {
-        firstHeartbeatReceived = true;
-        SYSLOG("Initialized Hyper-V Heartbeat");
-      }
-      break;
+  //DBGLOG("Got heartbeat, seq = %u", heartbeatMsg->heartbeat.sequence);
+  heartbeatMsg->heartbeat.sequence++;
 
-    default:
-      DBGLOG("Unknown heartbeat message type %u", heartbeatMsg.header.type);
-      heartbeatMsg.header.status = kHyperVStatusFail;
-      break;
+  if (!target->firstHeartbeatReceived) {
+    target->firstHeartbeatReceived = true;
+    SYSLOG("Initialized Hyper-V Heartbeat");
   }
-
-  //
-  // Send response back to Hyper-V. The packet size will always be the same as the original inbound one.
-  //
-  heartbeatMsg.header.flags = kVMBusICFlagTransaction | kVMBusICFlagResponse;
-  hvDevice->writeInbandPacket(&heartbeatMsg, pktDataLength, false);
   return true;
 }
@@ -14,10 +14,14 @@ class HyperVHeartbeat : public HyperVICService {
   OSDeclareDefaultStructors(HyperVHeartbeat);
 
 private:
+  static const HyperVICMessageHandler messageHandlers[];
+
   bool firstHeartbeatReceived;
 
+  static bool handleHeartbeat(HyperVHeartbeat *target, VMBusICMessageHeartbeat *heartbeatMsg, UInt32 msgLength);
+
 protected:
-  bool processMessage() APPLE_KEXT_OVERRIDE;
+  void handleNegotiation(UInt32 version) APPLE_KEXT_OVERRIDE;
 
 public:
   //
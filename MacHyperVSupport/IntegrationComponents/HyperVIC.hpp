@@ -89,4 +89,211 @@ typedef struct __attribute__((packed)) {
   };
 } VMBusICMessageShutdown;
 
+//
+// KVP exchange messages.
+// Keys and values are UTF-16 strings, sizes are in bytes including the null terminator.
+//
+#define kVMBusICKVPMaxKeySize       512
+#define kVMBusICKVPMaxValueSize     2048
+
+typedef enum : UInt8 {
+  kVMBusICKVPOperationGet       = 0,
+  kVMBusICKVPOperationSet       = 1,
+  kVMBusICKVPOperationDelete    = 2,
+  kVMBusICKVPOperationEnumerate = 3,
+  kVMBusICKVPOperationGetIPInfo = 4,
+  kVMBusICKVPOperationSetIPInfo = 5
+} VMBusICKVPOperation;
+
+typedef enum : UInt8 {
+  kVMBusICKVPPoolExternal       = 0,
+  kVMBusICKVPPoolGuest          = 1,
+  kVMBusICKVPPoolAuto           = 2,
+  kVMBusICKVPPoolAutoExternal   = 3,
+  kVMBusICKVPPoolAutoInternal   = 4,
+  kVMBusICKVPPoolCount          = 5
+} VMBusICKVPPool;
+
+typedef enum : UInt32 {
+  kVMBusICKVPValueTypeString    = 1,
+  kVMBusICKVPValueTypeUInt32    = 4,
+  kVMBusICKVPValueTypeUInt64    = 8
+} VMBusICKVPValueType;
+
+#define kVMBusICKVPStatusNoMoreItems    0x80070103
+#define kVMBusICKVPStatusNotSupported   0x80070032
+
+typedef struct __attribute__((packed)) {
+  VMBusICKVPValueType   valueType;
+  UInt32                keySize;
+  UInt32                valueSize;
+  UInt8                 key[kVMBusICKVPMaxKeySize];
+  union {
+    UInt8               value[kVMBusICKVPMaxValueSize];
+    UInt32              valueUInt32;
+    UInt64              valueUInt64;
+  };
+} VMBusICKVPValue;
+
+typedef struct __attribute__((packed)) {
+  UInt32                keySize;
+  UInt8                 key[kVMBusICKVPMaxKeySize];
+} VMBusICKVPDelete;
+
+typedef struct __attribute__((packed)) {
+  UInt32                index;
+  VMBusICKVPValue       data;
+} VMBusICKVPEnumerate;
+
+typedef struct __attribute__((packed)) {
+  VMBusICMessageHeader  header;
+
+  VMBusICKVPOperation   operation;
+  VMBusICKVPPool        pool;
+  UInt16                padding;
+  union {
+    VMBusICKVPValue     get;
+    VMBusICKVPValue     set;
+    VMBusICKVPDelete    remove;
+    VMBusICKVPEnumerate enumerate;
+  };
+} VMBusICMessageKVPExchangeData;
+
+typedef struct __attribute__((packed)) {
+  union {
+    VMBusICMessageHeader          header;
+    VMBusICMessageNegotiate       negotiate;
+    VMBusICMessageKVPExchangeData kvp;
+  };
+} VMBusICMessageKVPExchange;
+
+//
+// VSS (backup) messages.
+//
+typedef enum : UInt8 {
+  kVMBusICVSSOperationCreate          = 0,
+  kVMBusICVSSOperationDelete          = 1,
+  kVMBusICVSSOperationHotBackup       = 2,
+  kVMBusICVSSOperationGetDMInfo       = 3,
+  kVMBusICVSSOperationBackupComplete  = 4,
+  kVMBusICVSSOperationFreeze          = 5,
+  kVMBusICVSSOperationThaw            = 6,
+  kVMBusICVSSOperationAutoRecover     = 7
+} VMBusICVSSOperation;
+
+#define kVMBusICVSSFlagNoAutoRecovery   0x00000005
+
+typedef struct __attribute__((packed)) {
+  VMBusICMessageHeader  header;
+
+  VMBusICVSSOperation   operation;
+  UInt8                 reserved[7];
+  UInt32                flags;
+} VMBusICMessageVSSData;
+
+typedef struct __attribute__((packed)) {
+  union {
+    VMBusICMessageHeader    header;
+    VMBusICMessageNegotiate negotiate;
+    VMBusICMessageVSSData   vss;
+  };
+} VMBusICMessageVSS;
+
+//
+// Time synchronization messages.
+// Times are in 100ns units since January 1, 1601.
+//
+#define kVMBusICTimeSyncFlagProbe     0
+#define kVMBusICTimeSyncFlagSync      1
+#define kVMBusICTimeSyncFlagSample    2
+
+typedef struct __attribute__((packed)) {
+  VMBusICMessageHeader  header;
+
+  UInt64                parentTime;
+  UInt64                childTime;
+  UInt64                roundTripTime;
+  UInt8                 flags;
+} VMBusICMessageTimeSyncData;
+
+//
+// Version 4 and newer, host time is paired with the partition reference time it was sampled at.
+//
+typedef struct __attribute__((packed)) {
+  VMBusICMessageHeader  header;
+
+  UInt64                parentTime;
+  UInt64                vmReferenceTime;
+  UInt8                 flags;
+  UInt8                 leapFlags;
+  UInt8                 stratum;
+  UInt8                 reserved[3];
+} VMBusICMessageTimeSyncRefData;
+
+typedef struct __attribute__((packed)) {
+  union {
+    VMBusICMessageHeader            header;
+    VMBusICMessageNegotiate         negotiate;
+    VMBusICMessageTimeSyncData      timeSync;
+    VMBusICMessageTimeSyncRefData   timeSyncRef;
+  };
+} VMBusICMessageTimeSync;
+
+
+//
+// File copy messages.
+// File names are UTF-16LE, data is sent in fragments of up to kVMBusICFileCopyMaxFragmentSize bytes.
+//
+typedef enum : UInt32 {
+  kVMBusICFileCopyOperationStart      = 0,
+  kVMBusICFileCopyOperationWrite      = 1,
+  kVMBusICFileCopyOperationComplete   = 2,
+  kVMBusICFileCopyOperationCancel     = 3
+} VMBusICFileCopyOperation;
+
+#define kVMBusICFileCopyMaxPathLength       260
+#define kVMBusICFileCopyMaxFragmentSize     (6 * 1024)
+
+#define kVMBusICFileCopyFlagOverwrite       0x00000001
+#define kVMBusICFileCopyFlagCreatePath      0x00000002
+
+#define kVMBusICFileCopyStatusAlreadyExists 0x80070050
+#define kVMBusICFileCopyStatusDiskFull      0x80070070
+
+typedef struct __attribute__((packed)) {
+  VMBusICMessageHeader      header;
+
+  VMBusICFileCopyOperation  operation;
+  UInt8                     serviceId0[16];
+  UInt8                     serviceId1[16];
+} VMBusICMessageFileCopyData;
+
+typedef struct __attribute__((packed)) {
+  VMBusICMessageFileCopyData  fileCopy;
+
+  UInt16                      fileName[kVMBusICFileCopyMaxPathLength];
+  UInt16                      pathName[kVMBusICFileCopyMaxPathLength];
+  UInt32                      copyFlags;
+  UInt64                      fileSize;
+} VMBusICMessageFileCopyStart;
+
+typedef struct __attribute__((packed)) {
+  VMBusICMessageFileCopyData  fileCopy;
+
+  UInt32                      reserved;
+  UInt64                      offset;
+  UInt32                      size;
+  UInt8                       data[kVMBusICFileCopyMaxFragmentSize];
+} VMBusICMessageFileCopyWrite;
+
+typedef struct __attribute__((packed)) {
+  union {
+    VMBusICMessageHeader        header;
+    VMBusICMessageNegotiate     negotiate;
+    VMBusICMessageFileCopyData  fileCopy;
+    VMBusICMessageFileCopyStart start;
+    VMBusICMessageFileCopyWrite write;
+  };
+} VMBusICMessageFileCopy;
+
 #endif
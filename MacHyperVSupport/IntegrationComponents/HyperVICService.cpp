@@ -28,6 +28,18 @@ bool HyperVICService::start(IOService *provider) {
     return false;
   }
   hvDevice->retain();
+
+  //
+  // Allocate message buffer, this must exist before the channel is opened.
+  //
+  msgVersion    = 0;
+  msgBufferSize = getMaxMessageSize();
+  msgBuffer     = IOMalloc(msgBufferSize);
+  if (msgBuffer == NULL) {
+    SYSLOG("Failed to allocate message buffer");
+    super::stop(provider);
+    return false;
+  }
   
   //
   // Configure interrupt.
@@ -39,7 +51,7 @@ bool HyperVICService::start(IOService *provider) {
   //
   // Configure the channel.
   //
-  if (!hvDevice->openChannel(kHyperVICBufferSize, kHyperVICBufferSize)) {
+  if (!hvDevice->openChannel(getRingBufferSize(), getRingBufferSize())) {
     super::stop(provider);
     return false;
   }
@@ -55,54 +67,311 @@ void HyperVICService::stop(IOService *provider) {
   super::stop(provider);
 }
 
-bool HyperVICService::createNegotiationResponse(VMBusICMessageNegotiate *negMsg, UInt32 fwVersion, UInt32 msgVersion) {
+void HyperVICService::free() {
+  if (msgBuffer != NULL) {
+    IOFree(msgBuffer, msgBufferSize);
+    msgBuffer = NULL;
+  }
+
+  super::free();
+}
+
+void HyperVICService::setMessageHandlers(const UInt32 *versions, UInt32 versionCount,
+                                         const HyperVICMessageHandler *handlers, UInt32 handlerCount) {
+  msgVersions     = versions;
+  msgVersionCount = versionCount;
+  msgHandlers     = handlers;
+  msgHandlerCount = handlerCount;
+}
+
+void *HyperVICService::getMessageBuffer(UInt32 *bufferLength) {
+  *bufferLength = msgBufferSize;
+  return msgBuffer;
+}
+
+void HyperVICService::processMessages() {
+  //
+  // Drain all pending messages, each is read in a single pass through the channel's gate.
+  // Subclasses can leave messages in the channel by not providing a buffer, and call this again to resume.
+  //
+  while (true) {
+    UInt32 msgLength;
+    void *buffer = getMessageBuffer(&msgLength);
+    if (buffer == NULL) {
+      return;
+    }
+
+    IOReturn status = hvDevice->readInbandPacket(buffer, &msgLength, NULL);
+    if (status == kIOReturnNoResources) {
+      if (!discardMessage(msgLength)) {
+        return;
+      }
+      continue;
+    } else if (status == kIOReturnUnsupported) {
+      DBGLOG("Ignoring non-inband packet");
+      continue;
+    } else if (status != kIOReturnSuccess) {
+      //
+      // Channel is empty.
+      //
+      return;
+    }
+
+    VMBusICMessageHeader *msgHeader = (VMBusICMessageHeader *)buffer;
+    if (msgLength < sizeof (*msgHeader)) {
+      DBGLOG("Invalid message size %u", msgLength);
+      continue;
+    }
+    if (dispatchMessage(msgHeader, msgLength)) {
+      sendResponse(msgHeader, msgLength);
+    }
+  }
+}
+
+bool HyperVICService::dispatchMessage(VMBusICMessageHeader *msgHeader, UInt32 msgLength) {
+  if (msgHeader->type == kVMBusICMessageTypeNegotiate) {
+    if (createNegotiationResponse((VMBusICMessageNegotiate *)msgHeader, msgLength, kHyperVICFrameworkVersion, msgVersions, msgVersionCount, &msgVersion)) {
+      DBGLOG("%s is using message version %u", getName(), msgVersion);
+      handleNegotiation(msgVersion);
+    }
+    return true;
+  }
+
+  for (UInt32 i = 0; i < msgHandlerCount; i++) {
+    if (msgHandlers[i].type == msgHeader->type) {
+      return msgHandlers[i].action(this, msgHeader, msgLength);
+    }
+  }
+
+  DBGLOG("Unknown %s message type %u", getName(), msgHeader->type);
+  msgHeader->status = kHyperVStatusFail;
+  return true;
+}
+
+bool HyperVICService::discardMessage(UInt32 msgLength) {
+  //
+  // Messages larger than the buffer would block the channel, read them out and drop them.
+  //
+  SYSLOG("Dropping %s message of %u bytes, buffer is too small", getName(), msgLength);
+
+  UInt32 bufferLength = msgLength;
+  void   *buffer      = IOMalloc(bufferLength);
+  if (buffer == NULL) {
+    return false;
+  }
+  hvDevice->readInbandPacket(buffer, &msgLength, NULL);
+  IOFree(buffer, bufferLength);
+  return true;
+}
+
+void HyperVICService::sendResponse(VMBusICMessageHeader *msgHeader, UInt32 msgLength) {
+  //
+  // Send response back to Hyper-V. The packet size will always be the same as the original inbound one.
+  //
+  msgHeader->flags = kVMBusICFlagTransaction | kVMBusICFlagResponse;
+  hvDevice->writeInbandPacket(msgHeader, msgLength, false);
+}
+
+bool HyperVICService::createNegotiationResponse(VMBusICMessageNegotiate *negMsg, UInt32 msgLength, UInt32 fwVersion, UInt32 msgVersion) {
+  return createNegotiationResponse(negMsg, msgLength, fwVersion, &msgVersion, 1);
+}
+
+bool HyperVICService::createNegotiationResponse(VMBusICMessageNegotiate *negMsg, UInt32 msgLength, UInt32 fwVersion,
+                                                const UInt32 *msgVersions, UInt32 msgVersionCount, UInt32 *msgVersionSelected) {
+  //
+  // Message length is what was read into the message buffer, the response needs room for two versions.
+  //
+  if (msgLength < __offsetof(VMBusICMessageNegotiate, versions[2])) {
+    DBGLOG("Negotiation message of %u bytes is too small", msgLength);
+    return false;
+  }
   if (negMsg->frameworkVersionCount == 0 || negMsg->messageVersionCount == 0) {
     DBGLOG("Invalid framework or message version count");
     return false;
   }
   UInt32 versionCount = negMsg->frameworkVersionCount + negMsg->messageVersionCount;
   
+  //
+  // Version counts come from the host, all versions must be within both the stated and the received message size.
+  //
   UInt32 packetSize = negMsg->header.dataSize + sizeof(negMsg->header);
-  if (packetSize < __offsetof(VMBusICMessageNegotiate, versions[versionCount])) {
+  if (packetSize < __offsetof(VMBusICMessageNegotiate, versions[versionCount])
+      || msgLength < __offsetof(VMBusICMessageNegotiate, versions[versionCount])) {
     DBGLOG("Packet has invalid size and does not contain all versions");
     return false;
   }
   
   bool foundFwMatch = false;
   bool foundMsgMatch = false;
+  UInt32 msgVersion = 0;
   
   //
-  // Find supported framework version, and then message version.
+  // Find supported framework version, and then the most preferred message version also supported by the host.
   //
-  for (int i = 0; i < negMsg->frameworkVersionCount; i++) {
+  for (UInt32 i = 0; i < negMsg->frameworkVersionCount; i++) {
     if (negMsg->versions[i] == fwVersion) {
-      negMsg->versions[i] = fwVersion;
       foundFwMatch = true;
       break;
     }
   }
   
-  for (int i = negMsg->frameworkVersionCount; i < versionCount; i++) {
-    if (negMsg->versions[i] == msgVersion) {
-      negMsg->versions[i] = msgVersion;
-      foundMsgMatch = true;
-      break;
+  for (UInt32 v = 0; v < msgVersionCount && !foundMsgMatch; v++) {
+    for (UInt32 i = negMsg->frameworkVersionCount; i < versionCount; i++) {
+      if (negMsg->versions[i] == msgVersions[v]) {
+        msgVersion = msgVersions[v];
+        foundMsgMatch = true;
+        break;
+      }
     }
   }
   
+  //
+  // Response contains only the selected framework and message versions.
+  //
   if (foundFwMatch && foundMsgMatch) {
     DBGLOG("Found supported fw version %u and msg version %u", fwVersion, msgVersion);
     negMsg->frameworkVersionCount = 1;
     negMsg->messageVersionCount   = 1;
+    negMsg->versions[0]           = fwVersion;
+    negMsg->versions[1]           = msgVersion;
   } else {
-    DBGLOG("Unsupported fw version %u and msg version %u", fwVersion, msgVersion);
+    DBGLOG("Unsupported fw version %u and msg version %u", fwVersion, msgVersions[0]);
     negMsg->frameworkVersionCount = 0;
     negMsg->messageVersionCount   = 0;
   }
   
+  if (msgVersionSelected != NULL) {
+    *msgVersionSelected = msgVersion;
+  }
   return foundFwMatch && foundMsgMatch;
 }
 
+//
+// Converts a null terminated UTF-16LE string from Hyper-V to UTF-8.
+//
+bool HyperVICService::convertUTF16ToUTF8(const UInt8 *src, UInt32 srcSize, char *dst, size_t dstSize) {
+  size_t dstLength = 0;
+
+  for (UInt32 i = 0; i + 1 < srcSize; i += 2) {
+    UInt32 codePoint = src[i] | (src[i + 1] << 8);
+    if (codePoint == 0) {
+      break;
+    }
+
+    //
+    // Combine surrogate pairs, unpaired surrogates are replaced.
+    //
+    if (codePoint >= 0xD800 && codePoint <= 0xDBFF && i + 3 < srcSize) {
+      UInt32 lowSurrogate = src[i + 2] | (src[i + 3] << 8);
+      if (lowSurrogate >= 0xDC00 && lowSurrogate <= 0xDFFF) {
+        codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (lowSurrogate - 0xDC00);
+        i += 2;
+      }
+    }
+    if (codePoint >= 0xD800 && codePoint <= 0xDFFF) {
+      codePoint = 0xFFFD;
+    }
+
+    UInt8  bytes[4];
+    size_t byteCount;
+    if (codePoint < 0x80) {
+      bytes[0]  = codePoint;
+      byteCount = 1;
+    } else if (codePoint < 0x800) {
+      bytes[0]  = 0xC0 | (codePoint >> 6);
+      bytes[1]  = 0x80 | (codePoint & 0x3F);
+      byteCount = 2;
+    } else if (codePoint < 0x10000) {
+      bytes[0]  = 0xE0 | (codePoint >> 12);
+      bytes[1]  = 0x80 | ((codePoint >> 6) & 0x3F);
+      bytes[2]  = 0x80 | (codePoint & 0x3F);
+      byteCount = 3;
+    } else {
+      bytes[0]  = 0xF0 | (codePoint >> 18);
+      bytes[1]  = 0x80 | ((codePoint >> 12) & 0x3F);
+      bytes[2]  = 0x80 | ((codePoint >> 6) & 0x3F);
+      bytes[3]  = 0x80 | (codePoint & 0x3F);
+      byteCount = 4;
+    }
+
+    if (dstLength + byteCount >= dstSize) {
+      return false;
+    }
+    memcpy(&dst[dstLength], bytes, byteCount);
+    dstLength += byteCount;
+  }
+
+  dst[dstLength] = '\0';
+  return true;
+}
+
+//
+// Converts a null terminated UTF-8 string to UTF-16LE for Hyper-V, returning the size in bytes including the terminator.
+// Strings too long for the destination are truncated.
+//
+UInt32 HyperVICService::convertUTF8ToUTF16(const char *src, UInt8 *dst, UInt32 dstSize) {
+  const UInt8 *str    = (const UInt8 *)src;
+  UInt32      dstUsed = 0;
+
+  while (*str != '\0') {
+    UInt32 codePoint;
+    UInt32 extraBytes;
+
+    if (*str < 0x80) {
+      codePoint  = *str;
+      extraBytes = 0;
+    } else if ((*str & 0xE0) == 0xC0) {
+      codePoint  = *str & 0x1F;
+      extraBytes = 1;
+    } else if ((*str & 0xF0) == 0xE0) {
+      codePoint  = *str & 0x0F;
+      extraBytes = 2;
+    } else if ((*str & 0xF8) == 0xF0) {
+      codePoint  = *str & 0x07;
+      extraBytes = 3;
+    } else {
+      codePoint  = 0xFFFD;
+      extraBytes = 0;
+    }
+    str++;
+
+    for (UInt32 i = 0; i < extraBytes; i++) {
+      if ((*str & 0xC0) != 0x80) {
+        codePoint = 0xFFFD;
+        break;
+      }
+      codePoint = (codePoint << 6) | (*str++ & 0x3F);
+    }
+    if (codePoint > 0x10FFFF || (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+      codePoint = 0xFFFD;
+    }
+
+    //
+    // Leave room for the null terminator.
+    //
+    UInt32 unitCount = codePoint >= 0x10000 ? 2 : 1;
+    if (dstUsed + (unitCount * 2) + 2 > dstSize) {
+      break;
+    }
+    if (unitCount == 2) {
+      codePoint -= 0x10000;
+      UInt32 highSurrogate = 0xD800 + (codePoint >> 10);
+      UInt32 lowSurrogate  = 0xDC00 + (codePoint & 0x3FF);
+      dst[dstUsed++] = highSurrogate & 0xFF;
+      dst[dstUsed++] = highSurrogate >> 8;
+      dst[dstUsed++] = lowSurrogate & 0xFF;
+      dst[dstUsed++] = lowSurrogate >> 8;
+    } else {
+      dst[dstUsed++] = codePoint & 0xFF;
+      dst[dstUsed++] = codePoint >> 8;
+    }
+  }
+
+  dst[dstUsed++] = 0;
+  dst[dstUsed++] = 0;
+  return dstUsed;
+}
+
 void HyperVICService::handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count) {
-  while (processMessage());
+  processMessages();
 }
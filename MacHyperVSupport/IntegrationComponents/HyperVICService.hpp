@@ -14,7 +14,27 @@
 #include "HyperVVMBusDevice.hpp"
 #include "HyperVIC.hpp"
 
-#define kHyperVICBufferSize     4096
+#define kHyperVICBufferSize         4096
+
+//
+// Negotiation messages may list more versions than fit in a service message.
+//
+#define kHyperVICMessageMaxSize     128
+
+#define kHyperVICFrameworkVersion   3
+
+class HyperVICService;
+
+//
+// Message handlers update the message in place, and return true to have it sent back as the response.
+// Handlers returning false respond later through sendResponse().
+//
+typedef bool (*HyperVICMessageAction)(HyperVICService *target, VMBusICMessageHeader *msgHeader, UInt32 msgLength);
+
+typedef struct {
+  VMBusICMessageType    type;
+  HyperVICMessageAction action;
+} HyperVICMessageHandler;
 
 class HyperVICService : public IOService {
   OSDeclareDefaultStructors(HyperVICService);
@@ -22,13 +42,44 @@ class HyperVICService : public IOService {
 private:
   void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
   IOInterruptEventSource  *interruptSource;
+
+  //
+  // Supported message versions and handlers, provided by subclasses.
+  //
+  const UInt32                  *msgVersions;
+  UInt32                        msgVersionCount;
+  UInt32                        msgVersion;
+  const HyperVICMessageHandler  *msgHandlers;
+  UInt32                        msgHandlerCount;
+
+  //
+  // Default buffer messages are read into.
+  //
+  void                          *msgBuffer;
+  UInt32                        msgBufferSize;
+
+  bool dispatchMessage(VMBusICMessageHeader *msgHeader, UInt32 msgLength);
+  bool discardMessage(UInt32 msgLength);
   
 protected:
   HyperVVMBusDevice *hvDevice;
   
-  virtual bool processMessage() = 0;
+  virtual UInt32 getRingBufferSize() { return kHyperVICBufferSize; }
+  virtual UInt32 getMaxMessageSize() { return kHyperVICMessageMaxSize; }
+  virtual void *getMessageBuffer(UInt32 *bufferLength);
+  virtual void handleNegotiation(UInt32 version) { }
+
+  void setMessageHandlers(const UInt32 *versions, UInt32 versionCount, const HyperVICMessageHandler *handlers, UInt32 handlerCount);
+  UInt32 getMessageVersion() { return msgVersion; }
+  void processMessages();
+  void sendResponse(VMBusICMessageHeader *msgHeader, UInt32 msgLength);
   
-  bool createNegotiationResponse(VMBusICMessageNegotiate *negMsg, UInt32 fwVersion, UInt32 msgVersion);
+  bool createNegotiationResponse(VMBusICMessageNegotiate *negMsg, UInt32 msgLength, UInt32 fwVersion, UInt32 msgVersion);
+  bool createNegotiationResponse(VMBusICMessageNegotiate *negMsg, UInt32 msgLength, UInt32 fwVersion,
+                                 const UInt32 *msgVersions, UInt32 msgVersionCount, UInt32 *msgVersionSelected = NULL);
+
+  static bool convertUTF16ToUTF8(const UInt8 *src, UInt32 srcSize, char *dst, size_t dstSize);
+  static UInt32 convertUTF8ToUTF16(const char *src, UInt8 *dst, UInt32 dstSize);
   
 public:
   //
@@ -36,6 +87,7 @@ public:
   //
   virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
   virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void free() APPLE_KEXT_OVERRIDE;
 };
 
 #endif
@@ -0,0 +1,173 @@
+//
+//  HyperVKVP.cpp
+//  Hyper-V KVP exchange driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVKVP.hpp"
+
+#define super HyperVICService
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVKVP", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVKVP", str, ## __VA_ARGS__)
+
+OSDefineMetaClassAndStructors(HyperVKVP, super);
+
+//
+// Supported message versions, most preferred first.
+//
+static const UInt32 kvpVersions[] = {
+  kHyperVKVPVersionWin8,
+  kHyperVKVPVersionWin7
+};
+
+const HyperVICMessageHandler HyperVKVP::messageHandlers[] = {
+  { kVMBusICMessageTypeKVPExchange, (HyperVICMessageAction) &HyperVKVP::handleExchange }
+};
+
+bool HyperVKVP::start(IOService *provider) {
+  DBGLOG("Initializing Hyper-V KVP Exchange");
+
+  if (!kvpStore.init()) {
+    SYSLOG("Failed to initialize KVP store");
+    return false;
+  }
+
+  setMessageHandlers(kvpVersions, ARRAY_SIZE(kvpVersions), messageHandlers, ARRAY_SIZE(messageHandlers));
+  if (!super::start(provider)) {
+    kvpStore.free();
+    return false;
+  }
+
+  //
+  // Allow userspace daemons to find this service.
+  //
+  registerService();
+
+  SYSLOG("Initialized Hyper-V KVP Exchange");
+  return true;
+}
+
+void HyperVKVP::stop(IOService *provider) {
+  DBGLOG("Hyper-V KVP Exchange is stopping");
+
+  super::stop(provider);
+  kvpStore.free();
+}
+
+bool HyperVKVP::handleExchange(HyperVKVP *target, VMBusICMessageKVPExchange *kvpMsg, UInt32 msgLength) {
+  if (msgLength < __offsetof(VMBusICMessageKVPExchangeData, get) || kvpMsg->kvp.pool >= kVMBusICKVPPoolCount) {
+    DBGLOG("Invalid KVP message (size %u, pool %u)", msgLength, kvpMsg->kvp.pool);
+    kvpMsg->header.status = kHyperVStatusFail;
+    return true;
+  }
+
+  switch (kvpMsg->kvp.operation) {
+    case kVMBusICKVPOperationGet:
+      kvpMsg->header.status = target->handleGet(kvpMsg->kvp.pool, &kvpMsg->kvp.get);
+      break;
+
+    case kVMBusICKVPOperationSet:
+      kvpMsg->header.status = target->handleSet(kvpMsg->kvp.pool, &kvpMsg->kvp.set);
+      break;
+
+    case kVMBusICKVPOperationDelete:
+      kvpMsg->header.status = target->handleDelete(kvpMsg->kvp.pool, &kvpMsg->kvp.remove);
+      break;
+
+    case kVMBusICKVPOperationEnumerate:
+      kvpMsg->header.status = target->handleEnumerate(kvpMsg->kvp.pool, &kvpMsg->kvp.enumerate);
+      break;
+
+    default:
+      //
+      // IP injection is not supported.
+      //
+      DBGLOG("Unsupported KVP operation %u", kvpMsg->kvp.operation);
+      kvpMsg->header.status = kVMBusICKVPStatusNotSupported;
+      break;
+  }
+  return true;
+}
+
+UInt32 HyperVKVP::handleGet(VMBusICKVPPool pool, VMBusICKVPValue *kvpValue) {
+  char key[kHyperVKVPMaxKeySize];
+  char value[kHyperVKVPMaxValueSize];
+
+  if (kvpValue->keySize > sizeof (kvpValue->key)
+      || !convertUTF16ToUTF8(kvpValue->key, kvpValue->keySize, key, sizeof (key))) {
+    return kHyperVStatusFail;
+  }
+  if (kvpStore.getValue(pool, key, value, sizeof (value)) != kIOReturnSuccess) {
+    DBGLOG("Key %s not found in pool %u", key, pool);
+    return kHyperVStatusFail;
+  }
+
+  kvpValue->valueType = kVMBusICKVPValueTypeString;
+  kvpValue->valueSize = convertUTF8ToUTF16(value, kvpValue->value, sizeof (kvpValue->value));
+  return kHyperVStatusSuccess;
+}
+
+UInt32 HyperVKVP::handleSet(VMBusICKVPPool pool, VMBusICKVPValue *kvpValue) {
+  char key[kHyperVKVPMaxKeySize];
+  char value[kHyperVKVPMaxValueSize];
+
+  if (kvpValue->keySize > sizeof (kvpValue->key)
+      || !convertUTF16ToUTF8(kvpValue->key, kvpValue->keySize, key, sizeof (key))) {
+    return kHyperVStatusFail;
+  }
+
+  //
+  // Integer values are stored as strings.
+  //
+  switch (kvpValue->valueType) {
+    case kVMBusICKVPValueTypeString:
+      if (kvpValue->valueSize > sizeof (kvpValue->value)
+          || !convertUTF16ToUTF8(kvpValue->value, kvpValue->valueSize, value, sizeof (value))) {
+        return kHyperVStatusFail;
+      }
+      break;
+
+    case kVMBusICKVPValueTypeUInt32:
+      snprintf(value, sizeof (value), "%u", kvpValue->valueUInt32);
+      break;
+
+    case kVMBusICKVPValueTypeUInt64:
+      snprintf(value, sizeof (value), "%llu", kvpValue->valueUInt64);
+      break;
+
+    default:
+      DBGLOG("Unsupported value type %u", kvpValue->valueType);
+      return kHyperVStatusFail;
+  }
+
+  DBGLOG("Setting %s = %s in pool %u", key, value, pool);
+  return kvpStore.setValue(pool, key, value) == kIOReturnSuccess ? kHyperVStatusSuccess : kHyperVStatusFail;
+}
+
+UInt32 HyperVKVP::handleDelete(VMBusICKVPPool pool, VMBusICKVPDelete *kvpDelete) {
+  char key[kHyperVKVPMaxKeySize];
+
+  if (kvpDelete->keySize > sizeof (kvpDelete->key)
+      || !convertUTF16ToUTF8(kvpDelete->key, kvpDelete->keySize, key, sizeof (key))) {
+    return kHyperVStatusFail;
+  }
+
+  DBGLOG("Deleting %s from pool %u", key, pool);
+  return kvpStore.removeValue(pool, key) == kIOReturnSuccess ? kHyperVStatusSuccess : kHyperVStatusFail;
+}
+
+UInt32 HyperVKVP::handleEnumerate(VMBusICKVPPool pool, VMBusICKVPEnumerate *kvpEnumerate) {
+  char key[kHyperVKVPMaxKeySize];
+  char value[kHyperVKVPMaxValueSize];
+
+  if (kvpStore.getEntry(pool, kvpEnumerate->index, key, sizeof (key), value, sizeof (value)) != kIOReturnSuccess) {
+    return kVMBusICKVPStatusNoMoreItems;
+  }
+
+  kvpEnumerate->data.valueType = kVMBusICKVPValueTypeString;
+  kvpEnumerate->data.keySize   = convertUTF8ToUTF16(key, kvpEnumerate->data.key, sizeof (kvpEnumerate->data.key));
+  kvpEnumerate->data.valueSize = convertUTF8ToUTF16(value, kvpEnumerate->data.value, sizeof (kvpEnumerate->data.value));
+  return kHyperVStatusSuccess;
+}
@@ -0,0 +1,47 @@
+//
+//  HyperVKVP.hpp
+//  Hyper-V KVP exchange driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVKVP_hpp
+#define HyperVKVP_hpp
+
+#include "HyperVICService.hpp"
+#include "HyperVKVPStore.hpp"
+
+#define kHyperVKVPVersionWin7     3
+#define kHyperVKVPVersionWin8     4
+
+class HyperVKVP : public HyperVICService {
+  OSDeclareDefaultStructors(HyperVKVP);
+
+private:
+  static const HyperVICMessageHandler messageHandlers[];
+
+  HyperVKVPStore kvpStore;
+
+  static bool handleExchange(HyperVKVP *target, VMBusICMessageKVPExchange *kvpMsg, UInt32 msgLength);
+  UInt32 handleGet(VMBusICKVPPool pool, VMBusICKVPValue *kvpValue);
+  UInt32 handleSet(VMBusICKVPPool pool, VMBusICKVPValue *kvpValue);
+  UInt32 handleDelete(VMBusICKVPPool pool, VMBusICKVPDelete *kvpDelete);
+  UInt32 handleEnumerate(VMBusICKVPPool pool, VMBusICKVPEnumerate *kvpEnumerate);
+
+protected:
+  //
+  // Messages are larger than the default buffer.
+  //
+  UInt32 getMaxMessageSize() APPLE_KEXT_OVERRIDE { return sizeof (VMBusICMessageKVPExchange); }
+
+public:
+  //
+  // IOService overrides.
+  //
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+
+  HyperVKVPStore *getStore() { return &kvpStore; }
+};
+
+#endif
@@ -0,0 +1,66 @@
+//
+//  HyperVKVPShared.h
+//  Hyper-V KVP exchange driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Definitions shared between the KVP driver and userspace daemons.
+//
+
+#ifndef HyperVKVPShared_h
+#define HyperVKVPShared_h
+
+#include <stdint.h>
+
+//
+// Keys and values are null terminated UTF-8 strings.
+//
+#define kHyperVKVPMaxKeySize      512
+#define kHyperVKVPMaxValueSize    2048
+
+//
+// Maximum number of records per batch.
+//
+#define kHyperVKVPMaxBatchCount   64
+
+//
+// Pools, matching Hyper-V pool numbers.
+// The guest and auto pools are written by the guest, the others are written by the host.
+//
+enum {
+  kHyperVKVPPoolExternal      = 0,
+  kHyperVKVPPoolGuest         = 1,
+  kHyperVKVPPoolAuto          = 2,
+  kHyperVKVPPoolAutoExternal  = 3,
+  kHyperVKVPPoolAutoInternal  = 4,
+  kHyperVKVPPoolCount         = 5
+};
+
+enum {
+  kHyperVKVPOperationSet      = 1,
+  kHyperVKVPOperationDelete   = 2
+};
+
+//
+// External methods.
+//
+// Update: structure input is an array of HyperVKVPRecord.
+//   Scalar output 0 is the number of records applied.
+// Enumerate: scalar input 0 is the pool, scalar input 1 is the first index.
+//   Structure output is an array of HyperVKVPRecord.
+//   Scalar outputs are the number of records returned, the pool entry count, and the pool generation.
+//
+enum {
+  kHyperVKVPUserClientMethodUpdate    = 0,
+  kHyperVKVPUserClientMethodEnumerate = 1,
+  kHyperVKVPUserClientMethodCount
+};
+
+typedef struct {
+  uint32_t  operation;
+  uint32_t  pool;
+  char      key[kHyperVKVPMaxKeySize];
+  char      value[kHyperVKVPMaxValueSize];
+} HyperVKVPRecord;
+
+#endif
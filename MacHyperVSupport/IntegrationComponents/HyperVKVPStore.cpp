@@ -0,0 +1,256 @@
+//
+//  HyperVKVPStore.cpp
+//  Hyper-V KVP exchange driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVKVPStore.hpp"
+
+bool HyperVKVPStore::init() {
+  lock = IOLockAlloc();
+  if (lock == NULL) {
+    return false;
+  }
+
+  for (UInt32 p = 0; p < kHyperVKVPPoolCount; p++) {
+    pools[p].entries    = NULL;
+    pools[p].count      = 0;
+    pools[p].capacity   = 0;
+    pools[p].generation = 0;
+    for (UInt32 b = 0; b < kHyperVKVPStoreBucketCount; b++) {
+      pools[p].buckets[b] = kHyperVKVPStoreEntryNone;
+    }
+  }
+  return true;
+}
+
+void HyperVKVPStore::free() {
+  for (UInt32 p = 0; p < kHyperVKVPPoolCount; p++) {
+    if (pools[p].entries != NULL) {
+      IOFree(pools[p].entries, pools[p].capacity * sizeof (HyperVKVPStoreEntry));
+      pools[p].entries = NULL;
+    }
+    pools[p].count    = 0;
+    pools[p].capacity = 0;
+  }
+
+  if (lock != NULL) {
+    IOLockFree(lock);
+    lock = NULL;
+  }
+}
+
+UInt32 HyperVKVPStore::hashKey(const char *key) {
+  //
+  // FNV-1a.
+  //
+  UInt32 hash = 2166136261U;
+  while (*key != '\0') {
+    hash ^= (UInt8) *key++;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+UInt32 HyperVKVPStore::findEntryLocked(HyperVKVPStorePool *pool, const char *key, UInt32 hash) {
+  UInt32 index = pool->buckets[hash % kHyperVKVPStoreBucketCount];
+  while (index != kHyperVKVPStoreEntryNone) {
+    if (pool->entries[index].hash == hash && strncmp(pool->entries[index].key, key, kHyperVKVPMaxKeySize) == 0) {
+      return index;
+    }
+    index = pool->entries[index].next;
+  }
+  return kHyperVKVPStoreEntryNone;
+}
+
+IOReturn HyperVKVPStore::setValueLocked(UInt32 poolIndex, const char *key, const char *value) {
+  if (poolIndex >= kHyperVKVPPoolCount || key[0] == '\0'
+      || strnlen(key, kHyperVKVPMaxKeySize) == kHyperVKVPMaxKeySize
+      || strnlen(value, kHyperVKVPMaxValueSize) == kHyperVKVPMaxValueSize) {
+    return kIOReturnBadArgument;
+  }
+
+  HyperVKVPStorePool *pool = &pools[poolIndex];
+  UInt32 hash  = hashKey(key);
+  UInt32 index = findEntryLocked(pool, key, hash);
+
+  if (index == kHyperVKVPStoreEntryNone) {
+    //
+    // Grow entry array as needed, indexes are unchanged so bucket chains remain valid.
+    //
+    if (pool->count == pool->capacity) {
+      if (pool->capacity >= kHyperVKVPStoreMaxEntries) {
+        return kIOReturnNoSpace;
+      }
+
+      UInt32 newCapacity = pool->capacity == 0 ? kHyperVKVPStoreInitialCapacity : pool->capacity * 2;
+      if (newCapacity > kHyperVKVPStoreMaxEntries) {
+        newCapacity = kHyperVKVPStoreMaxEntries;
+      }
+      HyperVKVPStoreEntry *newEntries = (HyperVKVPStoreEntry *)IOMalloc(newCapacity * sizeof (HyperVKVPStoreEntry));
+      if (newEntries == NULL) {
+        return kIOReturnNoMemory;
+      }
+      if (pool->entries != NULL) {
+        memcpy(newEntries, pool->entries, pool->count * sizeof (HyperVKVPStoreEntry));
+        IOFree(pool->entries, pool->capacity * sizeof (HyperVKVPStoreEntry));
+      }
+      pool->entries  = newEntries;
+      pool->capacity = newCapacity;
+    }
+
+    UInt32 bucket = hash % kHyperVKVPStoreBucketCount;
+    index = pool->count++;
+    strlcpy(pool->entries[index].key, key, sizeof (pool->entries[index].key));
+    pool->entries[index].hash = hash;
+    pool->entries[index].next = pool->buckets[bucket];
+    pool->buckets[bucket]     = index;
+  }
+
+  strlcpy(pool->entries[index].value, value, sizeof (pool->entries[index].value));
+  pool->generation++;
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVKVPStore::removeValueLocked(UInt32 poolIndex, const char *key) {
+  if (poolIndex >= kHyperVKVPPoolCount || strnlen(key, kHyperVKVPMaxKeySize) == kHyperVKVPMaxKeySize) {
+    return kIOReturnBadArgument;
+  }
+
+  HyperVKVPStorePool *pool = &pools[poolIndex];
+  UInt32 hash  = hashKey(key);
+  UInt32 index = findEntryLocked(pool, key, hash);
+  if (index == kHyperVKVPStoreEntryNone) {
+    return kIOReturnNotFound;
+  }
+
+  //
+  // Unlink the entry, then move the last entry into its slot to keep the array dense.
+  //
+  UInt32 *link = &pool->buckets[hash % kHyperVKVPStoreBucketCount];
+  while (*link != index) {
+    link = &pool->entries[*link].next;
+  }
+  *link = pool->entries[index].next;
+
+  UInt32 lastIndex = pool->count - 1;
+  if (index != lastIndex) {
+    link = &pool->buckets[pool->entries[lastIndex].hash % kHyperVKVPStoreBucketCount];
+    while (*link != lastIndex) {
+      link = &pool->entries[*link].next;
+    }
+    *link = index;
+    memcpy(&pool->entries[index], &pool->entries[lastIndex], sizeof (pool->entries[index]));
+  }
+  pool->count--;
+  pool->generation++;
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVKVPStore::setValue(UInt32 poolIndex, const char *key, const char *value) {
+  IOLockLock(lock);
+  IOReturn status = setValueLocked(poolIndex, key, value);
+  IOLockUnlock(lock);
+  return status;
+}
+
+IOReturn HyperVKVPStore::getValue(UInt32 poolIndex, const char *key, char *value, size_t valueSize) {
+  if (poolIndex >= kHyperVKVPPoolCount || strnlen(key, kHyperVKVPMaxKeySize) == kHyperVKVPMaxKeySize) {
+    return kIOReturnBadArgument;
+  }
+
+  IOLockLock(lock);
+  HyperVKVPStorePool *pool = &pools[poolIndex];
+  UInt32 index = findEntryLocked(pool, key, hashKey(key));
+  if (index != kHyperVKVPStoreEntryNone) {
+    strlcpy(value, pool->entries[index].value, valueSize);
+  }
+  IOLockUnlock(lock);
+
+  return index != kHyperVKVPStoreEntryNone ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+IOReturn HyperVKVPStore::removeValue(UInt32 poolIndex, const char *key) {
+  IOLockLock(lock);
+  IOReturn status = removeValueLocked(poolIndex, key);
+  IOLockUnlock(lock);
+  return status;
+}
+
+IOReturn HyperVKVPStore::getEntry(UInt32 poolIndex, UInt32 index, char *key, size_t keySize, char *value, size_t valueSize) {
+  if (poolIndex >= kHyperVKVPPoolCount) {
+    return kIOReturnBadArgument;
+  }
+
+  IOLockLock(lock);
+  HyperVKVPStorePool *pool = &pools[poolIndex];
+  bool found = index < pool->count;
+  if (found) {
+    strlcpy(key, pool->entries[index].key, keySize);
+    strlcpy(value, pool->entries[index].value, valueSize);
+  }
+  IOLockUnlock(lock);
+
+  return found ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+IOReturn HyperVKVPStore::updateRecords(const HyperVKVPRecord *records, UInt32 recordCount, UInt32 *recordsApplied) {
+  IOReturn status = kIOReturnSuccess;
+  UInt32   index;
+
+  //
+  // Records are applied in order, stopping at the first failure.
+  // Removing a key that does not exist is not a failure.
+  //
+  IOLockLock(lock);
+  for (index = 0; index < recordCount; index++) {
+    switch (records[index].operation) {
+      case kHyperVKVPOperationSet:
+        status = setValueLocked(records[index].pool, records[index].key, records[index].value);
+        break;
+
+      case kHyperVKVPOperationDelete:
+        status = removeValueLocked(records[index].pool, records[index].key);
+        if (status == kIOReturnNotFound) {
+          status = kIOReturnSuccess;
+        }
+        break;
+
+      default:
+        status = kIOReturnBadArgument;
+        break;
+    }
+
+    if (status != kIOReturnSuccess) {
+      break;
+    }
+  }
+  IOLockUnlock(lock);
+
+  *recordsApplied = index;
+  return status;
+}
+
+IOReturn HyperVKVPStore::copyRecords(UInt32 poolIndex, UInt32 startIndex, HyperVKVPRecord *records, UInt32 maxRecords,
+                                     UInt32 *recordsCopied, UInt32 *entryCount, UInt32 *generation) {
+  if (poolIndex >= kHyperVKVPPoolCount) {
+    return kIOReturnBadArgument;
+  }
+
+  IOLockLock(lock);
+  HyperVKVPStorePool *pool = &pools[poolIndex];
+  UInt32 copied = 0;
+  for (UInt32 index = startIndex; index < pool->count && copied < maxRecords; index++, copied++) {
+    records[copied].operation = kHyperVKVPOperationSet;
+    records[copied].pool      = poolIndex;
+    strlcpy(records[copied].key, pool->entries[index].key, sizeof (records[copied].key));
+    strlcpy(records[copied].value, pool->entries[index].value, sizeof (records[copied].value));
+  }
+  *recordsCopied = copied;
+  *entryCount    = pool->count;
+  *generation    = pool->generation;
+  IOLockUnlock(lock);
+
+  return kIOReturnSuccess;
+}
@@ -0,0 +1,70 @@
+//
+//  HyperVKVPStore.hpp
+//  Hyper-V KVP exchange driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVKVPStore_hpp
+#define HyperVKVPStore_hpp
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+
+#include "HyperVKVPShared.h"
+
+#define kHyperVKVPStoreBucketCount      256
+#define kHyperVKVPStoreInitialCapacity  16
+#define kHyperVKVPStoreMaxEntries       1024
+#define kHyperVKVPStoreEntryNone        0xFFFFFFFF
+
+typedef struct {
+  char    key[kHyperVKVPMaxKeySize];
+  char    value[kHyperVKVPMaxValueSize];
+  UInt32  hash;
+  UInt32  next;
+} HyperVKVPStoreEntry;
+
+//
+// Entries are kept dense so they can be enumerated by index,
+// with buckets chaining entry indexes together for lookups by key.
+//
+typedef struct {
+  HyperVKVPStoreEntry *entries;
+  UInt32              count;
+  UInt32              capacity;
+  UInt32              buckets[kHyperVKVPStoreBucketCount];
+  UInt32              generation;
+} HyperVKVPStorePool;
+
+//
+// In-kernel key/value store for all KVP pools.
+//
+class HyperVKVPStore {
+private:
+  IOLock              *lock;
+  HyperVKVPStorePool  pools[kHyperVKVPPoolCount];
+
+  static UInt32 hashKey(const char *key);
+  UInt32 findEntryLocked(HyperVKVPStorePool *pool, const char *key, UInt32 hash);
+  IOReturn setValueLocked(UInt32 poolIndex, const char *key, const char *value);
+  IOReturn removeValueLocked(UInt32 poolIndex, const char *key);
+
+public:
+  bool init();
+  void free();
+
+  IOReturn setValue(UInt32 poolIndex, const char *key, const char *value);
+  IOReturn getValue(UInt32 poolIndex, const char *key, char *value, size_t valueSize);
+  IOReturn removeValue(UInt32 poolIndex, const char *key);
+  IOReturn getEntry(UInt32 poolIndex, UInt32 index, char *key, size_t keySize, char *value, size_t valueSize);
+
+  //
+  // Batched access, the store is locked once for all records.
+  //
+  IOReturn updateRecords(const HyperVKVPRecord *records, UInt32 recordCount, UInt32 *recordsApplied);
+  IOReturn copyRecords(UInt32 poolIndex, UInt32 startIndex, HyperVKVPRecord *records, UInt32 maxRecords,
+                       UInt32 *recordsCopied, UInt32 *entryCount, UInt32 *generation);
+};
+
+#endif
@@ -0,0 +1,184 @@
+//
+//  HyperVKVPUserClient.cpp
+//  Hyper-V KVP exchange driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVKVPUserClient.hpp"
+
+#define super IOUserClient
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVKVPUserClient", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVKVPUserClient", str, ## __VA_ARGS__)
+
+OSDefineMetaClassAndStructors(HyperVKVPUserClient, super);
+
+const IOExternalMethodDispatch HyperVKVPUserClient::methods[kHyperVKVPUserClientMethodCount] = {
+  { // kHyperVKVPUserClientMethodUpdate
+    (IOExternalMethodAction) &HyperVKVPUserClient::methodUpdate,
+    0, kIOUCVariableStructureSize, 1, 0
+  },
+  { // kHyperVKVPUserClientMethodEnumerate
+    (IOExternalMethodAction) &HyperVKVPUserClient::methodEnumerate,
+    2, 0, 3, kIOUCVariableStructureSize
+  }
+};
+
+bool HyperVKVPUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
+  if (!super::initWithTask(owningTask, securityToken, type, properties)) {
+    return false;
+  }
+
+  //
+  // Only administrators can access the KVP store.
+  //
+  if (clientHasPrivilege(securityToken, kIOClientPrivilegeAdministrator) != kIOReturnSuccess) {
+    DBGLOG("Client is not an administrator");
+    return false;
+  }
+  return true;
+}
+
+bool HyperVKVPUserClient::start(IOService *provider) {
+  hvKVP = OSDynamicCast(HyperVKVP, provider);
+  if (hvKVP == NULL) {
+    return false;
+  }
+
+  if (!super::start(provider)) {
+    return false;
+  }
+  hvKVP->retain();
+
+  DBGLOG("KVP user client started");
+  return true;
+}
+
+void HyperVKVPUserClient::stop(IOService *provider) {
+  DBGLOG("KVP user client stopping");
+  OSSafeReleaseNULL(hvKVP);
+  super::stop(provider);
+}
+
+IOReturn HyperVKVPUserClient::clientClose() {
+  terminate();
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVKVPUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch,
+                                             OSObject *target, void *reference) {
+  if (selector >= kHyperVKVPUserClientMethodCount) {
+    return kIOReturnUnsupported;
+  }
+  return super::externalMethod(selector, arguments, (IOExternalMethodDispatch *) &methods[selector], this, reference);
+}
+
+IOReturn HyperVKVPUserClient::methodUpdate(HyperVKVPUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  //
+  // Large batches are passed as a memory descriptor instead of inline.
+  //
+  UInt32 inputSize = args->structureInputDescriptor != NULL ? (UInt32) args->structureInputDescriptor->getLength() : args->structureInputSize;
+  if (inputSize == 0 || (inputSize % sizeof (HyperVKVPRecord)) != 0 || inputSize / sizeof (HyperVKVPRecord) > kHyperVKVPMaxBatchCount) {
+    return kIOReturnBadArgument;
+  }
+  UInt32 recordCount = inputSize / sizeof (HyperVKVPRecord);
+
+  HyperVKVPRecord *records = (HyperVKVPRecord *)IOMalloc(inputSize);
+  if (records == NULL) {
+    return kIOReturnNoMemory;
+  }
+  if (args->structureInputDescriptor != NULL) {
+    //
+    // Descriptor must be wired before its memory can be accessed.
+    //
+    IOReturn status = args->structureInputDescriptor->prepare(kIODirectionOut);
+    if (status != kIOReturnSuccess) {
+      IOFree(records, inputSize);
+      return status;
+    }
+    IOByteCount bytesRead = args->structureInputDescriptor->readBytes(0, records, inputSize);
+    args->structureInputDescriptor->complete(kIODirectionOut);
+
+    if (bytesRead != inputSize) {
+      IOFree(records, inputSize);
+      return kIOReturnVMError;
+    }
+  } else {
+    memcpy(records, args->structureInput, inputSize);
+  }
+
+  //
+  // Host owned pools are read-only to userspace.
+  //
+  for (UInt32 i = 0; i < recordCount; i++) {
+    if (records[i].pool != kHyperVKVPPoolGuest && records[i].pool != kHyperVKVPPoolAuto) {
+      IOFree(records, inputSize);
+      return kIOReturnNotPermitted;
+    }
+  }
+
+  UInt32   recordsApplied = 0;
+  IOReturn status         = target->hvKVP->getStore()->updateRecords(records, recordCount, &recordsApplied);
+  IOFree(records, inputSize);
+
+  args->scalarOutput[0] = recordsApplied;
+  return status;
+}
+
+IOReturn HyperVKVPUserClient::methodEnumerate(HyperVKVPUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  UInt32 outputSize = args->structureOutputDescriptor != NULL ? (UInt32) args->structureOutputDescriptor->getLength() : args->structureOutputSize;
+  UInt32 maxRecords = outputSize / sizeof (HyperVKVPRecord);
+  if (maxRecords > kHyperVKVPMaxBatchCount) {
+    maxRecords = kHyperVKVPMaxBatchCount;
+  }
+
+  //
+  // A zero sized output only returns the entry count and generation, used to poll for changes.
+  //
+  HyperVKVPRecord *records = NULL;
+  if (maxRecords > 0) {
+    records = (HyperVKVPRecord *)IOMalloc(maxRecords * sizeof (HyperVKVPRecord));
+    if (records == NULL) {
+      return kIOReturnNoMemory;
+    }
+  }
+
+  UInt32 recordsCopied = 0;
+  UInt32 entryCount    = 0;
+  UInt32 generation    = 0;
+  IOReturn status = target->hvKVP->getStore()->copyRecords((UInt32) args->scalarInput[0], (UInt32) args->scalarInput[1],
+                                                           records, maxRecords, &recordsCopied, &entryCount, &generation);
+  if (status == kIOReturnSuccess) {
+    UInt32 copiedSize = recordsCopied * sizeof (HyperVKVPRecord);
+    if (args->structureOutputDescriptor != NULL) {
+      if (copiedSize > 0) {
+        //
+        // Descriptor must be wired before its memory can be accessed.
+        //
+        status = args->structureOutputDescriptor->prepare(kIODirectionIn);
+        if (status == kIOReturnSuccess) {
+          if (args->structureOutputDescriptor->writeBytes(0, records, copiedSize) != copiedSize) {
+            status = kIOReturnVMError;
+          }
+          args->structureOutputDescriptor->complete(kIODirectionIn);
+        }
+      }
+      args->structureOutputDescriptorSize = copiedSize;
+    } else {
+      if (copiedSize > 0) {
+        memcpy(args->structureOutput, records, copiedSize);
+      }
+      args->structureOutputSize = copiedSize;
+    }
+
+    args->scalarOutput[0] = recordsCopied;
+    args->scalarOutput[1] = entryCount;
+    args->scalarOutput[2] = generation;
+  }
+
+  if (records != NULL) {
+    IOFree(records, maxRecords * sizeof (HyperVKVPRecord));
+  }
+  return status;
+}
@@ -0,0 +1,42 @@
+//
+//  HyperVKVPUserClient.hpp
+//  Hyper-V KVP exchange driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVKVPUserClient_hpp
+#define HyperVKVPUserClient_hpp
+
+#include <IOKit/IOUserClient.h>
+
+#include "HyperVKVP.hpp"
+
+//
+// Userspace daemon interface to the KVP store.
+// Records are transferred in batches, so a daemon needs one call to publish or read many keys.
+//
+class HyperVKVPUserClient : public IOUserClient {
+  OSDeclareDefaultStructors(HyperVKVPUserClient);
+
+private:
+  HyperVKVP *hvKVP;
+
+  static const IOExternalMethodDispatch methods[kHyperVKVPUserClientMethodCount];
+
+  static IOReturn methodUpdate(HyperVKVPUserClient *target, void *ref, IOExternalMethodArguments *args);
+  static IOReturn methodEnumerate(HyperVKVPUserClient *target, void *ref, IOExternalMethodArguments *args);
+
+public:
+  //
+  // IOUserClient overrides.
+  //
+  virtual bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) APPLE_KEXT_OVERRIDE;
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual IOReturn clientClose() APPLE_KEXT_OVERRIDE;
+  virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch,
+                                  OSObject *target, void *reference) APPLE_KEXT_OVERRIDE;
+};
+
+#endif
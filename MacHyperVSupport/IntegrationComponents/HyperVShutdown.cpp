@@ -15,7 +15,19 @@
 
 OSDefineMetaClassAndStructors(HyperVShutdown, super);
 
+//
+// Supported message versions and message handlers.
+//
+static const UInt32 shutdownVersions[] = {
+  3
+};
+
+const HyperVICMessageHandler HyperVShutdown::messageHandlers[] = {
+  { kVMBusICMessageTypeShutdown, (HyperVICMessageAction) &HyperVShutdown::handleShutdown }
+};
+
 bool HyperVShutdown::start(IOService *provider) {
+  setMessageHandlers(shutdownVersions, ARRAY_SIZE(shutdownVersions), messageHandlers, ARRAY_SIZE(messageHandlers));
   if (!super::start(provider)) {
     return false;
   }
@@ -24,58 +36,13 @@ bool HyperVShutdown::start(IOService *provider) {
   return true;
 }
 
-bool HyperVShutdown::processMessage() {
-  VMBusICMessageShutdown shutdownMsg;
-
-  //
-  // Ignore errors and the acknowledgement interrupt (no data to read).
-  //
-  UInt32 pktDataLength;
-  if (!hvDevice->nextInbandPacketAvailable(&pktDataLength) || pktDataLength > sizeof (shutdownMsg)) {
-    return false;
-  }
-
-  //
-  // Read and parse inbound inband packet.
-  //
-  if (hvDevice->readInbandCompletionPacket(&shutdownMsg, sizeof (shutdownMsg), NULL) != kIOReturnSuccess) {
-    return false;
-  }
-
-  bool doShutdown = false;
-  switch (shutdownMsg.header.type) {
-    case kVMBusICMessageTypeNegotiate:
-      createNegotiationResponse(&shutdownMsg.negotiate, 3, 3);
-      break;
-
-    case kVMBusICMessageTypeShutdown:
-      doShutdown = handleShutdown(&shutdownMsg.shutdown);
-      break;
-
-    default:
-      DBGLOG("Unknown shutdown message type %u", shutdownMsg.header.type);
-      shutdownMsg.header.status = kHyperVStatusFail;
-      break;
+bool HyperVShutdown::handleShutdown(HyperVShutdown *target, VMBusICMessageShutdown *shutdownMsg, UInt32 msgLength) {
+  if (msgLength < __offsetof(VMBusICMessageShutdownData, displayMessage)) {
+    DBGLOG("Invalid shutdown message size %u", msgLength);
+    shutdownMsg->header.status = kHyperVStatusFail;
+    return true;
   }
-
-  //
-  // Send response back to Hyper-V. The packet size will always be the same as the original inbound one.
-  //
-  shutdownMsg.header.flags = kVMBusICFlagTransaction | kVMBusICFlagResponse;
-  hvDevice->writeInbandPacket(&shutdownMsg, pktDataLength, false);
-
-  //
-  // Shutdown machine if requested. This should not return.
-  //
-  if (doShutdown) {
-    SYSLOG("Shutting down system");
-    HyperVPlatformProvider::getInstance()->shutdownSystem();
-  }
-  return true;
-}
-
-bool HyperVShutdown::handleShutdown(VMBusICMessageShutdownData *shutdownData) {
-  DBGLOG("Shutdown request received: flags 0x%X, reason 0x%X", shutdownData->flags, shutdownData->reason);
+  DBGLOG("Shutdown request received: flags 0x%X, reason 0x%X", shutdownMsg->shutdown.flags, shutdownMsg->shutdown.reason);
 
   //
   // Report back to Hyper-V if we can shutdown system.
@@ -86,9 +53,17 @@ bool HyperVShutdown::handleShutdown(VMBusICMessageShutdownData *shutdownData) {
     result = provider->canShutdownSystem();
   }
 
-  shutdownData->header.status = result ? kHyperVStatusSuccess : kHyperVStatusFail;
+  shutdownMsg->header.status = result ? kHyperVStatusSuccess : kHyperVStatusFail;
   if (!result) {
     SYSLOG("Platform does not support shutdown");
+    return true;
   }
-  return result;
+
+  //
+  // Response must be sent before shutting down the machine. This should not return.
+  //
+  target->sendResponse(&shutdownMsg->header, msgLength);
+  SYSLOG("Shutting down system");
+  provider->shutdownSystem();
+  return false;
 }
@@ -14,10 +14,15 @@ class HyperVShutdown : public HyperVICService {
   OSDeclareDefaultStructors(HyperVShutdown);
 
 private:
-  bool handleShutdown(VMBusICMessageShutdownData *shutdownData);
+  static const HyperVICMessageHandler messageHandlers[];
+
+  static bool handleShutdown(HyperVShutdown *target, VMBusICMessageShutdown *shutdownMsg, UInt32 msgLength);
 
 protected:
-  bool processMessage() APPLE_KEXT_OVERRIDE;
+  //
+  // Shutdown messages carry a display message, and are larger than the default buffer.
+  //
+  UInt32 getMaxMessageSize() APPLE_KEXT_OVERRIDE { return sizeof (VMBusICMessageShutdown); }
 
 public:
   //
@@ -0,0 +1,328 @@
+//
+//  HyperVTimeSync.cpp
+//  Hyper-V time synchronization driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVTimeSync.hpp"
+#include "HyperVPlatformProvider.hpp"
+
+#include <libkern/OSAtomic.h>
+
+#define super HyperVICService
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVTimeSync", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVTimeSync", str, ## __VA_ARGS__)
+
+OSDefineMetaClassAndStructors(HyperVTimeSync, super);
+
+//
+// Supported message versions, most preferred first.
+//
+static const UInt32 timeSyncVersions[] = {
+  kHyperVTimeSyncVersionV4,
+  kHyperVTimeSyncVersionV3,
+  kHyperVTimeSyncVersionV1
+};
+
+const HyperVICMessageHandler HyperVTimeSync::messageHandlers[] = {
+  { kVMBusICMessageTypeTimeSync, (HyperVICMessageAction) &HyperVTimeSync::handleTimeSyncMessage }
+};
+
+//
+// High 64 bits of a 64x64 multiply, 128-bit types are not available on 32-bit.
+//
+static inline UInt64 multiplyHigh64(UInt64 a, UInt64 b) {
+  UInt64 aLow  = a & 0xFFFFFFFF;
+  UInt64 aHigh = a >> 32;
+  UInt64 bLow  = b & 0xFFFFFFFF;
+  UInt64 bHigh = b >> 32;
+
+  UInt64 lowLow   = aLow * bLow;
+  UInt64 highLow  = aHigh * bLow;
+  UInt64 lowHigh  = aLow * bHigh;
+  UInt64 cross    = (lowLow >> 32) + (highLow & 0xFFFFFFFF) + lowHigh;
+
+  return (aHigh * bHigh) + (highLow >> 32) + (cross >> 32);
+}
+
+bool HyperVTimeSync::start(IOService *provider) {
+  DBGLOG("Initializing Hyper-V Time Synchronization");
+
+  sampleIndex     = 0;
+  sampleCount     = 0;
+  lastOffsetNs    = 0;
+  stepCount       = 0;
+  slewCount       = 0;
+  setMessageHandlers(timeSyncVersions, ARRAY_SIZE(timeSyncVersions), messageHandlers, ARRAY_SIZE(messageHandlers));
+
+  //
+  // Reference time is needed before the channel is opened and the first sample arrives.
+  //
+  if (!initReferenceTsc()) {
+    DBGLOG("Reference TSC page is not available, using reference counter MSR");
+  }
+
+  if (!super::start(provider)) {
+    freeReferenceTsc();
+    return false;
+  }
+
+  HyperVPlatformProvider *platformProvider = HyperVPlatformProvider::getInstance();
+  if (platformProvider == NULL || !platformProvider->canSetTime() || !platformProvider->canSlewTime()) {
+    SYSLOG("Platform does not support clock adjustments, time will not be synchronized");
+  }
+
+  updateStatistics();
+  SYSLOG("Initialized Hyper-V Time Synchronization");
+  return true;
+}
+
+void HyperVTimeSync::stop(IOService *provider) {
+  DBGLOG("Hyper-V Time Synchronization is stopping");
+
+  super::stop(provider);
+  freeReferenceTsc();
+}
+
+bool HyperVTimeSync::initReferenceTsc() {
+  uint32_t regs[4];
+
+  do_cpuid(kHyperVCpuidLeafFeatures, regs);
+  hasReferenceCounter = (regs[eax] & kHyperVCpuidMsrTimeRefCnt) != 0;
+  tscPageEnabled      = false;
+  tscPageDesc         = NULL;
+  tscPage             = NULL;
+
+  if ((regs[eax] & kHyperVCpuidMsrReferenceTsc) == 0) {
+    return false;
+  }
+
+  //
+  // The reference TSC MSR is shared by the whole partition, not just this CPU.
+  // It is only written if no page is enabled yet, and only cleared on stop if this driver enabled it.
+  //
+  UInt64 tscMsr = rdmsr64(kHyperVMsrReferenceTsc);
+  if (tscMsr & kHyperVMsrReferenceTscEnable) {
+    DBGLOG("Reference TSC page is already enabled (0x%llX)", tscMsr);
+    return false;
+  }
+
+  tscPageDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
+                                                                 kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryMapperNone,
+                                                                 PAGE_SIZE, 0xFFFFFFFFFFFFF000ULL);
+  if (tscPageDesc == NULL) {
+    SYSLOG("Failed to allocate reference TSC page");
+    return false;
+  }
+  tscPageDesc->prepare();
+  memset(tscPageDesc->getBytesNoCopy(), 0, PAGE_SIZE);
+
+  UInt64 tscPagePhysAddr = tscPageDesc->getPhysicalAddress();
+  wrmsr64(kHyperVMsrReferenceTsc, ((tscPagePhysAddr >> PAGE_SHIFT) << kHyperVMsrReferenceTscPageShift)
+          | (tscMsr & kHyperVMsrReferenceTscRsvdMask) | kHyperVMsrReferenceTscEnable);
+
+  tscPage        = (HyperVReferenceTscPage *)tscPageDesc->getBytesNoCopy();
+  tscPageEnabled = true;
+  DBGLOG("Reference TSC page enabled at phys 0x%llX", tscPagePhysAddr);
+  return true;
+}
+
+void HyperVTimeSync::freeReferenceTsc() {
+  if (tscPageEnabled) {
+    wrmsr64(kHyperVMsrReferenceTsc, rdmsr64(kHyperVMsrReferenceTsc) & kHyperVMsrReferenceTscRsvdMask);
+    tscPageEnabled = false;
+  }
+  tscPage = NULL;
+
+  if (tscPageDesc != NULL) {
+    tscPageDesc->complete();
+    OSSafeReleaseNULL(tscPageDesc);
+  }
+}
+
+UInt64 HyperVTimeSync::getReferenceTime() {
+  //
+  // Read reference time from the TSC page, retrying if Hyper-V updated it during the read.
+  // Hyper-V invalidates the page (sequence of 0) when the TSC cannot be used, such as during migration.
+  //
+  if (tscPage != NULL) {
+    UInt32 sequence;
+    UInt64 referenceTime;
+
+    do {
+      sequence = tscPage->sequence;
+      if (sequence == 0) {
+        break;
+      }
+      OSMemoryBarrier();
+      referenceTime = multiplyHigh64(rdtsc64(), tscPage->scale) + tscPage->offset;
+      OSMemoryBarrier();
+    } while (tscPage->sequence != sequence);
+
+    if (sequence != 0) {
+      return referenceTime;
+    }
+  }
+
+  return hasReferenceCounter ? rdmsr64(MSR_HV_TIME_REF_COUNT) : 0;
+}
+
+void HyperVTimeSync::handleNegotiation(UInt32 version) {
+  SYSLOG("Using time sync version %u", version);
+  sampleCount = 0;
+  sampleIndex = 0;
+}
+
+bool HyperVTimeSync::handleTimeSyncMessage(HyperVTimeSync *target, VMBusICMessageTimeSync *timeSyncMsg, UInt32 msgLength) {
+  UInt32 timeSyncVersion = target->getMessageVersion();
+
+  if (timeSyncVersion >= kHyperVTimeSyncVersionV4 && msgLength >= sizeof (timeSyncMsg->timeSyncRef)) {
+    target->handleTimeSync(timeSyncMsg->timeSyncRef.parentTime, timeSyncMsg->timeSyncRef.vmReferenceTime, true, timeSyncMsg->timeSyncRef.flags);
+  } else if (timeSyncVersion < kHyperVTimeSyncVersionV4 && msgLength >= sizeof (timeSyncMsg->timeSync)) {
+    target->handleTimeSync(timeSyncMsg->timeSync.parentTime, 0, false, timeSyncMsg->timeSync.flags);
+  } else {
+    DBGLOG("Invalid time sync message size %u", msgLength);
+    timeSyncMsg->header.status = kHyperVStatusFail;
+  }
+  return true;
+}
+
+void HyperVTimeSync::handleTimeSync(UInt64 hostTime, UInt64 hostReferenceTime, bool hasHostReferenceTime, UInt8 flags) {
+  if (flags == kVMBusICTimeSyncFlagProbe) {
+    DBGLOG("Time sync probe received");
+    return;
+  }
+  if (hostTime < kHyperVTimeSyncWindowsEpochDelta) {
+    DBGLOG("Invalid host time 0x%llX", hostTime);
+    return;
+  }
+
+  //
+  // Sample reference time and the guest clock back to back, so both describe the same instant.
+  // Host time is then advanced by the reference time that elapsed since Hyper-V sampled it.
+  //
+  clock_sec_t   guestSecs;
+  clock_nsec_t  guestNanosecs;
+  UInt64 referenceTime = getReferenceTime();
+  clock_get_calendar_nanotime(&guestSecs, &guestNanosecs);
+
+  UInt64 hostUnixTime = hostTime - kHyperVTimeSyncWindowsEpochDelta;
+  if (hasHostReferenceTime && referenceTime != 0) {
+    hostUnixTime += (SInt64) (referenceTime - hostReferenceTime);
+  }
+
+  SInt64 hostNs   = (SInt64) (hostUnixTime * HYPERV_TIMER_NS_FACTOR);
+  SInt64 guestNs  = ((SInt64) guestSecs * NSEC_PER_SEC) + guestNanosecs;
+  SInt64 offsetNs = hostNs - guestNs;
+  lastOffsetNs    = offsetNs;
+  DBGLOG("Time sync flags %u, offset %lld ns", flags, offsetNs);
+
+  //
+  // Sync messages are sent on boot and resume, the clock is always stepped.
+  // Samples are periodic, only large offsets are stepped and smaller ones are slewed.
+  //
+  if (flags & kVMBusICTimeSyncFlagSync) {
+    stepClock(offsetNs);
+  } else if (flags & kVMBusICTimeSyncFlagSample) {
+    if (offsetNs > (SInt64) kHyperVTimeSyncStepThresholdNs || offsetNs < -((SInt64) kHyperVTimeSyncStepThresholdNs)) {
+      stepClock(offsetNs);
+    } else {
+      slewClock(filterSampleOffset(offsetNs));
+    }
+  }
+
+  updateStatistics();
+}
+
+SInt64 HyperVTimeSync::filterSampleOffset(SInt64 offsetNs) {
+  SInt64 sorted[kHyperVTimeSyncSampleCount];
+
+  sampleOffsets[sampleIndex] = offsetNs;
+  sampleIndex = (sampleIndex + 1) % kHyperVTimeSyncSampleCount;
+  if (sampleCount < kHyperVTimeSyncSampleCount) {
+    sampleCount++;
+  }
+
+  //
+  // Use the median of recent samples, a single delayed sample should not pull the clock.
+  //
+  for (UInt32 i = 0; i < sampleCount; i++) {
+    SInt64 value = sampleOffsets[i];
+    UInt32 j = i;
+    while (j > 0 && sorted[j - 1] > value) {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = value;
+  }
+  return sorted[sampleCount / 2];
+}
+
+void HyperVTimeSync::stepClock(SInt64 offsetNs) {
+  HyperVPlatformProvider *platformProvider = HyperVPlatformProvider::getInstance();
+  if (platformProvider == NULL || !platformProvider->canSetTime()) {
+    return;
+  }
+
+  //
+  // Cancel any slew in progress, and discard samples taken against the old clock.
+  //
+  if (platformProvider->canSlewTime()) {
+    platformProvider->slewTime(0);
+  }
+  sampleCount = 0;
+  sampleIndex = 0;
+
+  clock_sec_t   secs;
+  clock_nsec_t  nanosecs;
+  clock_get_calendar_nanotime(&secs, &nanosecs);
+
+  SInt64 newTimeNs = ((SInt64) secs * NSEC_PER_SEC) + nanosecs + offsetNs;
+  platformProvider->setTime((clock_sec_t) (newTimeNs / NSEC_PER_SEC), (clock_usec_t) ((newTimeNs % NSEC_PER_SEC) / NSEC_PER_USEC));
+  stepCount++;
+
+  SYSLOG("Stepped clock by %lld ms", offsetNs / (SInt64) NSEC_PER_MSEC);
+}
+
+void HyperVTimeSync::slewClock(SInt64 offsetNs) {
+  HyperVPlatformProvider *platformProvider = HyperVPlatformProvider::getInstance();
+  if (platformProvider == NULL || !platformProvider->canSlewTime()) {
+    return;
+  }
+
+  //
+  // Each slew replaces the previous one, so the outstanding adjustment always matches the current offset.
+  //
+  platformProvider->slewTime(offsetNs / (SInt64) NSEC_PER_USEC);
+  slewCount++;
+}
+
+void HyperVTimeSync::updateStatistics() {
+  OSDictionary *stats = OSDictionary::withCapacity(5);
+  if (stats == NULL) {
+    return;
+  }
+
+  const struct {
+    const char  *key;
+    UInt64      value;
+  } values[] = {
+    { "Version",          getMessageVersion() },
+    { "LastOffsetNS",     (UInt64) lastOffsetNs },
+    { "StepCount",        stepCount },
+    { "SlewCount",        slewCount },
+    { "ReferenceTSCPage", tscPageEnabled ? 1 : 0 }
+  };
+  for (UInt32 i = 0; i < ARRAY_SIZE(values); i++) {
+    OSNumber *number = OSNumber::withNumber(values[i].value, 64);
+    if (number != NULL) {
+      stats->setObject(values[i].key, number);
+      number->release();
+    }
+  }
+
+  setProperty(kHyperVTimeSyncStatisticsKey, stats);
+  stats->release();
+}
@@ -0,0 +1,84 @@
+//
+//  HyperVTimeSync.hpp
+//  Hyper-V time synchronization driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVTimeSync_hpp
+#define HyperVTimeSync_hpp
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <i386/cpuid.h>
+#include <i386/proc_reg.h>
+
+#include "HyperVICService.hpp"
+
+#define kHyperVTimeSyncVersionV1          1
+#define kHyperVTimeSyncVersionV3          3
+#define kHyperVTimeSyncVersionV4          4
+
+//
+// Difference between the Windows epoch (1601) and the Unix epoch (1970) in 100ns units.
+//
+#define kHyperVTimeSyncWindowsEpochDelta  116444736000000000ULL
+
+//
+// Offsets above this are corrected by stepping the clock, smaller offsets are slewed.
+//
+#define kHyperVTimeSyncStepThresholdNs    (5ULL * NSEC_PER_SEC)
+
+//
+// Number of samples the slew offset is filtered over.
+//
+#define kHyperVTimeSyncSampleCount        3
+
+#define kHyperVTimeSyncStatisticsKey      "TimeSyncStatistics"
+
+class HyperVTimeSync : public HyperVICService {
+  OSDeclareDefaultStructors(HyperVTimeSync);
+
+private:
+  static const HyperVICMessageHandler messageHandlers[];
+
+  //
+  // Reference TSC page, used for reading the partition reference time without exits.
+  //
+  IOBufferMemoryDescriptor  *tscPageDesc;
+  HyperVReferenceTscPage    *tscPage;
+  bool                      tscPageEnabled;
+  bool                      hasReferenceCounter;
+
+  //
+  // Recent sample offsets, and statistics.
+  //
+  SInt64                    sampleOffsets[kHyperVTimeSyncSampleCount];
+  UInt32                    sampleIndex;
+  UInt32                    sampleCount;
+  SInt64                    lastOffsetNs;
+  UInt32                    stepCount;
+  UInt32                    slewCount;
+
+  bool initReferenceTsc();
+  void freeReferenceTsc();
+  UInt64 getReferenceTime();
+
+  static bool handleTimeSyncMessage(HyperVTimeSync *target, VMBusICMessageTimeSync *timeSyncMsg, UInt32 msgLength);
+  void handleTimeSync(UInt64 hostTime, UInt64 hostReferenceTime, bool hasHostReferenceTime, UInt8 flags);
+  SInt64 filterSampleOffset(SInt64 offsetNs);
+  void stepClock(SInt64 offsetNs);
+  void slewClock(SInt64 offsetNs);
+  void updateStatistics();
+
+protected:
+  void handleNegotiation(UInt32 version) APPLE_KEXT_OVERRIDE;
+
+public:
+  //
+  // IOService overrides.
+  //
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+};
+
+#endif
@@ -0,0 +1,400 @@
+//
+//  HyperVVSS.cpp
+//  Hyper-V VSS driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVVSS.hpp"
+
+#define super HyperVICService
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVVSS", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVVSS", str, ## __VA_ARGS__)
+
+OSDefineMetaClassAndStructors(HyperVVSS, super);
+
+//
+// Supported message versions, most preferred first.
+//
+static const UInt32 vssVersions[] = {
+  kHyperVVSSVersionV5,
+  kHyperVVSSVersionV4,
+  kHyperVVSSVersionV3
+};
+
+const HyperVICMessageHandler HyperVVSS::messageHandlers[] = {
+  { kVMBusICMessageTypeVSS, (HyperVICMessageAction) &HyperVVSS::handleVSS }
+};
+
+static inline UInt64 getElapsedMicroseconds(UInt64 startTime, UInt64 endTime) {
+  UInt64 elapsedNS;
+  absolutetime_to_nanoseconds(endTime - startTime, &elapsedNS);
+  return elapsedNS / 1000;
+}
+
+bool HyperVVSS::start(IOService *provider) {
+  DBGLOG("Initializing Hyper-V VSS");
+
+  //
+  // Request state must exist before the channel is opened.
+  //
+  vssLock = IOLockAlloc();
+  if (vssLock == NULL) {
+    SYSLOG("Failed to allocate VSS lock");
+    return false;
+  }
+  pendingOperation = kHyperVVSSOperationNone;
+
+  setMessageHandlers(vssVersions, ARRAY_SIZE(vssVersions), messageHandlers, ARRAY_SIZE(messageHandlers));
+  if (!super::start(provider)) {
+    return false;
+  }
+
+  timerSource = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &HyperVVSS::handleTimer));
+  if (timerSource == NULL) {
+    SYSLOG("Failed to create VSS timer event source");
+    super::stop(provider);
+    return false;
+  }
+  getWorkLoop()->addEventSource(timerSource);
+  timerSource->enable();
+
+  //
+  // Allow the userspace helper to find this service.
+  //
+  updateStatistics();
+  registerService();
+
+  SYSLOG("Initialized Hyper-V VSS");
+  return true;
+}
+
+void HyperVVSS::stop(IOService *provider) {
+  DBGLOG("Hyper-V VSS is stopping");
+
+  //
+  // Release any helper waiting for a request.
+  //
+  IOLockLock(vssLock);
+  isStopping       = true;
+  pendingOperation = kHyperVVSSOperationNone;
+  IOLockWakeup(vssLock, &requestId, false);
+  IOLockUnlock(vssLock);
+
+  if (timerSource != NULL) {
+    timerSource->cancelTimeout();
+    timerSource->disable();
+    getWorkLoop()->removeEventSource(timerSource);
+    OSSafeReleaseNULL(timerSource);
+  }
+
+  super::stop(provider);
+}
+
+void HyperVVSS::free() {
+  //
+  // Helper threads may still reference the lock until the user client releases this service.
+  //
+  if (vssLock != NULL) {
+    IOLockFree(vssLock);
+    vssLock = NULL;
+  }
+
+  super::free();
+}
+
+bool HyperVVSS::handleVSS(HyperVVSS *target, VMBusICMessageVSS *vssMsg, UInt32 msgLength) {
+  if (msgLength < sizeof (vssMsg->vss) || msgLength > sizeof (target->pendingMsg)) {
+    DBGLOG("Invalid VSS message size %u", msgLength);
+    vssMsg->header.status = kHyperVStatusFail;
+    return true;
+  }
+
+  switch (vssMsg->vss.operation) {
+    case kVMBusICVSSOperationFreeze:
+    case kVMBusICVSSOperationThaw:
+      bool isDeferred;
+      isDeferred = false;
+
+      //
+      // Freeze and thaw are answered once the helper completes them.
+      // A thaw may arrive while an automatic thaw is in progress, it is answered when that completes.
+      //
+      IOLockLock(target->vssLock);
+      if (vssMsg->vss.operation == kVMBusICVSSOperationThaw
+          && target->pendingOperation == kHyperVVSSOperationThaw && target->pendingMsgLength == 0) {
+        memcpy(target->pendingMsg, vssMsg, msgLength);
+        target->pendingMsgLength = msgLength;
+        isDeferred = true;
+      } else if (target->pendingOperation == kHyperVVSSOperationNone) {
+        isDeferred = target->queueRequestLocked(vssMsg->vss.operation == kVMBusICVSSOperationFreeze ? kHyperVVSSOperationFreeze : kHyperVVSSOperationThaw,
+                                                vssMsg, msgLength);
+      }
+      IOLockUnlock(target->vssLock);
+
+      if (isDeferred) {
+        return false;
+      }
+      SYSLOG("Unable to handle %s request, helper is %s", vssMsg->vss.operation == kVMBusICVSSOperationFreeze ? "freeze" : "thaw",
+             target->isHelperConnected ? "busy" : "not running");
+      vssMsg->header.status = kHyperVStatusFail;
+      break;
+
+    case kVMBusICVSSOperationHotBackup:
+      vssMsg->vss.flags     = kVMBusICVSSFlagNoAutoRecovery;
+      vssMsg->header.status = target->isHelperConnected ? kHyperVStatusSuccess : kHyperVStatusFail;
+      break;
+
+    case kVMBusICVSSOperationGetDMInfo:
+      vssMsg->vss.flags     = 0;
+      vssMsg->header.status = kHyperVStatusSuccess;
+      break;
+
+    default:
+      DBGLOG("Unsupported VSS operation %u", vssMsg->vss.operation);
+      vssMsg->header.status = kHyperVStatusFail;
+      break;
+  }
+  return true;
+}
+
+bool HyperVVSS::queueRequestLocked(UInt32 operation, void *msg, UInt32 msgLength) {
+  if (!isHelperConnected || isStopping) {
+    return false;
+  }
+
+  if (msg != NULL) {
+    memcpy(pendingMsg, msg, msgLength);
+  }
+  pendingMsgLength = msg != NULL ? msgLength : 0;
+  pendingOperation = operation;
+  requestId++;
+  clock_get_uptime(&requestTime);
+
+  timerSource->setTimeoutMS(kHyperVVSSHelperTimeoutMS);
+  IOLockWakeup(vssLock, &requestId, false);
+
+  DBGLOG("Queued %s request %llu", operation == kHyperVVSSOperationFreeze ? "freeze" : "thaw", requestId);
+  return true;
+}
+
+void HyperVVSS::respondPendingLocked(UInt32 status) {
+  if (pendingMsgLength == 0) {
+    return;
+  }
+
+  VMBusICMessageVSS *vssMsg = (VMBusICMessageVSS *)pendingMsg;
+  vssMsg->header.status = status;
+  sendResponse(&vssMsg->header, pendingMsgLength);
+  pendingMsgLength = 0;
+}
+
+void HyperVVSS::handleTimer(IOTimerEventSource *sender) {
+  IOLockLock(vssLock);
+  if (pendingOperation != kHyperVVSSOperationNone) {
+    //
+    // Helper did not respond in time, fail the request.
+    // Volumes may have been frozen after the timeout, so a failed freeze is always followed by a thaw.
+    //
+    UInt32 operation = pendingOperation;
+    SYSLOG("Helper timed out on %s request %llu", operation == kHyperVVSSOperationFreeze ? "freeze" : "thaw", requestId);
+
+    timeoutCount++;
+    pendingOperation = kHyperVVSSOperationNone;
+    respondPendingLocked(kHyperVStatusFail);
+
+    if (operation == kHyperVVSSOperationFreeze) {
+      queueRequestLocked(kHyperVVSSOperationThaw, NULL, 0);
+    } else {
+      isFrozen = false;
+    }
+  } else if (isFrozen) {
+    SYSLOG("Volumes frozen for over %u ms without a thaw request, thawing", kHyperVVSSMaxFreezeMS);
+    if (!queueRequestLocked(kHyperVVSSOperationThaw, NULL, 0)) {
+      SYSLOG("No helper is connected to thaw volumes");
+    }
+  }
+  IOLockUnlock(vssLock);
+
+  updateStatistics();
+}
+
+IOReturn HyperVVSS::completeRequestGated(UInt64 *completedRequestId, UInt32 *completedStatus) {
+  UInt64 currentTime;
+  clock_get_uptime(&currentTime);
+
+  IOLockLock(vssLock);
+  if (pendingOperation == kHyperVVSSOperationNone || *completedRequestId != requestId || deliveredRequestId != requestId) {
+    IOLockUnlock(vssLock);
+    DBGLOG("Ignoring completion of stale request %llu", *completedRequestId);
+    return kIOReturnNotFound;
+  }
+
+  UInt32 operation = pendingOperation;
+  pendingOperation = kHyperVVSSOperationNone;
+  timerSource->cancelTimeout();
+
+  if (operation == kHyperVVSSOperationFreeze) {
+    lastFreezeRequestUS = getElapsedMicroseconds(requestTime, currentTime);
+    if (*completedStatus == 0) {
+      //
+      // Volumes are thawed automatically if Hyper-V never sends a thaw.
+      //
+      isFrozen   = true;
+      frozenTime = currentTime;
+      freezeCount++;
+      timerSource->setTimeoutMS(kHyperVVSSMaxFreezeMS);
+    }
+    DBGLOG("Freeze completed with status %u in %llu us", *completedStatus, lastFreezeRequestUS);
+  } else {
+    if (isFrozen) {
+      lastFreezeWindowUS = getElapsedMicroseconds(frozenTime, currentTime);
+      if (lastFreezeWindowUS > maxFreezeWindowUS) {
+        maxFreezeWindowUS = lastFreezeWindowUS;
+      }
+      SYSLOG("Volumes were frozen for %llu us", lastFreezeWindowUS);
+    }
+    isFrozen = false;
+    thawCount++;
+  }
+  respondPendingLocked(*completedStatus == 0 ? kHyperVStatusSuccess : kHyperVStatusFail);
+  IOLockUnlock(vssLock);
+
+  updateStatistics();
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVSS::disconnectHelperGated() {
+  IOLockLock(vssLock);
+  isHelperConnected = false;
+
+  //
+  // Nothing can complete an outstanding request without the helper.
+  // A freeze may have partially completed, so volumes are treated as frozen.
+  //
+  if (pendingOperation != kHyperVVSSOperationNone) {
+    SYSLOG("Helper exited with a request outstanding");
+    if (pendingOperation == kHyperVVSSOperationFreeze && !isFrozen) {
+      isFrozen   = true;
+      clock_get_uptime(&frozenTime);
+    }
+    pendingOperation = kHyperVVSSOperationNone;
+    respondPendingLocked(kHyperVStatusFail);
+  }
+  
+  //
+  // Volumes stay frozen until a helper thaws them, the next helper to connect is sent a thaw right away.
+  //
+  if (timerSource != NULL) {
+    timerSource->cancelTimeout();
+  }
+  if (isFrozen) {
+    SYSLOG("Helper exited with volumes frozen, they will be thawed once a helper connects");
+  }
+  IOLockWakeup(vssLock, &requestId, false);
+  IOLockUnlock(vssLock);
+
+  updateStatistics();
+  return kIOReturnSuccess;
+}
+
+void HyperVVSS::updateStatistics() {
+  OSDictionary *stats = OSDictionary::withCapacity(7);
+  if (stats == NULL) {
+    return;
+  }
+
+  const struct {
+    const char  *key;
+    UInt64      value;
+  } values[] = {
+    { "HelperConnected",      isHelperConnected ? 1 : 0 },
+    { "FreezeCount",          freezeCount },
+    { "ThawCount",            thawCount },
+    { "TimeoutCount",         timeoutCount },
+    { "LastFreezeRequestUS",  lastFreezeRequestUS },
+    { "LastFreezeWindowUS",   lastFreezeWindowUS },
+    { "MaxFreezeWindowUS",    maxFreezeWindowUS }
+  };
+  for (UInt32 i = 0; i < ARRAY_SIZE(values); i++) {
+    OSNumber *number = OSNumber::withNumber(values[i].value, 64);
+    if (number != NULL) {
+      stats->setObject(values[i].key, number);
+      number->release();
+    }
+  }
+
+  setProperty(kHyperVVSSStatisticsKey, stats);
+  stats->release();
+}
+
+bool HyperVVSS::connectHelper() {
+  bool result;
+
+  IOLockLock(vssLock);
+  result = !isHelperConnected && !isStopping;
+  if (result) {
+    isHelperConnected  = true;
+    deliveredRequestId = requestId;
+    
+    //
+    // A previous helper exited with volumes frozen, have this one thaw them.
+    //
+    if (isFrozen && pendingOperation == kHyperVVSSOperationNone) {
+      SYSLOG("Volumes are still frozen, requesting thaw from new helper");
+      queueRequestLocked(kHyperVVSSOperationThaw, NULL, 0);
+    }
+  }
+  IOLockUnlock(vssLock);
+
+  if (result) {
+    SYSLOG("VSS helper connected");
+    updateStatistics();
+  }
+  return result;
+}
+
+void HyperVVSS::disconnectHelper() {
+  SYSLOG("VSS helper disconnected");
+
+  IOWorkLoop *workLoop = getWorkLoop();
+  if (workLoop != NULL) {
+    workLoop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &HyperVVSS::disconnectHelperGated), this);
+  } else {
+    IOLockLock(vssLock);
+    isHelperConnected = false;
+    IOLockWakeup(vssLock, &requestId, false);
+    IOLockUnlock(vssLock);
+  }
+}
+
+IOReturn HyperVVSS::waitRequest(UInt64 *waitRequestId, UInt32 *operation) {
+  IOLockLock(vssLock);
+  while (!isStopping && isHelperConnected && (pendingOperation == kHyperVVSSOperationNone || deliveredRequestId == requestId)) {
+    if (IOLockSleep(vssLock, &requestId, THREAD_ABORTSAFE) != THREAD_AWAKENED) {
+      IOLockUnlock(vssLock);
+      return kIOReturnAborted;
+    }
+  }
+
+  if (isStopping || !isHelperConnected) {
+    IOLockUnlock(vssLock);
+    return kIOReturnOffline;
+  }
+
+  deliveredRequestId = requestId;
+  *waitRequestId     = requestId;
+  *operation         = pendingOperation;
+  IOLockUnlock(vssLock);
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVSS::completeRequest(UInt64 completedRequestId, UInt32 status) {
+  IOWorkLoop *workLoop = getWorkLoop();
+  if (workLoop == NULL) {
+    return kIOReturnOffline;
+  }
+  return workLoop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &HyperVVSS::completeRequestGated),
+                             this, &completedRequestId, &status);
+}
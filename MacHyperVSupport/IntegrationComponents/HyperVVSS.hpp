@@ -0,0 +1,86 @@
+//
+//  HyperVVSS.hpp
+//  Hyper-V VSS driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVVSS_hpp
+#define HyperVVSS_hpp
+
+#include <IOKit/IOTimerEventSource.h>
+
+#include "HyperVICService.hpp"
+#include "HyperVVSSShared.h"
+
+//
+// Negotiation messages may list more versions than fit in a VSS message.
+//
+#define kHyperVVSSMessageMaxSize    128
+
+#define kHyperVVSSVersionV3         3
+#define kHyperVVSSVersionV4         4
+#define kHyperVVSSVersionV5         5
+
+#define kHyperVVSSStatisticsKey     "VSSStatistics"
+
+class HyperVVSS : public HyperVICService {
+  OSDeclareDefaultStructors(HyperVVSS);
+
+private:
+  static const HyperVICMessageHandler messageHandlers[];
+
+  IOLock              *vssLock;
+  IOTimerEventSource  *timerSource;
+  bool                isHelperConnected;
+  bool                isStopping;
+
+  //
+  // Request being handled by the helper.
+  // Internal thaw requests have no host message to respond to.
+  //
+  UInt8               pendingMsg[kHyperVVSSMessageMaxSize];
+  UInt32              pendingMsgLength;
+  UInt32              pendingOperation;
+  UInt64              requestId;
+  UInt64              deliveredRequestId;
+  UInt64              requestTime;
+
+  //
+  // Freeze state and statistics, times are in microseconds.
+  //
+  bool                isFrozen;
+  UInt64              frozenTime;
+  UInt64              freezeCount;
+  UInt64              thawCount;
+  UInt64              timeoutCount;
+  UInt64              lastFreezeRequestUS;
+  UInt64              lastFreezeWindowUS;
+  UInt64              maxFreezeWindowUS;
+
+  static bool handleVSS(HyperVVSS *target, VMBusICMessageVSS *vssMsg, UInt32 msgLength);
+  void handleTimer(IOTimerEventSource *sender);
+  bool queueRequestLocked(UInt32 operation, void *msg, UInt32 msgLength);
+  void respondPendingLocked(UInt32 status);
+  IOReturn completeRequestGated(UInt64 *completedRequestId, UInt32 *completedStatus);
+  IOReturn disconnectHelperGated();
+  void updateStatistics();
+
+public:
+  //
+  // IOService overrides.
+  //
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void free() APPLE_KEXT_OVERRIDE;
+
+  //
+  // Helper interface.
+  //
+  bool connectHelper();
+  void disconnectHelper();
+  IOReturn waitRequest(UInt64 *waitRequestId, UInt32 *operation);
+  IOReturn completeRequest(UInt64 completedRequestId, UInt32 status);
+};
+
+#endif
@@ -0,0 +1,51 @@
+//
+//  HyperVVSSShared.h
+//  Hyper-V VSS driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Definitions shared between the VSS driver and the userspace freeze helper.
+//
+
+#ifndef HyperVVSSShared_h
+#define HyperVVSSShared_h
+
+#include <stdint.h>
+
+//
+// Requests passed to the helper.
+//
+// Freeze: sync all mounted volumes, then freeze them (F_FREEZE_FS).
+//   Syncing first keeps the frozen window short, as little data is left to flush once frozen.
+//   If the freeze fails, the helper must thaw any volumes it already froze before completing the request.
+// Thaw: thaw all volumes frozen by the previous freeze request (F_THAW_FS).
+//   A helper that exits with volumes frozen is replaced by a new one, which is sent a thaw as soon as it connects.
+//   Such a helper does not know which volumes were frozen and must try all of them.
+//
+// The helper must complete each request within kHyperVVSSHelperTimeoutMS, or it is failed back to Hyper-V.
+// A freeze that times out is followed by a thaw request, and volumes frozen for longer than
+// kHyperVVSSMaxFreezeMS are thawed even if Hyper-V has not requested it.
+//
+enum {
+  kHyperVVSSOperationNone     = 0,
+  kHyperVVSSOperationFreeze   = 1,
+  kHyperVVSSOperationThaw     = 2
+};
+
+#define kHyperVVSSHelperTimeoutMS   10000
+#define kHyperVVSSMaxFreezeMS       60000
+
+//
+// External methods.
+//
+// WaitRequest: blocks until a request is available.
+//   Scalar output 0 is the request ID, scalar output 1 is the operation.
+// CompleteRequest: scalar input 0 is the request ID, scalar input 1 is 0 on success or an errno value.
+//
+enum {
+  kHyperVVSSUserClientMethodWaitRequest     = 0,
+  kHyperVVSSUserClientMethodCompleteRequest = 1,
+  kHyperVVSSUserClientMethodCount
+};
+
+#endif
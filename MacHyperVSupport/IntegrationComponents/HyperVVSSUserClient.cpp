@@ -0,0 +1,119 @@
+//
+//  HyperVVSSUserClient.cpp
+//  Hyper-V VSS driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVVSSUserClient.hpp"
+
+#define super IOUserClient
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVVSSUserClient", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVVSSUserClient", str, ## __VA_ARGS__)
+
+OSDefineMetaClassAndStructors(HyperVVSSUserClient, super);
+
+const IOExternalMethodDispatch HyperVVSSUserClient::methods[kHyperVVSSUserClientMethodCount] = {
+  { // kHyperVVSSUserClientMethodWaitRequest
+    (IOExternalMethodAction) &HyperVVSSUserClient::methodWaitRequest,
+    0, 0, 2, 0
+  },
+  { // kHyperVVSSUserClientMethodCompleteRequest
+    (IOExternalMethodAction) &HyperVVSSUserClient::methodCompleteRequest,
+    2, 0, 0, 0
+  }
+};
+
+bool HyperVVSSUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
+  if (!super::initWithTask(owningTask, securityToken, type, properties)) {
+    return false;
+  }
+
+  //
+  // Freezing volumes requires root, only allow administrators to act as the helper.
+  //
+  if (clientHasPrivilege(securityToken, kIOClientPrivilegeAdministrator) != kIOReturnSuccess) {
+    DBGLOG("Client is not an administrator");
+    return false;
+  }
+  return true;
+}
+
+bool HyperVVSSUserClient::start(IOService *provider) {
+  hvVSS = OSDynamicCast(HyperVVSS, provider);
+  if (hvVSS == NULL) {
+    return false;
+  }
+
+  if (!super::start(provider)) {
+    return false;
+  }
+  hvVSS->retain();
+
+  isHelperConnected = hvVSS->connectHelper();
+  if (!isHelperConnected) {
+    SYSLOG("Another VSS helper is already connected");
+    OSSafeReleaseNULL(hvVSS);
+    super::stop(provider);
+    return false;
+  }
+
+  DBGLOG("VSS user client started");
+  return true;
+}
+
+void HyperVVSSUserClient::stop(IOService *provider) {
+  DBGLOG("VSS user client stopping");
+  if (hvVSS != NULL) {
+    if (isHelperConnected) {
+      hvVSS->disconnectHelper();
+      isHelperConnected = false;
+    }
+    OSSafeReleaseNULL(hvVSS);
+  }
+  super::stop(provider);
+}
+
+IOReturn HyperVVSSUserClient::clientClose() {
+  terminate();
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVSSUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch,
+                                             OSObject *target, void *reference) {
+  if (selector >= kHyperVVSSUserClientMethodCount) {
+    return kIOReturnUnsupported;
+  }
+  return super::externalMethod(selector, arguments, (IOExternalMethodDispatch *) &methods[selector], this, reference);
+}
+
+IOReturn HyperVVSSUserClient::methodWaitRequest(HyperVVSSUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  UInt64 requestId;
+  UInt32 operation;
+
+  HyperVVSS *hvVSS = target->hvVSS;
+  if (hvVSS == NULL) {
+    return kIOReturnNotAttached;
+  }
+
+  //
+  // Keep the service alive while blocked, the client may be stopped during the wait.
+  //
+  hvVSS->retain();
+  IOReturn status = hvVSS->waitRequest(&requestId, &operation);
+  hvVSS->release();
+  if (status == kIOReturnSuccess) {
+    args->scalarOutput[0] = requestId;
+    args->scalarOutput[1] = operation;
+  }
+  return status;
+}
+
+IOReturn HyperVVSSUserClient::methodCompleteRequest(HyperVVSSUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  HyperVVSS *hvVSS = target->hvVSS;
+  if (hvVSS == NULL) {
+    return kIOReturnNotAttached;
+  }
+  return hvVSS->completeRequest(args->scalarInput[0], (UInt32) args->scalarInput[1]);
+}
@@ -0,0 +1,42 @@
+//
+//  HyperVVSSUserClient.hpp
+//  Hyper-V VSS driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVVSSUserClient_hpp
+#define HyperVVSSUserClient_hpp
+
+#include <IOKit/IOUserClient.h>
+
+#include "HyperVVSS.hpp"
+
+//
+// Userspace freeze helper interface, only one helper can be connected at a time.
+//
+class HyperVVSSUserClient : public IOUserClient {
+  OSDeclareDefaultStructors(HyperVVSSUserClient);
+
+private:
+  HyperVVSS *hvVSS;
+  bool      isHelperConnected;
+
+  static const IOExternalMethodDispatch methods[kHyperVVSSUserClientMethodCount];
+
+  static IOReturn methodWaitRequest(HyperVVSSUserClient *target, void *ref, IOExternalMethodArguments *args);
+  static IOReturn methodCompleteRequest(HyperVVSSUserClient *target, void *ref, IOExternalMethodArguments *args);
+
+public:
+  //
+  // IOUserClient overrides.
+  //
+  virtual bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) APPLE_KEXT_OVERRIDE;
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual IOReturn clientClose() APPLE_KEXT_OVERRIDE;
+  virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch,
+                                  OSObject *target, void *reference) APPLE_KEXT_OVERRIDE;
+};
+
+#endif
@@ -108,12 +108,17 @@ void HyperVKeyboard::handleInterrupt(OSObject *owner, IOInterruptEventSource *se
           DBGLOG("Keyboard protocol status %u %u", message->protocolResponse.header.type, message->protocolResponse.status);
           break;
 
-        case kHyperVKeyboardMessageTypeEvent:
+        case kHyperVKeyboardMessageTypeEvent: {
           UInt64 time;
           clock_get_uptime(&time);
           
           dispatchKeyboardEvent(getKeyCode(&message->keystroke), !message->keystroke.isBreak, *(AbsoluteTime*)&time);
+          
+          UInt64 dispatchTime;
+          clock_get_uptime(&dispatchTime);
+          inputStatistics.recordEvent(time, dispatchTime);
           break;
+        }
 
         default:
           DBGLOG("Unknown message type %u, size %u", message->header.type, pktDataLength);
@@ -128,6 +133,10 @@ void HyperVKeyboard::handleInterrupt(OSObject *owner, IOInterruptEventSource *se
       IOFree(message, pktDataLength);
     }
   } while (true);
+
+  UInt64 currentTime;
+  clock_get_uptime(&currentTime);
+  inputStatistics.publishIfNeeded(this, currentTime);
 }
 
 const unsigned char * HyperVKeyboard::defaultKeymapOfLength(UInt32 * length)
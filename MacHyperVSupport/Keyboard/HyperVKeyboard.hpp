@@ -13,6 +13,7 @@
 
 #include "HyperVVMBusDevice.hpp"
 #include "HyperVKeyboardRegs.hpp"
+#include "HyperVInputStatistics.hpp"
 
 #define super IOHIKeyboard
 
@@ -25,6 +26,7 @@ class HyperVKeyboard : public IOHIKeyboard {
 private:
   HyperVVMBusDevice       *hvDevice;
   IOInterruptEventSource  *interruptSource;
+  HyperVInputStatistics   inputStatistics;
   
   void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
   bool connectKeyboard();
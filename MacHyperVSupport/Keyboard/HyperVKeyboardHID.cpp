@@ -0,0 +1,331 @@
+//
+//  HyperVKeyboardHID.cpp
+//  Hyper-V keyboard driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVKeyboardHID.hpp"
+#include "HyperVKeyboardHIDMap.hpp"
+
+#include <IOKit/IOPlatformExpert.h>
+
+OSDefineMetaClassAndStructors(HyperVKeyboardHID, super);
+
+IOService *HyperVKeyboardHID::probe(IOService *provider, SInt32 *score) {
+  //
+  // Allow the legacy keyboard driver to match instead if requested.
+  //
+  char legacyArg[16];
+  if (PE_parse_boot_argn(kHyperVKeyboardLegacyBootArg, legacyArg, sizeof (legacyArg))) {
+    return NULL;
+  }
+  return super::probe(provider, score);
+}
+
+bool HyperVKeyboardHID::handleStart(IOService *provider) {
+  if (!super::handleStart(provider)) {
+    return false;
+  }
+
+  DBGLOG("Initializing Hyper-V Synthetic Keyboard (HID)");
+
+  //
+  // Get parent VMBus device object.
+  //
+  hvDevice = OSDynamicCast(HyperVVMBusDevice, provider);
+  if (hvDevice == NULL) {
+    return false;
+  }
+  hvDevice->retain();
+
+  //
+  // Allocate descriptor reused for every input report.
+  //
+  memset(keyState, 0, sizeof (keyState));
+  memset(keysChanged, 0, sizeof (keysChanged));
+  isReportPending = false;
+  isE1Pending     = false;
+  reportDescriptor = IOBufferMemoryDescriptor::withCapacity(kHyperVKeyboardHIDReportSize, kIODirectionNone);
+  if (reportDescriptor == NULL) {
+    SYSLOG("Failed to allocate input report descriptor");
+    return false;
+  }
+
+  //
+  // Configure interrupt.
+  //
+  interruptSource =
+    IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &HyperVKeyboardHID::handleInterrupt), provider, 0);
+  if (interruptSource == NULL) {
+    SYSLOG("Failed to create interrupt event source");
+    return false;
+  }
+  getWorkLoop()->addEventSource(interruptSource);
+  interruptSource->enable();
+
+  //
+  // Configure the channel.
+  //
+  if (!hvDevice->openChannel(kHyperVKeyboardRingBufferSize, kHyperVKeyboardRingBufferSize)) {
+    return false;
+  }
+
+  connectKeyboard();
+
+  SYSLOG("Initialized Hyper-V Synthetic Keyboard (HID)");
+  return true;
+}
+
+void HyperVKeyboardHID::handleStop(IOService *provider) {
+  DBGLOG("Hyper-V Keyboard is stopping");
+
+  if (interruptSource != NULL) {
+    interruptSource->disable();
+    getWorkLoop()->removeEventSource(interruptSource);
+    OSSafeReleaseNULL(interruptSource);
+  }
+
+  //
+  // Close channel.
+  //
+  if (hvDevice != NULL) {
+    hvDevice->closeChannel();
+    OSSafeReleaseNULL(hvDevice);
+  }
+  OSSafeReleaseNULL(reportDescriptor);
+
+  super::handleStop(provider);
+}
+
+bool HyperVKeyboardHID::connectKeyboard() {
+  DBGLOG("Connecting to keyboard interface");
+
+  HyperVKeyboardMessageProtocolRequest requestMsg;
+  requestMsg.header.type = kHyperVKeyboardMessageTypeProtocolRequest;
+  requestMsg.versionRequested = kHyperVKeyboardVersion;
+
+  return hvDevice->writeInbandPacket(&requestMsg, sizeof (requestMsg), true) == kIOReturnSuccess;
+}
+
+void HyperVKeyboardHID::handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count) {
+  UInt8 data128[128];
+
+  //
+  // All keystrokes read in this pass share one timestamp.
+  //
+  UInt64 timestamp;
+  clock_get_uptime(&timestamp);
+
+  do {
+    //
+    // Check for available inband packets.
+    // Large packets will be allocated as needed.
+    //
+    HyperVKeyboardMessage *message;
+    UInt32 pktDataLength;
+    if (!hvDevice->nextInbandPacketAvailable(&pktDataLength)) {
+      break;
+    }
+
+    if (pktDataLength <= sizeof (data128)) {
+      message = (HyperVKeyboardMessage*)data128;
+    } else {
+      DBGLOG("Allocating large packet of %u bytes", pktDataLength);
+      message = (HyperVKeyboardMessage*)IOMalloc(pktDataLength);
+      if (message == NULL) {
+        SYSLOG("Failed to allocate large packet of %u bytes", pktDataLength);
+        break;
+      }
+    }
+
+    //
+    // Read next packet.
+    //
+    if (hvDevice->readInbandCompletionPacket((void *)message, pktDataLength, NULL) == kIOReturnSuccess) {
+      switch (message->header.type) {
+        case kHyperVKeyboardMessageTypeProtocolResponse:
+          DBGLOG("Keyboard protocol status %u %u", message->protocolResponse.header.type, message->protocolResponse.status);
+          break;
+
+        case kHyperVKeyboardMessageTypeEvent: {
+          UInt64 receiveTime;
+          clock_get_uptime(&receiveTime);
+          handleKeystroke(&message->keystroke, timestamp, receiveTime);
+          break;
+        }
+
+        default:
+          DBGLOG("Unknown message type %u, size %u", message->header.type, pktDataLength);
+          break;
+      }
+    }
+
+    //
+    // Free allocated packet if needed.
+    //
+    if (pktDataLength > sizeof (data128)) {
+      IOFree(message, pktDataLength);
+    }
+  } while (true);
+
+  //
+  // Send all keystrokes from this pass in one report.
+  //
+  sendReport(timestamp);
+
+  UInt64 currentTime;
+  clock_get_uptime(&currentTime);
+  inputStatistics.publishIfNeeded(this, currentTime);
+}
+
+void HyperVKeyboardHID::handleKeystroke(HyperVKeyboardMessageKeystroke *keystroke, UInt64 timestamp, UInt64 receiveTime) {
+  if (keystroke->isUnicode) {
+    handleUnicodeKeystroke(keystroke, timestamp, receiveTime);
+    return;
+  }
+
+  //
+  // Pause is sent as E1 1D 45, the trailing scancode is not a separate key.
+  // Pause has no break code on PS/2, so it is typed as a full key press on its make event.
+  //
+  bool isPauseTrail = isE1Pending && keystroke->makeCode == kHyperVKeyboardE1PauseTrailScancode;
+  isE1Pending = false;
+  if (keystroke->isE1) {
+    if (keystroke->makeCode == kHyperVKeyboardE1PauseScancode) {
+      isE1Pending = true;
+      if (!keystroke->isBreak) {
+        updateKey(kHyperVKeyboardUsagePause, true, timestamp, receiveTime);
+        updateKey(kHyperVKeyboardUsagePause, false, timestamp, receiveTime);
+      }
+    } else if (keystroke->makeCode != kHyperVKeyboardE1PauseTrailScancode) {
+      SYSLOG("Dropping unknown E1 prefixed scancode 0x%X", keystroke->makeCode);
+    }
+    return;
+  }
+  if (isPauseTrail) {
+    return;
+  }
+
+  if (keystroke->makeCode >= kHyperVKeyboardScancodeCount) {
+    DBGLOG("Ignoring keystroke 0x%X", keystroke->makeCode);
+    return;
+  }
+  UInt8 usage = HyperVKeyboardUsages.usages[keystroke->makeCode + (keystroke->isE0 ? kHyperVKeyboardScancodeCount : 0)];
+  if (usage == kHyperVKeyboardUsageNone) {
+    DBGLOG("Unmapped scancode 0x%X (E0 %u)", keystroke->makeCode, keystroke->isE0);
+    return;
+  }
+  updateKey(usage, !keystroke->isBreak, timestamp, receiveTime);
+}
+
+void HyperVKeyboardHID::handleUnicodeKeystroke(HyperVKeyboardMessageKeystroke *keystroke, UInt64 timestamp, UInt64 receiveTime) {
+  //
+  // Each character is typed as a full key press on its make event.
+  //
+  if (keystroke->isBreak) {
+    return;
+  }
+
+  UInt16 character = keystroke->makeCode;
+  if (character >= kHyperVKeyboardCharacterCount || HyperVKeyboardUsages.characterUsages[character] == kHyperVKeyboardUsageNone) {
+    SYSLOG("Dropping Unicode character U+%04X, it has no key on the US layout", character);
+    return;
+  }
+  UInt8 usage     = HyperVKeyboardUsages.characterUsages[character];
+  bool  isShifted = HyperVKeyboardUsages.isCharacterShifted[character];
+
+  //
+  // Shift is only pressed and released if not already held.
+  //
+  bool pressShift = isShifted && !isKeyPressed(kHyperVKeyboardUsageLeftShift);
+  if (pressShift) {
+    updateKey(kHyperVKeyboardUsageLeftShift, true, timestamp, receiveTime);
+  }
+  updateKey(usage, true, timestamp, receiveTime);
+  updateKey(usage, false, timestamp, receiveTime);
+  if (pressShift) {
+    updateKey(kHyperVKeyboardUsageLeftShift, false, timestamp, receiveTime);
+  }
+}
+
+bool HyperVKeyboardHID::isKeyPressed(UInt8 usage) {
+  return (keyState[usage / 8] & (1 << (usage % 8))) != 0;
+}
+
+void HyperVKeyboardHID::updateKey(UInt8 usage, bool isPressed, UInt64 timestamp, UInt64 receiveTime) {
+  UInt32 byteIndex = usage / 8;
+  UInt8  bitMask   = 1 << (usage % 8);
+  if (isKeyPressed(usage) == isPressed) {
+    return;
+  }
+
+  //
+  // A key changing twice needs its intermediate state sent, otherwise quick presses would be lost.
+  //
+  if (keysChanged[byteIndex] & bitMask) {
+    sendReport(timestamp);
+  }
+
+  //
+  // Latency of a batched report is measured from its first keystroke.
+  //
+  if (!isReportPending) {
+    pendingReportTime = receiveTime;
+  }
+  keyState[byteIndex]    ^= bitMask;
+  keysChanged[byteIndex] |= bitMask;
+  isReportPending         = true;
+}
+
+void HyperVKeyboardHID::sendReport(UInt64 timestamp) {
+  if (!isReportPending) {
+    return;
+  }
+
+  memcpy(reportDescriptor->getBytesNoCopy(), keyState, sizeof (keyState));
+  reportDescriptor->setLength(sizeof (keyState));
+  handleReportWithTime(*(AbsoluteTime *)&timestamp, reportDescriptor);
+
+  memset(keysChanged, 0, sizeof (keysChanged));
+  isReportPending = false;
+
+  UInt64 dispatchTime;
+  clock_get_uptime(&dispatchTime);
+  inputStatistics.recordEvent(pendingReportTime, dispatchTime);
+}
+
+OSString* HyperVKeyboardHID::newTransportString() const {
+  return OSString::withCStringNoCopy("VMBus");
+}
+
+OSString* HyperVKeyboardHID::newManufacturerString() const {
+  return OSString::withCStringNoCopy("Microsoft");
+}
+
+OSString* HyperVKeyboardHID::newProductString() const {
+  return OSString::withCStringNoCopy("Hyper-V Keyboard");
+}
+
+OSNumber* HyperVKeyboardHID::newVendorIDNumber() const {
+  return OSNumber::withNumber(kHyperVKeyboardHIDVendorID, 16);
+}
+
+IOReturn HyperVKeyboardHID::newReportDescriptor(IOMemoryDescriptor **descriptor) const {
+  IOBufferMemoryDescriptor *bufferDesc = IOBufferMemoryDescriptor::withBytes(HyperVKeyboardHIDReportDescriptor,
+                                                                             sizeof (HyperVKeyboardHIDReportDescriptor), kIODirectionNone);
+  if (bufferDesc == NULL) {
+    SYSLOG("Failed to allocate report descriptor buffer descriptor");
+    return kIOReturnNoResources;
+  }
+
+  *descriptor = bufferDesc;
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVKeyboardHID::setReport(IOMemoryDescriptor *report, IOHIDReportType reportType, IOOptionBits options) {
+  //
+  // LED state is not passed to Hyper-V.
+  //
+  return kIOReturnSuccess;
+}
@@ -0,0 +1,78 @@
+//
+//  HyperVKeyboardHID.hpp
+//  Hyper-V keyboard driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVKeyboardHID_hpp
+#define HyperVKeyboardHID_hpp
+
+#include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/hid/IOHIDDevice.h>
+
+#include "HyperVVMBusDevice.hpp"
+#include "HyperVKeyboardRegs.hpp"
+#include "HyperVInputStatistics.hpp"
+
+#define super IOHIDDevice
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVKeyboardHID", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVKeyboardHID", str, ## __VA_ARGS__)
+
+class HyperVKeyboardHID : public IOHIDDevice {
+  OSDeclareDefaultStructors(HyperVKeyboardHID);
+
+private:
+  //
+  // Parent VMBus device.
+  //
+  HyperVVMBusDevice       *hvDevice;
+  IOInterruptEventSource  *interruptSource;
+
+  //
+  // Current key state, and keys changed since the last report was sent.
+  //
+  UInt8                     keyState[kHyperVKeyboardHIDReportSize];
+  UInt8                     keysChanged[kHyperVKeyboardHIDReportSize];
+  bool                      isReportPending;
+  bool                      isE1Pending;
+  UInt64                    pendingReportTime;
+  HyperVInputStatistics     inputStatistics;
+  IOBufferMemoryDescriptor  *reportDescriptor;
+
+  void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
+  bool connectKeyboard();
+  void handleKeystroke(HyperVKeyboardMessageKeystroke *keystroke, UInt64 timestamp, UInt64 receiveTime);
+  void handleUnicodeKeystroke(HyperVKeyboardMessageKeystroke *keystroke, UInt64 timestamp, UInt64 receiveTime);
+  bool isKeyPressed(UInt8 usage);
+  void updateKey(UInt8 usage, bool isPressed, UInt64 timestamp, UInt64 receiveTime);
+  void sendReport(UInt64 timestamp);
+
+protected:
+  //
+  // IOHIDDevice overrides.
+  //
+  virtual bool handleStart(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void handleStop(IOService *provider) APPLE_KEXT_OVERRIDE;
+
+public:
+  //
+  // IOService overrides.
+  //
+  virtual IOService *probe(IOService *provider, SInt32 *score) APPLE_KEXT_OVERRIDE;
+
+  //
+  // IOHIDDevice overrides.
+  //
+  virtual OSString *newTransportString() const APPLE_KEXT_OVERRIDE;
+  virtual OSString *newManufacturerString() const APPLE_KEXT_OVERRIDE;
+  virtual OSString *newProductString() const APPLE_KEXT_OVERRIDE;
+  virtual OSNumber *newVendorIDNumber() const APPLE_KEXT_OVERRIDE;
+
+  virtual IOReturn newReportDescriptor(IOMemoryDescriptor **descriptor) const APPLE_KEXT_OVERRIDE;
+  virtual IOReturn setReport(IOMemoryDescriptor *report, IOHIDReportType reportType, IOOptionBits options) APPLE_KEXT_OVERRIDE;
+};
+
+#endif
@@ -0,0 +1,275 @@
+//
+//  HyperVKeyboardHIDMap.hpp
+//  Hyper-V keyboard driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVKeyboardHIDMap_hpp
+#define HyperVKeyboardHIDMap_hpp
+
+#define kHyperVKeyboardScancodeCount      256
+#define kHyperVKeyboardUsageTableLength   (kHyperVKeyboardScancodeCount * 2)  // 0x00~0xff : normal key , 0x100~0x1ff : E0 extended key
+#define kHyperVKeyboardUsageNone          0x00
+#define kHyperVKeyboardCharacterCount     128
+
+//
+// Pause is the only E1 prefixed key, sent as E1 1D 45.
+//
+#define kHyperVKeyboardE1PauseScancode      0x1D
+#define kHyperVKeyboardE1PauseTrailScancode 0x45
+#define kHyperVKeyboardUsagePause           0x48
+#define kHyperVKeyboardUsageLeftShift       0xE1
+
+typedef struct {
+  UInt8 scancode;
+  UInt8 usage;
+} HyperVKeyboardScancodeUsage;
+
+// PS/2 scancode reference : USB HID to PS/2 Scan Code Translation Table PS/2 Set 1 columns
+// http://download.microsoft.com/download/1/6/1/161ba512-40e2-4cc9-843a-923143f3456c/translate.pdf
+static constexpr HyperVKeyboardScancodeUsage HyperVKeyboardSet1Usages[] = {
+  { 0x01, 0x29 }, // Escape
+  { 0x02, 0x1E }, // 1!
+  { 0x03, 0x1F }, // 2@
+  { 0x04, 0x20 }, // 3#
+  { 0x05, 0x21 }, // 4$
+  { 0x06, 0x22 }, // 5%
+  { 0x07, 0x23 }, // 6^
+  { 0x08, 0x24 }, // 7&
+  { 0x09, 0x25 }, // 8*
+  { 0x0A, 0x26 }, // 9(
+  { 0x0B, 0x27 }, // 0)
+  { 0x0C, 0x2D }, // -_
+  { 0x0D, 0x2E }, // =+
+  { 0x0E, 0x2A }, // Backspace
+  { 0x0F, 0x2B }, // Tab
+  { 0x10, 0x14 }, // qQ
+  { 0x11, 0x1A }, // wW
+  { 0x12, 0x08 }, // eE
+  { 0x13, 0x15 }, // rR
+  { 0x14, 0x17 }, // tT
+  { 0x15, 0x1C }, // yY
+  { 0x16, 0x18 }, // uU
+  { 0x17, 0x0C }, // iI
+  { 0x18, 0x12 }, // oO
+  { 0x19, 0x13 }, // pP
+  { 0x1A, 0x2F }, // [{
+  { 0x1B, 0x30 }, // ]}
+  { 0x1C, 0x28 }, // Enter
+  { 0x1D, 0xE0 }, // Left Control
+  { 0x1E, 0x04 }, // aA
+  { 0x1F, 0x16 }, // sS
+  { 0x20, 0x07 }, // dD
+  { 0x21, 0x09 }, // fF
+  { 0x22, 0x0A }, // gG
+  { 0x23, 0x0B }, // hH
+  { 0x24, 0x0D }, // jJ
+  { 0x25, 0x0E }, // kK
+  { 0x26, 0x0F }, // lL
+  { 0x27, 0x33 }, // ;:
+  { 0x28, 0x34 }, // '"
+  { 0x29, 0x35 }, // `~
+  { 0x2A, 0xE1 }, // Left Shift
+  { 0x2B, 0x31 }, // \|
+  { 0x2C, 0x1D }, // zZ
+  { 0x2D, 0x1B }, // xX
+  { 0x2E, 0x06 }, // cC
+  { 0x2F, 0x19 }, // vV
+  { 0x30, 0x05 }, // bB
+  { 0x31, 0x11 }, // nN
+  { 0x32, 0x10 }, // mM
+  { 0x33, 0x36 }, // ,<
+  { 0x34, 0x37 }, // .>
+  { 0x35, 0x38 }, // /?
+  { 0x36, 0xE5 }, // Right Shift
+  { 0x37, 0x55 }, // Keypad *
+  { 0x38, 0xE2 }, // Left Alt
+  { 0x39, 0x2C }, // Space
+  { 0x3A, 0x39 }, // Caps Lock
+  { 0x3B, 0x3A }, // F1
+  { 0x3C, 0x3B }, // F2
+  { 0x3D, 0x3C }, // F3
+  { 0x3E, 0x3D }, // F4
+  { 0x3F, 0x3E }, // F5
+  { 0x40, 0x3F }, // F6
+  { 0x41, 0x40 }, // F7
+  { 0x42, 0x41 }, // F8
+  { 0x43, 0x42 }, // F9
+  { 0x44, 0x43 }, // F10
+  { 0x45, 0x53 }, // Num Lock
+  { 0x46, 0x47 }, // Scroll Lock
+  { 0x47, 0x5F }, // Keypad 7
+  { 0x48, 0x60 }, // Keypad 8
+  { 0x49, 0x61 }, // Keypad 9
+  { 0x4A, 0x56 }, // Keypad -
+  { 0x4B, 0x5C }, // Keypad 4
+  { 0x4C, 0x5D }, // Keypad 5
+  { 0x4D, 0x5E }, // Keypad 6
+  { 0x4E, 0x57 }, // Keypad +
+  { 0x4F, 0x59 }, // Keypad 1
+  { 0x50, 0x5A }, // Keypad 2
+  { 0x51, 0x5B }, // Keypad 3
+  { 0x52, 0x62 }, // Keypad 0
+  { 0x53, 0x63 }, // Keypad .
+  { 0x56, 0x64 }, // Non-US \|
+  { 0x57, 0x44 }, // F11
+  { 0x58, 0x45 }, // F12
+  { 0x59, 0x67 }, // Keypad =
+  { 0x64, 0x68 }, // F13
+  { 0x65, 0x69 }, // F14
+  { 0x66, 0x6A }, // F15
+  { 0x67, 0x6B }, // F16
+  { 0x68, 0x6C }, // F17
+  { 0x69, 0x6D }, // F18
+  { 0x6A, 0x6E }, // F19
+  { 0x6B, 0x6F }, // F20
+  { 0x6C, 0x70 }, // F21
+  { 0x6D, 0x71 }, // F22
+  { 0x6E, 0x72 }, // F23
+  { 0x70, 0x88 }, // International 2 (Kana)
+  { 0x73, 0x87 }, // International 1 (Ro)
+  { 0x76, 0x73 }, // F24
+  { 0x79, 0x8A }, // International 4 (Henkan)
+  { 0x7B, 0x8B }, // International 5 (Muhenkan)
+  { 0x7D, 0x89 }, // International 3 (Yen)
+  { 0x7E, 0x85 }  // Keypad , (Brazilian)
+};
+
+static constexpr HyperVKeyboardScancodeUsage HyperVKeyboardSet1ExtendedUsages[] = {
+  { 0x1C, 0x58 }, // Keypad Enter
+  { 0x1D, 0xE4 }, // Right Control
+  { 0x20, 0x7F }, // Mute
+  { 0x2E, 0x81 }, // Volume Down
+  { 0x30, 0x80 }, // Volume Up
+  { 0x35, 0x54 }, // Keypad /
+  { 0x37, 0x46 }, // Print Screen
+  { 0x38, 0xE6 }, // Right Alt
+  { 0x47, 0x4A }, // Home
+  { 0x48, 0x52 }, // Up Arrow
+  { 0x49, 0x4B }, // Page Up
+  { 0x4B, 0x50 }, // Left Arrow
+  { 0x4D, 0x4F }, // Right Arrow
+  { 0x4F, 0x4D }, // End
+  { 0x50, 0x51 }, // Down Arrow
+  { 0x51, 0x4E }, // Page Down
+  { 0x52, 0x49 }, // Insert
+  { 0x53, 0x4C }, // Delete
+  { 0x5B, 0xE3 }, // Left GUI
+  { 0x5C, 0xE7 }, // Right GUI
+  { 0x5D, 0x65 }, // Application
+  { 0x5E, 0x66 }  // Power
+};
+
+//
+// Unicode keystrokes are sent when Hyper-V types text, such as from the clipboard.
+// ASCII characters are typed using a US layout, letters and digits are added by the table below.
+//
+typedef struct {
+  UInt8 character;
+  UInt8 usage;
+  bool  isShifted;
+} HyperVKeyboardCharacterUsage;
+
+static constexpr HyperVKeyboardCharacterUsage HyperVKeyboardCharacterUsages[] = {
+  { '\b', 0x2A, false }, // Backspace
+  { '\t', 0x2B, false }, // Tab
+  { '\n', 0x28, false }, // Enter
+  { '\r', 0x28, false }, // Enter
+  { 0x1B, 0x29, false }, // Escape
+  { ' ',  0x2C, false },
+  { '!',  0x1E, true  },
+  { '@',  0x1F, true  },
+  { '#',  0x20, true  },
+  { '$',  0x21, true  },
+  { '%',  0x22, true  },
+  { '^',  0x23, true  },
+  { '&',  0x24, true  },
+  { '*',  0x25, true  },
+  { '(',  0x26, true  },
+  { ')',  0x27, true  },
+  { '-',  0x2D, false },
+  { '_',  0x2D, true  },
+  { '=',  0x2E, false },
+  { '+',  0x2E, true  },
+  { '[',  0x2F, false },
+  { '{',  0x2F, true  },
+  { ']',  0x30, false },
+  { '}',  0x30, true  },
+  { '\\', 0x31, false },
+  { '|',  0x31, true  },
+  { ';',  0x33, false },
+  { ':',  0x33, true  },
+  { '\'', 0x34, false },
+  { '"',  0x34, true  },
+  { '`',  0x35, false },
+  { '~',  0x35, true  },
+  { ',',  0x36, false },
+  { '<',  0x36, true  },
+  { '.',  0x37, false },
+  { '>',  0x37, true  },
+  { '/',  0x38, false },
+  { '?',  0x38, true  }
+};
+
+//
+// Flat scancode and character to usage tables, generated from the lists above at compile time.
+//
+typedef struct HyperVKeyboardUsageTable {
+  UInt8 usages[kHyperVKeyboardUsageTableLength];
+  UInt8 characterUsages[kHyperVKeyboardCharacterCount];
+  bool  isCharacterShifted[kHyperVKeyboardCharacterCount];
+
+  constexpr HyperVKeyboardUsageTable() : usages(), characterUsages(), isCharacterShifted() {
+    for (size_t i = 0; i < ARRAY_SIZE(HyperVKeyboardSet1Usages); i++) {
+      usages[HyperVKeyboardSet1Usages[i].scancode] = HyperVKeyboardSet1Usages[i].usage;
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(HyperVKeyboardSet1ExtendedUsages); i++) {
+      usages[kHyperVKeyboardScancodeCount + HyperVKeyboardSet1ExtendedUsages[i].scancode] = HyperVKeyboardSet1ExtendedUsages[i].usage;
+    }
+
+    for (size_t i = 0; i < 26; i++) {
+      characterUsages['a' + i]    = 0x04 + i;
+      characterUsages['A' + i]    = 0x04 + i;
+      isCharacterShifted['A' + i] = true;
+    }
+    characterUsages['0'] = 0x27;
+    for (size_t i = 0; i < 9; i++) {
+      characterUsages['1' + i] = 0x1E + i;
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(HyperVKeyboardCharacterUsages); i++) {
+      characterUsages[HyperVKeyboardCharacterUsages[i].character]    = HyperVKeyboardCharacterUsages[i].usage;
+      isCharacterShifted[HyperVKeyboardCharacterUsages[i].character] = HyperVKeyboardCharacterUsages[i].isShifted;
+    }
+  }
+} HyperVKeyboardUsageTable;
+
+static constexpr HyperVKeyboardUsageTable HyperVKeyboardUsages;
+
+//
+// HID report descriptor, input is a bitmap of all keyboard usages and output is the LED state.
+//
+static const UInt8 HyperVKeyboardHIDReportDescriptor[] = {
+  0x05, 0x01,                         // Usage Page (Generic Desktop)
+  0x09, 0x06,                         // Usage (Keyboard)
+  0xA1, 0x01,                         // Collection (Application)
+  0x05, 0x07,                         //   Usage Page (Keyboard)
+  0x19, 0x00,                         //   Usage Minimum (0x00)
+  0x29, kHyperVKeyboardHIDUsageMax,   //   Usage Maximum (0xE7)
+  0x15, 0x00,                         //   Logical Minimum (0)
+  0x25, 0x01,                         //   Logical Maximum (1)
+  0x75, 0x01,                         //   Report Size (1)
+  0x95, kHyperVKeyboardHIDUsageMax + 1, //   Report Count (232)
+  0x81, 0x02,                         //   Input (Data, Variable, Absolute)
+  0x05, 0x08,                         //   Usage Page (LEDs)
+  0x19, 0x01,                         //   Usage Minimum (Num Lock)
+  0x29, 0x05,                         //   Usage Maximum (Kana)
+  0x95, 0x05,                         //   Report Count (5)
+  0x91, 0x02,                         //   Output (Data, Variable, Absolute)
+  0x75, 0x03,                         //   Report Size (3)
+  0x95, 0x01,                         //   Report Count (1)
+  0x91, 0x01,                         //   Output (Constant)
+  0xC0                                // End Collection
+};
+
+#endif
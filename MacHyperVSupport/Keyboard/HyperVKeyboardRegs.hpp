@@ -10,6 +10,18 @@
 
 #define kHyperVKeyboardRingBufferSize (0x8000)
 
+//
+// HID keyboard is used by default, the legacy IOHIKeyboard driver can be used with this boot argument.
+//
+#define kHyperVKeyboardLegacyBootArg  "-hvkbdlegacy"
+
+//
+// HID input report is a bitmap of keyboard usages 0x00-0xE7, including modifiers.
+//
+#define kHyperVKeyboardHIDUsageMax      0xE7
+#define kHyperVKeyboardHIDReportSize    ((kHyperVKeyboardHIDUsageMax + 8) / 8)
+#define kHyperVKeyboardHIDVendorID      0x045E
+
 //
 // Current keyboard protocol is 1.0.
 //
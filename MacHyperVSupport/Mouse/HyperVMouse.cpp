@@ -29,6 +29,16 @@ bool HyperVMouse::handleStart(IOService *provider) {
     return false;
   }
   hvDevice->retain();
+
+  //
+  // Allocate descriptor reused for every input report.
+  //
+  reportDescriptor = IOBufferMemoryDescriptor::withCapacity(kHyperVMouseReportMaxSize, kIODirectionNone);
+  if (reportDescriptor == NULL) {
+    SYSLOG("Failed to allocate input report descriptor");
+    return false;
+  }
+  pendingReportLength = 0;
   
   //
   // Configure interrupt.
@@ -83,6 +93,7 @@ void HyperVMouse::handleStop(IOService *provider) {
     hvDevice->closeChannel();
     hvDevice->release();
   }
+  OSSafeReleaseNULL(reportDescriptor);
 
   super::handleStop(provider);
 }
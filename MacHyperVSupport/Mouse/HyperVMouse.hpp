@@ -12,6 +12,7 @@
 
 #include "HyperVVMBusDevice.hpp"
 #include "HyperVMouseRegs.hpp"
+#include "HyperVInputStatistics.hpp"
 
 #define super IOHIDDevice
 
@@ -36,12 +37,23 @@ private:
   size_t                  hidDescriptorLength;
   bool                    hidDescriptorValid;
 
+  //
+  // Reports are copied into a preallocated descriptor, absolute moves within an interrupt are coalesced.
+  //
+  IOBufferMemoryDescriptor  *reportDescriptor;
+  UInt8                     pendingReport[kHyperVMouseReportMaxSize];
+  UInt32                    pendingReportLength;
+  UInt64                    pendingReportTime;
+  HyperVInputStatistics     inputStatistics;
+
   void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
 
   bool setupMouse();
   void handleProtocolResponse(HyperVMouseMessageProtocolResponse *response, UInt64 transactionId);
   void handleDeviceInfo(HyperVMouseMessageInitialDeviceInfo *deviceInfo);
-  void handleInputReport(HyperVMouseMessageInputReport *inputReport);
+  void handleInputReport(HyperVMouseMessageInputReport *inputReport, UInt64 receiveTime);
+  bool canCoalesceReport(const UInt8 *report, UInt32 reportLength);
+  void flushPendingReport();
 
 protected:
   //
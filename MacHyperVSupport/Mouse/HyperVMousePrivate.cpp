@@ -43,9 +43,12 @@ void HyperVMouse::handleInterrupt(OSObject *owner, IOInterruptEventSource *sende
           handleDeviceInfo(&message->deviceInfo);
           break;
 
-        case kHyperVMouseMessageTypeInputReport:
-          handleInputReport(&message->inputReport);
+        case kHyperVMouseMessageTypeInputReport: {
+          UInt64 receiveTime;
+          clock_get_uptime(&receiveTime);
+          handleInputReport(&message->inputReport, receiveTime);
           break;
+        }
 
         default:
           DBGLOG("Unknown message type %u, size %u", message->header.type, message->header.size);
@@ -60,6 +63,15 @@ void HyperVMouse::handleInterrupt(OSObject *owner, IOInterruptEventSource *sende
       IOFree(message, pktDataLength);
     }
   } while (true);
+
+  //
+  // Send last coalesced report from this pass.
+  //
+  flushPendingReport();
+
+  UInt64 currentTime;
+  clock_get_uptime(&currentTime);
+  inputStatistics.publishIfNeeded(this, currentTime);
 }
 
 bool HyperVMouse::setupMouse() {
@@ -141,13 +153,60 @@ void HyperVMouse::handleDeviceInfo(HyperVMouseMessageInitialDeviceInfo *deviceIn
   hvDevice->writeInbandPacket(&message, sizeof (message), false);
 }
 
-void HyperVMouse::handleInputReport(HyperVMouseMessageInputReport *inputReport) {
+void HyperVMouse::handleInputReport(HyperVMouseMessageInputReport *inputReport, UInt64 receiveTime) {
+  UInt32 reportLength = inputReport->header.size;
+  if (reportLength == 0 || reportLength > kHyperVMouseReportMaxSize) {
+    DBGLOG("Invalid input report of %u bytes", reportLength);
+    return;
+  }
+
+  //
+  // Send any pending report that cannot be replaced by this one.
+  //
+  if (pendingReportLength != 0 && !canCoalesceReport(inputReport->data, reportLength)) {
+    flushPendingReport();
+  }
+
+  //
+  // Latency of a coalesced report is measured from the first report it replaced.
+  //
+  if (pendingReportLength == 0) {
+    pendingReportTime = receiveTime;
+  }
+  memcpy(pendingReport, inputReport->data, reportLength);
+  pendingReportLength = reportLength;
+}
+
+bool HyperVMouse::canCoalesceReport(const UInt8 *report, UInt32 reportLength) {
   //
-  // Send new report to HID system.
+  // Only absolute moves can be replaced, button changes and relative values must be delivered.
   //
-  IOBufferMemoryDescriptor *memDesc = IOBufferMemoryDescriptor::withBytes(inputReport->data, inputReport->header.size, kIODirectionNone);
-  if (memDesc != NULL) {
-    handleReport(memDesc);
-    memDesc->release();
+  if (reportLength != pendingReportLength || reportLength < kHyperVMouseReportPositionLength
+      || report[kHyperVMouseReportButtonsOffset] != pendingReport[kHyperVMouseReportButtonsOffset]) {
+    return false;
   }
+  for (UInt32 i = kHyperVMouseReportPositionLength; i < pendingReportLength; i++) {
+    if (pendingReport[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void HyperVMouse::flushPendingReport() {
+  if (pendingReportLength == 0) {
+    return;
+  }
+
+  //
+  // Send report to HID system, the descriptor is consumed before handleReport() returns.
+  //
+  memcpy(reportDescriptor->getBytesNoCopy(), pendingReport, pendingReportLength);
+  reportDescriptor->setLength(pendingReportLength);
+  handleReport(reportDescriptor);
+  pendingReportLength = 0;
+
+  UInt64 dispatchTime;
+  clock_get_uptime(&dispatchTime);
+  inputStatistics.recordEvent(pendingReportTime, dispatchTime);
 }
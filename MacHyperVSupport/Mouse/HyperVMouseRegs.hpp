@@ -12,6 +12,14 @@
 
 #define kHyperVMouseInitTimeout     10000
 
+//
+// Input reports start with a button byte followed by 16-bit absolute X and Y positions.
+// Any remaining bytes are relative values such as the wheel.
+//
+#define kHyperVMouseReportMaxSize         64
+#define kHyperVMouseReportButtonsOffset   0
+#define kHyperVMouseReportPositionLength  5
+
 //
 // Current mouse protocol is 2.0.
 //
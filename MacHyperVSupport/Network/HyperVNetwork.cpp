@@ -7,6 +7,8 @@
 
 #include "HyperVNetwork.hpp"
 
+#include <Headers/kern_api.hpp>
+
 OSDefineMetaClassAndStructors(HyperVNetwork, super);
 
 bool HyperVNetwork::start(IOService *provider) {
@@ -44,8 +46,14 @@ bool HyperVNetwork::start(IOService *provider) {
   
   rndisLock = IOLockAlloc();
   
-  connectNetwork();
+  if (!connectNetwork()) {
+    SYSLOG("Failed to connect to the network");
+    hvDevice->closeChannel();
+    super::stop(provider);
+    return false;
+  }
   createMediumDictionary();
+  publishBufferProperties();
   
   //
   // Attach network interface.
@@ -55,25 +63,162 @@ bool HyperVNetwork::start(IOService *provider) {
   }
   ethInterface->registerService();
   
+  //
+  // SR-IOV VFs are only offered on protocol version 4 and newer.
+  //
+  if (netVersion >= kHyperVNetworkProtocolVersion4 && !initVF()) {
+    SYSLOG("Failed to initialize SR-IOV VF support, only the synthetic datapath will be used");
+  }
+  
   SYSLOG("Initialized Hyper-V Synthetic Networking");
   return true;
 }
 
+void HyperVNetwork::stop(IOService *provider) {
+  DBGLOG("Hyper-V Synthetic Networking is stopping");
+  
+  //
+  // Switch back to the synthetic datapath and release the VF.
+  //
+  freeVF();
+  super::stop(provider);
+}
+
 IOReturn HyperVNetwork::getHardwareAddress(IOEthernetAddress *addrP) {
   *addrP = ethAddress;
   return kIOReturnSuccess;
 }
 
+bool HyperVNetwork::configureInterface(IONetworkInterface *interface) {
+  if (!super::configureInterface(interface)) {
+    return false;
+  }
+  
+  //
+  // Get network statistics structure for packet counters.
+  //
+  IONetworkData *data = interface->getParameter(kIONetworkStatsKey);
+  if (data == NULL) {
+    SYSLOG("Failed to get network statistics");
+    return false;
+  }
+  netStats = (IONetworkStats *)data->getBuffer();
+  if (netStats == NULL) {
+    return false;
+  }
+  
+  //
+  // Input polling is supported on 10.8 and newer.
+  //
+  if (getKernelVersion() >= KernelVersion::MountainLion) {
+    if (!interface->configureInputPacketPolling(kHyperVNetworkPollQueueSize)) {
+      SYSLOG("Failed to configure input packet polling");
+    }
+  }
+  return true;
+}
+
+UInt32 HyperVNetwork::getFeatures() const {
+  //
+  // VLAN tags are inserted and stripped by Hyper-V through RNDIS per-packet info.
+  //
+  return kIONetworkFeatureHardwareVlan;
+}
+
 UInt32 HyperVNetwork::outputPacket(mbuf_t m, void *param) {
-  return sendRNDISDataPacket(m) ? kIOReturnSuccess : kIOReturnIOError;
+  //
+  // Send through the VF when it is the active datapath.
+  //
+  if (isDataPathVF) {
+    ifnet_t vfIfnetRef = copyVFIfnet();
+    if (vfIfnetRef != NULL) {
+      //
+      // Hardware VLAN support is advertised for the synthetic path, the VF needs the tag in the frame.
+      //
+      if (!insertVLANTag(&m)) {
+        ifnet_release(vfIfnetRef);
+        netStats->outputErrors++;
+        return kIOReturnOutputDropped;
+      }
+      
+      errno_t status = ifnet_output_raw(vfIfnetRef, 0, m);
+      ifnet_release(vfIfnetRef);
+      if (status != 0) {
+        netStats->outputErrors++;
+        return kIOReturnOutputDropped;
+      }
+      netStats->outputPackets++;
+      return kIOReturnOutputSuccess;
+    }
+  }
+  
+  //
+  // Stalled packets are kept by the output queue and sent again once a send section is free.
+  //
+  UInt32 status = sendRNDISDataPacket(m);
+  if (status == kIOReturnOutputSuccess) {
+    netStats->outputPackets++;
+  } else if (status == kIOReturnOutputDropped) {
+    netStats->outputErrors++;
+  }
+  return status;
+}
+
+IOOutputQueue* HyperVNetwork::createOutputQueue() {
+  return IOBasicOutputQueue::withTarget(this, kHyperVNetworkOutputQueueSize);
 }
 
 IOReturn HyperVNetwork::enable(IONetworkInterface *interface) {
   isEnabled = true;
+  getOutputQueue()->start();
   return kIOReturnSuccess;
 }
 
 IOReturn HyperVNetwork::disable(IONetworkInterface *interface) {
   isEnabled = false;
+  getOutputQueue()->stop();
+  getOutputQueue()->flush();
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVNetwork::setInputPacketPollingEnable(IONetworkInterface *interface, bool enabled) {
+  if (!isEnabled) {
+    return kIOReturnNotReady;
+  }
+  
+  DBGLOG("Input polling is now %s", enabled ? "enabled" : "disabled");
+  if (enabled) {
+    //
+    // Mask RX interrupts, packets will be pulled in pollInputPackets().
+    //
+    isRxPollingEnabled = true;
+    hvDevice->setRxInterruptMask(true);
+  } else {
+    //
+    // Unmask RX interrupts, and process anything that arrived while masked.
+    //
+    isRxPollingEnabled = false;
+    if (hvDevice->setRxInterruptMask(false)) {
+      interruptSource->interruptOccurred(NULL, NULL, 0);
+    }
+  }
+  return kIOReturnSuccess;
+}
+
+void HyperVNetwork::pollInputPackets(IONetworkInterface *interface, uint32_t maxCount, IOMbufQueue *pollQueue, void *context) {
+  //
+  // The RX ring is also drained by the interrupt handler, only one consumer may read it at a time.
+  //
+  getWorkLoop()->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &HyperVNetwork::pollInputPacketsGated), this, &maxCount, pollQueue);
+}
+
+IOReturn HyperVNetwork::pollInputPacketsGated(UInt32 *maxCount, IOMbufQueue *pollQueue) {
+  if (!isRxPollingEnabled) {
+    return kIOReturnNotReady;
+  }
+  
+  rxPollQueue = pollQueue;
+  processPackets(*maxCount);
+  rxPollQueue = NULL;
   return kIOReturnSuccess;
 }
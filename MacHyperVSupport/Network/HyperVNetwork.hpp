@@ -12,13 +12,16 @@
 #include <IOKit/network/IOEthernetController.h>
 #include <IOKit/network/IOEthernetInterface.h>
 #include <IOKit/network/IOMbufMemoryCursor.h>
+#include <IOKit/network/IOBasicOutputQueue.h>
 #include <IOKit/network/IONetworkMedium.h>
+#include <IOKit/IOTimerEventSource.h>
 
 #include "HyperVVMBusDevice.hpp"
 #include "HyperVNetworkRegs.hpp"
 
 extern "C" {
 #include <sys/kpi_mbuf.h>
+#include <net/kpi_interfilter.h>
 }
 
 #define super IOEthernetController
@@ -30,6 +33,8 @@ extern "C" {
 #define MBit 1000000
 
 #define kHyperVNetworkMaximumTransId  0xFFFFFFFF
+#define kHyperVNetworkPollQueueSize   256
+#define kHyperVNetworkOutputQueueSize 256
 #define kHyperVNetworkSendTransIdBits 0xFA00000000000000
 
 typedef struct HyperVNetworkRNDISRequest {
@@ -56,18 +61,30 @@ private:
   bool                    debugEnabled = false;
   
   bool                          isEnabled = false;
+  bool                          isRxPollingEnabled = false;
+  IOMbufQueue                   *rxPollQueue = NULL;
+  UInt32                        rxPacketCount = 0;
   
   HyperVNetworkProtocolVersion  netVersion;
   UInt32                        receiveBufferSize;
   UInt32                        receiveGpadlHandle;
   UInt8                          *receiveBuffer;
+  HyperVNetworkV1MessageReceiveBufferSection receiveSections[kHyperVNetworkReceiveBufferMaxSections];
+  UInt32                        receiveSectionCount = 0;
+  UInt32                        receiveSubAllocCount = 0;
+  UInt32                        rxRingBytesUsedPeak = 0;
+  UInt64                        rxRingHighUsageCount = 0;
+  UInt64                        *rxCompletionQueue = NULL;
+  UInt32                        rxCompletionQueueSize = 0;
+  UInt32                        rxCompletionQueueHead = 0;
+  UInt32                        rxCompletionQueueCount = 0;
   
   UInt32                        sendBufferSize;
   UInt32                        sendGpadlHandle;
   UInt8                         *sendBuffer;
   UInt32                        sendSectionSize;
   UInt32                        sendSectionCount;
-  UInt64                        *sendIndexMap;
+  volatile UInt64               *sendIndexMap;
   size_t                        sendIndexMapSize;
   
   IOLock                        *rndisLock = NULL;
@@ -77,34 +94,62 @@ private:
   
   IOEthernetInterface           *ethInterface;
   IOEthernetAddress             ethAddress;
+  IONetworkStats                *netStats = NULL;
+  UInt64                        sendStallCount = 0;
+  volatile bool                 isSendStalled = false;
+  volatile bool                 isSendRingStalled = false;
   
   bool                          isLinkUp = false;
   OSDictionary                  *mediumDict;
   UInt32                        currentMediumIndex;
   
-  void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
+  //
+  // SR-IOV virtual function, carries traffic for this NIC when allocated.
+  //
+  IOLock                        *vfLock = NULL;
+  IOTimerEventSource            *vfTimerSource = NULL;
+  IONotifier                    *vfPublishNotifier = NULL;
+  IONotifier                    *vfTerminateNotifier = NULL;
+  bool                          isVFAllocated = false;
+  UInt32                        vfSerialNumber = 0;
+  IOEthernetInterface           *vfInterface = NULL;
+  ifnet_t                       vfIfnet = NULL;
+  interface_filter_t            vfFilter = NULL;
+  UInt32                        vfAttachRetryCount = 0;
+  volatile bool                 isDataPathVF = false;
   
+  void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
+  void processPackets(UInt32 maxCount);
+  IOReturn pollInputPacketsGated(UInt32 *maxCount, IOMbufQueue *pollQueue);
   
   bool negotiateProtocol(HyperVNetworkProtocolVersion protocolVersion);
+  bool sendNDISConfig();
   bool initBuffers();
+  UInt32 getReceiveBufferSize();
+  UInt32 getReceiveRangeSubAllocCount(UInt32 offset, UInt32 length);
+  void updateReceiveBufferStatistics();
   bool connectNetwork();
   
   void handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32 headerSize, UInt32 pktSize);
+  bool sendRNDISRangesCompletion(UInt64 transactionId);
+  void flushRNDISRangesCompletions();
   void handleCompletion();
 
   bool processRNDISPacket(UInt8 *data, UInt32 dataLength);
   void processIncoming(UInt8 *data, UInt32 dataLength);
+  bool getIncomingVLANTag(HyperVNetworkRNDISMessage *rndisPkt, UInt32 dataLength, UInt16 *vlanTag);
   
   //
   // RNDIS
   //
   UInt32 getNextSendIndex();
   void releaseSendIndex(UInt32 sendIndex);
+  void initSendSectionTemplates();
   HyperVNetworkRNDISRequest *allocateRNDISRequest();
   void freeRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest);
   UInt32 getNextRNDISTransId();
   bool sendRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest, bool waitResponse = false);
-  bool sendRNDISDataPacket(mbuf_t packet);
+  UInt32 sendRNDISDataPacket(mbuf_t packet);
   
   bool initializeRNDIS();
   bool queryRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32 *valueSize);
@@ -115,23 +160,55 @@ private:
   void addNetworkMedium(UInt32 index, UInt32 type, UInt32 speed);
   void createMediumDictionary();
   bool readMACAddress();
+  void readVLANId();
   void updateLinkState(HyperVNetworkRNDISMessageIndicateStatus *indicateStatus);
+  void publishBufferProperties();
+  
+  //
+  // SR-IOV
+  //
+  bool initVF();
+  void handleVFAssociation(HyperVNetworkV4MessageSendVFAssociation *vfAssociation);
+  static bool handleVFPublish(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+  static bool handleVFTerminate(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+  static errno_t handleVFInput(void *cookie, ifnet_t interface, protocol_family_t protocol, mbuf_t *data, char **framePtr);
+  static void handleVFDetached(void *cookie, ifnet_t interface);
+  void handleVFTimer(IOTimerEventSource *sender);
+  IOReturn updateDataPathGated();
+  bool isVFInterface(IOService *service);
+  bool switchDataPath(HyperVNetworkDataPath dataPath);
+  void updateDataPath();
+  void detachVFFilter();
+  IOReturn freeVFGated();
+  void freeVF();
+  ifnet_t copyVFIfnet();
+  bool insertVLANTag(mbuf_t *packet);
   
 public:
   //
   // IOService overrides.
   //
   virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
   
   //
   // IOEthernetController overrides.
   //
   IOReturn getHardwareAddress(IOEthernetAddress *addrP) APPLE_KEXT_OVERRIDE;
+  bool configureInterface(IONetworkInterface *interface) APPLE_KEXT_OVERRIDE;
+  UInt32 getFeatures() const APPLE_KEXT_OVERRIDE;
+  IOOutputQueue *createOutputQueue() APPLE_KEXT_OVERRIDE;
   
   UInt32 outputPacket(mbuf_t m, void *param) APPLE_KEXT_OVERRIDE;
   
   virtual IOReturn enable(IONetworkInterface *interface) APPLE_KEXT_OVERRIDE;
   virtual IOReturn disable(IONetworkInterface *interface) APPLE_KEXT_OVERRIDE;
+  
+  //
+  // Input polling.
+  //
+  virtual IOReturn setInputPacketPollingEnable(IONetworkInterface *interface, bool enabled) APPLE_KEXT_OVERRIDE;
+  virtual void pollInputPackets(IONetworkInterface *interface, uint32_t maxCount, IOMbufQueue *pollQueue, void *context) APPLE_KEXT_OVERRIDE;
 };
 
 #endif /* HyperVNetwork_hpp */
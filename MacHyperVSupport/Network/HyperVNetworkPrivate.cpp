@@ -7,7 +7,27 @@
 
 #include "HyperVNetwork.hpp"
 
+#include <IOKit/IOPlatformExpert.h>
+
 void HyperVNetwork::handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count) {
+  //
+  // Packets are pulled by the network stack while polling is active.
+  //
+  if (isRxPollingEnabled) {
+    return;
+  }
+  
+  processPackets(UINT32_MAX);
+  
+  //
+  // Push packets queued during this pass up to the network stack.
+  //
+  if (isEnabled) {
+    ethInterface->flushInputQueue();
+  }
+}
+
+void HyperVNetwork::processPackets(UInt32 maxCount) {
   VMBusPacketType type;
   UInt32 headersize;
   UInt32 totalsize;
@@ -16,8 +36,12 @@ void HyperVNetwork::handleInterrupt(OSObject *owner, IOInterruptEventSource *sen
   UInt32 responseLength;
   
   HyperVNetworkMessage *pktComp;
+  HyperVNetworkMessage *netMsg;
   
-  while (true) {
+  rxPacketCount = 0;
+  updateReceiveBufferStatistics();
+  flushRNDISRangesCompletions();
+  while (rxPacketCount < maxCount) {
     if (!hvDevice->nextPacketAvailable(&type, &headersize, &totalsize)) {
      // DBGLOG("last one");
       break;
@@ -28,6 +52,11 @@ void HyperVNetwork::handleInterrupt(OSObject *owner, IOInterruptEventSource *sen
     
     switch (type) {
       case kVMBusPacketTypeDataInband:
+        netMsg = (HyperVNetworkMessage*) (buf + headersize);
+        if (netMsg->messageType == kHyperVNetworkMessageTypeV4SendVFAssociation
+            && totalsize - headersize >= sizeof (netMsg->messageType) + sizeof (netMsg->v4.sendVFAssociation)) {
+          handleVFAssociation(&netMsg->v4.sendVFAssociation);
+        }
         break;
       case kVMBusPacketTypeDataUsingTransferPages:
         handleRNDISRanges((VMBusPacketTransferPages*) buf, headersize, totalsize);
@@ -36,6 +65,9 @@ void HyperVNetwork::handleInterrupt(OSObject *owner, IOInterruptEventSource *sen
       case kVMBusPacketTypeCompletion:
         
         if (hvDevice->getPendingTransaction(((VMBusPacketHeader*)buf)->transactionId, &responseBuffer, &responseLength)) {
+          if (responseLength > totalsize - headersize) {
+            responseLength = totalsize - headersize;
+          }
           memcpy(responseBuffer, (UInt8*)buf + headersize, responseLength);
           hvDevice->wakeTransaction(((VMBusPacketHeader*)buf)->transactionId);
         } else {
@@ -53,6 +85,17 @@ void HyperVNetwork::handleInterrupt(OSObject *owner, IOInterruptEventSource *sen
     
     IOFree(buf, totalsize);
   }
+  flushRNDISRangesCompletions();
+  
+  //
+  // Restart the output queue if it was stalled waiting for TX ring space.
+  // Pending send size is left set, Hyper-V only signals when free space crosses it.
+  //
+  if (isSendRingStalled && hvDevice->isTxSpaceAvailable(sizeof (HyperVNetworkMessage))) {
+    isSendRingStalled = false;
+    setProperty(kHyperVNetworkSendStallCountKey, sendStallCount, 64);
+    getOutputQueue()->service(IOBasicOutputQueue::kServiceAsync);
+  }
 }
 
 void HyperVNetwork::handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32 headerSize, UInt32 pktSize) {
@@ -76,15 +119,57 @@ void HyperVNetwork::handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32
     UInt32 dataLength = pktPages->ranges[i].count;
     
     DBGLOG("Got range of %u bytes at 0x%X", dataLength, pktPages->ranges[i].offset);
+    
+    //
+    // Ensure range lies within a receive buffer section.
+    //
+    if (getReceiveRangeSubAllocCount(pktPages->ranges[i].offset, dataLength) == 0) {
+      SYSLOG("Invalid range of %u bytes at 0x%X", dataLength, pktPages->ranges[i].offset);
+      //
+      // Statistics are not available until the interface is configured.
+      //
+      if (netStats != NULL) {
+        netStats->inputErrors++;
+      }
+      continue;
+    }
+    
     processRNDISPacket(data, dataLength);
   }
   
-  HyperVNetworkMessage netMsg2;
-  memset(&netMsg2, 0, sizeof (netMsg2));
-  netMsg2.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacketComplete;
-  netMsg2.v1.sendRNDISPacketComplete.status = kHyperVNetworkMessageStatusSuccess;
+  //
+  // Hyper-V holds the receive buffer suballocations until the completion is received.
+  // If the TX ring is full, queue the completion and send it once space is available, keeping them in order.
+  //
+  if (rxCompletionQueueCount == 0 && sendRNDISRangesCompletion(pktPages->header.transactionId)) {
+    return;
+  }
+  if (rxCompletionQueueCount == rxCompletionQueueSize) {
+    SYSLOG("Receive completion queue is full, dropping completion for transaction 0x%llX", pktPages->header.transactionId);
+    return;
+  }
+  rxCompletionQueue[(rxCompletionQueueHead + rxCompletionQueueCount) % rxCompletionQueueSize] = pktPages->header.transactionId;
+  rxCompletionQueueCount++;
+  hvDevice->setTxPendingSendSize(sizeof (HyperVNetworkMessage));
+}
+
+bool HyperVNetwork::sendRNDISRangesCompletion(UInt64 transactionId) {
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacketComplete;
+  netMsg.v1.sendRNDISPacketComplete.status = kHyperVNetworkMessageStatusSuccess;
   
-  hvDevice->writeCompletionPacketWithTransactionId(&netMsg2, sizeof (netMsg2), pktPages->header.transactionId, false);
+  return hvDevice->writeCompletionPacketWithTransactionId(&netMsg, sizeof (netMsg), transactionId, false) == kIOReturnSuccess;
+}
+
+void HyperVNetwork::flushRNDISRangesCompletions() {
+  while (rxCompletionQueueCount > 0) {
+    if (!sendRNDISRangesCompletion(rxCompletionQueue[rxCompletionQueueHead])) {
+      return;
+    }
+    rxCompletionQueueHead = (rxCompletionQueueHead + 1) % rxCompletionQueueSize;
+    rxCompletionQueueCount--;
+  }
 }
 
 bool HyperVNetwork::negotiateProtocol(HyperVNetworkProtocolVersion protocolVersion) {
@@ -101,7 +186,8 @@ bool HyperVNetwork::negotiateProtocol(HyperVNetworkProtocolVersion protocolVersi
   }
 
   if (netMsg.init.initComplete.status != kHyperVNetworkMessageStatusSuccess) {
-    SYSLOG("error returned from Hyper-V: 0x%X", netMsg.init.initComplete.status);
+    DBGLOG("Protocol 0x%X rejected by Hyper-V: 0x%X", protocolVersion, netMsg.init.initComplete.status);
+    return false;
   }
 
   DBGLOG("Can use protocol 0x%X, max MDL length %u",
@@ -109,6 +195,30 @@ bool HyperVNetwork::negotiateProtocol(HyperVNetworkProtocolVersion protocolVersi
   return true;
 }
 
+bool HyperVNetwork::sendNDISConfig() {
+  //
+  // Send NDIS configuration to Hyper-V, MTU includes Ethernet header.
+  //
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV2SendNDISConfig;
+  netMsg.v2.sendNDISConfig.mtu = kIOEthernetMaxPacketSize - kIOEthernetCRCSize;
+  netMsg.v2.sendNDISConfig.capabilities = kHyperVNetworkNDISCapabilityIEEE8021Q;
+  
+  //
+  // Request an SR-IOV VF on protocol version 5 and newer, teaming is needed for link speed updates.
+  //
+  if (netVersion >= kHyperVNetworkProtocolVersion5) {
+    netMsg.v2.sendNDISConfig.capabilities |= kHyperVNetworkNDISCapabilitySRIOV | kHyperVNetworkNDISCapabilityTeaming;
+  }
+  
+  if (hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), false) != kIOReturnSuccess) {
+    SYSLOG("Failed to send NDIS configuration");
+    return false;
+  }
+  return true;
+}
+
 bool HyperVNetwork::initBuffers() {
   
   // Allocate receive and send buffers.
@@ -129,20 +239,62 @@ bool HyperVNetwork::initBuffers() {
   netMsg.v1.sendReceiveBuffer.gpadlHandle = receiveGpadlHandle;
   netMsg.v1.sendReceiveBuffer.id = kHyperVNetworkReceiveBufferID;
   
-  if (hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), true, &netMsg, sizeof (netMsg)) != kIOReturnSuccess) {
+  //
+  // Response may contain multiple sections.
+  //
+  UInt8 receiveResponse[sizeof (HyperVNetworkMessage) +
+                        (sizeof (HyperVNetworkV1MessageReceiveBufferSection) * (kHyperVNetworkReceiveBufferMaxSections - 1))];
+  memset(receiveResponse, 0, sizeof (receiveResponse));
+  HyperVNetworkV1MessageSendReceiveBufferComplete *receiveComplete =
+    &((HyperVNetworkMessage*)receiveResponse)->v1.sendReceiveBufferComplete;
+  
+  if (hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), true, receiveResponse, sizeof (receiveResponse)) != kIOReturnSuccess) {
     SYSLOG("Failed to send receive buffer configuration message");
     return false;
   }
 
-  if (netMsg.v1.sendReceiveBufferComplete.status != kHyperVNetworkMessageStatusSuccess) {
-    SYSLOG("Failed to configure receive buffer: 0x%X", netMsg.v1.sendReceiveBufferComplete.status);
+  if (receiveComplete->status != kHyperVNetworkMessageStatusSuccess) {
+    SYSLOG("Failed to configure receive buffer: 0x%X", receiveComplete->status);
     return false;
   }
-  DBGLOG("Receive buffer configured with %u sections", netMsg.v1.sendReceiveBufferComplete.numSections);
+  DBGLOG("Receive buffer configured with %u sections", receiveComplete->numSections);
   
-  // Linux driver only allows 1 section.
-  if (netMsg.v1.sendReceiveBufferComplete.numSections != 1 || netMsg.v1.sendReceiveBufferComplete.sections[0].offset != 0) {
-    SYSLOG("Invalid receive buffer sections");
+  //
+  // Validate each section and save it for checking receive ranges later.
+  // Sections must be in order and cannot overlap.
+  //
+  if (receiveComplete->numSections == 0 || receiveComplete->numSections > kHyperVNetworkReceiveBufferMaxSections) {
+    SYSLOG("Unsupported receive buffer section count of %u", receiveComplete->numSections);
+    return false;
+  }
+  
+  UInt32 sectionStart = 0;
+  receiveSubAllocCount = 0;
+  for (UInt32 i = 0; i < receiveComplete->numSections; i++) {
+    HyperVNetworkV1MessageReceiveBufferSection *section = &receiveComplete->sections[i];
+    DBGLOG("Receive buffer section %u: offset 0x%X, end 0x%X, %u suballocations of %u bytes",
+           i, section->offset, section->endOffset, section->numSubAllocs, section->subAllocSize);
+    
+    if (section->offset < sectionStart || section->endOffset <= section->offset
+        || section->endOffset > receiveBufferSize || section->subAllocSize == 0
+        || (UInt64)section->subAllocSize * section->numSubAllocs > section->endOffset - section->offset) {
+      SYSLOG("Invalid receive buffer section %u", i);
+      return false;
+    }
+    
+    receiveSections[i] = *section;
+    receiveSubAllocCount += section->numSubAllocs;
+    sectionStart = section->endOffset;
+  }
+  receiveSectionCount = receiveComplete->numSections;
+  
+  //
+  // Each receive indication holds at least one suballocation, so pending completions can never exceed the count.
+  //
+  rxCompletionQueueSize = receiveSubAllocCount;
+  rxCompletionQueue = (UInt64*)IOMalloc(rxCompletionQueueSize * sizeof (UInt64));
+  if (rxCompletionQueue == NULL) {
+    SYSLOG("Failed to allocate receive completion queue");
     return false;
   }
   
@@ -162,23 +314,63 @@ bool HyperVNetwork::initBuffers() {
     return false;
   }
   sendSectionSize = netMsg.v1.sendSendBufferComplete.sectionSize;
+  if (sendSectionSize < sizeof (HyperVNetworkRNDISMessageDataPacket) + sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q) + 8) {
+    SYSLOG("Invalid send buffer section size of %u bytes", sendSectionSize);
+    return false;
+  }
   sendSectionCount = sendBufferSize / sendSectionSize;
-  sendIndexMapSize = (sendSectionCount + sizeof (UInt64) - 1) / sizeof (UInt64);
-  sendIndexMap = (UInt64*)IOMalloc(sendIndexMapSize);
-  memset(sendIndexMap, 0, sendIndexMapSize);
+  
+  //
+  // Each send section is tracked by a single bit.
+  //
+  sendIndexMapSize = ((sendSectionCount + 63) / 64) * sizeof (UInt64);
+  sendIndexMap = (volatile UInt64*)IOMalloc(sendIndexMapSize);
+  if (sendIndexMap == NULL) {
+    SYSLOG("Failed to allocate send index map");
+    return false;
+  }
+  memset((void*)sendIndexMap, 0, sendIndexMapSize);
   DBGLOG("send index map size %u", sendIndexMapSize);
   
   DBGLOG("Send buffer configured with section size of %u bytes and %u sections", sendSectionSize, sendSectionCount);
   
+  initSendSectionTemplates();
+  
   return true;
 }
 
 bool HyperVNetwork::connectNetwork() {
   DBGLOG("start");
   
+  //
   // Negotiate max protocol version with Hyper-V.
-  negotiateProtocol(kHyperVNetworkProtocolVersion1);
-  netVersion = kHyperVNetworkProtocolVersion1;
+  //
+  static const HyperVNetworkProtocolVersion protocolVersions[] = {
+    kHyperVNetworkProtocolVersion61,
+    kHyperVNetworkProtocolVersion6,
+    kHyperVNetworkProtocolVersion5,
+    kHyperVNetworkProtocolVersion4,
+    kHyperVNetworkProtocolVersion2,
+    kHyperVNetworkProtocolVersion1
+  };
+  
+  bool foundVersion = false;
+  for (UInt32 i = 0; i < ARRAY_SIZE(protocolVersions); i++) {
+    if (negotiateProtocol(protocolVersions[i])) {
+      netVersion = protocolVersions[i];
+      foundVersion = true;
+      break;
+    }
+  }
+  if (!foundVersion) {
+    SYSLOG("Failed to negotiate a protocol version with Hyper-V");
+    return false;
+  }
+  DBGLOG("Using protocol version 0x%X", netVersion);
+  
+  if (netVersion >= kHyperVNetworkProtocolVersion2 && !sendNDISConfig()) {
+    return false;
+  }
   
   // Send NDIS version.
   UInt32 ndisVersion = netVersion > kHyperVNetworkProtocolVersion4 ?
@@ -195,19 +387,124 @@ bool HyperVNetwork::connectNetwork() {
     return false;
   }
   
-  receiveBufferSize = netVersion > kHyperVNetworkProtocolVersion2 ?
-    kHyperVNetworkReceiveBufferSize : kHyperVNetworkReceiveBufferSizeLegacy;
+  receiveBufferSize = getReceiveBufferSize();
   sendBufferSize = kHyperVNetworkSendBufferSize;
-  initBuffers();
+  if (!initBuffers()) {
+    return false;
+  }
   
   initializeRNDIS();
   
   readMACAddress();
+  readVLANId();
   updateLinkState(NULL);
   
   return true;
 }
 
+UInt32 HyperVNetwork::getReceiveBufferSize() {
+  //
+  // Protocol version 1 is limited to the legacy size.
+  //
+  if (netVersion < kHyperVNetworkProtocolVersion2) {
+    return kHyperVNetworkReceiveBufferSizeLegacy;
+  }
+  
+  //
+  // Larger buffers can be specified by boot argument, limited by the maximum GPADL size.
+  //
+  UInt32 receiveBufferSizeMB;
+  if (PE_parse_boot_argn(kHyperVNetworkReceiveBufferSizeBootArg, &receiveBufferSizeMB, sizeof (receiveBufferSizeMB))) {
+    UInt64 size = (UInt64)receiveBufferSizeMB * 1024 * 1024;
+    if (size < kHyperVNetworkReceiveBufferSizeLegacy) {
+      size = kHyperVNetworkReceiveBufferSizeLegacy;
+    } else if (size > kHyperVNetworkReceiveBufferSizeMax) {
+      size = kHyperVNetworkReceiveBufferSizeMax;
+    }
+    DBGLOG("Using receive buffer size of %llu bytes", size);
+    return (UInt32)size;
+  }
+  return kHyperVNetworkReceiveBufferSize;
+}
+
+UInt32 HyperVNetwork::getReceiveRangeSubAllocCount(UInt32 offset, UInt32 length) {
+  //
+  // Get number of suballocations used by a range, or zero if the range is not valid.
+  //
+  for (UInt32 i = 0; i < receiveSectionCount; i++) {
+    HyperVNetworkV1MessageReceiveBufferSection *section = &receiveSections[i];
+    if (offset >= section->offset && offset < section->endOffset) {
+      if (length == 0 || length > section->endOffset - offset) {
+        return 0;
+      }
+      return (length + section->subAllocSize - 1) / section->subAllocSize;
+    }
+  }
+  return 0;
+}
+
+void HyperVNetwork::updateReceiveBufferStatistics() {
+  if (receiveSubAllocCount == 0) {
+    return;
+  }
+  
+  //
+  // Sample RX ring occupancy before draining it, each transfer page packet still in the ring
+  // holds receive buffer suballocations that cannot be reused by Hyper-V until completed.
+  // Only update the IORegistry when a new peak or high usage is reached to avoid overhead.
+  //
+  UInt32 ringSize      = hvDevice->getRxRingBufferSize();
+  UInt32 ringBytesUsed = hvDevice->getRxRingBytesUsed();
+  
+  bool updated = false;
+  if (ringBytesUsed > rxRingBytesUsedPeak) {
+    rxRingBytesUsedPeak = ringBytesUsed;
+    updated = true;
+  }
+  if (ringBytesUsed * 100ULL >= ringSize * (UInt64)kHyperVNetworkRxRingHighUsage) {
+    rxRingHighUsageCount++;
+    updated = true;
+  }
+  
+  if (!updated) {
+    return;
+  }
+  
+  OSDictionary *stats = OSDictionary::withCapacity(5);
+  if (stats == NULL) {
+    return;
+  }
+  
+  OSNumber *number = OSNumber::withNumber(receiveSectionCount, 32);
+  if (number != NULL) {
+    stats->setObject("Sections", number);
+    number->release();
+  }
+  number = OSNumber::withNumber(receiveSubAllocCount, 32);
+  if (number != NULL) {
+    stats->setObject("SubAllocations", number);
+    number->release();
+  }
+  number = OSNumber::withNumber(ringSize, 32);
+  if (number != NULL) {
+    stats->setObject("RingSize", number);
+    number->release();
+  }
+  number = OSNumber::withNumber(rxRingBytesUsedPeak, 32);
+  if (number != NULL) {
+    stats->setObject("PeakRingBytesUsed", number);
+    number->release();
+  }
+  number = OSNumber::withNumber(rxRingHighUsageCount, 64);
+  if (number != NULL) {
+    stats->setObject("HighRingUsageCount", number);
+    number->release();
+  }
+  
+  setProperty(kHyperVNetworkReceiveBufferStatsKey, stats);
+  stats->release();
+}
+
 void HyperVNetwork::addNetworkMedium(UInt32 index, UInt32 type, UInt32 speed) {
   IONetworkMedium *medium = IONetworkMedium::medium(type, speed * MBit, 0, index);
   if (medium != NULL) {
@@ -227,6 +524,17 @@ void HyperVNetwork::createMediumDictionary() {
   publishMediumDictionary(mediumDict);
 }
 
+void HyperVNetwork::publishBufferProperties() {
+  //
+  // Publish buffer layout for tuning purposes.
+  //
+  setProperty(kHyperVNetworkReceiveBufferSizeKey, receiveBufferSize, 32);
+  setProperty(kHyperVNetworkSendBufferSizeKey, sendBufferSize, 32);
+  setProperty(kHyperVNetworkSendSectionSizeKey, sendSectionSize, 32);
+  setProperty(kHyperVNetworkSendSectionCountKey, sendSectionCount, 32);
+  setProperty(kHyperVNetworkSendStallCountKey, sendStallCount, 64);
+}
+
 bool HyperVNetwork::readMACAddress() {
   UInt32 macSize = sizeof (ethAddress.bytes);
   if (!queryRNDISOID(kHyperVNetworkRNDISOIDEthernetPermanentAddress, (void *)ethAddress.bytes, &macSize)) {
@@ -240,6 +548,21 @@ bool HyperVNetwork::readMACAddress() {
   return true;
 }
 
+void HyperVNetwork::readVLANId() {
+  //
+  // Get VLAN assigned by Hyper-V, if any.
+  //
+  UInt32 vlanId = 0;
+  UInt32 vlanIdSize = sizeof (vlanId);
+  if (!queryRNDISOID(kHyperVNetworkRNDISOIDGeneralVLANId, &vlanId, &vlanIdSize) || vlanIdSize != sizeof (vlanId)) {
+    DBGLOG("VLAN ID is not available");
+    return;
+  }
+  
+  DBGLOG("VLAN ID is %u", vlanId);
+  setProperty(kHyperVNetworkVLANIdKey, vlanId, 32);
+}
+
 void HyperVNetwork::updateLinkState(HyperVNetworkRNDISMessageIndicateStatus *indicateStatus) {
   //
   // Pull initial link state from OID.
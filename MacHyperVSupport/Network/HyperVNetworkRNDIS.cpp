@@ -77,18 +77,95 @@ void HyperVNetwork::processIncoming(UInt8 *data, UInt32 dataLength) {
   HyperVNetworkRNDISMessage *rndisPkt = (HyperVNetworkRNDISMessage*)data;
   UInt8 *pktData = data + 8 + rndisPkt->dataPacket.dataOffset;
   
+  //
+  // Ensure packet fits within the RNDIS message.
+  //
+  if ((UInt64)rndisPkt->dataPacket.dataOffset + rndisPkt->dataPacket.dataLength + 8 > dataLength) {
+    SYSLOG("Invalid RNDIS data packet of %u bytes at offset 0x%X", rndisPkt->dataPacket.dataLength, rndisPkt->dataPacket.dataOffset);
+    netStats->inputErrors++;
+    return;
+  }
+  
   mbuf_t newPacket = allocatePacket(rndisPkt->dataPacket.dataLength);
+  if (newPacket == NULL) {
+    netStats->inputErrors++;
+    return;
+  }
   memcpy(mbuf_data(newPacket), pktData, rndisPkt->dataPacket.dataLength);
   
-  ethInterface->inputPacket(newPacket, rndisPkt->dataPacket.dataLength);
+  //
+  // Pass any VLAN tag stripped by Hyper-V up to the network stack.
+  //
+  UInt16 vlanTag;
+  if (getIncomingVLANTag(rndisPkt, dataLength, &vlanTag)) {
+    mbuf_set_vlan_tag(newPacket, vlanTag);
+  }
+  
+  //
+  // Packets are either added to the poll queue, or queued and flushed once the interrupt is handled.
+  //
+  if (rxPollQueue != NULL) {
+    ethInterface->enqueueInputPacket(newPacket, rxPollQueue);
+  } else {
+    ethInterface->inputPacket(newPacket, rndisPkt->dataPacket.dataLength, IONetworkInterface::kInputOptionQueuePacket);
+  }
+  netStats->inputPackets++;
+  rxPacketCount++;
+}
+
+bool HyperVNetwork::getIncomingVLANTag(HyperVNetworkRNDISMessage *rndisPkt, UInt32 dataLength, UInt16 *vlanTag) {
+  //
+  // Per-packet info offset is from the beginning of the data packet header.
+  //
+  UInt32 ppiOffset = rndisPkt->dataPacket.perPacketInfoOffset;
+  UInt32 ppiLength = rndisPkt->dataPacket.perPacketInfoLength;
+  if (ppiLength == 0 || (UInt64)ppiOffset + ppiLength + 8 > dataLength) {
+    return false;
+  }
+  
+  UInt8 *ppiData = (UInt8*)&rndisPkt->dataPacket + ppiOffset;
+  while (ppiLength >= sizeof (HyperVNetworkRNDISPerPacketInfo)) {
+    HyperVNetworkRNDISPerPacketInfo *ppi = (HyperVNetworkRNDISPerPacketInfo*)ppiData;
+    if (ppi->size < sizeof (HyperVNetworkRNDISPerPacketInfo) || ppi->size > ppiLength) {
+      return false;
+    }
+    
+    if (ppi->type == kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q
+        && ppi->perPacketInfoOffset + sizeof (UInt32) <= ppi->size) {
+      //
+      // Convert NDIS 802.1Q info into a standard VLAN tag.
+      //
+      UInt32 value = *(UInt32*)(ppiData + ppi->perPacketInfoOffset);
+      *vlanTag = (((value >> kHyperVNetworkRNDISIEEE8021QVLANIdShift) & kHyperVNetworkRNDISIEEE8021QVLANIdMask)
+                  | (((value >> kHyperVNetworkRNDISIEEE8021QCFIShift) & 0x1) << 12)
+                  | ((value & kHyperVNetworkRNDISIEEE8021QPriorityMask) << 13));
+      return true;
+    }
+    
+    ppiData   += ppi->size;
+    ppiLength -= ppi->size;
+  }
+  return false;
 }
 
 UInt32 HyperVNetwork::getNextSendIndex() {
-  for (UInt32 i = 0; i < sendSectionCount; i++) {
-    DBGLOG("idx %u %X", i, sendIndexMap[i / 8]);
-    if ((sendIndexMap[i / 8] & (1 << (i % 8))) == 0) {
-      sendIndexMap[i / 8] |= (1 << (i % 8));
-      return i;
+  //
+  // Find first word with a free section, and then claim the free bit within it.
+  // Sections are released from the interrupt handler, so the map is updated atomically.
+  //
+  for (UInt32 i = 0; i < sendIndexMapSize / sizeof (UInt64); i++) {
+    UInt64 value = sendIndexMap[i];
+    while (value != ~0ULL) {
+      UInt32 bit = __builtin_ctzll(~value);
+      UInt32 sendIndex = (i * 64) + bit;
+      if (sendIndex >= sendSectionCount) {
+        return kHyperVNetworkRNDISSendSectionIndexInvalid;
+      }
+      
+      if (OSCompareAndSwap64(value, value | (1ULL << bit), &sendIndexMap[i])) {
+        return sendIndex;
+      }
+      value = sendIndexMap[i];
     }
   }
 
@@ -96,7 +173,23 @@ UInt32 HyperVNetwork::getNextSendIndex() {
 }
 
 void HyperVNetwork::releaseSendIndex(UInt32 sendIndex) {
-  sendIndexMap[sendIndex / 8] &= ~(1 << (sendIndex % 8));
+  if (sendIndex >= sendSectionCount) {
+    return;
+  }
+  
+  UInt64 value;
+  do {
+    value = sendIndexMap[sendIndex / 64];
+  } while (!OSCompareAndSwap64(value, value & ~(1ULL << (sendIndex % 64)), &sendIndexMap[sendIndex / 64]));
+  
+  //
+  // Restart the output queue if it was stalled waiting for a free send section.
+  //
+  if (isSendStalled) {
+    isSendStalled = false;
+    setProperty(kHyperVNetworkSendStallCountKey, sendStallCount, 64);
+    getOutputQueue()->service(IOBasicOutputQueue::kServiceAsync);
+  }
 }
 
 HyperVNetworkRNDISRequest* HyperVNetwork::allocateRNDISRequest() {
@@ -197,18 +290,100 @@ bool HyperVNetwork::sendRNDISRequest(HyperVNetworkRNDISRequest *rndisRequest, bo
   return true;
 }
 
-bool HyperVNetwork::sendRNDISDataPacket(mbuf_t packet) {
+void HyperVNetwork::initSendSectionTemplates() {
+  //
+  // Pre-build the RNDIS data packet header in each send section.
+  // Fields that are the same for every packet are only written here.
+  //
+  for (UInt32 i = 0; i < sendSectionCount; i++) {
+    UInt8 *rndisBuffer = sendBuffer + (sendSectionSize * i);
+    HyperVNetworkRNDISMessage *rndisMsg = (HyperVNetworkRNDISMessage*)rndisBuffer;
+    memset(rndisBuffer, 0, sizeof (HyperVNetworkRNDISMessageDataPacket) + sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q) + 8);
+    
+    rndisMsg->msgType = kHyperVNetworkRNDISMessageTypePacket;
+    
+    //
+    // 802.1Q per-packet info always immediately follows the data packet header if used.
+    //
+    HyperVNetworkRNDISPerPacketInfoIEEE8021Q *ppiVLAN =
+      (HyperVNetworkRNDISPerPacketInfoIEEE8021Q*)(rndisBuffer + 8 + sizeof (HyperVNetworkRNDISMessageDataPacket));
+    ppiVLAN->header.size                = sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q);
+    ppiVLAN->header.type                = kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q;
+    ppiVLAN->header.perPacketInfoOffset = sizeof (HyperVNetworkRNDISPerPacketInfo);
+  }
+}
+
+UInt32 HyperVNetwork::sendRNDISDataPacket(mbuf_t packet) {
   size_t packetLength = mbuf_pkthdr_len(packet);
   
+  //
+  // VLAN tag is passed to Hyper-V as per-packet info.
+  //
+  UInt16 vlanTag;
+  bool hasVLANTag = mbuf_get_vlan_tag(packet, &vlanTag) == 0;
+  UInt32 ppiLength = hasVLANTag ? sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q) : 0;
+  
+  //
+  // Packet must fit within a single send section.
+  //
+  if (packetLength + ppiLength + sizeof (HyperVNetworkRNDISMessageDataPacket) + 8 > sendSectionSize) {
+    DBGLOG("Packet of %u bytes is too large for send section", packetLength);
+    freePacket(packet);
+    return kIOReturnOutputDropped;
+  }
+  
+  //
+  // Stall the output queue if the TX ring has no space for the send message, as the packet would otherwise be dropped
+  // after a send section was filled. Hyper-V signals once enough space is freed, which restarts the queue.
+  //
+  if (!hvDevice->isTxSpaceAvailable(sizeof (HyperVNetworkMessage))) {
+    isSendRingStalled = true;
+    hvDevice->setTxPendingSendSize(sizeof (HyperVNetworkMessage));
+    if (!hvDevice->isTxSpaceAvailable(sizeof (HyperVNetworkMessage))) {
+      sendStallCount++;
+      return kIOReturnOutputStall;
+    }
+  }
+  
   UInt32 sendIndex = getNextSendIndex();
+  if (sendIndex == kHyperVNetworkRNDISSendSectionIndexInvalid) {
+    //
+    // All send sections are in use by Hyper-V, stall the output queue until one is released.
+    // Check again after marking the stall in case a section was released in between.
+    //
+    isSendStalled = true;
+    sendIndex = getNextSendIndex();
+    if (sendIndex == kHyperVNetworkRNDISSendSectionIndexInvalid) {
+      sendStallCount++;
+      return kIOReturnOutputStall;
+    }
+  }
+  
+  //
+  // Static header fields were already filled in by initSendSectionTemplates(), only set the fields specific to this packet.
+  //
   UInt8 *rndisBuffer = sendBuffer + (sendSectionSize * sendIndex);
   HyperVNetworkRNDISMessage *rndisMsg = (HyperVNetworkRNDISMessage*)rndisBuffer;
-  memset(rndisMsg, 0, sizeof (HyperVNetworkRNDISMessage));
-  
-  rndisMsg->msgType = kHyperVNetworkRNDISMessageTypePacket;
-  rndisMsg->dataPacket.dataOffset = sizeof (HyperVNetworkRNDISMessageDataPacket);
+  rndisMsg->dataPacket.dataOffset = sizeof (HyperVNetworkRNDISMessageDataPacket) + ppiLength;
   rndisMsg->dataPacket.dataLength = (UInt32)packetLength;
-  rndisMsg->msgLength = sizeof (HyperVNetworkRNDISMessageDataPacket) + 8 + rndisMsg->dataPacket.dataLength;
+  rndisMsg->msgLength = rndisMsg->dataPacket.dataOffset + 8 + rndisMsg->dataPacket.dataLength;
+  
+  if (hasVLANTag) {
+    //
+    // Convert standard VLAN tag into NDIS 802.1Q info.
+    //
+    rndisMsg->dataPacket.perPacketInfoOffset = sizeof (HyperVNetworkRNDISMessageDataPacket);
+    rndisMsg->dataPacket.perPacketInfoLength = ppiLength;
+    
+    HyperVNetworkRNDISPerPacketInfoIEEE8021Q *ppiVLAN =
+      (HyperVNetworkRNDISPerPacketInfoIEEE8021Q*)(rndisBuffer + 8 + sizeof (HyperVNetworkRNDISMessageDataPacket));
+    ppiVLAN->value = ((vlanTag & kHyperVNetworkRNDISIEEE8021QVLANIdMask) << kHyperVNetworkRNDISIEEE8021QVLANIdShift)
+                     | (((vlanTag >> 12) & 0x1) << kHyperVNetworkRNDISIEEE8021QCFIShift)
+                     | ((vlanTag >> 13) & kHyperVNetworkRNDISIEEE8021QPriorityMask);
+  } else {
+    rndisMsg->dataPacket.perPacketInfoOffset = 0;
+    rndisMsg->dataPacket.perPacketInfoLength = 0;
+  }
   
   rndisBuffer += rndisMsg->dataPacket.dataOffset + 8;
   for (mbuf_t pktCurrent = packet; pktCurrent != NULL; pktCurrent = mbuf_next(pktCurrent)) {
@@ -229,9 +404,16 @@ bool HyperVNetwork::sendRNDISDataPacket(mbuf_t packet) {
   netMsg.v1.sendRNDISPacket.sendBufferSectionSize = rndisMsg->msgLength;
   
   DBGLOG("Packet at index %u, size %u bytes", sendIndex, rndisMsg->msgLength);
-  hvDevice->writeInbandPacketWithTransactionId(&netMsg, sizeof (netMsg), sendIndex | kHyperVNetworkSendTransIdBits, true);
+  if (hvDevice->writeInbandPacketWithTransactionId(&netMsg, sizeof (netMsg), sendIndex | kHyperVNetworkSendTransIdBits, true) != kIOReturnSuccess) {
+    //
+    // Receive completions can take the ring space checked above, the packet is already freed so drop it.
+    //
+    DBGLOG("Failed to send packet at index %u", sendIndex);
+    releaseSendIndex(sendIndex);
+    return kIOReturnOutputDropped;
+  }
   
-  return true;
+  return kIOReturnOutputSuccess;
 }
 
 bool HyperVNetwork::initializeRNDIS() {
@@ -280,8 +462,18 @@ bool HyperVNetwork::queryRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32
            rndisRequest->message.queryComplete.status,
            rndisRequest->message.queryComplete.infoBufferOffset, rndisRequest->message.queryComplete.infoBufferLength);
     
-    memcpy(value, (UInt8*)(&rndisRequest->message.queryComplete) + rndisRequest->message.queryComplete.infoBufferOffset, rndisRequest->message.queryComplete.infoBufferLength);
-    *valueSize = rndisRequest->message.queryComplete.infoBufferLength;
+    result = rndisRequest->message.queryComplete.status == kHyperVNetworkRNDISStatusSuccess;
+    if (result) {
+      //
+      // Do not copy more than the caller's buffer can hold.
+      //
+      UInt32 infoLength = rndisRequest->message.queryComplete.infoBufferLength;
+      if (infoLength > *valueSize) {
+        infoLength = *valueSize;
+      }
+      memcpy(value, (UInt8*)(&rndisRequest->message.queryComplete) + rndisRequest->message.queryComplete.infoBufferOffset, infoLength);
+      *valueSize = infoLength;
+    }
   } else {
     SYSLOG("Failed to send OID 0x%X query", oid);
   }
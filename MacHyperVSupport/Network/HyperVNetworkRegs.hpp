@@ -15,8 +15,40 @@
 
 #define kHyperVNetworkReceiveBufferSize         (1024 * 1024 * 16)
 #define kHyperVNetworkReceiveBufferSizeLegacy   (1024 * 1024 * 15)
+#define kHyperVNetworkReceiveBufferSizeMax      (1024 * 1024 * 31)
+#define kHyperVNetworkReceiveBufferMaxSections  4
+#define kHyperVNetworkRxRingHighUsage           75
 #define kHyperVNetworkSendBufferSize            (1024 * 1024 * 15)
 
+//
+// IORegistry properties used for tuning buffer layout.
+//
+#define kHyperVNetworkReceiveBufferSizeKey      "ReceiveBufferSize"
+#define kHyperVNetworkSendBufferSizeKey         "SendBufferSize"
+#define kHyperVNetworkSendSectionSizeKey        "SendSectionSize"
+#define kHyperVNetworkSendSectionCountKey       "SendSectionCount"
+#define kHyperVNetworkSendStallCountKey         "SendStallCount"
+#define kHyperVNetworkReceiveBufferStatsKey     "ReceiveBufferStatistics"
+#define kHyperVNetworkVLANIdKey                 "VLANId"
+#define kHyperVNetworkVFSerialNumberKey         "VFSerialNumber"
+#define kHyperVNetworkDataPathKey               "DataPath"
+
+//
+// Retries while waiting for a VF interface to be attached to the network stack.
+//
+#define kHyperVNetworkVFAttachRetryMS           100
+#define kHyperVNetworkVFAttachRetryCount        50
+
+//
+// 802.1Q header inserted into frames sent through the VF.
+//
+#define kHyperVNetworkVLANHeaderLength          4
+
+//
+// Receive buffer size in MB can be overridden with this boot argument (protocol version 2 and newer only).
+//
+#define kHyperVNetworkReceiveBufferSizeBootArg  "hvnetrxbuf"
+
 //
 // Protocol versions.
 //
@@ -48,7 +80,14 @@ typedef enum : UInt32 {
   kHyperVNetworkMessageTypeV1SendSendBufferComplete,
   kHyperVNetworkMessageTypeV1RevokeSendBuffer,
   kHyperVNetworkMessageTypeV1SendRNDISPacket,
-  kHyperVNetworkMessageTypeV1SendRNDISPacketComplete
+  kHyperVNetworkMessageTypeV1SendRNDISPacketComplete,
+  
+  // Protocol version 2.
+  kHyperVNetworkMessageTypeV2SendNDISConfig               = 125,
+  
+  // Protocol version 4.
+  kHyperVNetworkMessageTypeV4SendVFAssociation            = 128,
+  kHyperVNetworkMessageTypeV4SwitchDataPath               = 129
 } HyperVNetworkMessageType;
 
 //
@@ -231,6 +270,69 @@ typedef union __attribute__((packed)) {
   HyperVNetworkV1MessageSendRNDISPacketComplete     sendRNDISPacketComplete;
 } HyperVNetworkV1Message;
 
+//
+// Protocol version 2
+//
+
+//
+// NDIS capabilities reported to Hyper-V.
+//
+#define kHyperVNetworkNDISCapabilityVMQ           BIT(0)
+#define kHyperVNetworkNDISCapabilityChimney       BIT(1)
+#define kHyperVNetworkNDISCapabilitySRIOV         BIT(2)
+#define kHyperVNetworkNDISCapabilityIEEE8021Q     BIT(3)
+#define kHyperVNetworkNDISCapabilityCorrelationId BIT(4)
+#define kHyperVNetworkNDISCapabilityTeaming       BIT(5)
+
+//
+// Send NDIS configuration to Hyper-V.
+//
+typedef struct __attribute__((packed)) {
+  UInt32 mtu;
+  UInt32 reserved;
+  UInt64 capabilities;
+} HyperVNetworkV2MessageSendNDISConfig;
+
+//
+// Protocol version 2 messages.
+//
+typedef union __attribute__((packed)) {
+  HyperVNetworkV2MessageSendNDISConfig              sendNDISConfig;
+} HyperVNetworkV2Message;
+
+//
+// Protocol version 4
+//
+
+//
+// Sent by Hyper-V when an SR-IOV virtual function is allocated to or removed from this NIC.
+// The serial number matches the one in the VF's vPCI function description.
+//
+typedef struct __attribute__((packed)) {
+  UInt32 allocated;
+  UInt32 serialNumber;
+} HyperVNetworkV4MessageSendVFAssociation;
+
+//
+// Datapath used by Hyper-V for packets to this NIC.
+//
+typedef enum : UInt32 {
+  kHyperVNetworkDataPathSynthetic = 0,
+  kHyperVNetworkDataPathVF        = 1
+} HyperVNetworkDataPath;
+
+typedef struct __attribute__((packed)) {
+  HyperVNetworkDataPath activeDataPath;
+} HyperVNetworkV4MessageSwitchDataPath;
+
+//
+// Protocol version 4 messages.
+//
+typedef union __attribute__((packed)) {
+  HyperVNetworkV4MessageSendVFAssociation           sendVFAssociation;
+  HyperVNetworkV4MessageSwitchDataPath              switchDataPath;
+} HyperVNetworkV4Message;
+
 //
 // Main message structure.
 //
@@ -239,6 +341,8 @@ typedef struct __attribute__((packed)) {
   union {
     HyperVNetworkMessageInit    init;
     HyperVNetworkV1Message      v1;
+    HyperVNetworkV2Message      v2;
+    HyperVNetworkV4Message      v4;
   } __attribute__((packed));
   UInt8 padd[sizeof (HyperVNetworkMessageInit)]; // TODO: required for now for some reason, otherwise Hyper-V rejects message
 } HyperVNetworkMessage;
@@ -297,6 +401,43 @@ typedef struct {
   UInt32 reserved;
 } HyperVNetworkRNDISMessageDataPacket;
 
+//
+// Per-packet info types.
+//
+typedef enum : UInt32 {
+  kHyperVNetworkRNDISPerPacketInfoTypeTCPChecksum   = 0,
+  kHyperVNetworkRNDISPerPacketInfoTypeIPSecInfo     = 1,
+  kHyperVNetworkRNDISPerPacketInfoTypeLSOInfo       = 2,
+  kHyperVNetworkRNDISPerPacketInfoTypeClassHandle   = 3,
+  kHyperVNetworkRNDISPerPacketInfoTypeReserved      = 4,
+  kHyperVNetworkRNDISPerPacketInfoTypeSGList        = 5,
+  kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q     = 6
+} HyperVNetworkRNDISPerPacketInfoType;
+
+//
+// Per-packet info header, data follows at the specified offset.
+// Offsets are from the beginning of this structure.
+//
+typedef struct {
+  UInt32                              size;
+  HyperVNetworkRNDISPerPacketInfoType type;
+  UInt32                              perPacketInfoOffset;
+} HyperVNetworkRNDISPerPacketInfo;
+
+//
+// 802.1Q per-packet info.
+// Bits 0-2 are priority, bit 3 is CFI, and bits 4-15 are VLAN ID.
+//
+#define kHyperVNetworkRNDISIEEE8021QPriorityMask    0x7
+#define kHyperVNetworkRNDISIEEE8021QCFIShift        3
+#define kHyperVNetworkRNDISIEEE8021QVLANIdShift     4
+#define kHyperVNetworkRNDISIEEE8021QVLANIdMask      0xFFF
+
+typedef struct {
+  HyperVNetworkRNDISPerPacketInfo header;
+  UInt32                          value;
+} HyperVNetworkRNDISPerPacketInfoIEEE8021Q;
+
 //
 // Initialization message.
 //
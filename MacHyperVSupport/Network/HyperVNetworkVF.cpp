@@ -0,0 +1,383 @@
+//
+//  HyperVNetworkVF.cpp
+//  Hyper-V network driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVNetwork.hpp"
+
+extern "C" {
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <sys/sockio.h>
+}
+
+bool HyperVNetwork::initVF() {
+  vfLock = IOLockAlloc();
+  if (vfLock == NULL) {
+    SYSLOG("Failed to allocate VF lock");
+    return false;
+  }
+
+  vfTimerSource = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &HyperVNetwork::handleVFTimer));
+  if (vfTimerSource == NULL) {
+    SYSLOG("Failed to create VF timer event source");
+    return false;
+  }
+  getWorkLoop()->addEventSource(vfTimerSource);
+  vfTimerSource->enable();
+
+  //
+  // VFs are exposed through vPCI and driven by their own Ethernet driver.
+  // Watch for an Ethernet interface with the same MAC address as this NIC.
+  //
+  OSDictionary *matching = serviceMatching(kIOEthernetInterfaceClass);
+  if (matching == NULL) {
+    return false;
+  }
+  vfPublishNotifier   = addMatchingNotification(gIOFirstPublishNotification, matching, &HyperVNetwork::handleVFPublish, this);
+  vfTerminateNotifier = addMatchingNotification(gIOTerminatedNotification, matching, &HyperVNetwork::handleVFTerminate, this);
+  matching->release();
+
+  if (vfPublishNotifier == NULL || vfTerminateNotifier == NULL) {
+    SYSLOG("Failed to register for VF notifications");
+    return false;
+  }
+
+  setProperty(kHyperVNetworkDataPathKey, "Synthetic");
+  DBGLOG("SR-IOV VF support initialized");
+  return true;
+}
+
+void HyperVNetwork::handleVFAssociation(HyperVNetworkV4MessageSendVFAssociation *vfAssociation) {
+  DBGLOG("VF association: allocated %u, serial number 0x%X", vfAssociation->allocated, vfAssociation->serialNumber);
+
+  isVFAllocated  = vfAssociation->allocated != 0;
+  vfSerialNumber = vfAssociation->serialNumber;
+  if (isVFAllocated) {
+    setProperty(kHyperVNetworkVFSerialNumberKey, vfSerialNumber, 32);
+  } else {
+    removeProperty(kHyperVNetworkVFSerialNumberKey);
+  }
+
+  //
+  // Association may arrive while connecting, before the VF state is set up.
+  //
+  if (vfTimerSource != NULL) {
+    vfAttachRetryCount = 0;
+    updateDataPath();
+  }
+}
+
+bool HyperVNetwork::handleVFPublish(void *target, void *refCon, IOService *newService, IONotifier *notifier) {
+  HyperVNetwork *hvNetwork = (HyperVNetwork *)target;
+  if (!hvNetwork->isVFInterface(newService)) {
+    return true;
+  }
+
+  IOLockLock(hvNetwork->vfLock);
+  if (hvNetwork->vfInterface == NULL) {
+    hvNetwork->vfInterface = (IOEthernetInterface *)newService;
+    hvNetwork->vfInterface->retain();
+  }
+  IOLockUnlock(hvNetwork->vfLock);
+
+  //
+  // Interface may not be attached to the network stack yet, retry from the timer if needed.
+  //
+  SYSLOG("Found SR-IOV VF interface %s", newService->getName());
+  hvNetwork->getWorkLoop()->runAction(OSMemberFunctionCast(IOWorkLoop::Action, hvNetwork, &HyperVNetwork::updateDataPathGated), hvNetwork);
+  return true;
+}
+
+bool HyperVNetwork::handleVFTerminate(void *target, void *refCon, IOService *newService, IONotifier *notifier) {
+  HyperVNetwork       *hvNetwork = (HyperVNetwork *)target;
+  IOEthernetInterface *interface = NULL;
+
+  IOLockLock(hvNetwork->vfLock);
+  if (hvNetwork->vfInterface == newService) {
+    interface = hvNetwork->vfInterface;
+    hvNetwork->vfInterface = NULL;
+  }
+  IOLockUnlock(hvNetwork->vfLock);
+
+  //
+  // Switch back to the synthetic datapath before the VF goes away.
+  //
+  if (interface != NULL) {
+    SYSLOG("SR-IOV VF interface %s removed", newService->getName());
+    hvNetwork->getWorkLoop()->runAction(OSMemberFunctionCast(IOWorkLoop::Action, hvNetwork, &HyperVNetwork::updateDataPathGated), hvNetwork);
+    interface->release();
+  }
+  return true;
+}
+
+errno_t HyperVNetwork::handleVFInput(void *cookie, ifnet_t interface, protocol_family_t protocol, mbuf_t *data, char **framePtr) {
+  HyperVNetwork *hvNetwork = (HyperVNetwork *)cookie;
+  ifnet_t       ifnet      = hvNetwork->ethInterface->getIfnet();
+  mbuf_t        packet     = *data;
+
+  if (ifnet == NULL || framePtr == NULL || *framePtr == NULL) {
+    return 0;
+  }
+
+  //
+  // Restore the Ethernet header stripped by the VF interface.
+  //
+  if ((UInt8 *)*framePtr < (UInt8 *)mbuf_datastart(packet) || (UInt8 *)*framePtr > (UInt8 *)mbuf_data(packet)) {
+    return 0;
+  }
+  size_t headerLength = (UInt8 *)mbuf_data(packet) - (UInt8 *)*framePtr;
+  mbuf_setdata(packet, *framePtr, mbuf_len(packet) + headerLength);
+  mbuf_pkthdr_adjustlen(packet, (int)headerLength);
+
+  //
+  // Inject packet into this NIC's interface so only one interface is used by the network stack.
+  //
+  struct ifnet_stat_increment_param stats;
+  memset(&stats, 0, sizeof (stats));
+  stats.packets_in = 1;
+  stats.bytes_in   = (UInt32)mbuf_pkthdr_len(packet);
+
+  mbuf_pkthdr_setrcvif(packet, ifnet);
+  mbuf_pkthdr_setheader(packet, mbuf_data(packet));
+  ifnet_input(ifnet, packet, &stats);
+  return EJUSTRETURN;
+}
+
+void HyperVNetwork::handleVFDetached(void *cookie, ifnet_t interface) {
+  HyperVNetwork *hvNetwork = (HyperVNetwork *)cookie;
+  if (hvNetwork->debugEnabled) {
+    DBGLOG_PRINT("HyperVNetwork", "VF interface filter detached");
+  }
+
+  //
+  // Filter holds a reference to this NIC until it is fully detached.
+  //
+  hvNetwork->release();
+}
+
+void HyperVNetwork::handleVFTimer(IOTimerEventSource *sender) {
+  updateDataPath();
+}
+
+IOReturn HyperVNetwork::updateDataPathGated() {
+  vfAttachRetryCount = 0;
+  updateDataPath();
+  return kIOReturnSuccess;
+}
+
+bool HyperVNetwork::isVFInterface(IOService *service) {
+  IOEthernetInterface *interface = OSDynamicCast(IOEthernetInterface, service);
+  if (interface == NULL) {
+    return false;
+  }
+
+  //
+  // Skip synthetic NICs, including this one.
+  //
+  IOEthernetController *controller = OSDynamicCast(IOEthernetController, interface->getController());
+  if (controller == NULL || OSDynamicCast(HyperVNetwork, controller) != NULL) {
+    return false;
+  }
+
+  IOEthernetAddress address;
+  if (controller->getHardwareAddress(&address) != kIOReturnSuccess) {
+    return false;
+  }
+  return memcmp(address.bytes, ethAddress.bytes, sizeof (address.bytes)) == 0;
+}
+
+bool HyperVNetwork::switchDataPath(HyperVNetworkDataPath dataPath) {
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV4SwitchDataPath;
+  netMsg.v4.switchDataPath.activeDataPath = dataPath;
+
+  //
+  // This runs on the workloop, a response cannot be waited on.
+  //
+  if (hvDevice->writeInbandPacket(&netMsg, sizeof (netMsg), false) != kIOReturnSuccess) {
+    SYSLOG("Failed to switch datapath to %s", dataPath == kHyperVNetworkDataPathVF ? "VF" : "synthetic");
+    return false;
+  }
+
+  setProperty(kHyperVNetworkDataPathKey, dataPath == kHyperVNetworkDataPathVF ? "VF" : "Synthetic");
+  SYSLOG("Switched datapath to %s", dataPath == kHyperVNetworkDataPathVF ? "VF" : "synthetic");
+  return true;
+}
+
+void HyperVNetwork::updateDataPath() {
+  IOEthernetInterface *interface;
+
+  IOLockLock(vfLock);
+  interface = vfInterface;
+  if (interface != NULL) {
+    interface->retain();
+  }
+  IOLockUnlock(vfLock);
+
+  bool useVF = isVFAllocated && interface != NULL;
+  if (useVF && vfFilter == NULL) {
+    ifnet_t ifnet = interface->getIfnet();
+    if (ifnet == NULL) {
+      if (vfAttachRetryCount++ < kHyperVNetworkVFAttachRetryCount) {
+        vfTimerSource->setTimeoutMS(kHyperVNetworkVFAttachRetryMS);
+      } else {
+        SYSLOG("Timed out waiting for VF interface to attach");
+      }
+      interface->release();
+      return;
+    }
+
+    //
+    // Redirect VF input to this interface, and bring the VF up.
+    //
+    struct iff_filter filter;
+    memset(&filter, 0, sizeof (filter));
+    filter.iff_cookie   = this;
+    filter.iff_name     = "com.goldfish64.HyperVNetwork.VF";
+    filter.iff_input    = &HyperVNetwork::handleVFInput;
+    filter.iff_detached = &HyperVNetwork::handleVFDetached;
+
+    retain();
+    errno_t status = iflt_attach(ifnet, &filter, &vfFilter);
+    if (status != 0) {
+      SYSLOG("Failed to attach VF interface filter: %d", status);
+      vfFilter = NULL;
+      release();
+      interface->release();
+      return;
+    }
+    ifnet_set_flags(ifnet, IFF_UP, IFF_UP);
+    ifnet_ioctl(ifnet, 0, SIOCSIFFLAGS, NULL);
+
+    ifnet_reference(ifnet);
+    IOLockLock(vfLock);
+    vfIfnet = ifnet;
+    IOLockUnlock(vfLock);
+
+    if (switchDataPath(kHyperVNetworkDataPathVF)) {
+      isDataPathVF = true;
+    } else {
+      //
+      // Hyper-V is still using the synthetic datapath, detach from the VF and try again later.
+      //
+      detachVFFilter();
+      if (vfAttachRetryCount++ < kHyperVNetworkVFAttachRetryCount) {
+        vfTimerSource->setTimeoutMS(kHyperVNetworkVFAttachRetryMS);
+      } else {
+        SYSLOG("Giving up switching datapath to VF");
+      }
+    }
+  } else if (!useVF && vfFilter != NULL) {
+    //
+    // Transmit on the synthetic path first, then tell Hyper-V to stop using the VF.
+    //
+    isDataPathVF = false;
+    switchDataPath(kHyperVNetworkDataPathSynthetic);
+    detachVFFilter();
+  }
+
+  if (interface != NULL) {
+    interface->release();
+  }
+}
+
+void HyperVNetwork::detachVFFilter() {
+  IOLockLock(vfLock);
+  ifnet_t ifnet = vfIfnet;
+  vfIfnet = NULL;
+  IOLockUnlock(vfLock);
+
+  //
+  // This NIC is released by handleVFDetached() once the filter is detached.
+  //
+  iflt_detach(vfFilter);
+  vfFilter = NULL;
+  if (ifnet != NULL) {
+    ifnet_release(ifnet);
+  }
+}
+
+IOReturn HyperVNetwork::freeVFGated() {
+  vfTimerSource->cancelTimeout();
+  isVFAllocated = false;
+
+  if (vfFilter != NULL) {
+    isDataPathVF = false;
+    switchDataPath(kHyperVNetworkDataPathSynthetic);
+    detachVFFilter();
+  }
+  return kIOReturnSuccess;
+}
+
+void HyperVNetwork::freeVF() {
+  //
+  // Stop VF notifications first so the VF state is no longer changed.
+  //
+  if (vfPublishNotifier != NULL) {
+    vfPublishNotifier->remove();
+    vfPublishNotifier = NULL;
+  }
+  if (vfTerminateNotifier != NULL) {
+    vfTerminateNotifier->remove();
+    vfTerminateNotifier = NULL;
+  }
+
+  if (vfTimerSource != NULL) {
+    getWorkLoop()->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &HyperVNetwork::freeVFGated), this);
+    vfTimerSource->disable();
+    getWorkLoop()->removeEventSource(vfTimerSource);
+    OSSafeReleaseNULL(vfTimerSource);
+  }
+
+  if (vfLock != NULL) {
+    IOLockLock(vfLock);
+    IOEthernetInterface *interface = vfInterface;
+    vfInterface = NULL;
+    IOLockUnlock(vfLock);
+    OSSafeReleaseNULL(interface);
+
+    IOLockFree(vfLock);
+    vfLock = NULL;
+  }
+}
+
+ifnet_t HyperVNetwork::copyVFIfnet() {
+  ifnet_t ifnet;
+
+  IOLockLock(vfLock);
+  ifnet = vfIfnet;
+  if (ifnet != NULL) {
+    ifnet_reference(ifnet);
+  }
+  IOLockUnlock(vfLock);
+  return ifnet;
+}
+
+bool HyperVNetwork::insertVLANTag(mbuf_t *packet) {
+  UInt16 vlanTag;
+  if (mbuf_get_vlan_tag(*packet, &vlanTag) != 0) {
+    return true;
+  }
+
+  //
+  // Insert 802.1Q header after the destination and source addresses.
+  // The packet is freed on failure.
+  //
+  if (mbuf_prepend(packet, kHyperVNetworkVLANHeaderLength, MBUF_DONTWAIT) != 0) {
+    return false;
+  }
+  if (mbuf_pullup(packet, kHyperVNetworkVLANHeaderLength + ETHER_HDR_LEN) != 0) {
+    return false;
+  }
+
+  UInt8 *frame = (UInt8 *)mbuf_data(*packet);
+  memmove(frame, frame + kHyperVNetworkVLANHeaderLength, ETHER_ADDR_LEN * 2);
+  *(UInt16 *)&frame[ETHER_ADDR_LEN * 2]                       = OSSwapHostToBigInt16(ETHERTYPE_VLAN);
+  *(UInt16 *)&frame[(ETHER_ADDR_LEN * 2) + sizeof (UInt16)] = OSSwapHostToBigInt16(vlanTag);
+  mbuf_clear_vlan_tag(*packet);
+  return true;
+}
@@ -0,0 +1,193 @@
+//
+//  HyperVPCIBridge.cpp
+//  Hyper-V virtual PCI bridge driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVPCIBridge.hpp"
+#include "HyperVPCIRoot.hpp"
+
+OSDefineMetaClassAndStructors(HyperVPCIBridge, super);
+
+bool HyperVPCIBridge::start(IOService *provider) {
+  bool channelOpen = false;
+
+  //
+  // Get parent VMBus device object.
+  //
+  hvDevice = OSDynamicCast(HyperVVMBusDevice, provider);
+  if (hvDevice == NULL) {
+    return false;
+  }
+  hvDevice->retain();
+
+  do {
+    //
+    // Each vPCI channel is its own bus.
+    //
+    if (!HyperVPCIRoot::allocateBusNumber(&busNum)) {
+      break;
+    }
+
+    relationsLock  = IOLockAlloc();
+    configLock     = IOSimpleLockAlloc();
+    workLock       = IOLockAlloc();
+    workThreadCall = thread_call_allocate(&HyperVPCIBridge::handleWorkThreadCall, this);
+    if (relationsLock == NULL || configLock == NULL || workLock == NULL || workThreadCall == NULL) {
+      break;
+    }
+
+    //
+    // Configure interrupt.
+    //
+    interruptSource =
+      IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &HyperVPCIBridge::handleInterrupt), provider, 0);
+    if (interruptSource == NULL) {
+      SYSLOG("Failed to create interrupt event source");
+      break;
+    }
+    getWorkLoop()->addEventSource(interruptSource);
+    interruptSource->enable();
+
+    //
+    // Configure the channel and get assigned functions from Hyper-V.
+    //
+    if (!hvDevice->openChannel(kHyperVPCIBridgeRingBufferSize, kHyperVPCIBridgeRingBufferSize)) {
+      break;
+    }
+    channelOpen = true;
+
+    if (!connectPCIBridge()) {
+      break;
+    }
+
+    //
+    // Register with root PCI bus and start bus.
+    //
+    if (!HyperVPCIRoot::registerChildPCIBridge(this)) {
+      SYSLOG("Failed to register with root PCI bus instance");
+      break;
+    }
+
+    if (!super::start(provider)) {
+      HyperVPCIRoot::unregisterChildPCIBridge(this);
+      break;
+    }
+
+    SYSLOG("Hyper-V virtual PCI bus %u initialized with %u functions", busNum, functionCount);
+    return true;
+  } while (false);
+
+  //
+  // Channel is only closed if it was opened.
+  //
+  if (!channelOpen) {
+    OSSafeReleaseNULL(hvDevice);
+  }
+  freePCIBridge();
+  HyperVPCIRoot::releaseBusNumber(busNum);
+  return false;
+}
+
+void HyperVPCIBridge::stop(IOService *provider) {
+  HyperVPCIRoot::unregisterChildPCIBridge(this);
+  freePCIBridge();
+  HyperVPCIRoot::releaseBusNumber(busNum);
+  super::stop(provider);
+}
+
+void HyperVPCIBridge::freePCIBridge() {
+  //
+  // Pending work needs the channel to communicate with Hyper-V.
+  //
+  stopWork();
+
+  if (hvDevice != NULL) {
+    hvDevice->closeChannel();
+  }
+
+  if (interruptSource != NULL) {
+    interruptSource->disable();
+    getWorkLoop()->removeEventSource(interruptSource);
+    OSSafeReleaseNULL(interruptSource);
+  }
+
+  freeConfigWindow();
+
+  if (relationsLock != NULL) {
+    IOLockFree(relationsLock);
+    relationsLock = NULL;
+  }
+  if (configLock != NULL) {
+    IOSimpleLockFree(configLock);
+    configLock = NULL;
+  }
+  if (workThreadCall != NULL) {
+    thread_call_free(workThreadCall);
+    workThreadCall = NULL;
+  }
+  if (workLock != NULL) {
+    IOLockFree(workLock);
+    workLock = NULL;
+  }
+  OSSafeReleaseNULL(hvDevice);
+}
+
+bool HyperVPCIBridge::configure(IOService *provider) {
+  //
+  // Add MMIO ranges containing assigned BARs.
+  //
+  if (mmioLowSize != 0) {
+    addBridgeMemoryRange(mmioLowBase, mmioLowSize, true);
+  }
+  if (mmioHighSize != 0) {
+    addBridgeMemoryRange(mmioHighBase, mmioHighSize, true);
+  }
+  return super::configure(provider);
+}
+
+UInt32 HyperVPCIBridge::configRead32(IOPCIAddressSpace space, UInt8 offset) {
+  HyperVPCIBridgeFunction *function = getFunction(space);
+  if (function == NULL) {
+    return 0xFFFFFFFF;
+  }
+  return readConfigSpace(function, offset, sizeof (UInt32));
+}
+
+void HyperVPCIBridge::configWrite32(IOPCIAddressSpace space, UInt8 offset, UInt32 data) {
+  HyperVPCIBridgeFunction *function = getFunction(space);
+  if (function != NULL) {
+    writeConfigSpace(function, offset, sizeof (UInt32), data);
+  }
+}
+
+UInt16 HyperVPCIBridge::configRead16(IOPCIAddressSpace space, UInt8 offset) {
+  HyperVPCIBridgeFunction *function = getFunction(space);
+  if (function == NULL) {
+    return 0xFFFF;
+  }
+  return readConfigSpace(function, offset, sizeof (UInt16));
+}
+
+void HyperVPCIBridge::configWrite16(IOPCIAddressSpace space, UInt8 offset, UInt16 data) {
+  HyperVPCIBridgeFunction *function = getFunction(space);
+  if (function != NULL) {
+    writeConfigSpace(function, offset, sizeof (UInt16), data);
+  }
+}
+
+UInt8 HyperVPCIBridge::configRead8(IOPCIAddressSpace space, UInt8 offset) {
+  HyperVPCIBridgeFunction *function = getFunction(space);
+  if (function == NULL) {
+    return 0xFF;
+  }
+  return readConfigSpace(function, offset, sizeof (UInt8));
+}
+
+void HyperVPCIBridge::configWrite8(IOPCIAddressSpace space, UInt8 offset, UInt8 data) {
+  HyperVPCIBridgeFunction *function = getFunction(space);
+  if (function != NULL) {
+    writeConfigSpace(function, offset, sizeof (UInt8), data);
+  }
+}
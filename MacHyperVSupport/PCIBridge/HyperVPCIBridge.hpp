@@ -0,0 +1,143 @@
+//
+//  HyperVPCIBridge.hpp
+//  Hyper-V virtual PCI bridge driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVPCIBridge_hpp
+#define HyperVPCIBridge_hpp
+
+#include "HyperVVMBusDevice.hpp"
+#include "HyperVPCIBridgeRegs.hpp"
+#include "HyperV.hpp"
+
+#include <IOKit/pci/IOPCIBridge.h>
+#include <kern/thread_call.h>
+
+#define super IOPCIBridge
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVPCIBridge", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVPCIBridge", str, ## __VA_ARGS__)
+
+//
+// Function assigned to this bus by Hyper-V.
+//
+typedef struct {
+  HyperVPCIBridgeFunctionDescription  description;
+  bool                                isPresent;
+  UInt32                              probedBARs[kHyperVPCIBridgeBARCount];
+  UInt64                              assignedBARs[kHyperVPCIBridgeBARCount];
+  UInt8                               msiCapabilityOffset;
+  bool                                hasInterrupt;
+  HyperVPCIBridgeInterruptDescriptor  interruptDescriptor;
+} HyperVPCIBridgeFunction;
+
+class HyperVPCIBridge : public IOPCIBridge {
+  OSDeclareDefaultStructors(HyperVPCIBridge);
+
+private:
+  //
+  // Parent VMBus device.
+  //
+  HyperVVMBusDevice       *hvDevice;
+  IOInterruptEventSource  *interruptSource;
+
+  HyperVPCIBridgeProtocolVersion  protocolVersion;
+  UInt8                           busNum;
+
+  //
+  // Functions on this bus.
+  //
+  HyperVPCIBridgeFunction functions[kHyperVPCIBridgeMaxDevices];
+  UInt32                  functionCount;
+  IOLock                  *relationsLock;
+  bool                    isWaitingRelations;
+
+  //
+  // MSI changes and ejections wait on Hyper-V, and are handled outside of config space accesses and the workloop.
+  //
+  thread_call_t           workThreadCall;
+  IOLock                  *workLock;
+  UInt32                  pendingMSIMask;
+  UInt32                  pendingEjectMask;
+  bool                    isWorkRunning;
+  bool                    isStopping;
+
+  //
+  // Config space window and MMIO for BARs.
+  //
+  IOSimpleLock            *configLock;
+  UInt64                  configWindowPhysAddress;
+  IOMemoryDescriptor      *configWindowDescriptor;
+  IOMemoryMap             *configWindowMap;
+  volatile UInt8          *configWindow;
+  UInt64                  mmioLowBase;
+  UInt64                  mmioLowSize;
+  UInt64                  mmioHighBase;
+  UInt64                  mmioHighSize;
+
+  void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
+  void handleIncomingMessage(HyperVPCIBridgeMessage *pciMessage, UInt32 messageLength);
+  void handleBusRelations(HyperVPCIBridgeMessage *pciMessage, UInt32 messageLength);
+  void handleEject(UInt32 winSlot);
+  void scheduleWork(UInt32 *pendingMask, UInt32 functionIndex);
+  static void handleWorkThreadCall(thread_call_param_t param0, thread_call_param_t param1);
+  void ejectFunction(HyperVPCIBridgeFunction *function);
+  void sendEjectionComplete(UInt32 winSlot);
+  void stopWork();
+
+  bool sendPCIMessage(HyperVPCIBridgeMessage *pciMessage, UInt32 messageLength, HyperVPCIBridgeResponse *pciResponse = NULL);
+  bool negotiateProtocolVersion();
+  bool allocateConfigWindow();
+  void freeConfigWindow();
+  bool enterD0();
+  bool queryBusRelations();
+  bool queryResourceRequirements(HyperVPCIBridgeFunction *function);
+  bool assignBARs();
+  bool sendResourcesAssigned(HyperVPCIBridgeFunction *function);
+  bool connectPCIBridge();
+  void freePCIBridge();
+
+  HyperVPCIBridgeFunction *getFunction(IOPCIAddressSpace space);
+  UInt32 readConfigWindow(HyperVPCIBridgeFunction *function, UInt8 offset, UInt8 size);
+  void writeConfigWindow(HyperVPCIBridgeFunction *function, UInt8 offset, UInt8 size, UInt32 data);
+  UInt32 readConfigSpace(HyperVPCIBridgeFunction *function, UInt8 offset, UInt8 size);
+  void writeConfigSpace(HyperVPCIBridgeFunction *function, UInt8 offset, UInt8 size, UInt32 data);
+  UInt8 findMSICapability(HyperVPCIBridgeFunction *function);
+  void updateMSI(HyperVPCIBridgeFunction *function);
+
+public:
+  //
+  // IOService overrides.
+  //
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+
+  //
+  // IOPCIBridge overrides.
+  //
+  virtual bool configure(IOService *provider) APPLE_KEXT_OVERRIDE;
+  IODeviceMemory *ioDeviceMemory() APPLE_KEXT_OVERRIDE { return NULL; }
+  UInt32 configRead32(IOPCIAddressSpace space, UInt8 offset) APPLE_KEXT_OVERRIDE;
+  void configWrite32(IOPCIAddressSpace space, UInt8 offset, UInt32 data) APPLE_KEXT_OVERRIDE;
+  UInt16 configRead16(IOPCIAddressSpace space, UInt8 offset) APPLE_KEXT_OVERRIDE;
+  void configWrite16(IOPCIAddressSpace space, UInt8 offset, UInt16 data) APPLE_KEXT_OVERRIDE;
+  UInt8 configRead8(IOPCIAddressSpace space, UInt8 offset) APPLE_KEXT_OVERRIDE;
+  void configWrite8(IOPCIAddressSpace space, UInt8 offset, UInt8 data) APPLE_KEXT_OVERRIDE;
+
+  IOPCIAddressSpace getBridgeSpace() APPLE_KEXT_OVERRIDE {
+    IOPCIAddressSpace space = { 0 };
+    return space;
+  }
+
+  UInt8 firstBusNum() APPLE_KEXT_OVERRIDE {
+    return busNum;
+  }
+
+  UInt8 lastBusNum() APPLE_KEXT_OVERRIDE {
+    return busNum;
+  }
+};
+
+#endif
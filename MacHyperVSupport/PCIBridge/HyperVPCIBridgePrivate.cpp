@@ -0,0 +1,811 @@
+//
+//  HyperVPCIBridgePrivate.cpp
+//  Hyper-V virtual PCI bridge driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVPCIBridge.hpp"
+#include "HyperVPCIRoot.hpp"
+
+#include <IOKit/pci/IOPCIDevice.h>
+
+//
+// Gets size of a BAR from the value probed by Hyper-V.
+// I/O BARs are not supported by vPCI.
+//
+static UInt64 getProbedBARSize(const UInt32 *probedBARs, UInt32 index, bool *is64Bit) {
+  UInt32 bar = probedBARs[index];
+  *is64Bit = false;
+
+  if (bar == 0 || (bar & 0x1) != 0) {
+    return 0;
+  }
+  if (((bar >> 1) & 0x3) == 0x2 && index + 1 < kHyperVPCIBridgeBARCount) {
+    *is64Bit = true;
+    UInt64 mask = ((UInt64)probedBARs[index + 1] << 32) | (bar & ~0xFULL);
+    return ~mask + 1;
+  }
+  return (UInt32)(~(bar & ~0xFU) + 1);
+}
+
+void HyperVPCIBridge::handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count) {
+  VMBusPacketType type;
+  UInt32 headerLength;
+  UInt32 totalLength;
+
+  void *responseBuffer;
+  UInt32 responseLength;
+
+  while (hvDevice->nextPacketAvailable(&type, &headerLength, &totalLength)) {
+    UInt8 *buffer = (UInt8 *)IOMalloc(totalLength);
+    if (buffer == NULL) {
+      SYSLOG("Failed to allocate packet of %u bytes", totalLength);
+      break;
+    }
+    if (hvDevice->readRawPacket(buffer, totalLength) != kIOReturnSuccess) {
+      IOFree(buffer, totalLength);
+      break;
+    }
+
+    switch (type) {
+      case kVMBusPacketTypeCompletion:
+        if (hvDevice->getPendingTransaction(((VMBusPacketHeader *)buffer)->transactionId, &responseBuffer, &responseLength)) {
+          if (responseLength > totalLength - headerLength) {
+            responseLength = totalLength - headerLength;
+          }
+          memcpy(responseBuffer, buffer + headerLength, responseLength);
+          hvDevice->wakeTransaction(((VMBusPacketHeader *)buffer)->transactionId);
+        }
+        break;
+
+      case kVMBusPacketTypeDataInband:
+        if (totalLength - headerLength >= sizeof (HyperVPCIBridgeMessageType)) {
+          handleIncomingMessage((HyperVPCIBridgeMessage *)(buffer + headerLength), totalLength - headerLength);
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    IOFree(buffer, totalLength);
+  }
+}
+
+void HyperVPCIBridge::handleIncomingMessage(HyperVPCIBridgeMessage *pciMessage, UInt32 messageLength) {
+  switch (pciMessage->type) {
+    case kHyperVPCIBridgeMessageTypeBusRelations:
+    case kHyperVPCIBridgeMessageTypeBusRelations2:
+      handleBusRelations(pciMessage, messageLength);
+      break;
+
+    case kHyperVPCIBridgeMessageTypeEject:
+      if (messageLength >= sizeof (pciMessage->type) + sizeof (pciMessage->child)) {
+        handleEject(pciMessage->child.winSlot);
+      }
+      break;
+
+    default:
+      DBGLOG("Unknown message type 0x%X", pciMessage->type);
+      break;
+  }
+}
+
+void HyperVPCIBridge::handleBusRelations(HyperVPCIBridgeMessage *pciMessage, UInt32 messageLength) {
+  bool isRelations2     = pciMessage->type == kHyperVPCIBridgeMessageTypeBusRelations2;
+  size_t descriptionSize = isRelations2 ? sizeof (HyperVPCIBridgeFunctionDescription2) : sizeof (HyperVPCIBridgeFunctionDescription);
+  size_t headerSize      = __offsetof(HyperVPCIBridgeMessage, busRelations.functions);
+
+  if (messageLength < headerSize
+      || (messageLength - headerSize) / descriptionSize < pciMessage->busRelations.deviceCount) {
+    SYSLOG("Invalid bus relations message of %u bytes", messageLength);
+    return;
+  }
+  DBGLOG("Got bus relations with %u functions", pciMessage->busRelations.deviceCount);
+
+  IOLockLock(relationsLock);
+
+  //
+  // Functions not in the relations have been removed.
+  // New functions are only configured during startup.
+  //
+  for (UInt32 i = 0; i < functionCount; i++) {
+    functions[i].isPresent = false;
+  }
+
+  UInt8 *descriptionData = (UInt8 *)pciMessage + headerSize;
+  for (UInt32 i = 0; i < pciMessage->busRelations.deviceCount; i++) {
+    HyperVPCIBridgeFunctionDescription *description = (HyperVPCIBridgeFunctionDescription *)(descriptionData + (i * descriptionSize));
+
+    bool found = false;
+    for (UInt32 f = 0; f < functionCount; f++) {
+      if (functions[f].description.winSlot == description->winSlot
+          && functions[f].description.serialNumber == description->serialNumber) {
+        functions[f].isPresent = true;
+        found = true;
+        break;
+      }
+    }
+    if (found) {
+      continue;
+    }
+
+    if (!isWaitingRelations) {
+      SYSLOG("Function %04X:%04X added at runtime, will not be configured", description->vendorId, description->deviceId);
+      continue;
+    }
+    if (functionCount >= kHyperVPCIBridgeMaxDevices) {
+      SYSLOG("Too many functions, ignoring %04X:%04X", description->vendorId, description->deviceId);
+      continue;
+    }
+
+    memset(&functions[functionCount], 0, sizeof (functions[functionCount]));
+    memcpy(&functions[functionCount].description, description, sizeof (*description));
+    functions[functionCount].isPresent = true;
+    DBGLOG("Function %04X:%04X (class %02X%02X) at slot 0x%X", description->vendorId, description->deviceId,
+           description->baseClass, description->subClass, description->winSlot);
+    functionCount++;
+  }
+
+  if (isWaitingRelations) {
+    isWaitingRelations = false;
+    IOLockWakeup(relationsLock, &isWaitingRelations, true);
+  }
+  IOLockUnlock(relationsLock);
+}
+
+void HyperVPCIBridge::handleEject(UInt32 winSlot) {
+  DBGLOG("Got eject request for slot 0x%X", winSlot);
+
+  //
+  // Hyper-V is notified once the matching PCI device has terminated, which cannot be waited on from the workloop.
+  //
+  for (UInt32 i = 0; i < functionCount; i++) {
+    if (functions[i].description.winSlot == winSlot) {
+      scheduleWork(&pendingEjectMask, i);
+      return;
+    }
+  }
+  sendEjectionComplete(winSlot);
+}
+
+void HyperVPCIBridge::scheduleWork(UInt32 *pendingMask, UInt32 functionIndex) {
+  IOLockLock(workLock);
+  *pendingMask |= 1U << functionIndex;
+  if (!isWorkRunning && !isStopping) {
+    isWorkRunning = true;
+    thread_call_enter(workThreadCall);
+  }
+  IOLockUnlock(workLock);
+}
+
+void HyperVPCIBridge::handleWorkThreadCall(thread_call_param_t param0, thread_call_param_t param1) {
+  HyperVPCIBridge *pciBridge = (HyperVPCIBridge *)param0;
+
+  //
+  // Handle work until none is left.
+  //
+  while (true) {
+    IOLockLock(pciBridge->workLock);
+    UInt32 msiMask   = pciBridge->pendingMSIMask;
+    UInt32 ejectMask = pciBridge->pendingEjectMask;
+    pciBridge->pendingMSIMask   = 0;
+    pciBridge->pendingEjectMask = 0;
+    if ((msiMask == 0 && ejectMask == 0) || pciBridge->isStopping) {
+      pciBridge->isWorkRunning = false;
+      IOLockWakeup(pciBridge->workLock, &pciBridge->isWorkRunning, false);
+      IOLockUnlock(pciBridge->workLock);
+      break;
+    }
+    IOLockUnlock(pciBridge->workLock);
+
+    for (UInt32 i = 0; i < pciBridge->functionCount; i++) {
+      if ((ejectMask & (1U << i)) != 0) {
+        pciBridge->ejectFunction(&pciBridge->functions[i]);
+      } else if ((msiMask & (1U << i)) != 0 && pciBridge->functions[i].isPresent) {
+        pciBridge->updateMSI(&pciBridge->functions[i]);
+      }
+    }
+  }
+}
+
+void HyperVPCIBridge::stopWork() {
+  if (workLock == NULL) {
+    return;
+  }
+
+  //
+  // Wait for any work in progress to stop.
+  //
+  IOLockLock(workLock);
+  isStopping = true;
+  if (workThreadCall != NULL && thread_call_cancel(workThreadCall)) {
+    isWorkRunning = false;
+  }
+  while (isWorkRunning) {
+    IOLockSleep(workLock, &isWorkRunning, THREAD_UNINT);
+  }
+  IOLockUnlock(workLock);
+}
+
+void HyperVPCIBridge::ejectFunction(HyperVPCIBridgeFunction *function) {
+  UInt32      winSlot   = function->description.winSlot;
+  IOPCIDevice *pciDevice = NULL;
+
+  //
+  // Locate the matching PCI device.
+  //
+  OSIterator *childIterator = getChildIterator(gIOServicePlane);
+  if (childIterator != NULL) {
+    OSObject *childObject;
+    while ((childObject = childIterator->getNextObject()) != NULL) {
+      pciDevice = OSDynamicCast(IOPCIDevice, childObject);
+      if (pciDevice != NULL
+          && kHyperVPCIBridgeWinSlot(pciDevice->getDeviceNumber(), pciDevice->getFunctionNumber()) == winSlot) {
+        pciDevice->retain();
+        break;
+      }
+      pciDevice = NULL;
+    }
+    childIterator->release();
+  }
+
+  //
+  // Config space remains accessible until the device and its driver have stopped.
+  //
+  if (pciDevice != NULL) {
+    DBGLOG("Terminating PCI device at slot 0x%X", winSlot);
+    pciDevice->terminate(kIOServiceSynchronous);
+    pciDevice->release();
+  }
+  function->isPresent = false;
+  sendEjectionComplete(winSlot);
+}
+
+void HyperVPCIBridge::sendEjectionComplete(UInt32 winSlot) {
+  HyperVPCIBridgeMessage pciMessage;
+
+  //
+  // Notify Hyper-V the function has been ejected.
+  //
+  memset(&pciMessage, 0, sizeof (pciMessage));
+  pciMessage.type = kHyperVPCIBridgeMessageTypeEjectionComplete;
+  pciMessage.ejectionComplete.winSlot = winSlot;
+  pciMessage.ejectionComplete.status  = 0;
+  sendPCIMessage(&pciMessage, sizeof (pciMessage.type) + sizeof (pciMessage.ejectionComplete));
+}
+
+bool HyperVPCIBridge::sendPCIMessage(HyperVPCIBridgeMessage *pciMessage, UInt32 messageLength, HyperVPCIBridgeResponse *pciResponse) {
+  //
+  // Messages needing a response must not be sent from the workloop, as responses are processed there.
+  //
+  if (pciResponse != NULL) {
+    memset(pciResponse, 0, sizeof (*pciResponse));
+  }
+  IOReturn status = hvDevice->writeInbandPacket(pciMessage, messageLength, pciResponse != NULL,
+                                                pciResponse, pciResponse != NULL ? sizeof (*pciResponse) : 0);
+  if (status != kIOReturnSuccess) {
+    SYSLOG("Failed to send message type 0x%X with status 0x%X", pciMessage->type, status);
+    return false;
+  }
+
+  if (pciResponse != NULL && pciResponse->status < 0) {
+    DBGLOG("Message type 0x%X failed with status 0x%X", pciMessage->type, pciResponse->status);
+    return false;
+  }
+  return true;
+}
+
+bool HyperVPCIBridge::negotiateProtocolVersion() {
+  HyperVPCIBridgeMessage  pciMessage;
+  HyperVPCIBridgeResponse pciResponse;
+
+  static const HyperVPCIBridgeProtocolVersion protocolVersions[] = {
+    kHyperVPCIBridgeProtocolVersion1_3,
+    kHyperVPCIBridgeProtocolVersion1_2,
+    kHyperVPCIBridgeProtocolVersion1_1
+  };
+
+  //
+  // Negotiate newest version supported by Hyper-V.
+  //
+  for (UInt32 i = 0; i < ARRAY_SIZE(protocolVersions); i++) {
+    memset(&pciMessage, 0, sizeof (pciMessage));
+    pciMessage.type = kHyperVPCIBridgeMessageTypeQueryProtocolVersion;
+    pciMessage.queryProtocolVersion.version = protocolVersions[i];
+
+    if (sendPCIMessage(&pciMessage, sizeof (pciMessage.type) + sizeof (pciMessage.queryProtocolVersion), &pciResponse)) {
+      protocolVersion = protocolVersions[i];
+      DBGLOG("Using vPCI protocol version 0x%X", protocolVersion);
+      return true;
+    }
+    if (pciResponse.status != (SInt32)kHyperVPCIBridgeStatusRevisionMismatch) {
+      break;
+    }
+  }
+
+  SYSLOG("Failed to negotiate vPCI protocol version");
+  return false;
+}
+
+bool HyperVPCIBridge::allocateConfigWindow() {
+  if (!HyperVPCIRoot::allocateMMIORange(kHyperVPCIBridgeConfigWindowSize, false, &configWindowPhysAddress)) {
+    return false;
+  }
+
+  configWindowDescriptor = IOMemoryDescriptor::withPhysicalAddress(configWindowPhysAddress, kHyperVPCIBridgeConfigWindowSize, kIODirectionInOut);
+  if (configWindowDescriptor == NULL) {
+    SYSLOG("Failed to create config window memory descriptor");
+    return false;
+  }
+  configWindowMap = configWindowDescriptor->createMappingInTask(kernel_task, 0, kIOMapAnywhere | kIOMapInhibitCache);
+  if (configWindowMap == NULL) {
+    SYSLOG("Failed to map config window");
+    OSSafeReleaseNULL(configWindowDescriptor);
+    return false;
+  }
+
+  configWindow = (volatile UInt8 *)configWindowMap->getVirtualAddress();
+  DBGLOG("Config window is at 0x%llX", configWindowPhysAddress);
+  return true;
+}
+
+void HyperVPCIBridge::freeConfigWindow() {
+  configWindow = NULL;
+  OSSafeReleaseNULL(configWindowMap);
+  OSSafeReleaseNULL(configWindowDescriptor);
+}
+
+bool HyperVPCIBridge::enterD0() {
+  HyperVPCIBridgeMessage  pciMessage;
+  HyperVPCIBridgeResponse pciResponse;
+
+  memset(&pciMessage, 0, sizeof (pciMessage));
+  pciMessage.type = kHyperVPCIBridgeMessageTypeBusD0Entry;
+  pciMessage.busD0Entry.mmioBase = configWindowPhysAddress;
+
+  if (!sendPCIMessage(&pciMessage, sizeof (pciMessage.type) + sizeof (pciMessage.busD0Entry), &pciResponse)) {
+    SYSLOG("Failed to enter D0");
+    return false;
+  }
+  return true;
+}
+
+bool HyperVPCIBridge::queryBusRelations() {
+  HyperVPCIBridgeMessage pciMessage;
+
+  IOLockLock(relationsLock);
+  isWaitingRelations = true;
+  IOLockUnlock(relationsLock);
+
+  //
+  // Bus relations are sent as a separate message, not as a completion.
+  //
+  memset(&pciMessage, 0, sizeof (pciMessage));
+  pciMessage.type = kHyperVPCIBridgeMessageTypeQueryBusRelations;
+  bool result = sendPCIMessage(&pciMessage, sizeof (pciMessage.type));
+
+  IOLockLock(relationsLock);
+  if (result) {
+    AbsoluteTime deadline;
+    clock_interval_to_deadline(kHyperVPCIBridgeResponseTimeoutMS, kMillisecondScale, &deadline);
+    while (isWaitingRelations) {
+      if (IOLockSleepDeadline(relationsLock, &isWaitingRelations, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
+        break;
+      }
+    }
+    result = !isWaitingRelations;
+  }
+  isWaitingRelations = false;
+  IOLockUnlock(relationsLock);
+
+  if (!result) {
+    SYSLOG("Failed to get bus relations");
+  }
+  return result;
+}
+
+bool HyperVPCIBridge::queryResourceRequirements(HyperVPCIBridgeFunction *function) {
+  HyperVPCIBridgeMessage  pciMessage;
+  HyperVPCIBridgeResponse pciResponse;
+
+  memset(&pciMessage, 0, sizeof (pciMessage));
+  pciMessage.type = kHyperVPCIBridgeMessageTypeQueryResourceRequirements;
+  pciMessage.child.winSlot = function->description.winSlot;
+
+  if (!sendPCIMessage(&pciMessage, sizeof (pciMessage.type) + sizeof (pciMessage.child), &pciResponse)) {
+    SYSLOG("Failed to get resource requirements for slot 0x%X", function->description.winSlot);
+    return false;
+  }
+
+  memcpy(function->probedBARs, pciResponse.probedBARs, sizeof (function->probedBARs));
+  for (UInt32 i = 0; i < kHyperVPCIBridgeBARCount; i++) {
+    DBGLOG("Slot 0x%X BAR%u probed value 0x%X", function->description.winSlot, i, function->probedBARs[i]);
+  }
+  return true;
+}
+
+bool HyperVPCIBridge::assignBARs() {
+  UInt64 lowTotal  = 0;
+  UInt64 highTotal = 0;
+  bool   is64Bit;
+
+  //
+  // Get total MMIO needed below and above 4GB.
+  //
+  for (UInt32 f = 0; f < functionCount; f++) {
+    for (UInt32 i = 0; i < kHyperVPCIBridgeBARCount; i++) {
+      UInt64 size = getProbedBARSize(functions[f].probedBARs, i, &is64Bit);
+      if (is64Bit) {
+        highTotal += size;
+        i++;
+      } else {
+        lowTotal += size;
+      }
+    }
+  }
+
+  //
+  // Ranges are a power of two in size, BARs are placed largest first so each is naturally aligned.
+  //
+  mmioLowSize  = 0;
+  mmioHighSize = 0;
+  if (lowTotal != 0) {
+    mmioLowSize = PAGE_SIZE;
+    while (mmioLowSize < lowTotal) {
+      mmioLowSize <<= 1;
+    }
+    if (!HyperVPCIRoot::allocateMMIORange(mmioLowSize, true, &mmioLowBase)) {
+      return false;
+    }
+  }
+  if (highTotal != 0) {
+    mmioHighSize = PAGE_SIZE;
+    while (mmioHighSize < highTotal) {
+      mmioHighSize <<= 1;
+    }
+    if (!HyperVPCIRoot::allocateMMIORange(mmioHighSize, false, &mmioHighBase)) {
+      return false;
+    }
+  }
+
+  UInt64 lowOffset  = 0;
+  UInt64 highOffset = 0;
+  while (true) {
+    HyperVPCIBridgeFunction *largestFunction = NULL;
+    UInt32 largestIndex   = 0;
+    UInt64 largestSize    = 0;
+    bool   largestIs64Bit = false;
+
+    for (UInt32 f = 0; f < functionCount; f++) {
+      for (UInt32 i = 0; i < kHyperVPCIBridgeBARCount; i++) {
+        UInt64 size = getProbedBARSize(functions[f].probedBARs, i, &is64Bit);
+        if (size > largestSize && functions[f].assignedBARs[i] == 0) {
+          largestFunction = &functions[f];
+          largestIndex    = i;
+          largestSize     = size;
+          largestIs64Bit  = is64Bit;
+        }
+        if (is64Bit) {
+          i++;
+        }
+      }
+    }
+    if (largestFunction == NULL) {
+      break;
+    }
+
+    //
+    // Program BAR, these writes are passed through to Hyper-V.
+    //
+    UInt64 address;
+    if (largestIs64Bit) {
+      address = mmioHighBase + highOffset;
+      highOffset += largestSize;
+    } else {
+      address = mmioLowBase + lowOffset;
+      lowOffset += largestSize;
+    }
+    largestFunction->assignedBARs[largestIndex] = address;
+
+    UInt8 barOffset = kIOPCIConfigBaseAddress0 + (largestIndex * sizeof (UInt32));
+    writeConfigSpace(largestFunction, barOffset, sizeof (UInt32), (UInt32)address);
+    if (largestIs64Bit) {
+      writeConfigSpace(largestFunction, barOffset + sizeof (UInt32), sizeof (UInt32), (UInt32)(address >> 32));
+    }
+    DBGLOG("Slot 0x%X BAR%u assigned 0x%llX bytes at 0x%llX", largestFunction->description.winSlot,
+           largestIndex, largestSize, address);
+  }
+
+  return true;
+}
+
+bool HyperVPCIBridge::sendResourcesAssigned(HyperVPCIBridgeFunction *function) {
+  HyperVPCIBridgeMessage  pciMessage;
+  HyperVPCIBridgeResponse pciResponse;
+  UInt32                  messageLength;
+
+  //
+  // BARs are programmed through config space, resource lists are left empty.
+  //
+  memset(&pciMessage, 0, sizeof (pciMessage));
+  if (protocolVersion < kHyperVPCIBridgeProtocolVersion1_2) {
+    pciMessage.type = kHyperVPCIBridgeMessageTypeResourcesAssigned;
+    pciMessage.resourcesAssigned.winSlot = function->description.winSlot;
+    messageLength = sizeof (pciMessage.type) + sizeof (pciMessage.resourcesAssigned);
+  } else {
+    pciMessage.type = kHyperVPCIBridgeMessageTypeResourcesAssigned2;
+    pciMessage.resourcesAssigned2.winSlot = function->description.winSlot;
+    messageLength = sizeof (pciMessage.type) + sizeof (pciMessage.resourcesAssigned2);
+  }
+
+  if (!sendPCIMessage(&pciMessage, messageLength, &pciResponse)) {
+    SYSLOG("Failed to send assigned resources for slot 0x%X", function->description.winSlot);
+    return false;
+  }
+  return true;
+}
+
+bool HyperVPCIBridge::connectPCIBridge() {
+  if (!negotiateProtocolVersion()) {
+    return false;
+  }
+  if (!allocateConfigWindow()) {
+    return false;
+  }
+  if (!enterD0()) {
+    return false;
+  }
+  if (!queryBusRelations()) {
+    return false;
+  }
+
+  //
+  // Configure resources for each function.
+  //
+  for (UInt32 i = 0; i < functionCount; i++) {
+    if (!queryResourceRequirements(&functions[i])) {
+      functions[i].isPresent = false;
+    }
+  }
+  if (!assignBARs()) {
+    return false;
+  }
+  for (UInt32 i = 0; i < functionCount; i++) {
+    if (!functions[i].isPresent) {
+      continue;
+    }
+    if (!sendResourcesAssigned(&functions[i])) {
+      functions[i].isPresent = false;
+      continue;
+    }
+    functions[i].msiCapabilityOffset = findMSICapability(&functions[i]);
+  }
+  return true;
+}
+
+HyperVPCIBridgeFunction *HyperVPCIBridge::getFunction(IOPCIAddressSpace space) {
+  if (space.es.busNum != busNum) {
+    return NULL;
+  }
+
+  UInt32 winSlot = kHyperVPCIBridgeWinSlot(space.es.deviceNum, space.es.functionNum);
+  for (UInt32 i = 0; i < functionCount; i++) {
+    if (functions[i].isPresent && functions[i].description.winSlot == winSlot) {
+      return &functions[i];
+    }
+  }
+  return NULL;
+}
+
+UInt32 HyperVPCIBridge::readConfigWindow(HyperVPCIBridgeFunction *function, UInt8 offset, UInt8 size) {
+  UInt32 data;
+
+  //
+  // Select function, then access its config space in the second page.
+  //
+  IOInterruptState ints = IOSimpleLockLockDisableInterrupt(configLock);
+  *(volatile UInt32 *)configWindow = function->description.winSlot;
+  __sync_synchronize();
+
+  volatile UInt8 *configData = &configWindow[kHyperVPCIBridgeConfigPageOffset + offset];
+  switch (size) {
+    case sizeof (UInt8):
+      data = *configData;
+      break;
+    case sizeof (UInt16):
+      data = *(volatile UInt16 *)configData;
+      break;
+    default:
+      data = *(volatile UInt32 *)configData;
+      break;
+  }
+
+  __sync_synchronize();
+  IOSimpleLockUnlockEnableInterrupt(configLock, ints);
+  return data;
+}
+
+void HyperVPCIBridge::writeConfigWindow(HyperVPCIBridgeFunction *function, UInt8 offset, UInt8 size, UInt32 data) {
+  IOInterruptState ints = IOSimpleLockLockDisableInterrupt(configLock);
+  *(volatile UInt32 *)configWindow = function->description.winSlot;
+  __sync_synchronize();
+
+  volatile UInt8 *configData = &configWindow[kHyperVPCIBridgeConfigPageOffset + offset];
+  switch (size) {
+    case sizeof (UInt8):
+      *configData = (UInt8)data;
+      break;
+    case sizeof (UInt16):
+      *(volatile UInt16 *)configData = (UInt16)data;
+      break;
+    default:
+      *(volatile UInt32 *)configData = data;
+      break;
+  }
+
+  __sync_synchronize();
+  IOSimpleLockUnlockEnableInterrupt(configLock, ints);
+}
+
+UInt32 HyperVPCIBridge::readConfigSpace(HyperVPCIBridgeFunction *function, UInt8 offset, UInt8 size) {
+  UInt32 shift = (offset & 0x3) * 8;
+  UInt32 mask  = size == sizeof (UInt32) ? 0xFFFFFFFF : ((1U << (size * 8)) - 1);
+
+  //
+  // IDs and class are provided by Hyper-V in the function description.
+  // Expansion ROMs and legacy interrupts are not supported.
+  //
+  if (offset + size <= kIOPCIConfigCommand) {
+    UInt32 ids = function->description.vendorId | (function->description.deviceId << 16);
+    return (ids >> shift) & mask;
+  } else if (offset >= kIOPCIConfigRevisionID && offset + size <= kIOPCIConfigCacheLineSize) {
+    UInt32 classCode = function->description.revision | (function->description.progInterface << 8)
+                       | (function->description.subClass << 16) | (function->description.baseClass << 24);
+    return (classCode >> shift) & mask;
+  } else if (offset >= kIOPCIConfigSubSystemVendorID && offset + size <= kIOPCIConfigExpansionROMBase) {
+    return (function->description.subsystemId >> shift) & mask;
+  } else if (offset >= kIOPCIConfigExpansionROMBase && offset + size <= kIOPCIConfigCapabilitiesPtr) {
+    return 0;
+  } else if (offset >= kIOPCIConfigInterruptLine && offset + size <= kIOPCIConfigInterruptPin + 1) {
+    return 0;
+  }
+  return readConfigWindow(function, offset, size);
+}
+
+void HyperVPCIBridge::writeConfigSpace(HyperVPCIBridgeFunction *function, UInt8 offset, UInt8 size, UInt32 data) {
+  //
+  // IDs, subsystem IDs, and expansion ROM are read-only.
+  //
+  if (offset < kIOPCIConfigCommand
+      || (offset >= kIOPCIConfigSubSystemVendorID && offset < kIOPCIConfigCapabilitiesPtr)) {
+    return;
+  }
+  writeConfigWindow(function, offset, size, data);
+
+  //
+  // MSI must be configured through Hyper-V, check for changes to the MSI capability.
+  // Hyper-V is not waited on here, the interrupt is created afterwards by the work thread call.
+  //
+  UInt8 msiOffset = function->msiCapabilityOffset;
+  if (msiOffset != 0 && offset + size > msiOffset && offset < msiOffset + kHyperVPCIBridgeMSICapabilitySize) {
+    scheduleWork(&pendingMSIMask, (UInt32)(function - functions));
+  }
+}
+
+UInt8 HyperVPCIBridge::findMSICapability(HyperVPCIBridgeFunction *function) {
+  if ((readConfigWindow(function, kIOPCIConfigStatus, sizeof (UInt16)) & kHyperVPCIBridgeStatusCapabilities) == 0) {
+    return 0;
+  }
+
+  //
+  // Walk capability list, limiting iterations in case of a malformed list.
+  //
+  UInt8 capOffset = readConfigWindow(function, kIOPCIConfigCapabilitiesPtr, sizeof (UInt8)) & 0xFC;
+  for (UInt32 i = 0; i < 48 && capOffset != 0; i++) {
+    if (readConfigWindow(function, capOffset, sizeof (UInt8)) == kIOPCIMSICapability) {
+      DBGLOG("Slot 0x%X MSI capability at 0x%X", function->description.winSlot, capOffset);
+      return capOffset;
+    }
+    capOffset = readConfigWindow(function, capOffset + 1, sizeof (UInt8)) & 0xFC;
+  }
+  return 0;
+}
+
+void HyperVPCIBridge::updateMSI(HyperVPCIBridgeFunction *function) {
+  HyperVPCIBridgeMessage  pciMessage;
+  HyperVPCIBridgeResponse pciResponse;
+  UInt32                  messageLength;
+
+  UInt8  msiOffset = function->msiCapabilityOffset;
+  UInt16 control   = readConfigWindow(function, msiOffset + kHyperVPCIBridgeMSIControlOffset, sizeof (UInt16));
+  bool   isEnabled = (control & kHyperVPCIBridgeMSIControlEnable) != 0;
+  bool   is64Bit   = (control & kHyperVPCIBridgeMSIControl64Bit) != 0;
+  UInt8  dataOffset = msiOffset + (is64Bit ? kHyperVPCIBridgeMSIData64Offset : kHyperVPCIBridgeMSIData32Offset);
+
+  UInt32 address = readConfigWindow(function, msiOffset + kHyperVPCIBridgeMSIAddressOffset, sizeof (UInt32));
+  UInt16 data    = readConfigWindow(function, dataOffset, sizeof (UInt16));
+
+  //
+  // Nothing to do if the interrupt already matches.
+  //
+  if (function->hasInterrupt && isEnabled
+      && (UInt32)function->interruptDescriptor.address == address && (UInt16)function->interruptDescriptor.data == data) {
+    return;
+  }
+
+  //
+  // Remove existing interrupt.
+  //
+  if (function->hasInterrupt) {
+    memset(&pciMessage, 0, sizeof (pciMessage));
+    pciMessage.type = kHyperVPCIBridgeMessageTypeDeleteInterruptMessage;
+    pciMessage.deleteInterrupt.winSlot             = function->description.winSlot;
+    pciMessage.deleteInterrupt.interruptDescriptor = function->interruptDescriptor;
+    sendPCIMessage(&pciMessage, sizeof (pciMessage.type) + sizeof (pciMessage.deleteInterrupt));
+    function->hasInterrupt = false;
+  }
+  if (!isEnabled || address == 0) {
+    return;
+  }
+
+  //
+  // Create interrupt using the vector and destination APIC ID programmed by the guest.
+  //
+  UInt8 vector       = data & 0xFF;
+  UInt8 deliveryMode = (data >> 8) & 0x7;
+  UInt8 apicId       = (address >> 12) & 0xFF;
+
+  //
+  // Hyper-V targets interrupts by VP index, older protocols can only describe the first 64 processors.
+  //
+  UInt32 vpIndex;
+  if (!hvDevice->getVirtualProcessorIndex(apicId, &vpIndex)) {
+    SYSLOG("Failed to get VP index for APIC %u, slot 0x%X interrupt not created", apicId, function->description.winSlot);
+    return;
+  }
+  if ((protocolVersion < kHyperVPCIBridgeProtocolVersion1_2 && vpIndex >= 64) || vpIndex > UINT16_MAX) {
+    SYSLOG("VP index %u for APIC %u is out of range, slot 0x%X interrupt not created", vpIndex, apicId, function->description.winSlot);
+    return;
+  }
+
+  memset(&pciMessage, 0, sizeof (pciMessage));
+  if (protocolVersion < kHyperVPCIBridgeProtocolVersion1_2) {
+    pciMessage.type = kHyperVPCIBridgeMessageTypeCreateInterruptMessage;
+    pciMessage.createInterrupt.winSlot                          = function->description.winSlot;
+    pciMessage.createInterrupt.interruptDescriptor.vector       = vector;
+    pciMessage.createInterrupt.interruptDescriptor.deliveryMode = deliveryMode;
+    pciMessage.createInterrupt.interruptDescriptor.vectorCount  = 1;
+    pciMessage.createInterrupt.interruptDescriptor.cpuMask      = 1ULL << vpIndex;
+    messageLength = sizeof (pciMessage.type) + sizeof (pciMessage.createInterrupt);
+  } else {
+    pciMessage.type = kHyperVPCIBridgeMessageTypeCreateInterruptMessage2;
+    pciMessage.createInterrupt2.winSlot                             = function->description.winSlot;
+    pciMessage.createInterrupt2.interruptDescriptor.vector          = vector;
+    pciMessage.createInterrupt2.interruptDescriptor.deliveryMode    = deliveryMode;
+    pciMessage.createInterrupt2.interruptDescriptor.vectorCount     = 1;
+    pciMessage.createInterrupt2.interruptDescriptor.processorCount  = 1;
+    pciMessage.createInterrupt2.interruptDescriptor.processorArray[0] = (UInt16)vpIndex;
+    messageLength = sizeof (pciMessage.type) + sizeof (pciMessage.createInterrupt2);
+  }
+
+  if (!sendPCIMessage(&pciMessage, messageLength, &pciResponse)) {
+    SYSLOG("Failed to create interrupt for slot 0x%X", function->description.winSlot);
+    return;
+  }
+  function->interruptDescriptor = pciResponse.createInterrupt.interruptDescriptor;
+  function->hasInterrupt        = true;
+
+  //
+  // Program address and data provided by Hyper-V.
+  //
+  writeConfigWindow(function, msiOffset + kHyperVPCIBridgeMSIAddressOffset, sizeof (UInt32), (UInt32)function->interruptDescriptor.address);
+  if (is64Bit) {
+    writeConfigWindow(function, msiOffset + kHyperVPCIBridgeMSIAddressOffset + sizeof (UInt32), sizeof (UInt32),
+                      (UInt32)(function->interruptDescriptor.address >> 32));
+  }
+  writeConfigWindow(function, dataOffset, sizeof (UInt16), (UInt16)function->interruptDescriptor.data);
+  DBGLOG("Slot 0x%X MSI vector 0x%X on APIC %u (VP %u), address 0x%llX data 0x%X", function->description.winSlot, vector, apicId, vpIndex,
+         function->interruptDescriptor.address, function->interruptDescriptor.data);
+}
@@ -0,0 +1,247 @@
+//
+//  HyperVPCIBridgeRegs.hpp
+//  Hyper-V virtual PCI bridge driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVPCIBridgeRegs_hpp
+#define HyperVPCIBridgeRegs_hpp
+
+#define kHyperVPCIBridgeRingBufferSize      (4 * PAGE_SIZE)
+#define kHyperVPCIBridgeResponseTimeoutMS   10000
+#define kHyperVPCIBridgeMaxDevices          32
+#define kHyperVPCIBridgeBARCount            6
+
+//
+// Status returned when a protocol version is not supported.
+//
+#define kHyperVPCIBridgeStatusRevisionMismatch  0xC0000059
+
+//
+// Config space window, the first page selects the function and the second page is its config space.
+//
+#define kHyperVPCIBridgeConfigWindowSize    0x2000
+#define kHyperVPCIBridgeConfigPageOffset    0x1000
+#define kHyperVPCIBridgeConfigPageSize      0x1000
+
+//
+// Config space status and MSI capability fields.
+//
+#define kHyperVPCIBridgeStatusCapabilities  0x10
+
+#define kHyperVPCIBridgeMSICapabilitySize   0x18
+#define kHyperVPCIBridgeMSIControlOffset    0x2
+#define kHyperVPCIBridgeMSIAddressOffset    0x4
+#define kHyperVPCIBridgeMSIData32Offset     0x8
+#define kHyperVPCIBridgeMSIData64Offset     0xC
+
+#define kHyperVPCIBridgeMSIControlEnable    0x1
+#define kHyperVPCIBridgeMSIControl64Bit     0x80
+
+//
+// vPCI protocol versions.
+//
+#define kHyperVPCIBridgeVersion(major, minor)   (((major) << 16) | (minor))
+
+typedef enum : UInt32 {
+  kHyperVPCIBridgeProtocolVersion1_1  = kHyperVPCIBridgeVersion(1, 1),  // Windows Server 2016
+  kHyperVPCIBridgeProtocolVersion1_2  = kHyperVPCIBridgeVersion(1, 2),  // Windows Server 2016 RS1
+  kHyperVPCIBridgeProtocolVersion1_3  = kHyperVPCIBridgeVersion(1, 3)   // Windows Server 2019 Vibranium
+} HyperVPCIBridgeProtocolVersion;
+
+//
+// Message types.
+//
+#define kHyperVPCIBridgeMessageBase   0x42490000
+
+typedef enum : UInt32 {
+  kHyperVPCIBridgeMessageTypeBusRelations               = kHyperVPCIBridgeMessageBase + 0x0,
+  kHyperVPCIBridgeMessageTypeQueryBusRelations          = kHyperVPCIBridgeMessageBase + 0x1,
+  kHyperVPCIBridgeMessageTypePowerStateChange           = kHyperVPCIBridgeMessageBase + 0x4,
+  kHyperVPCIBridgeMessageTypeQueryResourceRequirements  = kHyperVPCIBridgeMessageBase + 0x5,
+  kHyperVPCIBridgeMessageTypeQueryResources             = kHyperVPCIBridgeMessageBase + 0x6,
+  kHyperVPCIBridgeMessageTypeBusD0Entry                 = kHyperVPCIBridgeMessageBase + 0x7,
+  kHyperVPCIBridgeMessageTypeBusD0Exit                  = kHyperVPCIBridgeMessageBase + 0x8,
+  kHyperVPCIBridgeMessageTypeReadBlock                  = kHyperVPCIBridgeMessageBase + 0x9,
+  kHyperVPCIBridgeMessageTypeWriteBlock                 = kHyperVPCIBridgeMessageBase + 0xA,
+  kHyperVPCIBridgeMessageTypeEject                      = kHyperVPCIBridgeMessageBase + 0xB,
+  kHyperVPCIBridgeMessageTypeQueryStop                  = kHyperVPCIBridgeMessageBase + 0xC,
+  kHyperVPCIBridgeMessageTypeReenable                   = kHyperVPCIBridgeMessageBase + 0xD,
+  kHyperVPCIBridgeMessageTypeQueryStopFailed            = kHyperVPCIBridgeMessageBase + 0xE,
+  kHyperVPCIBridgeMessageTypeEjectionComplete           = kHyperVPCIBridgeMessageBase + 0xF,
+  kHyperVPCIBridgeMessageTypeResourcesAssigned          = kHyperVPCIBridgeMessageBase + 0x10,
+  kHyperVPCIBridgeMessageTypeResourcesReleased          = kHyperVPCIBridgeMessageBase + 0x11,
+  kHyperVPCIBridgeMessageTypeInvalidateBlock            = kHyperVPCIBridgeMessageBase + 0x12,
+  kHyperVPCIBridgeMessageTypeQueryProtocolVersion       = kHyperVPCIBridgeMessageBase + 0x13,
+  kHyperVPCIBridgeMessageTypeCreateInterruptMessage     = kHyperVPCIBridgeMessageBase + 0x14,
+  kHyperVPCIBridgeMessageTypeDeleteInterruptMessage     = kHyperVPCIBridgeMessageBase + 0x15,
+  kHyperVPCIBridgeMessageTypeResourcesAssigned2         = kHyperVPCIBridgeMessageBase + 0x16,
+  kHyperVPCIBridgeMessageTypeCreateInterruptMessage2    = kHyperVPCIBridgeMessageBase + 0x17,
+  kHyperVPCIBridgeMessageTypeDeleteInterruptMessage2    = kHyperVPCIBridgeMessageBase + 0x18,
+  kHyperVPCIBridgeMessageTypeBusRelations2              = kHyperVPCIBridgeMessageBase + 0x19
+} HyperVPCIBridgeMessageType;
+
+//
+// Windows slot encoding, device number in bits 0-4 and function number in bits 5-7.
+//
+#define kHyperVPCIBridgeWinSlot(dev, func)      (((dev) & 0x1F) | (((func) & 0x7) << 5))
+#define kHyperVPCIBridgeWinSlotDevice(slot)     ((slot) & 0x1F)
+#define kHyperVPCIBridgeWinSlotFunction(slot)   (((slot) >> 5) & 0x7)
+
+//
+// Function description from bus relations.
+//
+typedef struct __attribute__((packed)) {
+  UInt16  vendorId;
+  UInt16  deviceId;
+  UInt8   revision;
+  UInt8   progInterface;
+  UInt8   subClass;
+  UInt8   baseClass;
+  UInt32  subsystemId;
+  UInt32  winSlot;
+  UInt32  serialNumber;
+} HyperVPCIBridgeFunctionDescription;
+
+//
+// Extended function description from bus relations on protocol 1.3 and newer.
+//
+typedef struct __attribute__((packed)) {
+  HyperVPCIBridgeFunctionDescription  description;
+  UInt32                              flags;
+  UInt16                              virtualNUMANode;
+  UInt16                              reserved;
+} HyperVPCIBridgeFunctionDescription2;
+
+//
+// Interrupt descriptors.
+// Version 2 descriptors are used on protocol 1.2 and newer, and specify processors by index.
+//
+typedef struct __attribute__((packed)) {
+  UInt8   vector;
+  UInt8   deliveryMode;
+  UInt16  vectorCount;
+  UInt32  reserved;
+  UInt64  cpuMask;
+} HyperVPCIBridgeMSIDescriptor;
+
+#define kHyperVPCIBridgeMaxProcessorCount   32
+
+typedef struct __attribute__((packed)) {
+  UInt8   vector;
+  UInt8   deliveryMode;
+  UInt16  vectorCount;
+  UInt16  processorCount;
+  UInt16  processorArray[kHyperVPCIBridgeMaxProcessorCount];
+} HyperVPCIBridgeMSIDescriptor2;
+
+typedef struct __attribute__((packed)) {
+  UInt16  reserved;
+  UInt16  vectorCount;
+  UInt32  data;
+  UInt64  address;
+} HyperVPCIBridgeInterruptDescriptor;
+
+//
+// Messages sent to Hyper-V.
+//
+typedef struct __attribute__((packed)) {
+  HyperVPCIBridgeProtocolVersion  version;
+} HyperVPCIBridgeMessageQueryProtocolVersion;
+
+typedef struct __attribute__((packed)) {
+  UInt32  reserved;
+  UInt64  mmioBase;
+} HyperVPCIBridgeMessageBusD0Entry;
+
+typedef struct __attribute__((packed)) {
+  UInt32  winSlot;
+} HyperVPCIBridgeMessageChild;
+
+typedef struct __attribute__((packed)) {
+  UInt32  winSlot;
+  UInt8   memoryRange[0x14][6];
+  UInt32  msiDescriptors;
+  UInt32  reserved[4];
+} HyperVPCIBridgeMessageResourcesAssigned;
+
+typedef struct __attribute__((packed)) {
+  UInt32  winSlot;
+  UInt8   memoryRange[0x14][6];
+  UInt32  msiDescriptorCount;
+  UInt8   reserved[70];
+} HyperVPCIBridgeMessageResourcesAssigned2;
+
+typedef struct __attribute__((packed)) {
+  UInt32                        winSlot;
+  HyperVPCIBridgeMSIDescriptor  interruptDescriptor;
+} HyperVPCIBridgeMessageCreateInterrupt;
+
+typedef struct __attribute__((packed)) {
+  UInt32                        winSlot;
+  HyperVPCIBridgeMSIDescriptor2 interruptDescriptor;
+} HyperVPCIBridgeMessageCreateInterrupt2;
+
+typedef struct __attribute__((packed)) {
+  UInt32                              winSlot;
+  HyperVPCIBridgeInterruptDescriptor  interruptDescriptor;
+} HyperVPCIBridgeMessageDeleteInterrupt;
+
+typedef struct __attribute__((packed)) {
+  UInt32  winSlot;
+  UInt32  status;
+} HyperVPCIBridgeMessageEjectionComplete;
+
+//
+// Messages received from Hyper-V.
+// Bus relations contain a variable number of function descriptions.
+//
+typedef struct __attribute__((packed)) {
+  UInt32                              deviceCount;
+  HyperVPCIBridgeFunctionDescription  functions[1];
+} HyperVPCIBridgeMessageBusRelations;
+
+typedef struct __attribute__((packed)) {
+  UInt32                              deviceCount;
+  HyperVPCIBridgeFunctionDescription2 functions[1];
+} HyperVPCIBridgeMessageBusRelations2;
+
+//
+// Main message structure.
+//
+typedef struct __attribute__((packed)) {
+  HyperVPCIBridgeMessageType  type;
+
+  union {
+    HyperVPCIBridgeMessageQueryProtocolVersion  queryProtocolVersion;
+    HyperVPCIBridgeMessageBusD0Entry            busD0Entry;
+    HyperVPCIBridgeMessageChild                 child;
+    HyperVPCIBridgeMessageResourcesAssigned     resourcesAssigned;
+    HyperVPCIBridgeMessageResourcesAssigned2    resourcesAssigned2;
+    HyperVPCIBridgeMessageCreateInterrupt       createInterrupt;
+    HyperVPCIBridgeMessageCreateInterrupt2      createInterrupt2;
+    HyperVPCIBridgeMessageDeleteInterrupt       deleteInterrupt;
+    HyperVPCIBridgeMessageEjectionComplete      ejectionComplete;
+    HyperVPCIBridgeMessageBusRelations          busRelations;
+    HyperVPCIBridgeMessageBusRelations2         busRelations2;
+  };
+} HyperVPCIBridgeMessage;
+
+//
+// Completion packet contents for messages requiring a response.
+//
+typedef struct __attribute__((packed)) {
+  SInt32  status;
+
+  union {
+    UInt32  probedBARs[kHyperVPCIBridgeBARCount];
+
+    struct {
+      UInt32                              reserved;
+      HyperVPCIBridgeInterruptDescriptor  interruptDescriptor;
+    } createInterrupt;
+  };
+} HyperVPCIBridgeResponse;
+
+#endif /* HyperVPCIBridgeRegs_hpp */
@@ -8,6 +8,7 @@
 #include "HyperVPCIRoot.hpp"
 #include <architecture/i386/pio.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
+#include <IOKit/IOPlatformExpert.h>
 
 #define super IOPCIBridge
 
@@ -29,6 +30,33 @@ typedef struct __attribute__((packed)) {
   UInt64 reserved6;
 } AppleACPIRange;
 
+//
+// ACPI MCFG table.
+//
+typedef struct __attribute__((packed)) {
+  UInt64 baseAddress;
+  UInt16 segment;
+  UInt8  startBus;
+  UInt8  endBus;
+  UInt32 reserved;
+} AppleACPIMCFGEntry;
+
+typedef struct __attribute__((packed)) {
+  UInt32 signature;
+  UInt32 length;
+  UInt8  revision;
+  UInt8  checksum;
+  UInt8  oemId[6];
+  UInt64 oemTableId;
+  UInt32 oemRevision;
+  UInt32 creatorId;
+  UInt32 creatorRevision;
+  UInt64 reserved;
+  AppleACPIMCFGEntry entries[];
+} AppleACPIMCFGTable;
+
+#define kHyperVPCIRootECAMBusShift  20
+
 inline bool HyperVPCIRoot::setConfigSpace(IOPCIAddressSpace space, UInt8 offset) {
   offset &= 0xFC;
   
@@ -38,20 +66,80 @@ inline bool HyperVPCIRoot::setConfigSpace(IOPCIAddressSpace space, UInt8 offset)
   return true;
 }
 
-bool HyperVPCIRoot::registerChildPCIBridge(IOPCIBridge *pciBridge) {
+inline volatile void *HyperVPCIRoot::getECAMAddress(IOPCIAddressSpace space, UInt8 offset) {
+  if (ecamAddress == NULL || space.es.busNum < ecamStartBus || space.es.busNum > ecamEndBus) {
+    return NULL;
+  }
+  return &ecamAddress[((space.es.busNum - ecamStartBus) << kHyperVPCIRootECAMBusShift)
+                      | (space.es.deviceNum << 15) | (space.es.functionNum << 12) | offset];
+}
+
+bool HyperVPCIRoot::initECAM() {
+  //
+  // Get MCFG table published by the ACPI platform expert.
+  //
+  OSDictionary *acpiTables = OSDynamicCast(OSDictionary, getPlatform()->getProperty("ACPI Tables"));
+  if (acpiTables == NULL) {
+    return false;
+  }
+  OSData *mcfgData = OSDynamicCast(OSData, acpiTables->getObject("MCFG"));
+  if (mcfgData == NULL || mcfgData->getLength() < sizeof (AppleACPIMCFGTable) + sizeof (AppleACPIMCFGEntry)) {
+    DBGLOG("No MCFG table present, using port I/O for config space");
+    return false;
+  }
+
+  //
+  // Use the first segment 0 entry.
+  //
+  const AppleACPIMCFGTable *mcfgTable = (const AppleACPIMCFGTable *)mcfgData->getBytesNoCopy();
+  UInt32 mcfgLength = mcfgTable->length < mcfgData->getLength() ? mcfgTable->length : mcfgData->getLength();
+  UInt32 entryCount = (UInt32)((mcfgLength - sizeof (AppleACPIMCFGTable)) / sizeof (AppleACPIMCFGEntry));
+
+  const AppleACPIMCFGEntry *mcfgEntry = NULL;
+  for (UInt32 i = 0; i < entryCount; i++) {
+    if (mcfgTable->entries[i].segment == 0 && mcfgTable->entries[i].startBus <= mcfgTable->entries[i].endBus) {
+      mcfgEntry = &mcfgTable->entries[i];
+      break;
+    }
+  }
+  if (mcfgEntry == NULL) {
+    return false;
+  }
+
+  IOByteCount ecamLength = ((IOByteCount)(mcfgEntry->endBus - mcfgEntry->startBus) + 1) << kHyperVPCIRootECAMBusShift;
+  ecamMemoryDescriptor = IOMemoryDescriptor::withPhysicalAddress(mcfgEntry->baseAddress + ((IOByteCount)mcfgEntry->startBus << kHyperVPCIRootECAMBusShift),
+                                                                 ecamLength, kIODirectionInOut);
+  if (ecamMemoryDescriptor == NULL) {
+    return false;
+  }
+  ecamMemoryMap = ecamMemoryDescriptor->createMappingInTask(kernel_task, 0, kIOMapAnywhere | kIOMapInhibitCache);
+  if (ecamMemoryMap == NULL) {
+    OSSafeReleaseNULL(ecamMemoryDescriptor);
+    return false;
+  }
+
+  ecamStartBus = mcfgEntry->startBus;
+  ecamEndBus   = mcfgEntry->endBus;
+  ecamAddress  = (volatile UInt8 *)ecamMemoryMap->getVirtualAddress();
+  DBGLOG("Using ECAM at 0x%llX for buses %u-%u", mcfgEntry->baseAddress, ecamStartBus, ecamEndBus);
+  return true;
+}
+
+HyperVPCIRoot *HyperVPCIRoot::getPCIRootInstance() {
   //
   // Locate root PCI bus instance.
   //
   OSDictionary *pciMatching = IOService::serviceMatching("HyperVPCIRoot");
   if (pciMatching == NULL) {
     SYSLOG("Failed to create HyperVPCIRoot matching dictionary");
-    return false;
+    return NULL;
   }
   
   OSIterator *pciIterator = IOService::getMatchingServices(pciMatching);
+  pciMatching->release();
   if (pciIterator == NULL) {
     SYSLOG("Failed to create HyperVPCIRoot matching iterator");
-    return false;
+    return NULL;
   }
   
   pciIterator->reset();
@@ -60,6 +148,13 @@ bool HyperVPCIRoot::registerChildPCIBridge(IOPCIBridge *pciBridge) {
   
   if (pciInstance == NULL) {
     SYSLOG("Failed to locate HyperVPCIRoot instance");
+  }
+  return pciInstance;
+}
+
+bool HyperVPCIRoot::registerChildPCIBridge(IOPCIBridge *pciBridge) {
+  HyperVPCIRoot *pciInstance = getPCIRootInstance();
+  if (pciInstance == NULL) {
     return false;
   }
   
@@ -77,14 +172,146 @@ bool HyperVPCIRoot::registerChildPCIBridge(IOPCIBridge *pciBridge) {
   return true;
 }
 
+void HyperVPCIRoot::unregisterChildPCIBridge(IOPCIBridge *pciBridge) {
+  HyperVPCIRoot *pciInstance = getPCIRootInstance();
+  if (pciInstance == NULL) {
+    return;
+  }
+  
+  UInt8 busNum = pciBridge->firstBusNum();
+  if (pciInstance->pciBridges[busNum] == pciBridge) {
+    DBGLOG("Bus %u unregistered", busNum);
+    pciInstance->pciBridges[busNum] = NULL;
+  }
+}
+
+bool HyperVPCIRoot::allocateBusNumber(UInt8 *busNum) {
+  HyperVPCIRoot *pciInstance = getPCIRootInstance();
+  if (pciInstance == NULL) {
+    return false;
+  }
+  
+  //
+  // Use the lowest free bus number, numbers are returned with releaseBusNumber().
+  //
+  bool result = false;
+  IOLockLock(pciInstance->mmioLock);
+  for (UInt32 i = 0; i < ARRAY_SIZE(pciInstance->isVirtualBusAllocated); i++) {
+    if (!pciInstance->isVirtualBusAllocated[i]) {
+      pciInstance->isVirtualBusAllocated[i] = true;
+      *busNum = kHyperVPCIBusVirtualPCIFirst + i;
+      result = true;
+      break;
+    }
+  }
+  IOLockUnlock(pciInstance->mmioLock);
+  
+  if (!result) {
+    SYSLOG("No more bus numbers available for virtual PCI buses");
+  }
+  return result;
+}
+
+void HyperVPCIRoot::releaseBusNumber(UInt8 busNum) {
+  HyperVPCIRoot *pciInstance = getPCIRootInstance();
+  if (pciInstance == NULL || busNum < kHyperVPCIBusVirtualPCIFirst || busNum > kHyperVPCIBusVirtualPCILast) {
+    return;
+  }
+  
+  IOLockLock(pciInstance->mmioLock);
+  pciInstance->isVirtualBusAllocated[busNum - kHyperVPCIBusVirtualPCIFirst] = false;
+  IOLockUnlock(pciInstance->mmioLock);
+  DBGLOG("Bus %u released", busNum);
+}
+
+bool HyperVPCIRoot::allocateMMIORange(UInt64 size, bool below4GB, UInt64 *address) {
+  HyperVPCIRoot *pciInstance = getPCIRootInstance();
+  if (pciInstance == NULL) {
+    return false;
+  }
+  
+  //
+  // Ranges are naturally aligned, as required for BARs.
+  //
+  UInt64 alignment = PAGE_SIZE;
+  while (alignment < size) {
+    alignment <<= 1;
+  }
+  
+  //
+  // Try high MMIO first if allowed, falling back to low MMIO.
+  //
+  HyperVPCIRootMMIOPool *pools[] = {
+    below4GB ? NULL : &pciInstance->highMMIOPool,
+    &pciInstance->lowMMIOPool
+  };
+  
+  bool result = false;
+  IOLockLock(pciInstance->mmioLock);
+  for (UInt32 i = 0; i < ARRAY_SIZE(pools); i++) {
+    if (pools[i] == NULL || pools[i]->length == 0) {
+      continue;
+    }
+    
+    UInt64 start = (pools[i]->base + pools[i]->used + alignment - 1) & ~(alignment - 1);
+    if (start + size <= pools[i]->base + pools[i]->length) {
+      pools[i]->used = (start + size) - pools[i]->base;
+      *address = start;
+      result = true;
+      break;
+    }
+  }
+  IOLockUnlock(pciInstance->mmioLock);
+  
+  if (!result) {
+    SYSLOG("Failed to allocate MMIO range of 0x%llX bytes", size);
+  } else {
+    DBGLOG("Allocated MMIO range of 0x%llX bytes at 0x%llX", size, *address);
+  }
+  return result;
+}
+
+void HyperVPCIRoot::reserveMMIORange(UInt64 *base, UInt64 *length) {
+  //
+  // Reserve the top part of the range for VMBus devices.
+  // A pool is only reserved once, as allocations may have already been made from it.
+  //
+  bool isLow = (*base + *length) <= (1ULL << 32);
+  HyperVPCIRootMMIOPool *pool = isLow ? &lowMMIOPool : &highMMIOPool;
+  UInt64 reserveSize = isLow ? kHyperVPCIRootLowMMIOReserveSize : kHyperVPCIRootHighMMIOReserveSize;
+  
+  IOLockLock(mmioLock);
+  if (pool->length != 0) {
+    IOLockUnlock(mmioLock);
+    DBGLOG("MMIO range for VMBus devices already reserved, not reserving from 0x%llX", *base);
+    return;
+  }
+  if (reserveSize > *length / 2) {
+    reserveSize = (*length / 2) & ~((UInt64)PAGE_SIZE - 1);
+  }
+  
+  pool->base   = *base + *length - reserveSize;
+  pool->length = reserveSize;
+  pool->used   = 0;
+  *length     -= reserveSize;
+  IOLockUnlock(mmioLock);
+  DBGLOG("Reserved MMIO range 0x%llX-0x%llX for VMBus devices", pool->base, pool->base + pool->length - 1);
+}
+
 bool HyperVPCIRoot::start(IOService *provider) {
-  pciLock = IOSimpleLockAlloc();
+  pciLock  = IOSimpleLockAlloc();
+  mmioLock = IOLockAlloc();
   
   //
   // First bridge represents ourselves and will be NULL.
   //
   memset(pciBridges, 0, sizeof (pciBridges));
   
+  //
+  // Prefer ECAM for config space if available, port I/O requires serializing all accesses.
+  //
+  initECAM();
+  
   if (!super::start(provider)) {
     SYSLOG("Dummy PCI bridge failed to initialize");
     return false;
@@ -103,12 +330,32 @@ bool HyperVPCIRoot::configure(IOService *provider) {
     AppleACPIRange *acpiRanges = (AppleACPIRange*) acpiAddressSpaces->getBytesNoCopy();
     UInt32 acpiRangeCount = acpiAddressSpaces->getLength() / sizeof (AppleACPIRange);
     
+    //
+    // VMBus MMIO is reserved from the largest memory range below and above 4GB.
+    //
+    int largestLowIndex  = -1;
+    int largestHighIndex = -1;
+    for (int i = 0; i < acpiRangeCount; i++) {
+      if (acpiRanges[i].type != 0) {
+        continue;
+      }
+      int *largestIndex = (acpiRanges[i].min + acpiRanges[i].length) <= (1ULL << 32) ? &largestLowIndex : &largestHighIndex;
+      if (*largestIndex == -1 || acpiRanges[i].length > acpiRanges[*largestIndex].length) {
+        *largestIndex = i;
+      }
+    }
+    
     for (int i = 0; i < acpiRangeCount; i++) {
       DBGLOG("type %u, min %llX, max %llX, len %llX", acpiRanges[i].type, acpiRanges[i].min, acpiRanges[i].max, acpiRanges[i].length);
       if (acpiRanges[i].type == 1) {
         addBridgeIORange(acpiRanges[i].min, acpiRanges[i].length);
       } else if (acpiRanges[i].type == 0) {
-        addBridgeMemoryRange(acpiRanges[i].min, acpiRanges[i].length, true);
+        UInt64 base   = acpiRanges[i].min;
+        UInt64 length = acpiRanges[i].length;
+        if (i == largestLowIndex || i == largestHighIndex) {
+          reserveMMIORange(&base, &length);
+        }
+        addBridgeMemoryRange(base, length, true);
       }
     }
   }
@@ -117,37 +364,39 @@ bool HyperVPCIRoot::configure(IOService *provider) {
 }
 
 UInt32 HyperVPCIRoot::configRead32(IOPCIAddressSpace space, UInt8 offset) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
-  UInt32 data;
+  UInt32 data = 0xFFFFFFFF;
   IOInterruptState ints;
   
   if (pciBridges[space.es.busNum] != NULL) {
     return pciBridges[space.es.busNum]->configRead32(space, offset);
   }
   
-
+  volatile void *ecamData = getECAMAddress(space, offset);
+  if (ecamData != NULL) {
+    return *(volatile UInt32 *)ecamData;
+  }
   
   ints = IOSimpleLockLockDisableInterrupt(pciLock);
   if (setConfigSpace(space, offset)) {
     data = inl(0xCFC);
   }
   
-  if (offset == kIOPCIConfigurationOffsetBaseAddress0) {
-    DBGLOG("gonna read BAR0 %X", data);
-  }
-  
   IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
   return data;
 }
 
 void HyperVPCIRoot::configWrite32(IOPCIAddressSpace space, UInt8 offset, UInt32 data) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
   IOInterruptState ints;
   
   if (pciBridges[space.es.busNum] != NULL) {
     pciBridges[space.es.busNum]->configWrite32(space, offset, data);
+    return;
+  }
+  
+  volatile void *ecamData = getECAMAddress(space, offset);
+  if (ecamData != NULL) {
+    *(volatile UInt32 *)ecamData = data;
+    return;
   }
   
   ints = IOSimpleLockLockDisableInterrupt(pciLock);
@@ -155,26 +404,25 @@ void HyperVPCIRoot::configWrite32(IOPCIAddressSpace space, UInt8 offset, UInt32
     outl(0xCFC, data);
   }
   
-  if (offset == kIOPCIConfigurationOffsetBaseAddress0) {
-    DBGLOG("wrote BAR0 %X", data);
-  }
-  
   IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
 }
 
 UInt16 HyperVPCIRoot::configRead16(IOPCIAddressSpace space, UInt8 offset) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
-  UInt16 data;
+  UInt16 data = 0xFFFF;
   IOInterruptState ints;
   
   if (pciBridges[space.es.busNum] != NULL) {
     return pciBridges[space.es.busNum]->configRead16(space, offset);
   }
   
+  volatile void *ecamData = getECAMAddress(space, offset);
+  if (ecamData != NULL) {
+    return *(volatile UInt16 *)ecamData;
+  }
+  
   ints = IOSimpleLockLockDisableInterrupt(pciLock);
   if (setConfigSpace(space, offset)) {
-    data = inw(0xCFC);
+    data = inw(0xCFC + (offset & 0x3));
   }
   
   IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
@@ -182,35 +430,43 @@ UInt16 HyperVPCIRoot::configRead16(IOPCIAddressSpace space, UInt8 offset) {
 }
 
 void HyperVPCIRoot::configWrite16(IOPCIAddressSpace space, UInt8 offset, UInt16 data) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
   IOInterruptState ints;
   
   if (pciBridges[space.es.busNum] != NULL) {
     pciBridges[space.es.busNum]->configWrite16(space, offset, data);
+    return;
+  }
+  
+  volatile void *ecamData = getECAMAddress(space, offset);
+  if (ecamData != NULL) {
+    *(volatile UInt16 *)ecamData = data;
+    return;
   }
   
   ints = IOSimpleLockLockDisableInterrupt(pciLock);
   if (setConfigSpace(space, offset)) {
-    outw(0xCFC, data);
+    outw(0xCFC + (offset & 0x3), data);
   }
   
   IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
 }
 
 UInt8 HyperVPCIRoot::configRead8(IOPCIAddressSpace space, UInt8 offset) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
-  UInt8 data;
+  UInt8 data = 0xFF;
   IOInterruptState ints;
   
   if (pciBridges[space.es.busNum] != NULL) {
     return pciBridges[space.es.busNum]->configRead8(space, offset);
   }
   
+  volatile void *ecamData = getECAMAddress(space, offset);
+  if (ecamData != NULL) {
+    return *(volatile UInt8 *)ecamData;
+  }
+  
   ints = IOSimpleLockLockDisableInterrupt(pciLock);
   if (setConfigSpace(space, offset)) {
-    data = inb(0xCFC);
+    data = inb(0xCFC + (offset & 0x3));
   }
   
   IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
@@ -218,17 +474,22 @@ UInt8 HyperVPCIRoot::configRead8(IOPCIAddressSpace space, UInt8 offset) {
 }
 
 void HyperVPCIRoot::configWrite8(IOPCIAddressSpace space, UInt8 offset, UInt8 data) {
-  DBGLOG("Bus: %u, device: %u, function: %u, offset %X", space.es.busNum, space.es.deviceNum, space.es.functionNum, offset);
-  
   IOInterruptState ints;
   
   if (pciBridges[space.es.busNum] != NULL) {
     pciBridges[space.es.busNum]->configWrite8(space, offset, data);
+    return;
+  }
+  
+  volatile void *ecamData = getECAMAddress(space, offset);
+  if (ecamData != NULL) {
+    *(volatile UInt8 *)ecamData = data;
+    return;
   }
   
   ints = IOSimpleLockLockDisableInterrupt(pciLock);
   if (setConfigSpace(space, offset)) {
-    outb(0xCFC, data);
+    outb(0xCFC + (offset & 0x3), data);
   }
   
   IOSimpleLockUnlockEnableInterrupt(pciLock, ints);
@@ -11,18 +11,80 @@
 #include "HyperV.hpp"
 #include <IOKit/pci/IOPCIBridge.h>
 
+//
+// Emulated config space access for child bridges.
+// Reads are lock-free, writes atomically update the containing 32-bit word so reads always see a consistent value.
+// Config space must be 4-byte aligned.
+//
+static inline UInt32 readEmulatedConfigSpace(const UInt8 *configSpace, UInt8 offset, UInt8 size) {
+  UInt32 word = *(const volatile UInt32 *)&configSpace[offset & 0xFC];
+  word >>= (offset & 0x3) * 8;
+  return size == sizeof (UInt32) ? word : (word & ((1U << (size * 8)) - 1));
+}
+
+static inline void writeEmulatedConfigSpace(UInt8 *configSpace, UInt8 offset, UInt8 size, UInt32 data) {
+  volatile UInt32 *word = (volatile UInt32 *)&configSpace[offset & 0xFC];
+  UInt32 shift = (offset & 0x3) * 8;
+  UInt32 mask  = (size == sizeof (UInt32) ? 0xFFFFFFFF : ((1U << (size * 8)) - 1)) << shift;
+
+  UInt32 oldWord;
+  UInt32 newWord;
+  do {
+    oldWord = *word;
+    newWord = (oldWord & ~mask) | ((data << shift) & mask);
+  } while (!OSCompareAndSwap(oldWord, newWord, word));
+}
+
+//
+// MMIO reserved from the root bridge ranges, allocations are never returned.
+//
+#define kHyperVPCIRootLowMMIOReserveSize    (64 * 1024 * 1024)
+#define kHyperVPCIRootHighMMIOReserveSize   (1024ULL * 1024 * 1024)
+
+typedef struct {
+  UInt64 base;
+  UInt64 length;
+  UInt64 used;
+} HyperVPCIRootMMIOPool;
+
 class HyperVPCIRoot : public IOPCIBridge {
   OSDeclareDefaultStructors(HyperVPCIRoot);
   
 private:
   IOSimpleLock *pciLock = NULL;
   
+  //
+  // ECAM config space from ACPI MCFG table, if present.
+  //
+  IOMemoryDescriptor  *ecamMemoryDescriptor = NULL;
+  IOMemoryMap         *ecamMemoryMap        = NULL;
+  volatile UInt8      *ecamAddress          = NULL;
+  UInt8               ecamStartBus          = 0;
+  UInt8               ecamEndBus            = 0;
+  
+  //
+  // MMIO reserved for VMBus devices such as vPCI, split into ranges below and above 4GB.
+  //
+  IOLock              *mmioLock             = NULL;
+  HyperVPCIRootMMIOPool lowMMIOPool         {};
+  HyperVPCIRootMMIOPool highMMIOPool        {};
+  bool                isVirtualBusAllocated[kHyperVPCIBusVirtualPCILast - kHyperVPCIBusVirtualPCIFirst + 1] {};
+  
   inline bool setConfigSpace(IOPCIAddressSpace space, UInt8 offset);
+  inline volatile void *getECAMAddress(IOPCIAddressSpace space, UInt8 offset);
+  bool initECAM();
+  void reserveMMIORange(UInt64 *base, UInt64 *length);
   
   IOPCIBridge *pciBridges[256] {};
   
+  static HyperVPCIRoot *getPCIRootInstance();
+  
 public:
   static bool registerChildPCIBridge(IOPCIBridge *pciBridge);
+  static void unregisterChildPCIBridge(IOPCIBridge *pciBridge);
+  static bool allocateBusNumber(UInt8 *busNum);
+  static void releaseBusNumber(UInt8 busNum);
+  static bool allocateMMIORange(UInt64 size, bool below4GB, UInt64 *address);
   
   //
   // IOService overrides.
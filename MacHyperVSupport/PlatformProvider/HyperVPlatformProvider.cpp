@@ -13,6 +13,7 @@
 #include "HyperV.hpp"
 
 #include <IOKit/IOPlatformExpert.h>
+#include <IOKit/graphics/IOFramebuffer.h>
 
 #define SYSLOG(str, ...) SYSLOG_PRINT("HyperVPlatformProvider", str, ## __VA_ARGS__)
 #define DBGLOG(str, ...) DBGLOG_PRINT("HyperVPlatformProvider", str, ## __VA_ARGS__)
@@ -21,6 +22,11 @@
 
 HyperVPlatformProvider *HyperVPlatformProvider::instance;
 
+static const char *kextIONDRVSupportPath[] { "/System/Library/Extensions/IONDRVSupport.kext/IONDRVSupport" };
+static KernelPatcher::KextInfo kextIONDRVSupport {
+  "com.apple.iokit.IONDRVSupport", kextIONDRVSupportPath, arrsize(kextIONDRVSupportPath), { true }, {}, KernelPatcher::KextInfo::Unloaded
+};
+
 void HyperVPlatformProvider::init() {
   DBGLOG("Initializing provider");
   
@@ -30,6 +36,9 @@ void HyperVPlatformProvider::init() {
   lilu.onPatcherLoadForce([](void *user, KernelPatcher &patcher) {
     static_cast<HyperVPlatformProvider *>(user)->onLiluPatcherLoad(patcher);
   }, this);
+  lilu.onKextLoadForce(&kextIONDRVSupport, 1, [](void *user, KernelPatcher &patcher, size_t index, mach_vm_address_t address, size_t size) {
+    static_cast<HyperVPlatformProvider *>(user)->onLiluKextLoad(patcher, index, address, size);
+  }, this);
 
   //
   // Patch setConsoleInfo to call our wrapper function instead.
@@ -110,6 +119,59 @@ void HyperVPlatformProvider::onLiluPatcherLoad(KernelPatcher &patcher) {
     SYSLOG("Failed to route platform functions");
     patcher.clearError();
   }
+
+  //
+  // Resolve clock functions used for time synchronization.
+  //
+  setCalendarMicrotimeAddr = patcher.solveSymbol(KernelPatcher::KernelID, "_clock_set_calendar_microtime");
+  if (setCalendarMicrotimeAddr == 0) {
+    SYSLOG("Failed to resolve clock_set_calendar_microtime");
+    patcher.clearError();
+  }
+  kernAdjtimeAddr = patcher.solveSymbol(KernelPatcher::KernelID, "_kern_adjtime");
+  if (kernAdjtimeAddr == 0) {
+    patcher.clearError();
+    clockAdjtimeAddr = patcher.solveSymbol(KernelPatcher::KernelID, "_clock_adjtime");
+    if (clockAdjtimeAddr == 0) {
+      SYSLOG("Failed to resolve kern_adjtime or clock_adjtime");
+      patcher.clearError();
+    }
+  }
+
+  //
+  // Resolve VM page counters used for Dynamic Memory.
+  //
+  maxMemAddr                 = patcher.solveSymbol(KernelPatcher::KernelID, "_max_mem");
+  vmPageFreeCountAddr        = patcher.solveSymbol(KernelPatcher::KernelID, "_vm_page_free_count");
+  vmPageInactiveCountAddr    = patcher.solveSymbol(KernelPatcher::KernelID, "_vm_page_inactive_count");
+  vmPageSpeculativeCountAddr = patcher.solveSymbol(KernelPatcher::KernelID, "_vm_page_speculative_count");
+  if (!canGetMemoryStatus()) {
+    SYSLOG("Failed to resolve VM page counters");
+    patcher.clearError();
+  }
+}
+
+void HyperVPlatformProvider::onLiluKextLoad(KernelPatcher &patcher, size_t index, mach_vm_address_t address, size_t size) {
+  if (index != kextIONDRVSupport.loadIndex) {
+    return;
+  }
+  DBGLOG("IONDRVSupport loaded");
+
+  //
+  // Wrap the framebuffer hardware cursor functions, used to pass the cursor to Hyper-V.
+  //
+  KernelPatcher::RouteRequest requests[] = {
+    { "__ZN17IONDRVFramebuffer12getAttributeEjPm", wrapFramebufferGetAttribute, origFramebufferGetAttribute },
+    { "__ZN17IONDRVFramebuffer14setCursorImageEPv", wrapFramebufferSetCursorImage, origFramebufferSetCursorImage },
+    { "__ZN17IONDRVFramebuffer14setCursorStateEiib", wrapFramebufferSetCursorState, origFramebufferSetCursorState }
+  };
+  if (!patcher.routeMultiple(index, requests, arrsize(requests), address, size)) {
+    SYSLOG("Failed to route framebuffer cursor functions");
+    patcher.clearError();
+    origFramebufferGetAttribute   = 0;
+    origFramebufferSetCursorImage = 0;
+    origFramebufferSetCursorState = 0;
+  }
 }
 
 int HyperVPlatformProvider::reboot(proc_t proc, reboot_args *args, int32_t *retval) {
@@ -146,3 +208,107 @@ void HyperVPlatformProvider::shutdownSystem() {
     reboot(kernproc, &args, NULL);
   }
 }
+
+bool HyperVPlatformProvider::canSetTime() {
+  return setCalendarMicrotimeAddr != 0;
+}
+
+void HyperVPlatformProvider::setTime(clock_sec_t secs, clock_usec_t microsecs) {
+  DBGLOG("Setting calendar time to %lu.%06u", (unsigned long) secs, microsecs);
+  if (setCalendarMicrotimeAddr != 0) {
+    reinterpret_cast<void (*)(clock_sec_t, clock_usec_t)>(setCalendarMicrotimeAddr)(secs, microsecs);
+  }
+}
+
+bool HyperVPlatformProvider::canSlewTime() {
+  return kernAdjtimeAddr != 0 || clockAdjtimeAddr != 0;
+}
+
+void HyperVPlatformProvider::slewTime(SInt64 deltaMicroseconds) {
+  //
+  // Replaces any adjustment still in progress, like adjtime().
+  //
+  if (kernAdjtimeAddr != 0) {
+    struct timeval delta;
+    delta.tv_sec  = (__darwin_time_t) (deltaMicroseconds / USEC_PER_SEC);
+    delta.tv_usec = (__darwin_suseconds_t) (deltaMicroseconds % USEC_PER_SEC);
+    reinterpret_cast<int (*)(struct timeval *)>(kernAdjtimeAddr)(&delta);
+  } else if (clockAdjtimeAddr != 0) {
+    long secs     = (long) (deltaMicroseconds / USEC_PER_SEC);
+    int microsecs = (int) (deltaMicroseconds % USEC_PER_SEC);
+    reinterpret_cast<void (*)(long *, int *)>(clockAdjtimeAddr)(&secs, &microsecs);
+  }
+}
+
+bool HyperVPlatformProvider::canGetMemoryStatus() {
+  return maxMemAddr != 0 && vmPageFreeCountAddr != 0 && vmPageInactiveCountAddr != 0 && vmPageSpeculativeCountAddr != 0;
+}
+
+void HyperVPlatformProvider::getMemoryStatus(UInt64 *totalPages, UInt64 *availablePages) {
+  if (!canGetMemoryStatus()) {
+    *totalPages     = 0;
+    *availablePages = 0;
+    return;
+  }
+
+  //
+  // Inactive and speculative pages can be reclaimed without paging out, count them as available.
+  //
+  *totalPages     = *reinterpret_cast<volatile uint64_t *>(maxMemAddr) / PAGE_SIZE;
+  *availablePages = (UInt64) *reinterpret_cast<volatile unsigned int *>(vmPageFreeCountAddr)
+                    + *reinterpret_cast<volatile unsigned int *>(vmPageInactiveCountAddr)
+                    + *reinterpret_cast<volatile unsigned int *>(vmPageSpeculativeCountAddr);
+}
+
+bool HyperVPlatformProvider::isCursorFramebuffer(IOFramebuffer *framebuffer) {
+  //
+  // Framebuffer is attached to the PCI device produced by the cursor owner.
+  //
+  IOService *device = framebuffer->getProvider();
+  return cursorOwner != NULL && device != NULL && device->getProvider() == cursorOwner;
+}
+
+IOReturn HyperVPlatformProvider::wrapFramebufferGetAttribute(IOFramebuffer *that, IOSelect attribute, uintptr_t *value) {
+  //
+  // Report hardware cursor support (kIOFBHWCursorSupported), IOFramebuffer then uses setCursorImage and setCursorState.
+  // A failed setCursorImage falls back to the software cursor.
+  //
+  if (attribute == kIOHardwareCursorAttribute && value != NULL && instance->isCursorFramebuffer(that)) {
+    *value = 1;
+    return kIOReturnSuccess;
+  }
+  return FunctionCast(wrapFramebufferGetAttribute, instance->origFramebufferGetAttribute)(that, attribute, value);
+}
+
+IOReturn HyperVPlatformProvider::wrapFramebufferSetCursorImage(IOFramebuffer *that, void *cursorImage) {
+  if (instance->isCursorFramebuffer(that)) {
+    return instance->cursorImageAction(instance->cursorOwner, that, cursorImage);
+  }
+  return FunctionCast(wrapFramebufferSetCursorImage, instance->origFramebufferSetCursorImage)(that, cursorImage);
+}
+
+IOReturn HyperVPlatformProvider::wrapFramebufferSetCursorState(IOFramebuffer *that, SInt32 x, SInt32 y, bool visible) {
+  if (instance->isCursorFramebuffer(that)) {
+    return instance->cursorStateAction(instance->cursorOwner, x, y, visible);
+  }
+  return FunctionCast(wrapFramebufferSetCursorState, instance->origFramebufferSetCursorState)(that, x, y, visible);
+}
+
+bool HyperVPlatformProvider::canRouteFramebufferCursor() {
+  return origFramebufferGetAttribute != 0 && origFramebufferSetCursorImage != 0 && origFramebufferSetCursorState != 0;
+}
+
+void HyperVPlatformProvider::registerFramebufferCursor(IOService *owner, HyperVCursorImageAction imageAction, HyperVCursorStateAction stateAction) {
+  //
+  // Owner must register before its framebuffer is started, as the cursor attribute is read when the framebuffer is opened.
+  //
+  cursorImageAction = imageAction;
+  cursorStateAction = stateAction;
+  cursorOwner       = owner;
+}
+
+void HyperVPlatformProvider::unregisterFramebufferCursor(IOService *owner) {
+  if (cursorOwner == owner) {
+    cursorOwner = NULL;
+  }
+}
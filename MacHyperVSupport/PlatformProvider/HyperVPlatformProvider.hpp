@@ -11,6 +11,14 @@
 #include <IOKit/IOService.h>
 #include <Headers/kern_patcher.hpp>
 
+class IOFramebuffer;
+
+//
+// Hardware cursor calls forwarded from the framebuffer, target is the registered cursor owner.
+//
+typedef IOReturn (*HyperVCursorImageAction)(OSObject *target, IOFramebuffer *framebuffer, void *cursorImage);
+typedef IOReturn (*HyperVCursorStateAction)(OSObject *target, SInt32 x, SInt32 y, bool visible);
+
 #define  PAD_(t)  (sizeof(uint64_t) <= sizeof(t) \
      ? 0 : sizeof(uint64_t) - sizeof(t))
 #define  PADL_(t)  0
@@ -39,6 +47,22 @@ private:
   mach_vm_address_t origReboot = 0;
   static int reboot(proc_t proc, reboot_args *args, __unused int32_t *retval);
   
+  //
+  // Clock functions.
+  // kern_adjtime replaced clock_adjtime in 10.13.
+  //
+  mach_vm_address_t setCalendarMicrotimeAddr = 0;
+  mach_vm_address_t kernAdjtimeAddr = 0;
+  mach_vm_address_t clockAdjtimeAddr = 0;
+  
+  //
+  // VM page counters used for memory pressure reporting.
+  //
+  mach_vm_address_t maxMemAddr = 0;
+  mach_vm_address_t vmPageFreeCountAddr = 0;
+  mach_vm_address_t vmPageInactiveCountAddr = 0;
+  mach_vm_address_t vmPageSpeculativeCountAddr = 0;
+  
   //
   // IOPlatformExpert::setConsoleInfo wrapping
   //
@@ -46,11 +70,27 @@ private:
   uint64_t setConsoleInfoOrg[2] {};
   static IOReturn wrapSetConsoleInfo(IOPlatformExpert *that, PE_Video * consoleInfo, unsigned int op);
   
+  //
+  // IONDRVFramebuffer hardware cursor wrapping.
+  // The boot NDRV has no hardware cursor, calls for framebuffers below the cursor owner are forwarded to it instead.
+  //
+  mach_vm_address_t origFramebufferGetAttribute   = 0;
+  mach_vm_address_t origFramebufferSetCursorImage = 0;
+  mach_vm_address_t origFramebufferSetCursorState = 0;
+  IOService               *cursorOwner            = NULL;
+  HyperVCursorImageAction cursorImageAction       = NULL;
+  HyperVCursorStateAction cursorStateAction       = NULL;
+  bool isCursorFramebuffer(IOFramebuffer *framebuffer);
+  static IOReturn wrapFramebufferGetAttribute(IOFramebuffer *that, IOSelect attribute, uintptr_t *value);
+  static IOReturn wrapFramebufferSetCursorImage(IOFramebuffer *that, void *cursorImage);
+  static IOReturn wrapFramebufferSetCursorState(IOFramebuffer *that, SInt32 x, SInt32 y, bool visible);
+  
   //
   // Initialization function.
   //
   void init();
   void onLiluPatcherLoad(KernelPatcher &patcher);
+  void onLiluKextLoad(KernelPatcher &patcher, size_t index, mach_vm_address_t address, size_t size);
   
 public:
   //
@@ -72,6 +112,15 @@ public:
   //
   bool canShutdownSystem();
   void shutdownSystem();
+  bool canSetTime();
+  void setTime(clock_sec_t secs, clock_usec_t microsecs);
+  bool canSlewTime();
+  void slewTime(SInt64 deltaMicroseconds);
+  bool canGetMemoryStatus();
+  void getMemoryStatus(UInt64 *totalPages, UInt64 *availablePages);
+  bool canRouteFramebufferCursor();
+  void registerFramebufferCursor(IOService *owner, HyperVCursorImageAction imageAction, HyperVCursorStateAction stateAction);
+  void unregisterFramebufferCursor(IOService *owner);
   
 };
 
@@ -0,0 +1,454 @@
+//
+//  HyperVSocket.cpp
+//  Hyper-V socket driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVSocket.hpp"
+
+OSDefineMetaClassAndStructors(HyperVSocket, super);
+
+bool HyperVSocket::start(IOService *provider) {
+  bool channelOpen = false;
+
+  if (!super::start(provider)) {
+    return false;
+  }
+
+  //
+  // Get parent VMBus device object.
+  //
+  hvDevice = OSDynamicCast(HyperVVMBusDevice, provider);
+  if (hvDevice == NULL) {
+    super::stop(provider);
+    return false;
+  }
+  hvDevice->retain();
+
+  do {
+    socketLock    = IOLockAlloc();
+    sendLock      = IOLockAlloc();
+    packetBuffer  = (UInt8 *)IOMalloc(kHyperVSocketPacketBufferSize);
+    sharedBuffer  = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                          PAGE_SIZE + kHyperVSocketReceiveBufferSize + kHyperVSocketSendBufferSize, PAGE_SIZE);
+    if (socketLock == NULL || sendLock == NULL || packetBuffer == NULL || sharedBuffer == NULL) {
+      SYSLOG("Failed to allocate socket resources");
+      break;
+    }
+
+    sharedHeader = (HyperVSocketHeader *)sharedBuffer->getBytesNoCopy();
+    bzero(sharedHeader, sharedBuffer->getLength());
+    sharedHeader->receiveSize   = kHyperVSocketReceiveBufferSize;
+    sharedHeader->receiveOffset = PAGE_SIZE;
+    sharedHeader->sendSize      = kHyperVSocketSendBufferSize;
+    sharedHeader->sendOffset    = PAGE_SIZE + kHyperVSocketReceiveBufferSize;
+    receiveBuffer = (UInt8 *)sharedHeader + sharedHeader->receiveOffset;
+    sendBuffer    = (UInt8 *)sharedHeader + sharedHeader->sendOffset;
+
+    //
+    // Configure interrupt.
+    //
+    interruptSource =
+      IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &HyperVSocket::handleInterrupt), provider, 0);
+    if (interruptSource == NULL) {
+      SYSLOG("Failed to create interrupt event source");
+      break;
+    }
+    getWorkLoop()->addEventSource(interruptSource);
+    interruptSource->enable();
+
+    //
+    // Opening the channel accepts the connection, data is buffered until a client connects.
+    //
+    if (!hvDevice->openChannel(kHyperVSocketRingBufferSize, kHyperVSocketRingBufferSize)) {
+      break;
+    }
+    channelOpen = true;
+
+    //
+    // Allow userspace to find this connection.
+    //
+    updateStatistics();
+    registerService();
+
+    OSString *serviceId = OSDynamicCast(OSString, provider->getProperty(kHyperVVMBusDeviceChannelTypeKey));
+    SYSLOG("Accepted Hyper-V socket connection for service %s", serviceId != NULL ? serviceId->getCStringNoCopy() : "unknown");
+    return true;
+  } while (false);
+
+  if (channelOpen) {
+    hvDevice->closeChannel();
+  }
+  freeSocket();
+  super::stop(provider);
+  return false;
+}
+
+void HyperVSocket::stop(IOService *provider) {
+  DBGLOG("Hyper-V socket is stopping");
+
+  //
+  // Release any client waiting for data, and wait for sends in progress to stop.
+  //
+  IOLockLock(socketLock);
+  isStopping = true;
+  IOLockUnlock(socketLock);
+  setState(kHyperVSocketStateClosed);
+
+  IOLockLock(sendLock);
+  IOLockUnlock(sendLock);
+
+  if (hvDevice != NULL) {
+    hvDevice->closeChannel();
+  }
+  freeSocket();
+  super::stop(provider);
+}
+
+void HyperVSocket::free() {
+  //
+  // Client threads and mappings may still reference these until the user client releases this service.
+  //
+  OSSafeReleaseNULL(sharedBuffer);
+  if (socketLock != NULL) {
+    IOLockFree(socketLock);
+    socketLock = NULL;
+  }
+  if (sendLock != NULL) {
+    IOLockFree(sendLock);
+    sendLock = NULL;
+  }
+
+  super::free();
+}
+
+void HyperVSocket::freeSocket() {
+  if (interruptSource != NULL) {
+    interruptSource->disable();
+    getWorkLoop()->removeEventSource(interruptSource);
+    OSSafeReleaseNULL(interruptSource);
+  }
+  if (packetBuffer != NULL) {
+    IOFree(packetBuffer, kHyperVSocketPacketBufferSize);
+    packetBuffer = NULL;
+  }
+  OSSafeReleaseNULL(hvDevice);
+}
+
+void HyperVSocket::handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count) {
+  //
+  // Hyper-V also signals once it has freed the TX space a sender is waiting on.
+  //
+  IOLockLock(socketLock);
+  if (isWaitingTxSpace) {
+    isWaitingTxSpace = false;
+    IOLockWakeup(socketLock, &isWaitingTxSpace, false);
+  }
+  IOLockUnlock(socketLock);
+
+  receivePackets();
+}
+
+void HyperVSocket::receivePackets() {
+  UInt32  pktDataLength;
+  UInt32  producerIndex       = receiveProducer;
+  UInt32  receivedBytes       = 0;
+  bool    isShutdownReceived  = false;
+
+  //
+  // Drain all pending packets, waking the client once for the whole batch.
+  // Receive indexes are only changed on the workloop.
+  //
+  while (hvDevice != NULL && hvDevice->nextInbandPacketAvailable(&pktDataLength)) {
+    if (pktDataLength < sizeof (HyperVSocketPipeHeader) || pktDataLength > kHyperVSocketPacketBufferSize) {
+      SYSLOG("Invalid packet of %u bytes, closing connection", pktDataLength);
+      setState(kHyperVSocketStateClosed);
+      break;
+    }
+
+    //
+    // Leave packets in the channel while the receive buffer is full, they are read once the client hands back space.
+    //
+    if (pktDataLength - sizeof (HyperVSocketPipeHeader) > kHyperVSocketReceiveBufferSize - (producerIndex - receiveConsumer)) {
+      if (!isReceiveStalled) {
+        isReceiveStalled = true;
+        receiveStallCount++;
+      }
+      break;
+    }
+
+    if (hvDevice->readInbandCompletionPacket(packetBuffer, pktDataLength, NULL) != kIOReturnSuccess) {
+      break;
+    }
+    HyperVSocketPipeHeader *pipeHeader = (HyperVSocketPipeHeader *)packetBuffer;
+    if (pipeHeader->type != kHyperVSocketPipeTypeData || pipeHeader->dataSize > pktDataLength - sizeof (HyperVSocketPipeHeader)) {
+      DBGLOG("Ignoring pipe packet type %u with %u bytes", pipeHeader->type, pipeHeader->dataSize);
+      continue;
+    }
+    packetsReceived++;
+
+    if (pipeHeader->dataSize == 0) {
+      isShutdownReceived = true;
+      continue;
+    }
+
+    //
+    // Copy data into the receive buffer, wrapping around if needed.
+    //
+    UInt32 receiveIndex   = producerIndex % kHyperVSocketReceiveBufferSize;
+    UInt32 fragmentLength = kHyperVSocketReceiveBufferSize - receiveIndex;
+    if (fragmentLength > pipeHeader->dataSize) {
+      fragmentLength = pipeHeader->dataSize;
+    }
+    memcpy(&receiveBuffer[receiveIndex], pipeHeader + 1, fragmentLength);
+    memcpy(receiveBuffer, (UInt8 *)(pipeHeader + 1) + fragmentLength, pipeHeader->dataSize - fragmentLength);
+
+    producerIndex += pipeHeader->dataSize;
+    receivedBytes += pipeHeader->dataSize;
+  }
+
+  if (receivedBytes == 0 && !isShutdownReceived) {
+    return;
+  }
+  bytesReceived += receivedBytes;
+  receiveBatchCount++;
+
+  IOLockLock(socketLock);
+  receiveProducer               = producerIndex;
+  sharedHeader->receiveProducer = producerIndex;
+  if (isShutdownReceived) {
+    state              |= kHyperVSocketStateReceiveShutdown;
+    sharedHeader->state = state;
+  }
+  IOLockWakeup(socketLock, &receiveProducer, false);
+  IOLockUnlock(socketLock);
+
+  if (isShutdownReceived) {
+    DBGLOG("Host has shut down the connection");
+    updateStatistics();
+  }
+}
+
+IOReturn HyperVSocket::consumeGated(UInt32 *consumerIndex) {
+  if (*consumerIndex - receiveConsumer > receiveProducer - receiveConsumer) {
+    return kIOReturnBadArgument;
+  }
+
+  IOLockLock(socketLock);
+  receiveConsumer               = *consumerIndex;
+  sharedHeader->receiveConsumer = receiveConsumer;
+  IOLockUnlock(socketLock);
+
+  //
+  // Read any packets left in the channel while the receive buffer was full.
+  //
+  if (isReceiveStalled && !isStopping) {
+    isReceiveStalled = false;
+    receivePackets();
+  }
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVSocket::sendPipePacket(void *data, UInt32 dataLength) {
+  HyperVSocketPipeHeader pipeHeader;
+  pipeHeader.type     = kHyperVSocketPipeTypeData;
+  pipeHeader.dataSize = dataLength;
+
+  //
+  // While the TX ring is full, ask Hyper-V to signal once it has freed enough space and sleep until then.
+  // The deadline only guards against a missed signal.
+  //
+  IOReturn status       = kIOReturnSuccess;
+  bool     isSizeSet    = false;
+  UInt32   packetLength = sizeof (pipeHeader) + dataLength;
+
+  IOLockLock(socketLock);
+  while (true) {
+    if (isStopping || (state & (kHyperVSocketStateSendShutdown | kHyperVSocketStateClosed)) != 0) {
+      status = kIOReturnNotOpen;
+      break;
+    }
+    if (hvDevice->isTxSpaceAvailable(packetLength)) {
+      break;
+    }
+    if (!isSizeSet) {
+      hvDevice->setTxPendingSendSize(packetLength);
+      isSizeSet = true;
+      continue;
+    }
+
+    sendWaitCount++;
+    AbsoluteTime deadline;
+    clock_interval_to_deadline(kHyperVSocketSendWaitMS, kMillisecondScale, &deadline);
+    isWaitingTxSpace = true;
+    IOLockSleepDeadline(socketLock, &isWaitingTxSpace, deadline, THREAD_UNINT);
+  }
+  isWaitingTxSpace = false;
+  IOLockUnlock(socketLock);
+
+  if (isSizeSet) {
+    hvDevice->setTxPendingSendSize(0);
+  }
+  if (status != kIOReturnSuccess) {
+    return status;
+  }
+
+  status = hvDevice->writeInbandPacketWithPrefix(&pipeHeader, sizeof (pipeHeader), data, dataLength);
+  if (status == kIOReturnSuccess) {
+    packetsSent++;
+  }
+  return status;
+}
+
+void HyperVSocket::setState(UInt32 newState) {
+  IOLockLock(socketLock);
+  state              |= newState;
+  sharedHeader->state = state;
+  IOLockWakeup(socketLock, &receiveProducer, false);
+  IOLockWakeup(socketLock, &isWaitingTxSpace, false);
+  IOLockUnlock(socketLock);
+}
+
+void HyperVSocket::updateStatistics() {
+  OSDictionary *stats = OSDictionary::withCapacity(8);
+  if (stats == NULL) {
+    return;
+  }
+
+  const struct {
+    const char  *key;
+    UInt64      value;
+  } values[] = {
+    { "ClientConnected",    isClientConnected ? 1 : 0 },
+    { "BytesReceived",      bytesReceived },
+    { "BytesSent",          bytesSent },
+    { "PacketsReceived",    packetsReceived },
+    { "PacketsSent",        packetsSent },
+    { "ReceiveBatchCount",  receiveBatchCount },
+    { "ReceiveStallCount",  receiveStallCount },
+    { "SendWaitCount",      sendWaitCount }
+  };
+  for (UInt32 i = 0; i < ARRAY_SIZE(values); i++) {
+    OSNumber *number = OSNumber::withNumber(values[i].value, 64);
+    if (number != NULL) {
+      stats->setObject(values[i].key, number);
+      number->release();
+    }
+  }
+
+  setProperty(kHyperVSocketStatisticsKey, stats);
+  stats->release();
+}
+
+bool HyperVSocket::connectClient() {
+  bool result;
+
+  IOLockLock(socketLock);
+  result = !isClientConnected && !isStopping;
+  if (result) {
+    isClientConnected = true;
+  }
+  IOLockUnlock(socketLock);
+
+  if (result) {
+    DBGLOG("Socket client connected");
+    updateStatistics();
+  }
+  return result;
+}
+
+void HyperVSocket::disconnectClient() {
+  DBGLOG("Socket client disconnected");
+
+  //
+  // Closing the client shuts down this side of the connection.
+  //
+  IOLockLock(sendLock);
+  if (!isStopping) {
+    sendPipePacket(NULL, 0);
+  }
+  setState(kHyperVSocketStateSendShutdown);
+  IOLockUnlock(sendLock);
+
+  IOLockLock(socketLock);
+  isClientConnected = false;
+  IOLockWakeup(socketLock, &receiveProducer, false);
+  IOLockUnlock(socketLock);
+
+  updateStatistics();
+}
+
+IOReturn HyperVSocket::receive(UInt32 consumerIndex, UInt32 *producerIndex, UInt32 *connectionState) {
+  IOWorkLoop *workLoop = getWorkLoop();
+  if (workLoop == NULL) {
+    return kIOReturnOffline;
+  }
+
+  IOReturn status = workLoop->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &HyperVSocket::consumeGated), this, &consumerIndex);
+  if (status != kIOReturnSuccess) {
+    return status;
+  }
+
+  IOLockLock(socketLock);
+  while (isClientConnected && receiveProducer == receiveConsumer
+         && (state & (kHyperVSocketStateReceiveShutdown | kHyperVSocketStateClosed)) == 0) {
+    if (IOLockSleep(socketLock, &receiveProducer, THREAD_ABORTSAFE) != THREAD_AWAKENED) {
+      IOLockUnlock(socketLock);
+      return kIOReturnAborted;
+    }
+  }
+
+  if (!isClientConnected) {
+    IOLockUnlock(socketLock);
+    return kIOReturnOffline;
+  }
+
+  *producerIndex    = receiveProducer;
+  *connectionState  = state;
+  IOLockUnlock(socketLock);
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVSocket::send(UInt32 offset, UInt32 length) {
+  IOReturn  status    = kIOReturnSuccess;
+  UInt32    sentBytes = 0;
+
+  if (offset > kHyperVSocketSendBufferSize || length > kHyperVSocketSendBufferSize - offset) {
+    return kIOReturnBadArgument;
+  }
+
+  //
+  // Data is sent straight from the shared send buffer, split into the largest packets Hyper-V accepts.
+  //
+  IOLockLock(sendLock);
+  while (sentBytes < length) {
+    UInt32 chunkLength = length - sentBytes;
+    if (chunkLength > kHyperVSocketMaxSendSize) {
+      chunkLength = kHyperVSocketMaxSendSize;
+    }
+    status = sendPipePacket(sendBuffer + offset + sentBytes, chunkLength);
+    if (status != kIOReturnSuccess) {
+      break;
+    }
+    sentBytes += chunkLength;
+  }
+  bytesSent += sentBytes;
+  IOLockUnlock(sendLock);
+
+  return status;
+}
+
+IOReturn HyperVSocket::shutdown() {
+  IOLockLock(sendLock);
+  IOReturn status = sendPipePacket(NULL, 0);
+  if (status == kIOReturnSuccess) {
+    setState(kHyperVSocketStateSendShutdown);
+  }
+  IOLockUnlock(sendLock);
+
+  if (status == kIOReturnSuccess) {
+    DBGLOG("Socket has been shut down");
+  }
+  return status;
+}
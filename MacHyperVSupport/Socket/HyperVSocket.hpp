@@ -0,0 +1,99 @@
+//
+//  HyperVSocket.hpp
+//  Hyper-V socket driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVSocket_hpp
+#define HyperVSocket_hpp
+
+#include "HyperVVMBusDevice.hpp"
+#include "HyperVSocketRegs.hpp"
+#include "HyperVSocketShared.h"
+#include "HyperV.hpp"
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+#define super IOService
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVSocket", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVSocket", str, ## __VA_ARGS__)
+
+#define kHyperVSocketStatisticsKey    "SocketStatistics"
+
+//
+// Stream connection over a Hyper-V socket channel, accepted from the host.
+//
+class HyperVSocket : public IOService {
+  OSDeclareDefaultStructors(HyperVSocket);
+
+private:
+  //
+  // Parent VMBus device.
+  //
+  HyperVVMBusDevice       *hvDevice;
+  IOInterruptEventSource  *interruptSource;
+  IOLock                  *socketLock;
+  IOLock                  *sendLock;
+  bool                    isClientConnected;
+  bool                    isStopping;
+
+  //
+  // Shared buffers.
+  //
+  IOBufferMemoryDescriptor  *sharedBuffer;
+  HyperVSocketHeader        *sharedHeader;
+  UInt8                     *receiveBuffer;
+  UInt8                     *sendBuffer;
+  UInt8                     *packetBuffer;
+
+  //
+  // Receive indexes and connection state, protected by socketLock.
+  // Packets are left in the channel while the receive buffer is full.
+  //
+  UInt32                  receiveProducer;
+  UInt32                  receiveConsumer;
+  bool                    isReceiveStalled;
+  UInt32                  state;
+  bool                    isWaitingTxSpace;
+
+  //
+  // Statistics.
+  //
+  UInt64                  bytesReceived;
+  UInt64                  bytesSent;
+  UInt64                  packetsReceived;
+  UInt64                  packetsSent;
+  UInt64                  receiveBatchCount;
+  UInt64                  receiveStallCount;
+  UInt64                  sendWaitCount;
+
+  void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
+  void receivePackets();
+  IOReturn consumeGated(UInt32 *consumerIndex);
+  IOReturn sendPipePacket(void *data, UInt32 dataLength);
+  void setState(UInt32 newState);
+  void updateStatistics();
+  void freeSocket();
+
+public:
+  //
+  // IOService overrides.
+  //
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void free() APPLE_KEXT_OVERRIDE;
+
+  //
+  // Client interface.
+  //
+  bool connectClient();
+  void disconnectClient();
+  IOBufferMemoryDescriptor *getSharedBuffer() { return sharedBuffer; }
+  IOReturn receive(UInt32 consumerIndex, UInt32 *producerIndex, UInt32 *connectionState);
+  IOReturn send(UInt32 offset, UInt32 length);
+  IOReturn shutdown();
+};
+
+#endif
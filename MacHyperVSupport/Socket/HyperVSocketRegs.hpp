@@ -0,0 +1,40 @@
+//
+//  HyperVSocketRegs.hpp
+//  Hyper-V socket driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVSocketRegs_hpp
+#define HyperVSocketRegs_hpp
+
+//
+// Largest ring buffers Hyper-V accepts for socket channels.
+//
+#define kHyperVSocketRingBufferSize       (64 * PAGE_SIZE)
+
+//
+// Pipe packet types.
+//
+typedef enum : UInt32 {
+  kHyperVSocketPipeTypeData = 1
+} HyperVSocketPipeType;
+
+//
+// Each packet on a socket channel is prefixed with a pipe header.
+// A data packet with no data indicates the sender has shut down its side of the connection.
+//
+typedef struct __attribute__((packed)) {
+  HyperVSocketPipeType  type;
+  UInt32                dataSize;
+} HyperVSocketPipeHeader;
+
+//
+// Hyper-V accepts at most a page per packet, and sends at most 16 KB of data per packet.
+//
+#define kHyperVSocketMaxSendSize          (4096 - sizeof (HyperVSocketPipeHeader))
+#define kHyperVSocketSendWaitMS           100
+#define kHyperVSocketMaxReceiveSize       (16 * 1024)
+#define kHyperVSocketPacketBufferSize     HV_PACKETALIGN(sizeof (HyperVSocketPipeHeader) + kHyperVSocketMaxReceiveSize)
+
+#endif
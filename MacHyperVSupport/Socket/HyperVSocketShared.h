@@ -0,0 +1,68 @@
+//
+//  HyperVSocketShared.h
+//  Hyper-V socket driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Definitions shared between the socket driver and userspace.
+//
+
+#ifndef HyperVSocketShared_h
+#define HyperVSocketShared_h
+
+#include <stdint.h>
+
+//
+// Shared buffers, mapped into the client with memory type kHyperVSocketMemoryTypeBuffers.
+//
+// The header is followed by the receive buffer at receiveOffset and the send buffer at sendOffset.
+// Receive indexes are free running byte counts, byte N is at receiveOffset + (N % receiveSize).
+// The driver fills the receive buffer up to receiveProducer, the client hands bytes back through the Receive method.
+//
+// The service ID and the instance of the connection are the HVType and HVInstance properties of the provider.
+//
+#define kHyperVSocketMemoryTypeBuffers    0
+
+#define kHyperVSocketReceiveBufferSize    (256 * 1024)
+#define kHyperVSocketSendBufferSize       (256 * 1024)
+
+//
+// Connection state bits.
+//
+// ReceiveShutdown: the host has shut down its side, no more data will be received once the buffer is drained.
+// SendShutdown: this side has been shut down, no more data can be sent.
+// Closed: the host has closed the connection.
+//
+#define kHyperVSocketStateReceiveShutdown 0x00000001
+#define kHyperVSocketStateSendShutdown    0x00000002
+#define kHyperVSocketStateClosed          0x00000004
+
+typedef struct {
+  volatile uint32_t receiveProducer;
+  volatile uint32_t receiveConsumer;
+  uint32_t          receiveSize;
+  uint32_t          receiveOffset;
+  uint32_t          sendSize;
+  uint32_t          sendOffset;
+  volatile uint32_t state;
+  uint32_t          reserved[9];
+} HyperVSocketHeader;
+
+//
+// External methods.
+//
+// Receive: scalar input 0 is the new consumer index, all bytes before it are handed back.
+//   Blocks until data is available or the connection is shut down.
+//   Scalar output 0 is the producer index, scalar output 1 is the connection state.
+// Send: sends scalar input 1 bytes starting at scalar input 0 within the send buffer.
+//   Data is sent directly from the send buffer, and blocks until all of it has been queued to Hyper-V.
+// Shutdown: shuts down this side of the connection.
+//
+enum {
+  kHyperVSocketUserClientMethodReceive  = 0,
+  kHyperVSocketUserClientMethodSend     = 1,
+  kHyperVSocketUserClientMethodShutdown = 2,
+  kHyperVSocketUserClientMethodCount
+};
+
+#endif
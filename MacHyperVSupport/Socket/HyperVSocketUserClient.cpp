@@ -0,0 +1,156 @@
+//
+//  HyperVSocketUserClient.cpp
+//  Hyper-V socket driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVSocketUserClient.hpp"
+
+#undef super
+#define super IOUserClient
+
+#undef SYSLOG
+#undef DBGLOG
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVSocketUserClient", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVSocketUserClient", str, ## __VA_ARGS__)
+
+OSDefineMetaClassAndStructors(HyperVSocketUserClient, super);
+
+const IOExternalMethodDispatch HyperVSocketUserClient::methods[kHyperVSocketUserClientMethodCount] = {
+  { // kHyperVSocketUserClientMethodReceive
+    (IOExternalMethodAction) &HyperVSocketUserClient::methodReceive,
+    1, 0, 2, 0
+  },
+  { // kHyperVSocketUserClientMethodSend
+    (IOExternalMethodAction) &HyperVSocketUserClient::methodSend,
+    2, 0, 0, 0
+  },
+  { // kHyperVSocketUserClientMethodShutdown
+    (IOExternalMethodAction) &HyperVSocketUserClient::methodShutdown,
+    0, 0, 0, 0
+  }
+};
+
+bool HyperVSocketUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
+  if (!super::initWithTask(owningTask, securityToken, type, properties)) {
+    return false;
+  }
+
+  //
+  // Connections come from the host, only allow administrators to act as the guest endpoint.
+  //
+  if (clientHasPrivilege(securityToken, kIOClientPrivilegeAdministrator) != kIOReturnSuccess) {
+    DBGLOG("Client is not an administrator");
+    return false;
+  }
+  return true;
+}
+
+bool HyperVSocketUserClient::start(IOService *provider) {
+  hvSocket = OSDynamicCast(HyperVSocket, provider);
+  if (hvSocket == NULL) {
+    return false;
+  }
+
+  if (!super::start(provider)) {
+    return false;
+  }
+  hvSocket->retain();
+
+  isClientConnected = hvSocket->connectClient();
+  if (!isClientConnected) {
+    SYSLOG("Another client is already connected to this socket");
+    OSSafeReleaseNULL(hvSocket);
+    super::stop(provider);
+    return false;
+  }
+
+  DBGLOG("Socket user client started");
+  return true;
+}
+
+void HyperVSocketUserClient::stop(IOService *provider) {
+  DBGLOG("Socket user client stopping");
+  if (hvSocket != NULL) {
+    if (isClientConnected) {
+      hvSocket->disconnectClient();
+      isClientConnected = false;
+    }
+    OSSafeReleaseNULL(hvSocket);
+  }
+  super::stop(provider);
+}
+
+IOReturn HyperVSocketUserClient::clientClose() {
+  terminate();
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVSocketUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch,
+                                                OSObject *target, void *reference) {
+  if (selector >= kHyperVSocketUserClientMethodCount) {
+    return kIOReturnUnsupported;
+  }
+  return super::externalMethod(selector, arguments, (IOExternalMethodDispatch *) &methods[selector], this, reference);
+}
+
+IOReturn HyperVSocketUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
+  if (type != kHyperVSocketMemoryTypeBuffers) {
+    return kIOReturnBadArgument;
+  }
+  if (hvSocket == NULL || hvSocket->getSharedBuffer() == NULL) {
+    return kIOReturnNotAttached;
+  }
+
+  //
+  // Caller releases the returned descriptor.
+  //
+  IOMemoryDescriptor *bufferDesc = hvSocket->getSharedBuffer();
+  bufferDesc->retain();
+  *options = 0;
+  *memory  = bufferDesc;
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVSocketUserClient::methodReceive(HyperVSocketUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  UInt32 producerIndex;
+  UInt32 connectionState;
+
+  HyperVSocket *hvSocket = target->hvSocket;
+  if (hvSocket == NULL) {
+    return kIOReturnNotAttached;
+  }
+
+  //
+  // Keep the service alive while blocked, the client may be stopped during the wait.
+  //
+  hvSocket->retain();
+  IOReturn status = hvSocket->receive((UInt32) args->scalarInput[0], &producerIndex, &connectionState);
+  hvSocket->release();
+  if (status == kIOReturnSuccess) {
+    args->scalarOutput[0] = producerIndex;
+    args->scalarOutput[1] = connectionState;
+  }
+  return status;
+}
+
+IOReturn HyperVSocketUserClient::methodSend(HyperVSocketUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  HyperVSocket *hvSocket = target->hvSocket;
+  if (hvSocket == NULL) {
+    return kIOReturnNotAttached;
+  }
+
+  hvSocket->retain();
+  IOReturn status = hvSocket->send((UInt32) args->scalarInput[0], (UInt32) args->scalarInput[1]);
+  hvSocket->release();
+  return status;
+}
+
+IOReturn HyperVSocketUserClient::methodShutdown(HyperVSocketUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  HyperVSocket *hvSocket = target->hvSocket;
+  if (hvSocket == NULL) {
+    return kIOReturnNotAttached;
+  }
+  return hvSocket->shutdown();
+}
@@ -0,0 +1,44 @@
+//
+//  HyperVSocketUserClient.hpp
+//  Hyper-V socket driver
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVSocketUserClient_hpp
+#define HyperVSocketUserClient_hpp
+
+#include <IOKit/IOUserClient.h>
+
+#include "HyperVSocket.hpp"
+
+//
+// Userspace stream interface, only one client can be connected to a socket at a time.
+//
+class HyperVSocketUserClient : public IOUserClient {
+  OSDeclareDefaultStructors(HyperVSocketUserClient);
+
+private:
+  HyperVSocket *hvSocket;
+  bool         isClientConnected;
+
+  static const IOExternalMethodDispatch methods[kHyperVSocketUserClientMethodCount];
+
+  static IOReturn methodReceive(HyperVSocketUserClient *target, void *ref, IOExternalMethodArguments *args);
+  static IOReturn methodSend(HyperVSocketUserClient *target, void *ref, IOExternalMethodArguments *args);
+  static IOReturn methodShutdown(HyperVSocketUserClient *target, void *ref, IOExternalMethodArguments *args);
+
+public:
+  //
+  // IOUserClient overrides.
+  //
+  virtual bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) APPLE_KEXT_OVERRIDE;
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual IOReturn clientClose() APPLE_KEXT_OVERRIDE;
+  virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch,
+                                  OSObject *target, void *reference) APPLE_KEXT_OVERRIDE;
+  virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) APPLE_KEXT_OVERRIDE;
+};
+
+#endif
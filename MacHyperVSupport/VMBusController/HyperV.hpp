@@ -20,6 +20,8 @@
 #define kHyperVHypercallRetryCount  100
 
 
+#define kHyperVPCIBusVirtualPCIFirst      0xC0
+#define kHyperVPCIBusVirtualPCILast       0xFA
 #define kHyperVPCIBusSyntheticGraphics    0xFB
 #define kHyperVPCIBusDummy                0xFE
 
@@ -149,6 +151,17 @@ constexpr size_t ARRAY_SIZE(const T (&array)[N]) {
 #define kHyperVMsrReferenceTscRsvdMask          0x0FFEULL
 #define kHyperVMsrReferenceTscPageShift         PAGE_SHIFT
 
+//
+// Reference TSC page.
+// Reference time = ((TSC * scale) >> 64) + offset, a sequence of 0 means the page is invalid.
+//
+typedef struct __attribute__((packed)) {
+  volatile UInt32 sequence;
+  UInt32          reserved1;
+  volatile UInt64 scale;
+  volatile SInt64 offset;
+} HyperVReferenceTscPage;
+
 #define kHyperVMsrSyncICControl                 0x40000080
 #define kHyperVMsrSyncICControlEnable           0x0001ULL
 #define kHyperVMsrSyncICControlRsvdMask         0xFFFFFFFFFFFFFFFEULL
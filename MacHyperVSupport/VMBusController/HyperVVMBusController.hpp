@@ -47,6 +47,7 @@ guid_unparse(const uuid_t uu, uuid_string_t out)
 typedef struct {
   UInt64                  interruptCounter;
   UInt64                  virtualCPUID;
+  UInt32                  apicId;
   
   SynICProcessor          *synProc;
   
@@ -93,6 +94,7 @@ private:
   
   HyperVDMABuffer     vmbusMnf1;
   HyperVDMABuffer     vmbusMnf2;
+  UInt32              vmbusVersion;
 
   //
   // Flag used for waiting for incoming message response.
@@ -175,6 +177,7 @@ public:
   //
   void processIncomingVMBusMessage(UInt32 cpu);
   IOWorkLoop *getSynICWorkLoop();
+  bool getVirtualProcessorIndex(UInt32 apicId, UInt32 *vpIndex);
   
   //
   // Public VMBus channel management.
@@ -184,6 +187,7 @@ public:
   void signalVMBusChannel(UInt32 channelId);
   void closeVMBusChannel(UInt32 channelId);
   void freeVMBusChannel(UInt32 channelId);
+  IOBufferMemoryDescriptor *getVMBusChannelBuffer(UInt32 channelId);
   
   bool initVMBusChannelGpadl(UInt32 channelId, UInt32 bufferSize, UInt32 *gpadlHandle, void **buffer);
 };
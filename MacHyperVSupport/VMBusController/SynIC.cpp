@@ -52,8 +52,12 @@ extern "C" void initSyncIC(void *cpuData) {
   HyperVPerCPUData *hvPerCpuData = &hvCPUData->perCPUData[cpuIndex];
   
   //
-  // Get processor ID.
+  // Get processor ID, and the local APIC ID used to map MSI destinations to it.
   //
+  UInt32 regs[4];
+  do_cpuid(1, regs);
+  hvPerCpuData->apicId = regs[ebx] >> 24;
+  
   if (hvCPUData->supportsHvVpIndex) {
     hvPerCpuData->virtualCPUID = rdmsr64(kHyperVMsrVPIndex);
   } else {
@@ -153,7 +157,8 @@ bool HyperVVMBusController::initSynIC() {
     SYSLOG("Failed to get VMBus device interrupt vector");
     return false;
   }
-  cpuData.interruptVector = vector;
+  cpuData.interruptVector   = vector;
+  cpuData.supportsHvVpIndex = (hvFeatures & kHyperVCpuidMsrVPIndex) != 0;
   DBGLOG("VMBus device interrupt vector: 0x%X", cpuData.interruptVector);
 
   //
@@ -350,3 +355,20 @@ void HyperVVMBusController::handleSynICInterrupt(OSObject *target, void *refCon,
 IOWorkLoop* HyperVVMBusController::getSynICWorkLoop() {
   return workloop;
 }
+
+bool HyperVVMBusController::getVirtualProcessorIndex(UInt32 apicId, UInt32 *vpIndex) {
+  //
+  // Hyper-V identifies processors by VP index, which does not have to match the APIC ID.
+  //
+  if (!cpuData.supportsHvVpIndex) {
+    return false;
+  }
+  
+  for (UInt32 i = 0; i < cpuData.perCPUDataCount; i++) {
+    if (cpuData.perCPUData[i].apicId == apicId) {
+      *vpIndex = (UInt32)cpuData.perCPUData[i].virtualCPUID;
+      return true;
+    }
+  }
+  return false;
+}
@@ -175,21 +175,40 @@ void HyperVVMBusController::processIncomingVMBusMessage(UInt32 cpu) {
 }
 
 bool HyperVVMBusController::connectVMBus() {
-  VMBusChannelMessageConnect connectMsg;
-  connectMsg.header.type = kVMBusChannelMessageTypeConnect; //VMBUS_CHANMSG_TYPE_CONNECT;
-  connectMsg.targetProcessor = 0;
-  connectMsg.protocolVersion = kVMBusVersionWIN8_1; //((4 << 16) | (0)); // ((5 << 16) | (0));//((4 << 16) | (0));
-  connectMsg.interruptPage = vmbusEventFlags.physAddr;
-  connectMsg.monitorPage1 = vmbusMnf1.physAddr;
-  connectMsg.monitorPage2 = vmbusMnf2.physAddr;
-  DBGLOG("Version %X", connectMsg.protocolVersion);
-  
-  VMBusChannelMessageConnectResponse resp;
-  sendVMBusMessage((VMBusChannelMessage*) &connectMsg, kVMBusChannelMessageTypeConnectResponse, (VMBusChannelMessage*) &resp);
-  
-  DBGLOG("header %X %X %X", cpuData.perCPUData[0].messages[kVMBusInterruptMessage].type, resp.header.type, resp.supported);
+  //
+  // Hyper-V sockets require Windows 10 or newer, older hosts reject that version and Windows 8.1 is used instead.
+  //
+  static const UInt32 vmbusVersions[] = {
+    kVMBusVersionWIN10,
+    kVMBusVersionWIN8_1
+  };
 
-  return true;
+  for (UInt32 i = 0; i < ARRAY_SIZE(vmbusVersions); i++) {
+    VMBusChannelMessageConnect connectMsg;
+    memset(&connectMsg, 0, sizeof (connectMsg));
+    connectMsg.header.type = kVMBusChannelMessageTypeConnect;
+    connectMsg.targetProcessor = 0;
+    connectMsg.protocolVersion = vmbusVersions[i];
+    connectMsg.interruptPage = vmbusEventFlags.physAddr;
+    connectMsg.monitorPage1 = vmbusMnf1.physAddr;
+    connectMsg.monitorPage2 = vmbusMnf2.physAddr;
+    DBGLOG("Trying version %X", connectMsg.protocolVersion);
+
+    VMBusChannelMessageConnectResponse resp;
+    if (!sendVMBusMessage((VMBusChannelMessage*) &connectMsg, kVMBusChannelMessageTypeConnectResponse, (VMBusChannelMessage*) &resp)) {
+      return false;
+    }
+    DBGLOG("header %X %X %X", cpuData.perCPUData[0].messages[kVMBusInterruptMessage].type, resp.header.type, resp.supported);
+
+    if (resp.supported) {
+      vmbusVersion = vmbusVersions[i];
+      SYSLOG("Connected to VMBus version %u.%u", VMBUS_VERSION_MAJOR(vmbusVersion), VMBUS_VERSION_MINOR(vmbusVersion));
+      return true;
+    }
+  }
+
+  SYSLOG("Hyper-V does not support any known VMBus version");
+  return false;
 }
 
 bool HyperVVMBusController::scanVMBus() {
@@ -360,6 +379,23 @@ bool HyperVVMBusController::registerVMBusDevice(VMBusChannel *channel) {
     return false;
   }
   
+  //
+  // Some devices such as SynthVid are offered with an MMIO range size in megabytes.
+  //
+  if (channel->offerMessage.mmioSizeMegabytes != 0) {
+    childDevice->setProperty(kHyperVVMBusDeviceChannelMMIOSizeKey, channel->offerMessage.mmioSizeMegabytes, 16);
+  }
+  
+  //
+  // Hyper-V socket offers are identified by their instance, the service ID alone is shared by all connections to a service.
+  //
+  uuid_string_t instanceGuidString;
+  guid_unparse(channel->offerMessage.instance, instanceGuidString);
+  childDevice->setProperty(kHyperVVMBusDeviceChannelInstanceKey, instanceGuidString);
+  if (channel->offerMessage.flags & kVMBusChannelOfferFlagTLNPIProvider) {
+    childDevice->setProperty(kHyperVVMBusDeviceSocketKey, true);
+  }
+  
   childDevice->registerService();
   channel->deviceNub = childDevice;
 
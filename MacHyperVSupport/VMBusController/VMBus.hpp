@@ -112,6 +112,16 @@ typedef struct __attribute__((packed)) {
   VMBusChannelMessageHeader header;
 } VMBusChannelMessage;
 
+//
+// Channel offer flags.
+// Hyper-V socket offers are pipe offers from the transport provider, with the service ID as the type.
+//
+#define kVMBusChannelOfferFlagNamedPipeMode       0x0010
+#define kVMBusChannelOfferFlagTLNPIProvider       0x2000
+
+#define kVMBusPipeModeByte                        0x0
+#define kVMBusPipeModeMessage                     0x4
+
 // The size of the user defined data buffer for non-pipe offers.
 #define kVMBusChannelOfferMaxUserDefinedBytes       120
 
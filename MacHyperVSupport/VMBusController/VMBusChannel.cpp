@@ -267,6 +267,12 @@ bool HyperVVMBusController::initVMBusChannel(UInt32 channelId, UInt32 txBufferSi
   channel->rxBuffer = (VMBusRingBuffer*) (((UInt8*)channel->dataBuffer.buffer) + PAGE_SIZE * channel->rxPageIndex);
   channel->status   = kVMBusChannelStatusGpadlConfigured;
   
+  //
+  // Pending send sizes are used in both directions, Hyper-V and the guest signal each other once enough space is freed.
+  //
+  channel->txBuffer->features.pendingSendSizeSupported = 1;
+  channel->rxBuffer->features.pendingSendSizeSupported = 1;
+  
   *txBuffer = channel->txBuffer;
   *rxBuffer = channel->rxBuffer;
   
@@ -380,6 +386,17 @@ void HyperVVMBusController::freeVMBusChannel(UInt32 channelId) {
   channel->status = kVMBusChannelStatusNotPresent;
 }
 
+IOBufferMemoryDescriptor *HyperVVMBusController::getVMBusChannelBuffer(UInt32 channelId) {
+  if (channelId >= kHyperVMaxChannels) {
+    return NULL;
+  }
+
+  //
+  // TX and RX ring buffers share a single allocation, TX first.
+  //
+  return vmbusChannels[channelId].dataBuffer.bufDesc;
+}
+
 bool HyperVVMBusController::initVMBusChannelGpadl(UInt32 channelId, UInt32 bufferSize, UInt32 *gpadlHandle, void **buffer) {
   VMBusChannel *channel = &vmbusChannels[channelId];
   
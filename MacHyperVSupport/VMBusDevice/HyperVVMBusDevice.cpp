@@ -17,7 +17,8 @@ bool HyperVVMBusDevice::attach(IOService *provider) {
     return false;
   }
   
-  channelIsOpen = false;
+  channelIsOpen      = false;
+  channelIsUserOwned = false;
   
   //
   // Get channel number.
@@ -46,6 +47,11 @@ bool HyperVVMBusDevice::attach(IOService *provider) {
     builtInData->release();
   }
 
+  //
+  // Channels not used by a driver can be opened from userspace.
+  //
+  setProperty("IOUserClientClass", kHyperVVMBusDeviceUserClientClass);
+
   vmbusRequestsLock = IOLockAlloc();
   vmbusTransLock = IOLockAlloc();
   
@@ -56,6 +62,7 @@ void HyperVVMBusDevice::detach(IOService *provider) {
   //
   // Close and free channel.
   //
+  closeUserChannel();
   if (channelIsOpen) {
     closeChannel();
   }
@@ -68,6 +75,13 @@ void HyperVVMBusDevice::detach(IOService *provider) {
 }
 
 bool HyperVVMBusDevice::openChannel(UInt32 txSize, UInt32 rxSize, UInt64 maxAutoTransId) {
+  //
+  // Channel is in use by a user task, drivers cannot share it.
+  //
+  if (channelIsUserOwned) {
+    SYSLOG("Channel %u is in use by userspace", channelId);
+    return false;
+  }
   if (channelIsOpen) {
     return true;
   }
@@ -101,6 +115,13 @@ bool HyperVVMBusDevice::openChannel(UInt32 txSize, UInt32 rxSize, UInt64 maxAuto
 }
 
 void HyperVVMBusDevice::closeChannel() {
+  //
+  // Drivers failing to open a channel owned by userspace must not close it.
+  //
+  if (channelIsUserOwned) {
+    return;
+  }
+
   //
   // Close channel and stop interrupts.
   //
@@ -109,10 +130,60 @@ void HyperVVMBusDevice::closeChannel() {
   channelIsOpen = false;
 }
 
+bool HyperVVMBusDevice::openUserChannel(UInt32 txSize, UInt32 rxSize) {
+  //
+  // Only channels not already opened by a driver can be handed to userspace.
+  //
+  if (channelIsOpen || channelIsUserOwned) {
+    return false;
+  }
+  if (!openChannel(txSize, rxSize)) {
+    return false;
+  }
+  channelIsUserOwned = true;
+
+  SYSLOG("Channel %u opened for userspace access", channelId);
+  return true;
+}
+
+void HyperVVMBusDevice::closeUserChannel() {
+  if (!channelIsUserOwned) {
+    return;
+  }
+
+  channelIsUserOwned = false;
+  closeChannel();
+  DBGLOG("Channel %u closed for userspace access", channelId);
+}
+
+IOBufferMemoryDescriptor *HyperVVMBusDevice::getChannelBuffer() {
+  return channelIsOpen ? vmbusProvider->getVMBusChannelBuffer(channelId) : NULL;
+}
+
+void HyperVVMBusDevice::signalChannel() {
+  if (channelIsOpen) {
+    vmbusProvider->signalVMBusChannel(channelId);
+  }
+}
+
 bool HyperVVMBusDevice::createGpadlBuffer(UInt32 bufferSize, UInt32 *gpadlHandle, void **buffer) {
   return vmbusProvider->initVMBusChannelGpadl(channelId, bufferSize, gpadlHandle, buffer);
 }
 
+bool HyperVVMBusDevice::setRxInterruptMask(bool masked) {
+  //
+  // Masking prevents Hyper-V from signaling us when new packets are placed in the RX ring.
+  // When unmasking, packets may have arrived while masked and no interrupt will be raised for them.
+  // Caller is responsible for draining the ring if true is returned.
+  //
+  rxBuffer->interruptMask = masked ? 1 : 0;
+  __sync_synchronize();
+  if (masked) {
+    return false;
+  }
+  return rxBuffer->readIndex != rxBuffer->writeIndex;
+}
+
 bool HyperVVMBusDevice::nextPacketAvailable(VMBusPacketType *type, UInt32 *packetHeaderLength, UInt32 *packetTotalLength) {
   return commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::nextPacketAvailableGated),
                                 type, packetHeaderLength, packetTotalLength) == kIOReturnSuccess;
@@ -175,6 +246,32 @@ IOReturn HyperVVMBusDevice::readInbandCompletionPacket(void *buffer, UInt32 buff
   return status;
 }
 
+IOReturn HyperVVMBusDevice::readInbandPacket(void *buffer, UInt32 *bufferLength, UInt64 *transactionId) {
+  VMBusPacketHeader pktHeader;
+  UInt32 pktHeaderSize = sizeof (pktHeader);
+
+  if (bufferLength == NULL) {
+    return kIOReturnBadArgument;
+  }
+
+  //
+  // Packet is read in a single pass through the gate, the buffer length is updated with the packet data length.
+  //
+  IOReturn status = commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::readRawPacketGated),
+                                           &pktHeader, &pktHeaderSize, buffer, bufferLength);
+  if (status == kIOReturnSuccess) {
+    if (pktHeader.type != kVMBusPacketTypeDataInband) {
+      MSGDBG("INBAND attempted to read non-inband packet");
+      return kIOReturnUnsupported;
+    }
+
+    if (transactionId != NULL) {
+      *transactionId = pktHeader.transactionId;
+    }
+  }
+  return status;
+}
+
 IOReturn HyperVVMBusDevice::writeRawPacket(void *buffer, UInt32 bufferLength) {
   return commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::writeRawPacketGated),
                                 NULL, NULL, buffer, &bufferLength);
@@ -295,6 +392,45 @@ IOReturn HyperVVMBusDevice::writeCompletionPacketWithTransactionId(void *buffer,
   return writePacketInternal(buffer, bufferLength, kVMBusPacketTypeCompletion, transactionId, responseRequired, NULL, 0);
 }
 
+IOReturn HyperVVMBusDevice::writeInbandPacketWithPrefix(const void *prefix, UInt32 prefixLength, void *buffer, UInt32 bufferLength) {
+  UInt8 pktHeaderBuffer[sizeof (VMBusPacketHeader) + kHyperVVMBusDeviceMaxPacketPrefixLength];
+  if (prefixLength > kHyperVVMBusDeviceMaxPacketPrefixLength) {
+    return kIOReturnBadArgument;
+  }
+
+  //
+  // The prefix is written along with the packet header, allowing the data to be copied straight from the caller's buffer.
+  //
+  VMBusPacketHeader *pktHeader  = (VMBusPacketHeader*) pktHeaderBuffer;
+  UInt32 pktHeaderLength        = sizeof (VMBusPacketHeader) + prefixLength;
+  pktHeader->type               = kVMBusPacketTypeDataInband;
+  pktHeader->flags              = 0;
+  pktHeader->transactionId      = getNextTransId();
+  pktHeader->headerLength       = sizeof (VMBusPacketHeader) >> kVMBusPacketSizeShift;
+  pktHeader->totalLength        = HV_PACKETALIGN(pktHeaderLength + bufferLength) >> kVMBusPacketSizeShift;
+  memcpy(pktHeader + 1, prefix, prefixLength);
+
+  return commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::writeRawPacketGated),
+                                pktHeaderBuffer, &pktHeaderLength, buffer, &bufferLength);
+}
+
+bool HyperVVMBusDevice::isTxSpaceAvailable(UInt32 packetDataLength) {
+  //
+  // Space needed for the packet header, data, padding, and index.
+  //
+  UInt32 pktLength = HV_PACKETALIGN(sizeof (VMBusPacketHeader) + packetDataLength) + sizeof (UInt64);
+  return getAvailableTxSpace() > pktLength;
+}
+
+void HyperVVMBusDevice::setTxPendingSendSize(UInt32 packetDataLength) {
+  //
+  // Hyper-V signals the channel once it has freed enough TX space for this packet, 0 disables the signal.
+  // Callers must check for space again afterwards, as it may have been freed before Hyper-V saw the request.
+  //
+  txBuffer->pendingSendSize = packetDataLength != 0 ? HV_PACKETALIGN(sizeof (VMBusPacketHeader) + packetDataLength) + sizeof (UInt64) : 0;
+  __sync_synchronize();
+}
+
 bool HyperVVMBusDevice::getPendingTransaction(UInt64 transactionId, void **buffer, UInt32 *bufferLength) {
   IOLockLock(vmbusRequestsLock);
 
@@ -19,6 +19,15 @@
 #define kHyperVVMBusDeviceChannelTypeKey      "HVType"
 #define kHyperVVMBusDeviceChannelInstanceKey  "HVInstance"
 #define kHyperVVMBusDeviceChannelIDKey        "HVChannel"
+#define kHyperVVMBusDeviceChannelMMIOSizeKey  "HVMMIOSize"
+#define kHyperVVMBusDeviceSocketKey           "HVSocket"
+
+#define kHyperVVMBusDeviceUserClientClass     "HyperVVMBusDeviceUserClient"
+
+//
+// Largest prefix supported by writeInbandPacketWithPrefix.
+//
+#define kHyperVVMBusDeviceMaxPacketPrefixLength   16
 
 typedef struct HyperVVMBusDeviceRequest {
   HyperVVMBusDeviceRequest  *next;
@@ -37,6 +46,7 @@ private:
   HyperVVMBusController   *vmbusProvider;
   UInt32                  channelId;
   bool                    channelIsOpen;
+  bool                    channelIsUserOwned;
   
   IOWorkLoop              *workLoop;
   IOCommandGate           *commandGate;
@@ -80,6 +90,12 @@ private:
       (txBufferSize - (txBuffer->writeIndex - txBuffer->readIndex)) :
       (txBuffer->readIndex - txBuffer->writeIndex);
   }
+  
+  inline UInt32 getAvailableRxSpace(UInt32 readIndex) {
+    return (rxBuffer->writeIndex >= readIndex) ?
+      (rxBufferSize - (rxBuffer->writeIndex - readIndex)) :
+      (readIndex - rxBuffer->writeIndex);
+  }
 
 public:
   
@@ -96,6 +112,19 @@ public:
   bool openChannel(UInt32 txSize, UInt32 rxSize, UInt64 maxAutoTransId = UINT64_MAX);
   void closeChannel();
   bool createGpadlBuffer(UInt32 bufferSize, UInt32 *gpadlHandle, void **buffer);
+  bool setRxInterruptMask(bool masked);
+  bool getVirtualProcessorIndex(UInt32 apicId, UInt32 *vpIndex) { return vmbusProvider->getVirtualProcessorIndex(apicId, vpIndex); }
+  UInt32 getRxRingBufferSize() { return rxBufferSize; }
+  UInt32 getRxRingBytesUsed() { return rxBufferSize - getAvailableRxSpace(rxBuffer->readIndex); }
+
+  //
+  // Userspace channel access, packets are read and written by the user task through the mapped rings.
+  //
+  bool openUserChannel(UInt32 txSize, UInt32 rxSize);
+  void closeUserChannel();
+  IOBufferMemoryDescriptor *getChannelBuffer();
+  UInt32 getRxRingOffset() { return (UInt32)((UInt8 *)rxBuffer - (UInt8 *)txBuffer); }
+  void signalChannel();
 
   
   //
@@ -107,6 +136,7 @@ public:
   
   IOReturn readRawPacket(void *buffer, UInt32 bufferLength);
   IOReturn readInbandCompletionPacket(void *buffer, UInt32 bufferLength, UInt64 *transactionId = NULL);
+  IOReturn readInbandPacket(void *buffer, UInt32 *bufferLength, UInt64 *transactionId = NULL);
   
   IOReturn writeRawPacket(void *buffer, UInt32 bufferLength);
   IOReturn writeInbandPacket(void *buffer, UInt32 bufferLength, bool responseRequired,
@@ -120,6 +150,9 @@ public:
                                          VMBusPacketMultiPageBuffer *pagePacket, UInt32 pagePacketLength,
                                          void *responseBuffer = NULL, UInt32 responseBufferLength = 0);
   IOReturn writeCompletionPacketWithTransactionId(void *buffer, UInt32 bufferLength, UInt64 transactionId, bool responseRequired);
+  IOReturn writeInbandPacketWithPrefix(const void *prefix, UInt32 prefixLength, void *buffer, UInt32 bufferLength);
+  bool isTxSpaceAvailable(UInt32 packetDataLength);
+  void setTxPendingSendSize(UInt32 packetDataLength);
   
   
   bool getPendingTransaction(UInt64 transactionId, void **buffer, UInt32 *bufferLength);
@@ -140,11 +140,16 @@ IOReturn HyperVVMBusDevice::readRawPacketGated(void *header, UInt32 *headerLengt
          pktHeader.transactionId, pktHeader.headerLength << kVMBusPacketSizeShift, packetTotalLength);
   MSGDBG("RAW old RX read index %X, RX write index %X", rxBuffer->readIndex, rxBuffer->writeIndex);
   
+  //
+  // Buffer length is updated with the packet data length, callers can size a retry from it.
+  //
   UInt32 packetDataLength = headerLength != NULL ? packetTotalLength - *headerLength : packetTotalLength;
   if (*bufferLength < packetDataLength) {
     MSGDBG("RAW buffer too small, %u < %u", *bufferLength, packetDataLength);
+    *bufferLength = packetDataLength;
     return kIOReturnNoResources;
   }
+  *bufferLength = packetDataLength;
   
   //
   // Read raw packet.
@@ -158,8 +163,19 @@ IOReturn HyperVVMBusDevice::readRawPacketGated(void *header, UInt32 *headerLengt
   UInt64 readIndexShifted;
   readIndexNew = copyPacketDataFromRingBuffer(readIndexNew, sizeof (readIndexShifted), &readIndexShifted, sizeof (readIndexShifted));
   
+  UInt32 rxSpaceOld = getAvailableRxSpace(rxBuffer->readIndex);
   rxBuffer->readIndex = readIndexNew;
   MSGDBG("RAW new RX read index %X, RX write index %X", rxBuffer->readIndex, rxBuffer->writeIndex);
+  
+  //
+  // Hyper-V may be waiting for space to write its next packet, signal it only when this read freed enough.
+  //
+  __sync_synchronize();
+  UInt32 pendingSendSize = rxBuffer->pendingSendSize;
+  if (pendingSendSize != 0 && rxSpaceOld <= pendingSendSize && getAvailableRxSpace(readIndexNew) > pendingSendSize) {
+    MSGDBG("RAW RX space now above pending send size %X, signaling", pendingSendSize);
+    vmbusProvider->signalVMBusChannel(channelId);
+  }
   return kIOReturnSuccess;
 }
 
@@ -173,11 +189,11 @@ IOReturn HyperVVMBusDevice::writeRawPacketGated(void *header, UInt32 *headerLeng
   UInt64 writeIndexShifted      = ((UInt64)writeIndexOld) << 32;
   
   //
-  // Ensure there is space for the packet.
+  // Ensure there is space for the packet and the trailing index.
   //
   // We cannot end up with read index == write index after the write, as that would indicate an empty buffer.
   //
-  if (getAvailableTxSpace() <= pktTotalLengthAligned) {
+  if (getAvailableTxSpace() <= pktTotalLengthAligned + sizeof (writeIndexShifted)) {
     SYSLOG("RAW packet is too large for buffer (TXR: %X, TXW: %X)", txBuffer->readIndex, txBuffer->writeIndex);
     return kIOReturnNoResources;
   }
@@ -197,9 +213,13 @@ IOReturn HyperVVMBusDevice::writeRawPacketGated(void *header, UInt32 *headerLeng
   //
   // Update write index and notify Hyper-V if needed.
   //
+  // Hyper-V only needs to be signaled if the ring was empty before this packet, otherwise it is still reading
+  // and will pick this packet up too. Packets written back to back are then batched under a single signal.
+  //
   MSGDBG("RAW TX imask %X, RX imask %X, channel ID %u", txBuffer->interruptMask, rxBuffer->interruptMask, channelId);
   txBuffer->writeIndex = writeIndexNew;
-  if (txBuffer->interruptMask == 0) {
+  __sync_synchronize();
+  if (txBuffer->interruptMask == 0 && txBuffer->readIndex == writeIndexOld) {
     vmbusProvider->signalVMBusChannel(channelId);
   }
   MSGDBG("RAW TX read index %X, new TX write index %X", txBuffer->readIndex, txBuffer->writeIndex);
@@ -0,0 +1,63 @@
+//
+//  HyperVVMBusDeviceShared.h
+//  Hyper-V VMBus device nub
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Definitions shared between the VMBus device user client and userspace.
+//
+
+#ifndef HyperVVMBusDeviceShared_h
+#define HyperVVMBusDeviceShared_h
+
+#include <stdint.h>
+
+//
+// Channel ring buffers, mapped into the client with memory type kHyperVVMBusDeviceMemoryTypeRings.
+//
+// Both rings are a page of ring state (VMBusRingBuffer) followed by the ring data.
+// The TX ring starts at txRingOffset and the RX ring at rxRingOffset within the mapping.
+// Packets use the VMBus packet format, each followed by the 64-bit previous write index.
+//
+// Control page, mapped with memory type kHyperVVMBusDeviceMemoryTypeControl.
+// interruptCount is incremented by the driver each time Hyper-V signals the channel, and can be polled.
+//
+#define kHyperVVMBusDeviceMemoryTypeRings     0
+#define kHyperVVMBusDeviceMemoryTypeControl   1
+
+//
+// Ring data sizes must be a multiple of the page size.
+//
+#define kHyperVVMBusDeviceMinRingSize         (4 * 1024)
+#define kHyperVVMBusDeviceMaxRingSize         (2 * 1024 * 1024)
+
+typedef struct {
+  uint32_t          pageSize;
+  uint32_t          txRingOffset;
+  uint32_t          txDataSize;
+  uint32_t          rxRingOffset;
+  uint32_t          rxDataSize;
+  volatile uint32_t interruptCount;
+  uint32_t          reserved[10];
+} HyperVVMBusDeviceControl;
+
+//
+// External methods.
+//
+// Open: opens the channel with a TX ring of scalar input 0 bytes and an RX ring of scalar input 1 bytes.
+//   Fails with kIOReturnExclusiveAccess if a driver or another client is using the channel.
+// Close: closes the channel, mappings of the rings must no longer be used.
+// Signal: signals Hyper-V that packets were written to the TX ring.
+//   Only needed if the TX ring was empty before the write and its interrupt mask is clear.
+// WaitInterrupt: blocks until interruptCount differs from scalar input 0, or scalar input 1 milliseconds elapse.
+//   A timeout of 0 waits indefinitely. Scalar output 0 is the current interrupt count.
+//
+enum {
+  kHyperVVMBusDeviceUserClientMethodOpen          = 0,
+  kHyperVVMBusDeviceUserClientMethodClose         = 1,
+  kHyperVVMBusDeviceUserClientMethodSignal        = 2,
+  kHyperVVMBusDeviceUserClientMethodWaitInterrupt = 3,
+  kHyperVVMBusDeviceUserClientMethodCount
+};
+
+#endif
@@ -0,0 +1,306 @@
+//
+//  HyperVVMBusDeviceUserClient.cpp
+//  Hyper-V VMBus device nub
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "HyperVVMBusDeviceUserClient.hpp"
+
+#define super IOUserClient
+
+#define SYSLOG(str, ...) SYSLOG_PRINT("HyperVVMBusDeviceUserClient", str, ## __VA_ARGS__)
+#define DBGLOG(str, ...) DBGLOG_PRINT("HyperVVMBusDeviceUserClient", str, ## __VA_ARGS__)
+
+OSDefineMetaClassAndStructors(HyperVVMBusDeviceUserClient, super);
+
+const IOExternalMethodDispatch HyperVVMBusDeviceUserClient::methods[kHyperVVMBusDeviceUserClientMethodCount] = {
+  { // kHyperVVMBusDeviceUserClientMethodOpen
+    (IOExternalMethodAction) &HyperVVMBusDeviceUserClient::methodOpen,
+    2, 0, 0, 0
+  },
+  { // kHyperVVMBusDeviceUserClientMethodClose
+    (IOExternalMethodAction) &HyperVVMBusDeviceUserClient::methodClose,
+    0, 0, 0, 0
+  },
+  { // kHyperVVMBusDeviceUserClientMethodSignal
+    (IOExternalMethodAction) &HyperVVMBusDeviceUserClient::methodSignal,
+    0, 0, 0, 0
+  },
+  { // kHyperVVMBusDeviceUserClientMethodWaitInterrupt
+    (IOExternalMethodAction) &HyperVVMBusDeviceUserClient::methodWaitInterrupt,
+    2, 0, 1, 0
+  }
+};
+
+bool HyperVVMBusDeviceUserClient::initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) {
+  if (!super::initWithTask(owningTask, securityToken, type, properties)) {
+    return false;
+  }
+
+  //
+  // Raw channel access bypasses all drivers, only allow administrators.
+  //
+  if (clientHasPrivilege(securityToken, kIOClientPrivilegeAdministrator) != kIOReturnSuccess) {
+    DBGLOG("Client is not an administrator");
+    return false;
+  }
+  return true;
+}
+
+bool HyperVVMBusDeviceUserClient::start(IOService *provider) {
+  hvDevice = OSDynamicCast(HyperVVMBusDevice, provider);
+  if (hvDevice == NULL) {
+    return false;
+  }
+
+  if (!super::start(provider)) {
+    return false;
+  }
+  hvDevice->retain();
+
+  clientLock = IOLockAlloc();
+  if (clientLock == NULL) {
+    SYSLOG("Failed to allocate client lock");
+    OSSafeReleaseNULL(hvDevice);
+    super::stop(provider);
+    return false;
+  }
+
+  //
+  // Control page holds the ring layout and the interrupt count, the client polls it without calling in.
+  //
+  controlBuffer = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared, PAGE_SIZE, PAGE_SIZE);
+  if (controlBuffer == NULL) {
+    SYSLOG("Failed to allocate control page");
+    OSSafeReleaseNULL(hvDevice);
+    super::stop(provider);
+    return false;
+  }
+  control = (HyperVVMBusDeviceControl *)controlBuffer->getBytesNoCopy();
+  bzero(control, PAGE_SIZE);
+  control->pageSize = PAGE_SIZE;
+
+  DBGLOG("VMBus device user client started");
+  return true;
+}
+
+void HyperVVMBusDeviceUserClient::stop(IOService *provider) {
+  DBGLOG("VMBus device user client stopping");
+
+  //
+  // Release any client waiting for an interrupt.
+  //
+  if (clientLock != NULL) {
+    IOLockLock(clientLock);
+    isStopping = true;
+    IOLockWakeup(clientLock, control, false);
+    IOLockUnlock(clientLock);
+  }
+
+  if (hvDevice != NULL) {
+    getWorkLoop()->runAction(OSMemberFunctionCast(IOWorkLoop::Action, this, &HyperVVMBusDeviceUserClient::closeChannelGated), this);
+  }
+  OSSafeReleaseNULL(hvDevice);
+  super::stop(provider);
+}
+
+void HyperVVMBusDeviceUserClient::free() {
+  //
+  // Mappings of the control page may outlive the user client until the task unmaps them.
+  //
+  OSSafeReleaseNULL(controlBuffer);
+  if (clientLock != NULL) {
+    IOLockFree(clientLock);
+    clientLock = NULL;
+  }
+
+  super::free();
+}
+
+IOReturn HyperVVMBusDeviceUserClient::clientClose() {
+  terminate();
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBusDeviceUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch,
+                                                     OSObject *target, void *reference) {
+  if (selector >= kHyperVVMBusDeviceUserClientMethodCount) {
+    return kIOReturnUnsupported;
+  }
+  return super::externalMethod(selector, arguments, (IOExternalMethodDispatch *) &methods[selector], this, reference);
+}
+
+IOReturn HyperVVMBusDeviceUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) {
+  IOMemoryDescriptor *memoryDesc;
+
+  switch (type) {
+    case kHyperVVMBusDeviceMemoryTypeRings:
+      if (!isChannelOpen || hvDevice == NULL) {
+        return kIOReturnNotOpen;
+      }
+      memoryDesc = hvDevice->getChannelBuffer();
+      break;
+
+    case kHyperVVMBusDeviceMemoryTypeControl:
+      memoryDesc = controlBuffer;
+      break;
+
+    default:
+      return kIOReturnBadArgument;
+  }
+
+  if (memoryDesc == NULL) {
+    return kIOReturnNotAttached;
+  }
+
+  //
+  // Caller releases the returned descriptor.
+  //
+  memoryDesc->retain();
+  *options = 0;
+  *memory  = memoryDesc;
+  return kIOReturnSuccess;
+}
+
+void HyperVVMBusDeviceUserClient::handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count) {
+  //
+  // Packets are handled by the client, only the interrupt count is updated here.
+  //
+  IOLockLock(clientLock);
+  control->interruptCount++;
+  IOLockWakeup(clientLock, control, false);
+  IOLockUnlock(clientLock);
+}
+
+IOReturn HyperVVMBusDeviceUserClient::openChannelGated(UInt32 *txSize, UInt32 *rxSize) {
+  if (isChannelOpen || isStopping) {
+    return kIOReturnExclusiveAccess;
+  }
+
+  //
+  // Interrupt is only taken once the channel is known not to be used by a driver.
+  // Packets may arrive before it is registered, clients check the RX ring after opening.
+  //
+  if (!hvDevice->openUserChannel(*txSize, *rxSize)) {
+    return kIOReturnExclusiveAccess;
+  }
+  interruptSource = IOInterruptEventSource::interruptEventSource(this,
+                                                                 OSMemberFunctionCast(IOInterruptEventAction, this, &HyperVVMBusDeviceUserClient::handleInterrupt),
+                                                                 hvDevice, 0);
+  if (interruptSource == NULL) {
+    SYSLOG("Failed to create interrupt event source");
+    hvDevice->closeUserChannel();
+    return kIOReturnNoResources;
+  }
+  getWorkLoop()->addEventSource(interruptSource);
+  interruptSource->enable();
+
+  //
+  // TX ring is at the start of the channel buffer, each ring has a page of state before its data.
+  //
+  control->txRingOffset = 0;
+  control->txDataSize   = *txSize;
+  control->rxRingOffset = hvDevice->getRxRingOffset();
+  control->rxDataSize   = *rxSize;
+  isChannelOpen         = true;
+
+  DBGLOG("Opened channel with TX ring of %u bytes and RX ring of %u bytes", *txSize, *rxSize);
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBusDeviceUserClient::closeChannelGated() {
+  if (!isChannelOpen) {
+    return kIOReturnSuccess;
+  }
+
+  if (interruptSource != NULL) {
+    interruptSource->disable();
+    getWorkLoop()->removeEventSource(interruptSource);
+    OSSafeReleaseNULL(interruptSource);
+  }
+  hvDevice->closeUserChannel();
+
+  //
+  // Release any client waiting for an interrupt.
+  //
+  IOLockLock(clientLock);
+  isChannelOpen = false;
+  IOLockWakeup(clientLock, control, false);
+  IOLockUnlock(clientLock);
+
+  DBGLOG("Closed channel");
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBusDeviceUserClient::methodOpen(HyperVVMBusDeviceUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  if (target->hvDevice == NULL) {
+    return kIOReturnNotAttached;
+  }
+
+  UInt32 txSize = (UInt32) args->scalarInput[0];
+  UInt32 rxSize = (UInt32) args->scalarInput[1];
+  if ((txSize & PAGE_MASK) || (rxSize & PAGE_MASK)
+      || txSize < kHyperVVMBusDeviceMinRingSize || txSize > kHyperVVMBusDeviceMaxRingSize
+      || rxSize < kHyperVVMBusDeviceMinRingSize || rxSize > kHyperVVMBusDeviceMaxRingSize) {
+    return kIOReturnBadArgument;
+  }
+
+  return target->getWorkLoop()->runAction(OSMemberFunctionCast(IOWorkLoop::Action, target, &HyperVVMBusDeviceUserClient::openChannelGated),
+                                          target, &txSize, &rxSize);
+}
+
+IOReturn HyperVVMBusDeviceUserClient::methodClose(HyperVVMBusDeviceUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  if (target->hvDevice == NULL) {
+    return kIOReturnNotAttached;
+  }
+  return target->getWorkLoop()->runAction(OSMemberFunctionCast(IOWorkLoop::Action, target, &HyperVVMBusDeviceUserClient::closeChannelGated), target);
+}
+
+IOReturn HyperVVMBusDeviceUserClient::methodSignal(HyperVVMBusDeviceUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  if (target->hvDevice == NULL) {
+    return kIOReturnNotAttached;
+  }
+  if (!target->isChannelOpen) {
+    return kIOReturnNotOpen;
+  }
+
+  target->hvDevice->signalChannel();
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBusDeviceUserClient::methodWaitInterrupt(HyperVVMBusDeviceUserClient *target, void *ref, IOExternalMethodArguments *args) {
+  UInt32   lastInterruptCount = (UInt32) args->scalarInput[0];
+  UInt32   timeoutMS          = (UInt32) args->scalarInput[1];
+  UInt64   deadline           = 0;
+  IOReturn status             = kIOReturnSuccess;
+
+  if (target->hvDevice == NULL) {
+    return kIOReturnNotAttached;
+  }
+  if (timeoutMS != 0) {
+    clock_interval_to_deadline(timeoutMS, kMillisecondScale, &deadline);
+  }
+
+  IOLockLock(target->clientLock);
+  while (!target->isStopping && target->isChannelOpen && target->control->interruptCount == lastInterruptCount) {
+    wait_result_t result = deadline != 0
+      ? IOLockSleepDeadline(target->clientLock, target->control, deadline, THREAD_ABORTSAFE)
+      : IOLockSleep(target->clientLock, target->control, THREAD_ABORTSAFE);
+
+    if (result == THREAD_TIMED_OUT) {
+      status = kIOReturnTimeout;
+      break;
+    } else if (result != THREAD_AWAKENED) {
+      status = kIOReturnAborted;
+      break;
+    }
+  }
+
+  if (status == kIOReturnSuccess && (target->isStopping || !target->isChannelOpen)) {
+    status = kIOReturnNotOpen;
+  }
+  args->scalarOutput[0] = target->control->interruptCount;
+  IOLockUnlock(target->clientLock);
+  return status;
+}
@@ -0,0 +1,58 @@
+//
+//  HyperVVMBusDeviceUserClient.hpp
+//  Hyper-V VMBus device nub
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVVMBusDeviceUserClient_hpp
+#define HyperVVMBusDeviceUserClient_hpp
+
+#include <IOKit/IOUserClient.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+#include "HyperVVMBusDevice.hpp"
+#include "HyperVVMBusDeviceShared.h"
+
+//
+// Userspace channel access, the channel rings are mapped into the client and packets are handled there.
+//
+class HyperVVMBusDeviceUserClient : public IOUserClient {
+  OSDeclareDefaultStructors(HyperVVMBusDeviceUserClient);
+
+private:
+  HyperVVMBusDevice         *hvDevice;
+  IOInterruptEventSource    *interruptSource;
+  IOLock                    *clientLock;
+  bool                      isChannelOpen;
+  bool                      isStopping;
+
+  IOBufferMemoryDescriptor  *controlBuffer;
+  HyperVVMBusDeviceControl  *control;
+
+  static const IOExternalMethodDispatch methods[kHyperVVMBusDeviceUserClientMethodCount];
+
+  static IOReturn methodOpen(HyperVVMBusDeviceUserClient *target, void *ref, IOExternalMethodArguments *args);
+  static IOReturn methodClose(HyperVVMBusDeviceUserClient *target, void *ref, IOExternalMethodArguments *args);
+  static IOReturn methodSignal(HyperVVMBusDeviceUserClient *target, void *ref, IOExternalMethodArguments *args);
+  static IOReturn methodWaitInterrupt(HyperVVMBusDeviceUserClient *target, void *ref, IOExternalMethodArguments *args);
+
+  void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
+  IOReturn openChannelGated(UInt32 *txSize, UInt32 *rxSize);
+  IOReturn closeChannelGated();
+
+public:
+  //
+  // IOUserClient overrides.
+  //
+  virtual bool initWithTask(task_t owningTask, void *securityToken, UInt32 type, OSDictionary *properties) APPLE_KEXT_OVERRIDE;
+  virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void free() APPLE_KEXT_OVERRIDE;
+  virtual IOReturn clientClose() APPLE_KEXT_OVERRIDE;
+  virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch *dispatch,
+                                  OSObject *target, void *reference) APPLE_KEXT_OVERRIDE;
+  virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory) APPLE_KEXT_OVERRIDE;
+};
+
+#endif
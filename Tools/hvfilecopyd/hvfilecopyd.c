@@ -0,0 +1,261 @@
+//
+//  hvfilecopyd.c
+//  Hyper-V file copy writer
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Writes files sent with Copy-VMFile to disk, reading them from the ring shared by HyperVFileCopy.
+// Must be run as root, normally from launchd.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <IOKit/IOKitLib.h>
+
+#include "../../MacHyperVSupport/IntegrationComponents/HyperVFileCopyShared.h"
+
+#define kHyperVFileCopyServiceClass "HyperVFileCopy"
+#define kRetryDelaySeconds          5
+
+//
+// File currently being written.
+//
+static int  fileDescriptor = -1;
+static int  fileError;
+static char filePath[kHyperVFileCopyMaxPathSize];
+
+static int createParentDirectories(char *path) {
+  //
+  // Create each missing directory along the path, the last component is the file itself.
+  //
+  for (char *separator = strchr(path + 1, '/'); separator != NULL; separator = strchr(separator + 1, '/')) {
+    *separator = '\0';
+    int status = (mkdir(path, 0755) == 0 || errno == EEXIST) ? 0 : errno;
+    *separator = '/';
+    if (status != 0) {
+      return status;
+    }
+  }
+  return 0;
+}
+
+static void closeFile(bool removeFile) {
+  if (fileDescriptor < 0) {
+    return;
+  }
+
+  close(fileDescriptor);
+  fileDescriptor = -1;
+  if (removeFile) {
+    unlink(filePath);
+  }
+}
+
+static int startFile(const HyperVFileCopyRingHeader *ringHeader, const HyperVFileCopySlot *slot) {
+  //
+  // Any file still open was abandoned by the host.
+  //
+  closeFile(true);
+  fileError = 0;
+
+  strlcpy(filePath, ringHeader->startPath, sizeof (filePath));
+  if (filePath[0] != '/') {
+    return EINVAL;
+  }
+
+  if (slot->flags & kHyperVFileCopyFlagCreatePath) {
+    int status = createParentDirectories(filePath);
+    if (status != 0) {
+      return status;
+    }
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if ((slot->flags & kHyperVFileCopyFlagOverwrite) == 0) {
+    flags |= O_EXCL;
+  }
+  fileDescriptor = open(filePath, flags, 0644);
+  if (fileDescriptor < 0) {
+    return errno;
+  }
+
+  syslog(LOG_INFO, "Receiving %s (%llu bytes)", filePath, slot->fileSize);
+  return 0;
+}
+
+static int writeFile(const HyperVFileCopySlot *slot) {
+  //
+  // Later writes to a file that already failed are dropped, the error has been reported.
+  //
+  if (fileDescriptor < 0 || fileError != 0) {
+    return fileError != 0 ? fileError : EBADF;
+  }
+  if (slot->dataOffset > kHyperVFileCopySlotSize || slot->size > kHyperVFileCopySlotSize - slot->dataOffset) {
+    return EINVAL;
+  }
+
+  const uint8_t *data = (const uint8_t *)slot + slot->dataOffset;
+  uint32_t      written = 0;
+  while (written < slot->size) {
+    ssize_t result = pwrite(fileDescriptor, data + written, slot->size - written, (off_t)(slot->offset + written));
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    written += (uint32_t)result;
+  }
+  return 0;
+}
+
+static int completeFile(void) {
+  if (fileDescriptor < 0) {
+    return EBADF;
+  }
+
+  int status = fileError;
+  if (status == 0 && fsync(fileDescriptor) != 0) {
+    status = errno;
+  }
+  closeFile(status != 0);
+
+  if (status == 0) {
+    syslog(LOG_INFO, "Received %s", filePath);
+  } else {
+    syslog(LOG_ERR, "Failed to write %s: %s", filePath, strerror(status));
+  }
+  return status;
+}
+
+static int handleSlot(const HyperVFileCopyRingHeader *ringHeader, const HyperVFileCopySlot *slot) {
+  int status = 0;
+
+  switch (slot->operation) {
+    case kHyperVFileCopyOperationStart:
+      status = startFile(ringHeader, slot);
+      break;
+
+    case kHyperVFileCopyOperationWrite:
+      status = writeFile(slot);
+      break;
+
+    case kHyperVFileCopyOperationComplete:
+      status = completeFile();
+      break;
+
+    case kHyperVFileCopyOperationCancel:
+      syslog(LOG_NOTICE, "Copy of %s was cancelled", filePath);
+      closeFile(true);
+      return 0;
+
+    default:
+      syslog(LOG_ERR, "Unknown slot operation %u", slot->operation);
+      return EINVAL;
+  }
+
+  if (status != 0 && fileError == 0) {
+    fileError = status;
+  }
+  return status;
+}
+
+static void runWriter(io_connect_t connection, HyperVFileCopyRingHeader *ringHeader) {
+  uint32_t consumerIndex = ringHeader->consumerIndex;
+
+  while (true) {
+    uint64_t output;
+    uint32_t outputCount = 1;
+    kern_return_t status = IOConnectCallScalarMethod(connection, kHyperVFileCopyUserClientMethodWaitData,
+                                                     NULL, 0, &output, &outputCount);
+    if (status == kIOReturnAborted) {
+      continue;
+    } else if (status != KERN_SUCCESS) {
+      syslog(LOG_ERR, "Failed to wait for data: 0x%X", status);
+      return;
+    }
+
+    //
+    // Handle every available slot, then hand them back together.
+    // Only the first error is reported, a start or cancel begins a new file so earlier errors no longer apply.
+    //
+    uint32_t producerIndex = (uint32_t)output;
+    int      batchError    = 0;
+    for (; consumerIndex != producerIndex; consumerIndex++) {
+      const HyperVFileCopySlot *slot = (const HyperVFileCopySlot *)((const uint8_t *)ringHeader + ringHeader->slotsOffset
+                                                                    + (consumerIndex % kHyperVFileCopySlotCount) * kHyperVFileCopySlotSize);
+      if (slot->operation == kHyperVFileCopyOperationStart || slot->operation == kHyperVFileCopyOperationCancel) {
+        batchError = 0;
+      }
+      int slotError = handleSlot(ringHeader, slot);
+      if (slotError != 0 && batchError == 0) {
+        batchError = slotError;
+      }
+    }
+
+    uint64_t input[2] = { consumerIndex, (uint64_t)batchError };
+    status = IOConnectCallScalarMethod(connection, kHyperVFileCopyUserClientMethodCompleteSlots, input, 2, NULL, NULL);
+    if (status != KERN_SUCCESS) {
+      syslog(LOG_ERR, "Failed to complete slots: 0x%X", status);
+      return;
+    }
+  }
+}
+
+int main(int argc, const char *argv[]) {
+  openlog("hvfilecopyd", LOG_PID, LOG_DAEMON);
+
+  if (geteuid() != 0) {
+    syslog(LOG_ERR, "Must be run as root");
+    fprintf(stderr, "hvfilecopyd: must be run as root\n");
+    return EXIT_FAILURE;
+  }
+
+  while (true) {
+    io_service_t service = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching(kHyperVFileCopyServiceClass));
+    if (service == IO_OBJECT_NULL) {
+      sleep(kRetryDelaySeconds);
+      continue;
+    }
+
+    io_connect_t connection = IO_OBJECT_NULL;
+    kern_return_t status = IOServiceOpen(service, mach_task_self(), 0, &connection);
+    IOObjectRelease(service);
+    if (status != KERN_SUCCESS) {
+      syslog(LOG_ERR, "Failed to open %s: 0x%X", kHyperVFileCopyServiceClass, status);
+      sleep(kRetryDelaySeconds);
+      continue;
+    }
+
+    mach_vm_address_t ringAddress = 0;
+    mach_vm_size_t    ringSize    = 0;
+    status = IOConnectMapMemory64(connection, kHyperVFileCopyMemoryTypeRing, mach_task_self(), &ringAddress, &ringSize, kIOMapAnywhere);
+    if (status == KERN_SUCCESS) {
+      HyperVFileCopyRingHeader *ringHeader = (HyperVFileCopyRingHeader *)ringAddress;
+      if (ringSize >= ringHeader->slotsOffset + (mach_vm_size_t)kHyperVFileCopySlotCount * kHyperVFileCopySlotSize) {
+        syslog(LOG_INFO, "Connected to %s", kHyperVFileCopyServiceClass);
+        runWriter(connection, ringHeader);
+      } else {
+        syslog(LOG_ERR, "Shared ring of %llu bytes is too small", ringSize);
+      }
+      IOConnectUnmapMemory64(connection, kHyperVFileCopyMemoryTypeRing, mach_task_self(), ringAddress);
+    } else {
+      syslog(LOG_ERR, "Failed to map shared ring: 0x%X", status);
+    }
+
+    //
+    // The driver fails any transfer in progress once the writer disconnects.
+    //
+    closeFile(true);
+    IOServiceClose(connection);
+    sleep(kRetryDelaySeconds);
+  }
+}
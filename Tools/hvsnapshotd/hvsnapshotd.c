@@ -0,0 +1,218 @@
+//
+//  hvsnapshotd.c
+//  Hyper-V VSS freeze helper
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Freezes and thaws local volumes on request from HyperVVSS, allowing Hyper-V to take
+// application consistent backups. Must be run as root, normally from launchd.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mount.h>
+
+#include <IOKit/IOKitLib.h>
+
+#include "../../MacHyperVSupport/IntegrationComponents/HyperVVSSShared.h"
+
+#define kHyperVVSSServiceClass  "HyperVVSS"
+#define kRetryDelaySeconds      5
+
+//
+// Volumes frozen by the last freeze request.
+//
+static char   **frozenVolumes;
+static int    frozenVolumeCount;
+
+static bool isFreezableVolume(const struct statfs *fs) {
+  //
+  // Only local, writable volumes need to be frozen.
+  //
+  return (fs->f_flags & MNT_LOCAL) != 0 && (fs->f_flags & MNT_RDONLY) == 0;
+}
+
+static int setVolumeFrozen(const char *path, bool freeze) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return errno;
+  }
+
+  int status = fcntl(fd, freeze ? F_FREEZE_FS : F_THAW_FS, 0) == 0 ? 0 : errno;
+  close(fd);
+  return status;
+}
+
+static void thawVolumes(void) {
+  for (int i = 0; i < frozenVolumeCount; i++) {
+    int status = setVolumeFrozen(frozenVolumes[i], false);
+    if (status != 0) {
+      syslog(LOG_ERR, "Failed to thaw %s: %s", frozenVolumes[i], strerror(status));
+    }
+    free(frozenVolumes[i]);
+  }
+  free(frozenVolumes);
+  frozenVolumes     = NULL;
+  frozenVolumeCount = 0;
+}
+
+static void thawAllVolumes(void) {
+  //
+  // Volumes left frozen by a previous helper instance are not known, try every candidate.
+  // Volumes that are not frozen fail with EINVAL, which is expected.
+  //
+  struct statfs *mounts;
+  int mountCount = getmntinfo(&mounts, MNT_NOWAIT);
+  for (int i = 0; i < mountCount; i++) {
+    if (!isFreezableVolume(&mounts[i])) {
+      continue;
+    }
+    int status = setVolumeFrozen(mounts[i].f_mntonname, false);
+    if (status == 0) {
+      syslog(LOG_NOTICE, "Thawed %s left frozen by a previous helper", mounts[i].f_mntonname);
+    }
+  }
+}
+
+static int freezeVolumes(void) {
+  struct statfs *mounts;
+  int mountCount = getmntinfo(&mounts, MNT_NOWAIT);
+  if (mountCount <= 0) {
+    return errno != 0 ? errno : ENOENT;
+  }
+
+  frozenVolumes = calloc(mountCount, sizeof (char *));
+  if (frozenVolumes == NULL) {
+    return ENOMEM;
+  }
+
+  //
+  // Flush everything first, this keeps the frozen window short as little is left to write once frozen.
+  //
+  sync();
+
+  for (int i = 0; i < mountCount; i++) {
+    if (!isFreezableVolume(&mounts[i])) {
+      continue;
+    }
+
+    int status = setVolumeFrozen(mounts[i].f_mntonname, true);
+    if (status != 0) {
+      syslog(LOG_ERR, "Failed to freeze %s: %s", mounts[i].f_mntonname, strerror(status));
+      thawVolumes();
+      return status;
+    }
+
+    frozenVolumes[frozenVolumeCount] = strdup(mounts[i].f_mntonname);
+    if (frozenVolumes[frozenVolumeCount] == NULL) {
+      setVolumeFrozen(mounts[i].f_mntonname, false);
+      thawVolumes();
+      return ENOMEM;
+    }
+    frozenVolumeCount++;
+  }
+
+  syslog(LOG_INFO, "Froze %d volumes", frozenVolumeCount);
+  return 0;
+}
+
+static int handleRequest(uint32_t operation) {
+  switch (operation) {
+    case kHyperVVSSOperationFreeze:
+      //
+      // A freeze should never arrive with volumes frozen, but never leave them frozen if it does.
+      //
+      if (frozenVolumeCount != 0) {
+        thawVolumes();
+      }
+      return freezeVolumes();
+
+    case kHyperVVSSOperationThaw:
+      if (frozenVolumes == NULL) {
+        thawAllVolumes();
+      } else {
+        thawVolumes();
+      }
+      syslog(LOG_INFO, "Thawed volumes");
+      return 0;
+
+    default:
+      syslog(LOG_ERR, "Unknown request operation %u", operation);
+      return EINVAL;
+  }
+}
+
+static io_connect_t openVSS(void) {
+  io_service_t service = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching(kHyperVVSSServiceClass));
+  if (service == IO_OBJECT_NULL) {
+    return IO_OBJECT_NULL;
+  }
+
+  io_connect_t connection = IO_OBJECT_NULL;
+  kern_return_t status = IOServiceOpen(service, mach_task_self(), 0, &connection);
+  IOObjectRelease(service);
+  if (status != KERN_SUCCESS) {
+    syslog(LOG_ERR, "Failed to open %s: 0x%X", kHyperVVSSServiceClass, status);
+    return IO_OBJECT_NULL;
+  }
+  return connection;
+}
+
+int main(int argc, const char *argv[]) {
+  openlog("hvsnapshotd", LOG_PID, LOG_DAEMON);
+
+  if (geteuid() != 0) {
+    syslog(LOG_ERR, "Must be run as root");
+    fprintf(stderr, "hvsnapshotd: must be run as root\n");
+    return EXIT_FAILURE;
+  }
+
+  while (true) {
+    io_connect_t connection = openVSS();
+    if (connection == IO_OBJECT_NULL) {
+      sleep(kRetryDelaySeconds);
+      continue;
+    }
+    syslog(LOG_INFO, "Connected to %s", kHyperVVSSServiceClass);
+
+    while (true) {
+      uint64_t output[2];
+      uint32_t outputCount = 2;
+      kern_return_t status = IOConnectCallScalarMethod(connection, kHyperVVSSUserClientMethodWaitRequest,
+                                                       NULL, 0, output, &outputCount);
+      if (status == kIOReturnAborted) {
+        continue;
+      } else if (status != KERN_SUCCESS) {
+        syslog(LOG_ERR, "Failed to wait for request: 0x%X", status);
+        break;
+      }
+
+      //
+      // Completion is attempted even if slow, a stale request is rejected by the driver.
+      //
+      uint64_t input[2];
+      input[0] = output[0];
+      input[1] = (uint64_t) handleRequest((uint32_t) output[1]);
+      status = IOConnectCallScalarMethod(connection, kHyperVVSSUserClientMethodCompleteRequest, input, 2, NULL, NULL);
+      if (status != KERN_SUCCESS && status != kIOReturnNotFound) {
+        syslog(LOG_ERR, "Failed to complete request %llu: 0x%X", input[0], status);
+        break;
+      }
+    }
+
+    //
+    // Never leave volumes frozen once the driver can no longer ask for them to be thawed.
+    //
+    if (frozenVolumeCount != 0) {
+      thawVolumes();
+    }
+    IOServiceClose(connection);
+    sleep(kRetryDelaySeconds);
+  }
+}
@@ -0,0 +1,36 @@
+//
+//  IOLib.h
+//  Hyper-V network host simulator
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Minimal stand-in for the kernel IOLib header, allowing the driver's wire format
+// headers to be used unchanged from Linux userspace.
+//
+
+#ifndef IOLib_h
+#define IOLib_h
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint8_t   UInt8;
+typedef uint16_t  UInt16;
+typedef uint32_t  UInt32;
+typedef uint64_t  UInt64;
+typedef int8_t    SInt8;
+typedef int16_t   SInt16;
+typedef int32_t   SInt32;
+typedef int64_t   SInt64;
+
+typedef unsigned char uuid_t[16];
+
+#define PAGE_SHIFT  12
+#define PAGE_SIZE   (1 << PAGE_SHIFT)
+
+#define IOLog       printf
+
+#endif
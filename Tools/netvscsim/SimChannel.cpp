@@ -0,0 +1,303 @@
+//
+//  SimChannel.cpp
+//  Hyper-V network host simulator
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "SimChannel.hpp"
+
+#include <stdlib.h>
+#include <chrono>
+
+void SimEvent::signal() {
+  std::lock_guard<std::mutex> guard(lock);
+  isSignaled = true;
+  signalCount++;
+  condition.notify_one();
+}
+
+bool SimEvent::wait(UInt32 timeoutMS) {
+  std::unique_lock<std::mutex> guard(lock);
+  condition.wait_for(guard, std::chrono::milliseconds(timeoutMS), [this] { return isSignaled; });
+  bool signaled = isSignaled;
+  isSignaled = false;
+  return signaled;
+}
+
+SimGuestMemory::~SimGuestMemory() {
+  for (auto &allocation : allocations) {
+    free(allocation.first);
+  }
+}
+
+UInt8 *SimGuestMemory::allocatePages(UInt32 size, UInt64 *pfn) {
+  UInt32 pageCount = HV_PAGEALIGN(size) >> PAGE_SHIFT;
+  UInt8 *buffer = (UInt8*)aligned_alloc(PAGE_SIZE, pageCount << PAGE_SHIFT);
+  if (buffer == NULL) {
+    return NULL;
+  }
+  memset(buffer, 0, pageCount << PAGE_SHIFT);
+
+  std::lock_guard<std::mutex> guard(lock);
+  *pfn = nextPfn;
+  for (UInt32 i = 0; i < pageCount; i++) {
+    pages[nextPfn++] = buffer + (i << PAGE_SHIFT);
+  }
+  allocations[buffer] = std::make_pair(*pfn, pageCount);
+  return buffer;
+}
+
+void SimGuestMemory::freePages(UInt8 *buffer) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto allocation = allocations.find(buffer);
+  if (allocation == allocations.end()) {
+    return;
+  }
+
+  for (UInt32 i = 0; i < allocation->second.second; i++) {
+    pages.erase(allocation->second.first + i);
+  }
+  allocations.erase(allocation);
+  free(buffer);
+}
+
+bool SimGuestMemory::createGpadlBuffer(UInt32 size, UInt32 *gpadlHandle, void **buffer) {
+  UInt64 pfn;
+  UInt8 *pageBuffer = allocatePages(size, &pfn);
+  if (pageBuffer == NULL) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  *gpadlHandle = nextGpadl++;
+  gpadls[*gpadlHandle] = std::make_pair(pageBuffer, size);
+  *buffer = pageBuffer;
+  return true;
+}
+
+UInt8 *SimGuestMemory::getPage(UInt64 pfn) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto page = pages.find(pfn);
+  return page != pages.end() ? page->second : NULL;
+}
+
+UInt8 *SimGuestMemory::getGpadlBuffer(UInt32 gpadlHandle, UInt32 *size) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto gpadl = gpadls.find(gpadlHandle);
+  if (gpadl == gpadls.end()) {
+    return NULL;
+  }
+  *size = gpadl->second.second;
+  return gpadl->second.first;
+}
+
+bool SimVMBusChannel::createChannelPair(UInt32 guestTxSize, UInt32 guestRxSize, SimVMBusChannel *guest, SimVMBusChannel *host) {
+  //
+  // Ring control page is followed by the ring data, as in the channel GPADL.
+  //
+  VMBusRingBuffer *guestTx = (VMBusRingBuffer*)aligned_alloc(PAGE_SIZE, sizeof (VMBusRingBuffer) + guestTxSize);
+  VMBusRingBuffer *guestRx = (VMBusRingBuffer*)aligned_alloc(PAGE_SIZE, sizeof (VMBusRingBuffer) + guestRxSize);
+  if (guestTx == NULL || guestRx == NULL) {
+    free(guestTx);
+    free(guestRx);
+    return false;
+  }
+  memset(guestTx, 0, sizeof (VMBusRingBuffer) + guestTxSize);
+  memset(guestRx, 0, sizeof (VMBusRingBuffer) + guestRxSize);
+  guestTx->features.pendingSendSizeSupported = 1;
+  guestRx->features.pendingSendSizeSupported = 1;
+
+  guest->txBuffer     = guestTx;
+  guest->txBufferSize = guestTxSize;
+  guest->rxBuffer     = guestRx;
+  guest->rxBufferSize = guestRxSize;
+  guest->peerEvent    = &host->event;
+
+  host->txBuffer      = guestRx;
+  host->txBufferSize  = guestRxSize;
+  host->rxBuffer      = guestTx;
+  host->rxBufferSize  = guestTxSize;
+  host->peerEvent     = &guest->event;
+  return true;
+}
+
+void SimVMBusChannel::freeChannelPair(SimVMBusChannel *guest, SimVMBusChannel *host) {
+  free(guest->txBuffer);
+  free(guest->rxBuffer);
+  guest->txBuffer = guest->rxBuffer = NULL;
+  host->txBuffer  = host->rxBuffer  = NULL;
+}
+
+bool SimVMBusChannel::isTxSpaceAvailable(UInt32 packetDataLength) {
+  UInt32 pktLength = HV_PACKETALIGN(sizeof (VMBusPacketHeader) + packetDataLength) + sizeof (UInt64);
+  return getAvailableTxSpace() > pktLength;
+}
+
+void SimVMBusChannel::setTxPendingSendSize(UInt32 packetDataLength) {
+  setPendingSendSize(packetDataLength != 0 ? HV_PACKETALIGN(sizeof (VMBusPacketHeader) + packetDataLength) + sizeof (UInt64) : 0);
+}
+
+bool SimVMBusChannel::nextPacketAvailable(VMBusPacketType *type, UInt32 *packetHeaderLength, UInt32 *packetTotalLength) {
+  //
+  // No data to read.
+  //
+  if (rxBuffer->readIndex == rxBuffer->writeIndex) {
+    return false;
+  }
+  __sync_synchronize();
+
+  VMBusPacketHeader pktHeader;
+  copyPacketDataFromRingBuffer(rxBuffer->readIndex, sizeof (VMBusPacketHeader), &pktHeader, sizeof (VMBusPacketHeader));
+
+  if (type != NULL) {
+    *type = pktHeader.type;
+  }
+  if (packetHeaderLength != NULL) {
+    *packetHeaderLength = pktHeader.headerLength << kVMBusPacketSizeShift;
+  }
+  if (packetTotalLength != NULL) {
+    *packetTotalLength = pktHeader.totalLength << kVMBusPacketSizeShift;
+  }
+  return true;
+}
+
+bool SimVMBusChannel::readRawPacket(void *buffer, UInt32 bufferLength) {
+  //
+  // No data to read.
+  //
+  if (rxBuffer->readIndex == rxBuffer->writeIndex) {
+    return false;
+  }
+  __sync_synchronize();
+
+  VMBusPacketHeader pktHeader;
+  copyPacketDataFromRingBuffer(rxBuffer->readIndex, sizeof (VMBusPacketHeader), &pktHeader, sizeof (VMBusPacketHeader));
+
+  UInt32 packetTotalLength = pktHeader.totalLength << kVMBusPacketSizeShift;
+  if (bufferLength < packetTotalLength) {
+    return false;
+  }
+
+  UInt32 readIndexNew = copyPacketDataFromRingBuffer(rxBuffer->readIndex, packetTotalLength, buffer, packetTotalLength);
+  UInt64 readIndexShifted;
+  readIndexNew = copyPacketDataFromRingBuffer(readIndexNew, sizeof (readIndexShifted), &readIndexShifted, sizeof (readIndexShifted));
+
+  UInt32 rxSpaceOld = getAvailableRxSpace(rxBuffer->readIndex);
+  __sync_synchronize();
+  rxBuffer->readIndex = readIndexNew;
+
+  //
+  // The other end may be waiting for space to write its next packet, signal it only when this read freed enough.
+  //
+  __sync_synchronize();
+  UInt32 pendingSendSize = rxBuffer->pendingSendSize;
+  if (pendingSendSize != 0 && rxSpaceOld <= pendingSendSize && getAvailableRxSpace(readIndexNew) > pendingSendSize) {
+    peerEvent->signal();
+  }
+  return true;
+}
+
+bool SimVMBusChannel::writeRawPacket(const void *header, UInt32 headerLength, const void *buffer, UInt32 bufferLength) {
+  std::lock_guard<std::mutex> guard(writeLock);
+
+  UInt32 pktTotalLength         = headerLength + bufferLength;
+  UInt32 pktTotalLengthAligned  = HV_PACKETALIGN(pktTotalLength);
+
+  UInt32 writeIndexOld          = txBuffer->writeIndex;
+  UInt32 writeIndexNew          = writeIndexOld;
+  UInt64 writeIndexShifted      = ((UInt64)writeIndexOld) << 32;
+
+  //
+  // Ensure there is space for the packet and the trailing index.
+  //
+  // We cannot end up with read index == write index after the write, as that would indicate an empty buffer.
+  //
+  if (getAvailableTxSpace() <= pktTotalLengthAligned + sizeof (writeIndexShifted)) {
+    return false;
+  }
+
+  if (header != NULL) {
+    writeIndexNew = copyPacketDataToRingBuffer(writeIndexNew, header, headerLength);
+  }
+  writeIndexNew = copyPacketDataToRingBuffer(writeIndexNew, buffer, bufferLength);
+  writeIndexNew = zeroPacketDataToRingBuffer(writeIndexNew, pktTotalLengthAligned - pktTotalLength);
+  writeIndexNew = copyPacketDataToRingBuffer(writeIndexNew, &writeIndexShifted, sizeof (writeIndexShifted));
+
+  //
+  // Only signal if the ring was empty before this packet, otherwise the other end is still reading
+  // and will pick this packet up too.
+  //
+  __sync_synchronize();
+  txBuffer->writeIndex = writeIndexNew;
+  __sync_synchronize();
+  if (txBuffer->interruptMask == 0 && txBuffer->readIndex == writeIndexOld) {
+    peerEvent->signal();
+  }
+  return true;
+}
+
+bool SimVMBusChannel::writeInbandPacket(const void *buffer, UInt32 bufferLength, UInt64 transactionId, bool responseRequired) {
+  VMBusPacketHeader pktHeader;
+  pktHeader.type          = kVMBusPacketTypeDataInband;
+  pktHeader.flags         = responseRequired ? kVMBusPacketResponseRequired : 0;
+  pktHeader.transactionId = transactionId;
+  pktHeader.headerLength  = sizeof (pktHeader) >> kVMBusPacketSizeShift;
+  pktHeader.totalLength   = HV_PACKETALIGN(sizeof (pktHeader) + bufferLength) >> kVMBusPacketSizeShift;
+  return writeRawPacket(&pktHeader, sizeof (pktHeader), buffer, bufferLength);
+}
+
+bool SimVMBusChannel::writeCompletionPacket(const void *buffer, UInt32 bufferLength, UInt64 transactionId) {
+  VMBusPacketHeader pktHeader;
+  pktHeader.type          = kVMBusPacketTypeCompletion;
+  pktHeader.flags         = 0;
+  pktHeader.transactionId = transactionId;
+  pktHeader.headerLength  = sizeof (pktHeader) >> kVMBusPacketSizeShift;
+  pktHeader.totalLength   = HV_PACKETALIGN(sizeof (pktHeader) + bufferLength) >> kVMBusPacketSizeShift;
+  return writeRawPacket(&pktHeader, sizeof (pktHeader), buffer, bufferLength);
+}
+
+UInt32 SimVMBusChannel::copyPacketDataFromRingBuffer(UInt32 readIndex, UInt32 readLength, void *data, UInt32 dataLength) {
+  //
+  // Check for wraparound.
+  //
+  if (dataLength > rxBufferSize - readIndex) {
+    UInt32 fragmentLength = rxBufferSize - readIndex;
+    memcpy(data, &rxBuffer->buffer[readIndex], fragmentLength);
+    memcpy((UInt8*) data + fragmentLength, rxBuffer->buffer, dataLength - fragmentLength);
+  } else {
+    memcpy(data, &rxBuffer->buffer[readIndex], dataLength);
+  }
+
+  return (readIndex + readLength) % rxBufferSize;
+}
+
+UInt32 SimVMBusChannel::copyPacketDataToRingBuffer(UInt32 writeIndex, const void *data, UInt32 length) {
+  //
+  // Check for wraparound.
+  //
+  if (length > txBufferSize - writeIndex) {
+    UInt32 fragmentLength = txBufferSize - writeIndex;
+    memcpy(&txBuffer->buffer[writeIndex], data, fragmentLength);
+    memcpy(txBuffer->buffer, (const UInt8*) data + fragmentLength, length - fragmentLength);
+  } else {
+    memcpy(&txBuffer->buffer[writeIndex], data, length);
+  }
+
+  return (writeIndex + length) % txBufferSize;
+}
+
+UInt32 SimVMBusChannel::zeroPacketDataToRingBuffer(UInt32 writeIndex, UInt32 length) {
+  //
+  // Check for wraparound.
+  //
+  if (length > txBufferSize - writeIndex) {
+    UInt32 fragmentLength = txBufferSize - writeIndex;
+    memset(&txBuffer->buffer[writeIndex], 0, fragmentLength);
+    memset(txBuffer->buffer, 0, length - fragmentLength);
+  } else {
+    memset(&txBuffer->buffer[writeIndex], 0, length);
+  }
+
+  return (writeIndex + length) % txBufferSize;
+}
@@ -0,0 +1,115 @@
+//
+//  SimChannel.hpp
+//  Hyper-V network host simulator
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// In-process VMBus channel, guest memory and signaling used between the simulated host and guest.
+//
+
+#ifndef SimChannel_hpp
+#define SimChannel_hpp
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+#include "VMBusController/VMBus.hpp"
+
+//
+// Stand-in for a SynIC event, signals are sticky until the waiter consumes them.
+//
+class SimEvent {
+  std::mutex              lock;
+  std::condition_variable condition;
+  bool                    isSignaled = false;
+
+public:
+  UInt64                  signalCount = 0;
+
+  void signal();
+  bool wait(UInt32 timeoutMS);
+};
+
+//
+// Guest memory, pages are given fake PFNs and buffers are shared with the host by GPADL handle.
+//
+class SimGuestMemory {
+  std::mutex                      lock;
+  std::map<UInt8*, std::pair<UInt64, UInt32>> allocations;
+  std::map<UInt64, UInt8*>        pages;
+  std::map<UInt32, std::pair<UInt8*, UInt32>> gpadls;
+  UInt64                          nextPfn = 0x100000;
+  UInt32                          nextGpadl = 0xE1E10;
+
+public:
+  ~SimGuestMemory();
+
+  UInt8 *allocatePages(UInt32 size, UInt64 *pfn);
+  void freePages(UInt8 *buffer);
+  bool createGpadlBuffer(UInt32 size, UInt32 *gpadlHandle, void **buffer);
+
+  UInt8 *getPage(UInt64 pfn);
+  UInt8 *getGpadlBuffer(UInt32 gpadlHandle, UInt32 *size);
+};
+
+//
+// One end of a VMBus channel. Packets are read and written using the same ring layout and
+// index handling as HyperVVMBusDevice, so the signaling behavior matches the driver.
+//
+class SimVMBusChannel {
+  VMBusRingBuffer *txBuffer = NULL;
+  UInt32          txBufferSize = 0;
+  VMBusRingBuffer *rxBuffer = NULL;
+  UInt32          rxBufferSize = 0;
+
+  //
+  // Writes may come from several threads, reads only from one.
+  //
+  std::mutex      writeLock;
+  SimEvent        *peerEvent = NULL;
+
+  inline UInt32 getAvailableTxSpace() {
+    return (txBuffer->writeIndex >= txBuffer->readIndex) ?
+      (txBufferSize - (txBuffer->writeIndex - txBuffer->readIndex)) :
+      (txBuffer->readIndex - txBuffer->writeIndex);
+  }
+
+  inline UInt32 getAvailableRxSpace(UInt32 readIndex) {
+    return (rxBuffer->writeIndex >= readIndex) ?
+      (rxBufferSize - (rxBuffer->writeIndex - readIndex)) :
+      (readIndex - rxBuffer->writeIndex);
+  }
+
+  UInt32 copyPacketDataFromRingBuffer(UInt32 readIndex, UInt32 readLength, void *data, UInt32 dataLength);
+  UInt32 copyPacketDataToRingBuffer(UInt32 writeIndex, const void *data, UInt32 length);
+  UInt32 zeroPacketDataToRingBuffer(UInt32 writeIndex, UInt32 length);
+
+public:
+  SimEvent        event;
+
+  //
+  // Creates both ends of a channel, the guest TX ring is the host RX ring and vice versa.
+  //
+  static bool createChannelPair(UInt32 guestTxSize, UInt32 guestRxSize, SimVMBusChannel *guest, SimVMBusChannel *host);
+  static void freeChannelPair(SimVMBusChannel *guest, SimVMBusChannel *host);
+
+  bool nextPacketAvailable(VMBusPacketType *type, UInt32 *packetHeaderLength, UInt32 *packetTotalLength);
+  bool readRawPacket(void *buffer, UInt32 bufferLength);
+  bool writeRawPacket(const void *header, UInt32 headerLength, const void *buffer, UInt32 bufferLength);
+
+  bool writeInbandPacket(const void *buffer, UInt32 bufferLength, UInt64 transactionId, bool responseRequired);
+  bool writeCompletionPacket(const void *buffer, UInt32 bufferLength, UInt64 transactionId);
+
+  //
+  // Pending send size is set on the TX ring while waiting for the other end to free space.
+  //
+  void setPendingSendSize(UInt32 size) { txBuffer->pendingSendSize = size; __sync_synchronize(); }
+  bool isTxSpaceAvailable(UInt32 packetDataLength);
+  void setTxPendingSendSize(UInt32 packetDataLength);
+  UInt32 getRxRingBufferSize() { return rxBufferSize; }
+  UInt32 getRxRingBytesUsed() { return rxBufferSize - getAvailableRxSpace(rxBuffer->readIndex); }
+  UInt64 getSignalCount() { return peerEvent->signalCount; }
+};
+
+#endif
@@ -0,0 +1,870 @@
+//
+//  SimGuest.cpp
+//  Hyper-V network host simulator
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "SimGuest.hpp"
+
+#include <stdlib.h>
+
+SimNetworkGuest::SimNetworkGuest(SimVMBusChannel *channel, SimGuestMemory *guestMemory) {
+  this->channel     = channel;
+  this->guestMemory = guestMemory;
+  memset(ethAddress, 0, sizeof (ethAddress));
+}
+
+SimNetworkGuest::~SimNetworkGuest() {
+  free((void*)sendIndexMap);
+  free(rxCompletionQueue);
+}
+
+bool SimNetworkGuest::writePacketAndWait(const void *header, UInt32 headerLength, void *buffer, UInt32 bufferLength, UInt64 transactionId,
+                                         void *responseBuffer, UInt32 responseBufferLength) {
+  SimNetworkTransaction req;
+  if (responseBuffer != NULL) {
+    req.isSleeping         = true;
+    req.responseData       = responseBuffer;
+    req.responseDataLength = responseBufferLength;
+    req.transactionId      = transactionId;
+
+    std::lock_guard<std::mutex> guard(sleepLock);
+    req.next     = transactions;
+    transactions = &req;
+  }
+
+  bool status = channel->writeRawPacket(header, headerLength, buffer, bufferLength);
+  if (responseBuffer != NULL) {
+    if (status) {
+      std::unique_lock<std::mutex> guard(sleepLock);
+      sleepCondition.wait(guard, [&req] { return !req.isSleeping; });
+    } else {
+      wakeTransaction(transactionId);
+    }
+  }
+  return status;
+}
+
+bool SimNetworkGuest::writeInbandPacket(void *buffer, UInt32 bufferLength, bool responseRequired,
+                                        void *responseBuffer, UInt32 responseBufferLength) {
+  VMBusPacketHeader pktHeader;
+  pktHeader.type          = kVMBusPacketTypeDataInband;
+  pktHeader.flags         = responseRequired ? kVMBusPacketResponseRequired : 0;
+  pktHeader.transactionId = nextTransId++;
+  pktHeader.headerLength  = sizeof (pktHeader) >> kVMBusPacketSizeShift;
+  pktHeader.totalLength   = HV_PACKETALIGN(sizeof (pktHeader) + bufferLength) >> kVMBusPacketSizeShift;
+  return writePacketAndWait(&pktHeader, sizeof (pktHeader), buffer, bufferLength, pktHeader.transactionId,
+                            responseBuffer, responseBufferLength);
+}
+
+bool SimNetworkGuest::writeGPADirectSinglePagePacket(void *buffer, UInt32 bufferLength, bool responseRequired,
+                                                     VMBusSinglePageBuffer pageBuffers[], UInt32 pageBufferCount,
+                                                     void *responseBuffer, UInt32 responseBufferLength) {
+  if (pageBufferCount > kVMBusMaxPageBufferCount) {
+    return false;
+  }
+
+  VMBusPacketSinglePageBuffer pagePacket;
+  UInt32 pagePacketLength = sizeof (VMBusPacketSinglePageBuffer) -
+    ((kVMBusMaxPageBufferCount - pageBufferCount) * sizeof (VMBusSinglePageBuffer));
+
+  pagePacket.header.type          = kVMBusPacketTypeDataUsingGPADirect;
+  pagePacket.header.headerLength  = pagePacketLength >> kVMBusPacketSizeShift;
+  pagePacket.header.totalLength   = (pagePacketLength + bufferLength) >> kVMBusPacketSizeShift;
+  pagePacket.header.flags         = responseRequired ? kVMBusPacketResponseRequired : 0;
+  pagePacket.header.transactionId = nextTransId++;
+
+  pagePacket.reserved             = 0;
+  pagePacket.rangeCount           = pageBufferCount;
+  for (UInt32 i = 0; i < pagePacket.rangeCount; i++) {
+    pagePacket.ranges[i] = pageBuffers[i];
+  }
+  return writePacketAndWait(&pagePacket, pagePacketLength, buffer, bufferLength, pagePacket.header.transactionId,
+                            responseBuffer, responseBufferLength);
+}
+
+bool SimNetworkGuest::getPendingTransaction(UInt64 transactionId, void **buffer, UInt32 *bufferLength) {
+  std::lock_guard<std::mutex> guard(sleepLock);
+  for (SimNetworkTransaction *current = transactions; current != NULL; current = current->next) {
+    if (current->transactionId == transactionId) {
+      *buffer       = current->responseData;
+      *bufferLength = current->responseDataLength;
+      return true;
+    }
+  }
+  return false;
+}
+
+void SimNetworkGuest::wakeTransaction(UInt64 transactionId) {
+  std::lock_guard<std::mutex> guard(sleepLock);
+  SimNetworkTransaction *previous = NULL;
+  for (SimNetworkTransaction *current = transactions; current != NULL; previous = current, current = current->next) {
+    if (current->transactionId == transactionId) {
+      if (previous == NULL) {
+        transactions = current->next;
+      } else {
+        previous->next = current->next;
+      }
+      current->isSleeping = false;
+      sleepCondition.notify_all();
+      return;
+    }
+  }
+}
+
+//
+// HyperVNetworkPrivate.cpp
+//
+
+void SimNetworkGuest::handleInterrupt() {
+  processPackets(UINT32_MAX);
+}
+
+void SimNetworkGuest::processPackets(UInt32 maxCount) {
+  VMBusPacketType type;
+  UInt32 headersize;
+  UInt32 totalsize;
+
+  void *responseBuffer;
+  UInt32 responseLength;
+
+  HyperVNetworkMessage *pktComp;
+
+  rxPacketCount = 0;
+  updateReceiveBufferStatistics();
+  flushRNDISRangesCompletions();
+  while (rxPacketCount < maxCount) {
+    if (!channel->nextPacketAvailable(&type, &headersize, &totalsize)) {
+      break;
+    }
+
+    UInt8 *buf = (UInt8*)malloc(totalsize);
+    channel->readRawPacket((void*)buf, totalsize);
+
+    switch (type) {
+      case kVMBusPacketTypeDataUsingTransferPages:
+        handleRNDISRanges((VMBusPacketTransferPages*) buf, headersize, totalsize);
+        break;
+
+      case kVMBusPacketTypeCompletion:
+        if (getPendingTransaction(((VMBusPacketHeader*)buf)->transactionId, &responseBuffer, &responseLength)) {
+          if (responseLength > totalsize - headersize) {
+            responseLength = totalsize - headersize;
+          }
+          memcpy(responseBuffer, (UInt8*)buf + headersize, responseLength);
+          wakeTransaction(((VMBusPacketHeader*)buf)->transactionId);
+        } else {
+          pktComp = (HyperVNetworkMessage*) (buf + headersize);
+          if (pktComp->messageType == kHyperVNetworkMessageTypeV1SendRNDISPacketComplete) {
+            releaseSendIndex((UInt32)(((VMBusPacketHeader*)buf)->transactionId & ~kHyperVNetworkSendTransIdBits));
+          }
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    free(buf);
+  }
+  flushRNDISRangesCompletions();
+
+  //
+  // Restart the output queue if it was stalled waiting for TX ring space.
+  //
+  if (isSendRingStalled && channel->isTxSpaceAvailable(sizeof (HyperVNetworkMessage))) {
+    std::lock_guard<std::mutex> guard(sleepLock);
+    isSendRingStalled = false;
+    sleepCondition.notify_all();
+  }
+}
+
+void SimNetworkGuest::handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32 headerSize, UInt32 pktSize) {
+  HyperVNetworkMessage *netMsg = (HyperVNetworkMessage*) ((UInt8*)pktPages + headerSize);
+
+  //
+  // Ensure packet is valid.
+  //
+  if (netMsg->messageType != kHyperVNetworkMessageTypeV1SendRNDISPacket ||
+      pktPages->transferPagesetId != kHyperVNetworkReceiveBufferID) {
+    printf("guest: invalid message of type 0x%X and pageset ID of 0x%X received\n", netMsg->messageType, pktPages->transferPagesetId);
+    return;
+  }
+
+  //
+  // Process each range which contains a packet.
+  //
+  for (UInt32 i = 0; i < pktPages->rangeCount; i++) {
+    UInt8 *data = receiveBuffer + pktPages->ranges[i].offset;
+    UInt32 dataLength = pktPages->ranges[i].count;
+
+    //
+    // Ensure range lies within a receive buffer section.
+    //
+    if (getReceiveRangeSubAllocCount(pktPages->ranges[i].offset, dataLength) == 0) {
+      printf("guest: invalid range of %u bytes at 0x%X\n", dataLength, pktPages->ranges[i].offset);
+      inputErrors++;
+      continue;
+    }
+
+    processRNDISPacket(data, dataLength);
+  }
+
+  //
+  // Queue the completion if the TX ring is full, keeping completions in order.
+  //
+  if (rxCompletionQueueCount == 0 && sendRNDISRangesCompletion(pktPages->header.transactionId)) {
+    return;
+  }
+  if (rxCompletionQueueCount == rxCompletionQueueSize) {
+    printf("guest: receive completion queue is full, dropping completion for transaction 0x%llX\n",
+           (unsigned long long)pktPages->header.transactionId);
+    return;
+  }
+  rxCompletionQueue[(rxCompletionQueueHead + rxCompletionQueueCount) % rxCompletionQueueSize] = pktPages->header.transactionId;
+  rxCompletionQueueCount++;
+  rxCompletionQueuedCount++;
+  channel->setTxPendingSendSize(sizeof (HyperVNetworkMessage));
+}
+
+bool SimNetworkGuest::sendRNDISRangesCompletion(UInt64 transactionId) {
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacketComplete;
+  netMsg.v1.sendRNDISPacketComplete.status = kHyperVNetworkMessageStatusSuccess;
+
+  return channel->writeCompletionPacket(&netMsg, sizeof (netMsg), transactionId);
+}
+
+void SimNetworkGuest::flushRNDISRangesCompletions() {
+  while (rxCompletionQueueCount > 0) {
+    if (!sendRNDISRangesCompletion(rxCompletionQueue[rxCompletionQueueHead])) {
+      return;
+    }
+    rxCompletionQueueHead = (rxCompletionQueueHead + 1) % rxCompletionQueueSize;
+    rxCompletionQueueCount--;
+  }
+}
+
+bool SimNetworkGuest::negotiateProtocol(HyperVNetworkProtocolVersion protocolVersion) {
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeInit;
+  netMsg.init.initVersion.maxProtocolVersion = protocolVersion;
+  netMsg.init.initVersion.minProtocolVersion = protocolVersion;
+
+  if (!writeInbandPacket(&netMsg, sizeof (netMsg), true, &netMsg, sizeof (netMsg))) {
+    printf("guest: failed to send protocol negotiation message\n");
+    return false;
+  }
+  return netMsg.init.initComplete.status == kHyperVNetworkMessageStatusSuccess;
+}
+
+bool SimNetworkGuest::sendNDISConfig() {
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV2SendNDISConfig;
+  netMsg.v2.sendNDISConfig.mtu = 1514;
+  netMsg.v2.sendNDISConfig.capabilities = kHyperVNetworkNDISCapabilityIEEE8021Q;
+  if (netVersion >= kHyperVNetworkProtocolVersion5) {
+    netMsg.v2.sendNDISConfig.capabilities |= kHyperVNetworkNDISCapabilitySRIOV | kHyperVNetworkNDISCapabilityTeaming;
+  }
+
+  return writeInbandPacket(&netMsg, sizeof (netMsg), false);
+}
+
+bool SimNetworkGuest::initBuffers() {
+  if (!guestMemory->createGpadlBuffer(receiveBufferSize, &receiveGpadlHandle, (void**)&receiveBuffer)) {
+    printf("guest: failed to create GPADL for receive buffer\n");
+    return false;
+  }
+  if (!guestMemory->createGpadlBuffer(sendBufferSize, &sendGpadlHandle, (void**)&sendBuffer)) {
+    printf("guest: failed to create GPADL for send buffer\n");
+    return false;
+  }
+
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV1SendReceiveBuffer;
+  netMsg.v1.sendReceiveBuffer.gpadlHandle = receiveGpadlHandle;
+  netMsg.v1.sendReceiveBuffer.id = kHyperVNetworkReceiveBufferID;
+
+  //
+  // Response may contain multiple sections.
+  //
+  UInt8 receiveResponse[sizeof (HyperVNetworkMessage) +
+                        (sizeof (HyperVNetworkV1MessageReceiveBufferSection) * (kHyperVNetworkReceiveBufferMaxSections - 1))];
+  memset(receiveResponse, 0, sizeof (receiveResponse));
+  HyperVNetworkV1MessageSendReceiveBufferComplete *receiveComplete =
+    &((HyperVNetworkMessage*)receiveResponse)->v1.sendReceiveBufferComplete;
+
+  if (!writeInbandPacket(&netMsg, sizeof (netMsg), true, receiveResponse, sizeof (receiveResponse))) {
+    printf("guest: failed to send receive buffer configuration message\n");
+    return false;
+  }
+  if (receiveComplete->status != kHyperVNetworkMessageStatusSuccess) {
+    printf("guest: failed to configure receive buffer: 0x%X\n", receiveComplete->status);
+    return false;
+  }
+
+  //
+  // Validate each section and save it for checking receive ranges later.
+  // Sections must be in order and cannot overlap.
+  //
+  if (receiveComplete->numSections == 0 || receiveComplete->numSections > kHyperVNetworkReceiveBufferMaxSections) {
+    printf("guest: unsupported receive buffer section count of %u\n", receiveComplete->numSections);
+    return false;
+  }
+
+  UInt32 sectionStart = 0;
+  receiveSubAllocCount = 0;
+  for (UInt32 i = 0; i < receiveComplete->numSections; i++) {
+    HyperVNetworkV1MessageReceiveBufferSection *section = &receiveComplete->sections[i];
+    if (section->offset < sectionStart || section->endOffset <= section->offset
+        || section->endOffset > receiveBufferSize || section->subAllocSize == 0
+        || (UInt64)section->subAllocSize * section->numSubAllocs > section->endOffset - section->offset) {
+      printf("guest: invalid receive buffer section %u\n", i);
+      return false;
+    }
+
+    receiveSections[i] = *section;
+    receiveSubAllocCount += section->numSubAllocs;
+    sectionStart = section->endOffset;
+  }
+  receiveSectionCount = receiveComplete->numSections;
+
+  rxCompletionQueueSize = receiveSubAllocCount;
+  rxCompletionQueue = (UInt64*)malloc(rxCompletionQueueSize * sizeof (UInt64));
+  if (rxCompletionQueue == NULL) {
+    printf("guest: failed to allocate receive completion queue\n");
+    return false;
+  }
+
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV1SendSendBuffer;
+  netMsg.v1.sendSendBuffer.gpadlHandle = sendGpadlHandle;
+  netMsg.v1.sendSendBuffer.id = kHyperVNetworkSendBufferID;
+
+  if (!writeInbandPacket(&netMsg, sizeof (netMsg), true, &netMsg, sizeof (netMsg))) {
+    printf("guest: failed to send send buffer configuration message\n");
+    return false;
+  }
+  if (netMsg.v1.sendSendBufferComplete.status != kHyperVNetworkMessageStatusSuccess) {
+    printf("guest: failed to configure send buffer: 0x%X\n", netMsg.v1.sendSendBufferComplete.status);
+    return false;
+  }
+  sendSectionSize = netMsg.v1.sendSendBufferComplete.sectionSize;
+  if (sendSectionSize < sizeof (HyperVNetworkRNDISMessageDataPacket) + sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q) + 8) {
+    printf("guest: invalid send buffer section size of %u bytes\n", sendSectionSize);
+    return false;
+  }
+  sendSectionCount = sendBufferSize / sendSectionSize;
+
+  //
+  // Each send section is tracked by a single bit.
+  //
+  sendIndexMapSize = ((sendSectionCount + 63) / 64) * sizeof (UInt64);
+  sendIndexMap = (volatile UInt64*)malloc(sendIndexMapSize);
+  if (sendIndexMap == NULL) {
+    return false;
+  }
+  memset((void*)sendIndexMap, 0, sendIndexMapSize);
+
+  initSendSectionTemplates();
+  return true;
+}
+
+bool SimNetworkGuest::connectNetwork() {
+  static const HyperVNetworkProtocolVersion protocolVersions[] = {
+    kHyperVNetworkProtocolVersion61,
+    kHyperVNetworkProtocolVersion6,
+    kHyperVNetworkProtocolVersion5,
+    kHyperVNetworkProtocolVersion4,
+    kHyperVNetworkProtocolVersion2,
+    kHyperVNetworkProtocolVersion1
+  };
+
+  bool foundVersion = false;
+  for (UInt32 i = 0; i < ARRAY_SIZE(protocolVersions); i++) {
+    if (negotiateProtocol(protocolVersions[i])) {
+      netVersion = protocolVersions[i];
+      foundVersion = true;
+      break;
+    }
+  }
+  if (!foundVersion) {
+    printf("guest: failed to negotiate a protocol version\n");
+    return false;
+  }
+
+  if (netVersion >= kHyperVNetworkProtocolVersion2 && !sendNDISConfig()) {
+    return false;
+  }
+
+  UInt32 ndisVersion = netVersion > kHyperVNetworkProtocolVersion4 ?
+    kHyperVNetworkNDISVersion6001E : kHyperVNetworkNDISVersion60001;
+
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV1SendNDISVersion;
+  netMsg.v1.sendNDISVersion.major = (ndisVersion & 0xFFFF0000) >> 16;
+  netMsg.v1.sendNDISVersion.minor = ndisVersion & 0x0000FFFF;
+  if (!writeInbandPacket(&netMsg, sizeof (netMsg), false)) {
+    printf("guest: failed to send NDIS version\n");
+    return false;
+  }
+
+  //
+  // Boot argument override of the receive buffer size is not simulated.
+  //
+  receiveBufferSize = netVersion < kHyperVNetworkProtocolVersion2 ? kHyperVNetworkReceiveBufferSizeLegacy : kHyperVNetworkReceiveBufferSize;
+  sendBufferSize = kHyperVNetworkSendBufferSize;
+  if (!initBuffers()) {
+    return false;
+  }
+
+  if (!initializeRNDIS()) {
+    return false;
+  }
+
+  readMACAddress();
+  readVLANId();
+  updateLinkState(NULL);
+  return true;
+}
+
+UInt32 SimNetworkGuest::getReceiveRangeSubAllocCount(UInt32 offset, UInt32 length) {
+  for (UInt32 i = 0; i < receiveSectionCount; i++) {
+    HyperVNetworkV1MessageReceiveBufferSection *section = &receiveSections[i];
+    if (offset >= section->offset && offset < section->endOffset) {
+      if (length == 0 || length > section->endOffset - offset) {
+        return 0;
+      }
+      return (length + section->subAllocSize - 1) / section->subAllocSize;
+    }
+  }
+  return 0;
+}
+
+void SimNetworkGuest::updateReceiveBufferStatistics() {
+  if (receiveSubAllocCount == 0) {
+    return;
+  }
+
+  UInt32 ringSize      = channel->getRxRingBufferSize();
+  UInt32 ringBytesUsed = channel->getRxRingBytesUsed();
+  if (ringBytesUsed > rxRingBytesUsedPeak) {
+    rxRingBytesUsedPeak = ringBytesUsed;
+  }
+  if (ringBytesUsed * 100ULL >= ringSize * (UInt64)kHyperVNetworkRxRingHighUsage) {
+    rxRingHighUsageCount++;
+  }
+}
+
+bool SimNetworkGuest::readMACAddress() {
+  UInt32 macSize = sizeof (ethAddress);
+  if (!queryRNDISOID(kHyperVNetworkRNDISOIDEthernetPermanentAddress, (void *)ethAddress, &macSize)) {
+    printf("guest: failed to get MAC address\n");
+    return false;
+  }
+  return true;
+}
+
+void SimNetworkGuest::readVLANId() {
+  UInt32 vlanIdValue = 0;
+  UInt32 vlanIdSize = sizeof (vlanIdValue);
+  if (!queryRNDISOID(kHyperVNetworkRNDISOIDGeneralVLANId, &vlanIdValue, &vlanIdSize) || vlanIdSize != sizeof (vlanIdValue)) {
+    return;
+  }
+  vlanId = vlanIdValue;
+}
+
+void SimNetworkGuest::updateLinkState(HyperVNetworkRNDISMessageIndicateStatus *indicateStatus) {
+  if (indicateStatus == NULL) {
+    HyperVNetworkRNDISLinkState linkState;
+    UInt32 linkStateSize = sizeof (linkState);
+    if (!queryRNDISOID(kHyperVNetworkRNDISOIDGeneralMediaConnectStatus, &linkState, &linkStateSize)) {
+      printf("guest: failed to get link state\n");
+      return;
+    }
+    isLinkUp = linkState == kHyperVNetworkRNDISLinkStateConnected;
+    return;
+  }
+
+  switch (indicateStatus->status) {
+    case kHyperVNetworkRNDISStatusMediaConnect:
+      isLinkUp = true;
+      break;
+
+    case kHyperVNetworkRNDISStatusMediaDisconnect:
+      isLinkUp = false;
+      break;
+
+    default:
+      break;
+  }
+}
+
+//
+// HyperVNetworkRNDIS.cpp
+//
+
+bool SimNetworkGuest::processRNDISPacket(UInt8 *data, UInt32 dataLength) {
+  HyperVNetworkRNDISMessage *rndisPkt = (HyperVNetworkRNDISMessage*)data;
+
+  SimNetworkRNDISRequest *reqCurr = rndisRequests;
+  SimNetworkRNDISRequest *reqPrev = NULL;
+
+  switch (rndisPkt->msgType) {
+    case kHyperVNetworkRNDISMessageTypeInitComplete:
+    case kHyperVNetworkRNDISMessageTypeQueryComplete:
+    case kHyperVNetworkRNDISMessageTypeSetComplete:
+    case kHyperVNetworkRNDISMessageTypeResetComplete:
+      while (reqCurr != NULL) {
+        if (reqCurr->message.initComplete.requestId == rndisPkt->initComplete.requestId) {
+          memcpy(&reqCurr->message, rndisPkt, dataLength);
+
+          {
+            std::lock_guard<std::mutex> guard(rndisLock);
+            if (reqPrev == NULL) {
+              rndisRequests = reqCurr->next;
+            } else {
+              reqPrev->next = reqCurr->next;
+            }
+          }
+
+          std::lock_guard<std::mutex> guard(sleepLock);
+          reqCurr->isSleeping = false;
+          sleepCondition.notify_all();
+          return true;
+        }
+
+        reqPrev = reqCurr;
+        reqCurr = reqCurr->next;
+      }
+      break;
+
+    case kHyperVNetworkRNDISMessageTypePacket:
+      if (isEnabled) {
+        processIncoming(data, dataLength);
+      }
+      break;
+
+    case kHyperVNetworkRNDISMessageTypeIndicate:
+      updateLinkState(&rndisPkt->indicateStatus);
+      break;
+
+    default:
+      break;
+  }
+
+  return true;
+}
+
+void SimNetworkGuest::processIncoming(UInt8 *data, UInt32 dataLength) {
+  HyperVNetworkRNDISMessage *rndisPkt = (HyperVNetworkRNDISMessage*)data;
+  UInt8 *pktData = data + 8 + rndisPkt->dataPacket.dataOffset;
+
+  //
+  // Ensure packet fits within the RNDIS message.
+  //
+  if ((UInt64)rndisPkt->dataPacket.dataOffset + rndisPkt->dataPacket.dataLength + 8 > dataLength) {
+    printf("guest: invalid RNDIS data packet of %u bytes at offset 0x%X\n", rndisPkt->dataPacket.dataLength, rndisPkt->dataPacket.dataOffset);
+    inputErrors++;
+    return;
+  }
+
+  //
+  // Packet allocation and input to the network stack are replaced by a heap copy.
+  //
+  UInt8 *newPacket = (UInt8*)malloc(rndisPkt->dataPacket.dataLength);
+  if (newPacket == NULL) {
+    inputErrors++;
+    return;
+  }
+  memcpy(newPacket, pktData, rndisPkt->dataPacket.dataLength);
+
+  UInt16 vlanTag;
+  if (getIncomingVLANTag(rndisPkt, dataLength, &vlanTag) && (vlanTag & kHyperVNetworkRNDISIEEE8021QVLANIdMask) != vlanId) {
+    inputErrors++;
+  }
+  free(newPacket);
+
+  inputPackets++;
+  inputBytes += rndisPkt->dataPacket.dataLength;
+  rxPacketCount++;
+}
+
+bool SimNetworkGuest::getIncomingVLANTag(HyperVNetworkRNDISMessage *rndisPkt, UInt32 dataLength, UInt16 *vlanTag) {
+  UInt32 ppiOffset = rndisPkt->dataPacket.perPacketInfoOffset;
+  UInt32 ppiLength = rndisPkt->dataPacket.perPacketInfoLength;
+  if (ppiLength == 0 || (UInt64)ppiOffset + ppiLength + 8 > dataLength) {
+    return false;
+  }
+
+  UInt8 *ppiData = (UInt8*)&rndisPkt->dataPacket + ppiOffset;
+  while (ppiLength >= sizeof (HyperVNetworkRNDISPerPacketInfo)) {
+    HyperVNetworkRNDISPerPacketInfo *ppi = (HyperVNetworkRNDISPerPacketInfo*)ppiData;
+    if (ppi->size < sizeof (HyperVNetworkRNDISPerPacketInfo) || ppi->size > ppiLength) {
+      return false;
+    }
+
+    if (ppi->type == kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q
+        && ppi->perPacketInfoOffset + sizeof (UInt32) <= ppi->size) {
+      UInt32 value = *(UInt32*)(ppiData + ppi->perPacketInfoOffset);
+      *vlanTag = (((value >> kHyperVNetworkRNDISIEEE8021QVLANIdShift) & kHyperVNetworkRNDISIEEE8021QVLANIdMask)
+                  | (((value >> kHyperVNetworkRNDISIEEE8021QCFIShift) & 0x1) << 12)
+                  | ((value & kHyperVNetworkRNDISIEEE8021QPriorityMask) << 13));
+      return true;
+    }
+
+    ppiData   += ppi->size;
+    ppiLength -= ppi->size;
+  }
+  return false;
+}
+
+UInt32 SimNetworkGuest::getNextSendIndex() {
+  for (UInt32 i = 0; i < sendIndexMapSize / sizeof (UInt64); i++) {
+    UInt64 value = sendIndexMap[i];
+    while (value != ~0ULL) {
+      UInt32 bit = __builtin_ctzll(~value);
+      UInt32 sendIndex = (i * 64) + bit;
+      if (sendIndex >= sendSectionCount) {
+        return kHyperVNetworkRNDISSendSectionIndexInvalid;
+      }
+
+      if (__sync_bool_compare_and_swap(&sendIndexMap[i], value, value | (1ULL << bit))) {
+        return sendIndex;
+      }
+      value = sendIndexMap[i];
+    }
+  }
+
+  return kHyperVNetworkRNDISSendSectionIndexInvalid;
+}
+
+void SimNetworkGuest::releaseSendIndex(UInt32 sendIndex) {
+  if (sendIndex >= sendSectionCount) {
+    return;
+  }
+
+  UInt64 value;
+  do {
+    value = sendIndexMap[sendIndex / 64];
+  } while (!__sync_bool_compare_and_swap(&sendIndexMap[sendIndex / 64], value, value & ~(1ULL << (sendIndex % 64))));
+
+  //
+  // Restart the output queue if it was stalled waiting for a free send section.
+  //
+  if (isSendStalled) {
+    std::lock_guard<std::mutex> guard(sleepLock);
+    isSendStalled = false;
+    sleepCondition.notify_all();
+  }
+}
+
+void SimNetworkGuest::waitSendStall() {
+  //
+  // Equivalent of the output queue waiting to be serviced again.
+  //
+  std::unique_lock<std::mutex> guard(sleepLock);
+  sleepCondition.wait_for(guard, std::chrono::milliseconds(100), [this] { return !isSendStalled && !isSendRingStalled; });
+}
+
+SimNetworkRNDISRequest *SimNetworkGuest::allocateRNDISRequest() {
+  UInt64 pfn;
+  SimNetworkRNDISRequest *rndisRequest = (SimNetworkRNDISRequest*)guestMemory->allocatePages(sizeof (SimNetworkRNDISRequest), &pfn);
+  if (rndisRequest == NULL) {
+    return NULL;
+  }
+
+  rndisRequest->isSleeping = false;
+  rndisRequest->messagePhysicalAddress = pfn << PAGE_SHIFT;
+  return rndisRequest;
+}
+
+void SimNetworkGuest::freeRNDISRequest(SimNetworkRNDISRequest *rndisRequest) {
+  guestMemory->freePages((UInt8*)rndisRequest);
+}
+
+UInt32 SimNetworkGuest::getNextRNDISTransId() {
+  std::lock_guard<std::mutex> guard(rndisLock);
+  return rndisTransId++;
+}
+
+bool SimNetworkGuest::sendRNDISRequest(SimNetworkRNDISRequest *rndisRequest) {
+  VMBusSinglePageBuffer pageBuffer;
+  pageBuffer.length = rndisRequest->message.msgLength;
+  pageBuffer.offset = 0;
+  pageBuffer.pfn    = rndisRequest->messagePhysicalAddress >> PAGE_SHIFT;
+
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacket;
+  netMsg.v1.sendRNDISPacket.channelType = kHyperVNetworkRNDISChannelTypeControl;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionIndex = -1;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionSize = 0;
+
+  rndisRequest->isSleeping = true;
+  rndisRequest->message.initRequest.requestId = getNextRNDISTransId();
+
+  {
+    std::lock_guard<std::mutex> guard(rndisLock);
+    rndisRequest->next = rndisRequests;
+    rndisRequests = rndisRequest;
+  }
+
+  if (!writeGPADirectSinglePagePacket(&netMsg, sizeof (netMsg), true, &pageBuffer, 1, &netMsg, sizeof (netMsg))) {
+    return false;
+  }
+
+  std::unique_lock<std::mutex> guard(sleepLock);
+  sleepCondition.wait(guard, [rndisRequest] { return !rndisRequest->isSleeping; });
+  return true;
+}
+
+void SimNetworkGuest::initSendSectionTemplates() {
+  for (UInt32 i = 0; i < sendSectionCount; i++) {
+    UInt8 *rndisBuffer = sendBuffer + (sendSectionSize * i);
+    HyperVNetworkRNDISMessage *rndisMsg = (HyperVNetworkRNDISMessage*)rndisBuffer;
+    memset(rndisBuffer, 0, sizeof (HyperVNetworkRNDISMessageDataPacket) + sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q) + 8);
+
+    rndisMsg->msgType = kHyperVNetworkRNDISMessageTypePacket;
+
+    HyperVNetworkRNDISPerPacketInfoIEEE8021Q *ppiVLAN =
+      (HyperVNetworkRNDISPerPacketInfoIEEE8021Q*)(rndisBuffer + 8 + sizeof (HyperVNetworkRNDISMessageDataPacket));
+    ppiVLAN->header.size                = sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q);
+    ppiVLAN->header.type                = kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q;
+    ppiVLAN->header.perPacketInfoOffset = sizeof (HyperVNetworkRNDISPerPacketInfo);
+  }
+}
+
+UInt32 SimNetworkGuest::sendRNDISDataPacket(const UInt8 *packet, UInt32 packetLength, bool hasVLANTag, UInt16 vlanTag) {
+  UInt32 ppiLength = hasVLANTag ? sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q) : 0;
+
+  //
+  // Packet must fit within a single send section.
+  //
+  if (packetLength + ppiLength + sizeof (HyperVNetworkRNDISMessageDataPacket) + 8 > sendSectionSize) {
+    return kSimOutputDropped;
+  }
+
+  if (!channel->isTxSpaceAvailable(sizeof (HyperVNetworkMessage))) {
+    isSendRingStalled = true;
+    channel->setTxPendingSendSize(sizeof (HyperVNetworkMessage));
+    if (!channel->isTxSpaceAvailable(sizeof (HyperVNetworkMessage))) {
+      sendStallCount++;
+      return kSimOutputStall;
+    }
+  }
+
+  UInt32 sendIndex = getNextSendIndex();
+  if (sendIndex == (UInt32)kHyperVNetworkRNDISSendSectionIndexInvalid) {
+    isSendStalled = true;
+    sendIndex = getNextSendIndex();
+    if (sendIndex == (UInt32)kHyperVNetworkRNDISSendSectionIndexInvalid) {
+      sendStallCount++;
+      return kSimOutputStall;
+    }
+  }
+
+  UInt8 *rndisBuffer = sendBuffer + (sendSectionSize * sendIndex);
+  HyperVNetworkRNDISMessage *rndisMsg = (HyperVNetworkRNDISMessage*)rndisBuffer;
+  rndisMsg->dataPacket.dataOffset = sizeof (HyperVNetworkRNDISMessageDataPacket) + ppiLength;
+  rndisMsg->dataPacket.dataLength = packetLength;
+  rndisMsg->msgLength = rndisMsg->dataPacket.dataOffset + 8 + rndisMsg->dataPacket.dataLength;
+
+  if (hasVLANTag) {
+    rndisMsg->dataPacket.perPacketInfoOffset = sizeof (HyperVNetworkRNDISMessageDataPacket);
+    rndisMsg->dataPacket.perPacketInfoLength = ppiLength;
+
+    HyperVNetworkRNDISPerPacketInfoIEEE8021Q *ppiVLAN =
+      (HyperVNetworkRNDISPerPacketInfoIEEE8021Q*)(rndisBuffer + 8 + sizeof (HyperVNetworkRNDISMessageDataPacket));
+    ppiVLAN->value = ((vlanTag & kHyperVNetworkRNDISIEEE8021QVLANIdMask) << kHyperVNetworkRNDISIEEE8021QVLANIdShift)
+                     | (((vlanTag >> 12) & 0x1) << kHyperVNetworkRNDISIEEE8021QCFIShift)
+                     | ((vlanTag >> 13) & kHyperVNetworkRNDISIEEE8021QPriorityMask);
+  } else {
+    rndisMsg->dataPacket.perPacketInfoOffset = 0;
+    rndisMsg->dataPacket.perPacketInfoLength = 0;
+  }
+
+  memcpy(rndisBuffer + rndisMsg->dataPacket.dataOffset + 8, packet, packetLength);
+
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacket;
+  netMsg.v1.sendRNDISPacket.channelType = kHyperVNetworkRNDISChannelTypeData;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionIndex = sendIndex;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionSize = rndisMsg->msgLength;
+
+  if (!channel->writeInbandPacket(&netMsg, sizeof (netMsg), sendIndex | kHyperVNetworkSendTransIdBits, true)) {
+    txDroppedCount++;
+    releaseSendIndex(sendIndex);
+    return kSimOutputDropped;
+  }
+
+  outputPackets++;
+  outputBytes += packetLength;
+  return kSimOutputSuccess;
+}
+
+bool SimNetworkGuest::initializeRNDIS() {
+  SimNetworkRNDISRequest *rndisRequest = allocateRNDISRequest();
+  if (rndisRequest == NULL) {
+    return false;
+  }
+  rndisRequest->message.msgType   = kHyperVNetworkRNDISMessageTypeInit;
+  rndisRequest->message.msgLength = sizeof (HyperVNetworkRNDISMessageInitializeRequest) + 8;
+
+  rndisRequest->message.initRequest.majorVersion    = kHyperVNetworkRNDISVersionMajor;
+  rndisRequest->message.initRequest.minorVersion    = kHyperVNetworkRNDISVersionMinor;
+  rndisRequest->message.initRequest.maxTransferSize = kHyperVNetworkRNDISMaxTransferSize;
+
+  bool result = sendRNDISRequest(rndisRequest);
+  if (result) {
+    result = rndisRequest->message.initComplete.status == kHyperVNetworkRNDISStatusSuccess;
+  } else {
+    printf("guest: failed to send RNDIS initialization request\n");
+  }
+
+  freeRNDISRequest(rndisRequest);
+  return result;
+}
+
+bool SimNetworkGuest::queryRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32 *valueSize) {
+  if (value == NULL || valueSize == NULL) {
+    return false;
+  }
+
+  SimNetworkRNDISRequest *rndisRequest = allocateRNDISRequest();
+  if (rndisRequest == NULL) {
+    return false;
+  }
+  rndisRequest->message.msgType   = kHyperVNetworkRNDISMessageTypeQuery;
+  rndisRequest->message.msgLength = sizeof (HyperVNetworkRNDISMessageQueryRequest) + 8;
+
+  rndisRequest->message.queryRequest.oid              = oid;
+  rndisRequest->message.queryRequest.infoBufferOffset = sizeof (HyperVNetworkRNDISMessageQueryRequest);
+  rndisRequest->message.queryRequest.infoBufferLength = 0;
+  rndisRequest->message.queryRequest.deviceVcHandle   = 0;
+
+  bool result = sendRNDISRequest(rndisRequest);
+  if (result) {
+    result = rndisRequest->message.queryComplete.status == kHyperVNetworkRNDISStatusSuccess;
+    if (result) {
+      UInt32 infoLength = rndisRequest->message.queryComplete.infoBufferLength;
+      if (infoLength > *valueSize) {
+        infoLength = *valueSize;
+      }
+      memcpy(value, (UInt8*)(&rndisRequest->message.queryComplete) + rndisRequest->message.queryComplete.infoBufferOffset, infoLength);
+      *valueSize = infoLength;
+    }
+  } else {
+    printf("guest: failed to send OID 0x%X query\n", oid);
+  }
+
+  freeRNDISRequest(rndisRequest);
+  return result;
+}
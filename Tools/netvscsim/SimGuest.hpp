@@ -0,0 +1,165 @@
+//
+//  SimGuest.hpp
+//  Hyper-V network host simulator
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Guest side of the simulator. Follows the HyperVNetwork setup, TX and RX paths function by function,
+// with IOKit and mbuf calls replaced by their userspace equivalents. Keep in sync with the driver.
+//
+
+#ifndef SimGuest_hpp
+#define SimGuest_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include "SimChannel.hpp"
+#include "Network/HyperVNetworkRegs.hpp"
+
+#define kHyperVNetworkSendTransIdBits 0xFA00000000000000
+
+typedef struct SimNetworkRNDISRequest {
+  HyperVNetworkRNDISMessage message;
+  UInt8                     messageOverflow[PAGE_SIZE];
+
+  SimNetworkRNDISRequest    *next;
+  bool                      isSleeping;
+  UInt64                    messagePhysicalAddress;
+} SimNetworkRNDISRequest;
+
+typedef struct SimNetworkTransaction {
+  SimNetworkTransaction     *next;
+  UInt64                    transactionId;
+  void                      *responseData;
+  UInt32                    responseDataLength;
+  bool                      isSleeping;
+} SimNetworkTransaction;
+
+class SimNetworkGuest {
+  SimVMBusChannel         *channel;
+  SimGuestMemory          *guestMemory;
+
+  HyperVNetworkProtocolVersion netVersion;
+  UInt8                   ethAddress[6];
+
+  //
+  // Stand-in for the IOLock sleeps and IOCommandGate used by the driver.
+  //
+  std::mutex              sleepLock;
+  std::condition_variable sleepCondition;
+  std::mutex              rndisLock;
+  UInt32                  rndisTransId = 0;
+  SimNetworkRNDISRequest  *rndisRequests = NULL;
+  SimNetworkTransaction   *transactions = NULL;
+  UInt64                  nextTransId = 1;
+
+  UInt32                  receiveBufferSize = 0;
+  UInt32                  receiveGpadlHandle = 0;
+  UInt8                   *receiveBuffer = NULL;
+  HyperVNetworkV1MessageReceiveBufferSection receiveSections[kHyperVNetworkReceiveBufferMaxSections];
+  UInt32                  receiveSectionCount = 0;
+  UInt32                  receiveSubAllocCount = 0;
+  UInt64                  *rxCompletionQueue = NULL;
+  UInt32                  rxCompletionQueueSize = 0;
+  UInt32                  rxCompletionQueueHead = 0;
+  UInt32                  rxCompletionQueueCount = 0;
+
+  UInt32                  sendBufferSize = 0;
+  UInt32                  sendGpadlHandle = 0;
+  UInt8                   *sendBuffer = NULL;
+  UInt32                  sendSectionSize = 0;
+  UInt32                  sendSectionCount = 0;
+  volatile UInt64         *sendIndexMap = NULL;
+  UInt32                  sendIndexMapSize = 0;
+
+  UInt32                  rxPacketCount = 0;
+
+  //
+  // VMBus device equivalents.
+  //
+  bool writeInbandPacket(void *buffer, UInt32 bufferLength, bool responseRequired,
+                         void *responseBuffer = NULL, UInt32 responseBufferLength = 0);
+  bool writeGPADirectSinglePagePacket(void *buffer, UInt32 bufferLength, bool responseRequired,
+                                      VMBusSinglePageBuffer pageBuffers[], UInt32 pageBufferCount,
+                                      void *responseBuffer = NULL, UInt32 responseBufferLength = 0);
+  bool writePacketAndWait(const void *header, UInt32 headerLength, void *buffer, UInt32 bufferLength, UInt64 transactionId,
+                          void *responseBuffer, UInt32 responseBufferLength);
+  bool getPendingTransaction(UInt64 transactionId, void **buffer, UInt32 *bufferLength);
+  void wakeTransaction(UInt64 transactionId);
+
+  //
+  // HyperVNetwork equivalents.
+  //
+  void handleRNDISRanges(VMBusPacketTransferPages *pktPages, UInt32 headerSize, UInt32 pktSize);
+  bool sendRNDISRangesCompletion(UInt64 transactionId);
+  void flushRNDISRangesCompletions();
+  bool negotiateProtocol(HyperVNetworkProtocolVersion protocolVersion);
+  bool sendNDISConfig();
+  bool initBuffers();
+  UInt32 getReceiveRangeSubAllocCount(UInt32 offset, UInt32 length);
+  void updateReceiveBufferStatistics();
+  bool readMACAddress();
+  void readVLANId();
+  void updateLinkState(HyperVNetworkRNDISMessageIndicateStatus *indicateStatus);
+
+  bool processRNDISPacket(UInt8 *data, UInt32 dataLength);
+  void processIncoming(UInt8 *data, UInt32 dataLength);
+  bool getIncomingVLANTag(HyperVNetworkRNDISMessage *rndisPkt, UInt32 dataLength, UInt16 *vlanTag);
+  UInt32 getNextSendIndex();
+  void releaseSendIndex(UInt32 sendIndex);
+  SimNetworkRNDISRequest *allocateRNDISRequest();
+  void freeRNDISRequest(SimNetworkRNDISRequest *rndisRequest);
+  UInt32 getNextRNDISTransId();
+  bool sendRNDISRequest(SimNetworkRNDISRequest *rndisRequest);
+  void initSendSectionTemplates();
+  bool initializeRNDIS();
+  bool queryRNDISOID(HyperVNetworkRNDISOID oid, void *value, UInt32 *valueSize);
+
+public:
+  std::atomic<bool>       isEnabled { false };
+  std::atomic<bool>       isSendStalled { false };
+  std::atomic<bool>       isSendRingStalled { false };
+  bool                    isLinkUp = false;
+
+  //
+  // Statistics, equivalent to IONetworkStats and the driver's published properties.
+  //
+  std::atomic<UInt64>     outputPackets { 0 };
+  std::atomic<UInt64>     outputBytes { 0 };
+  std::atomic<UInt64>     outputErrors { 0 };
+  std::atomic<UInt64>     inputPackets { 0 };
+  std::atomic<UInt64>     inputBytes { 0 };
+  std::atomic<UInt64>     inputErrors { 0 };
+  std::atomic<UInt64>     sendStallCount { 0 };
+  std::atomic<UInt64>     txDroppedCount { 0 };
+  UInt64                  rxCompletionQueuedCount = 0;
+  UInt32                  rxRingBytesUsedPeak = 0;
+  UInt64                  rxRingHighUsageCount = 0;
+  UInt32                  vlanId = 0;
+
+  SimNetworkGuest(SimVMBusChannel *channel, SimGuestMemory *guestMemory);
+  ~SimNetworkGuest();
+
+  bool connectNetwork();
+  void handleInterrupt();
+  void processPackets(UInt32 maxCount);
+  UInt32 sendRNDISDataPacket(const UInt8 *packet, UInt32 packetLength, bool hasVLANTag, UInt16 vlanTag);
+  void waitSendStall();
+
+  HyperVNetworkProtocolVersion getProtocolVersion() { return netVersion; }
+  UInt32 getSendSectionSize() { return sendSectionSize; }
+  UInt32 getSendSectionCount() { return sendSectionCount; }
+  UInt32 getReceiveSubAllocCount() { return receiveSubAllocCount; }
+  UInt32 getReceiveBufferSize() { return receiveBufferSize; }
+};
+
+//
+// Output results, equivalent to the IOOutputQueue return codes used by the driver.
+//
+#define kSimOutputSuccess   0
+#define kSimOutputStall     1
+#define kSimOutputDropped   2
+
+#endif
@@ -0,0 +1,537 @@
+//
+//  SimHost.cpp
+//  Hyper-V network host simulator
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+
+#include "SimHost.hpp"
+
+#define kSimHostMaxMdlChainLength     0x34
+#define kSimHostRNDISMaxPackets       8
+#define kSimHostRNDISAlignmentShift   3
+#define kSimHostRNDISStatusNotSupported 0xC00000BB
+#define kSimHostLinkSpeed             100000000 // 10 Gbps in 100 bps units.
+#define kSimHostMTU                   1500
+
+static const UInt8 hostMACAddress[6]  = { 0x00, 0x15, 0x5D, 0x00, 0x00, 0x01 };
+static const UInt8 guestMACAddress[6] = { 0x00, 0x15, 0x5D, 0x00, 0x00, 0x02 };
+
+SimNetworkHost::SimNetworkHost(SimVMBusChannel *channel, SimGuestMemory *guestMemory, const SimNetworkHostConfig &config) {
+  this->channel     = channel;
+  this->guestMemory = guestMemory;
+  this->config      = config;
+
+  //
+  // Frames sent to the guest are broadcast IPv4 frames with a counting payload.
+  //
+  receiveFrame.resize(config.receiveFrameSize);
+  memcpy(&receiveFrame[0], guestMACAddress, sizeof (guestMACAddress));
+  memcpy(&receiveFrame[6], hostMACAddress, sizeof (hostMACAddress));
+  receiveFrame[12] = 0x08;
+  receiveFrame[13] = 0x00;
+  for (UInt32 i = 14; i < config.receiveFrameSize; i++) {
+    receiveFrame[i] = (UInt8)i;
+  }
+}
+
+bool SimNetworkHost::writeToGuest(const void *header, UInt32 headerLength, const void *buffer, UInt32 bufferLength, bool wait) {
+  bool written = channel->writeRawPacket(header, headerLength, buffer, bufferLength);
+  if (!written) {
+    rxRingFullCount++;
+
+    //
+    // Guest signals once it has read enough for this packet to fit.
+    // Space is checked again after setting the pending size, as it may have been freed before the guest saw it.
+    //
+    channel->setPendingSendSize(HV_PACKETALIGN(headerLength + bufferLength) + sizeof (UInt64));
+    isPendingSendSizeSet = true;
+    written = channel->writeRawPacket(header, headerLength, buffer, bufferLength);
+    while (!written && wait && isRunning) {
+      channel->event.wait(100);
+      written = channel->writeRawPacket(header, headerLength, buffer, bufferLength);
+    }
+  }
+
+  if (written && isPendingSendSizeSet) {
+    channel->setPendingSendSize(0);
+    isPendingSendSizeSet = false;
+  }
+  return written;
+}
+
+bool SimNetworkHost::writeCompletionToGuest(const void *buffer, UInt32 bufferLength, UInt64 transactionId) {
+  VMBusPacketHeader pktHeader;
+  pktHeader.type          = kVMBusPacketTypeCompletion;
+  pktHeader.flags         = 0;
+  pktHeader.transactionId = transactionId;
+  pktHeader.headerLength  = sizeof (pktHeader) >> kVMBusPacketSizeShift;
+  pktHeader.totalLength   = HV_PACKETALIGN(sizeof (pktHeader) + bufferLength) >> kVMBusPacketSizeShift;
+  return writeToGuest(&pktHeader, sizeof (pktHeader), buffer, bufferLength, true);
+}
+
+bool SimNetworkHost::handleInbandPacket(VMBusPacketHeader *pktHeader, UInt8 *data, UInt32 dataLength) {
+  HyperVNetworkMessage *netMsg = (HyperVNetworkMessage*)data;
+  if (dataLength < sizeof (netMsg->messageType) + sizeof (netMsg->init)) {
+    printf("host: inband packet of %u bytes is too small\n", dataLength);
+    return false;
+  }
+
+  HyperVNetworkMessage response;
+  memset(&response, 0, sizeof (response));
+
+  switch (netMsg->messageType) {
+    case kHyperVNetworkMessageTypeInit: {
+      //
+      // Accept any version from the list known to Hyper-V.
+      //
+      static const HyperVNetworkProtocolVersion protocolVersions[] = {
+        kHyperVNetworkProtocolVersion61,
+        kHyperVNetworkProtocolVersion6,
+        kHyperVNetworkProtocolVersion5,
+        kHyperVNetworkProtocolVersion4,
+        kHyperVNetworkProtocolVersion2,
+        kHyperVNetworkProtocolVersion1
+      };
+
+      response.messageType = kHyperVNetworkMessageTypeInitComplete;
+      response.init.initComplete.status = kHyperVNetworkMessageStatusProtocolUnsupported;
+      for (UInt32 i = 0; i < ARRAY_SIZE(protocolVersions); i++) {
+        if (protocolVersions[i] >= netMsg->init.initVersion.minProtocolVersion
+            && protocolVersions[i] <= netMsg->init.initVersion.maxProtocolVersion) {
+          netVersion = protocolVersions[i];
+          response.init.initComplete.negotiatedProtocolVersion = netVersion;
+          response.init.initComplete.maxMdlChainLength         = kSimHostMaxMdlChainLength;
+          response.init.initComplete.status                    = kHyperVNetworkMessageStatusSuccess;
+          break;
+        }
+      }
+      return writeCompletionToGuest(&response, sizeof (response), pktHeader->transactionId);
+    }
+
+    case kHyperVNetworkMessageTypeV1SendNDISVersion:
+    case kHyperVNetworkMessageTypeV2SendNDISConfig:
+      return true;
+
+    case kHyperVNetworkMessageTypeV1SendReceiveBuffer: {
+      //
+      // Receive buffer is handed out as a single section of fixed size suballocations.
+      //
+      HyperVNetworkV1MessageSendReceiveBufferComplete *receiveComplete = &response.v1.sendReceiveBufferComplete;
+      response.messageType = kHyperVNetworkMessageTypeV1SendReceiveBufferComplete;
+
+      receiveBuffer = guestMemory->getGpadlBuffer(netMsg->v1.sendReceiveBuffer.gpadlHandle, &receiveBufferSize);
+      if (receiveBuffer == NULL || netMsg->v1.sendReceiveBuffer.id != kHyperVNetworkReceiveBufferID
+          || receiveBufferSize < config.receiveSubAllocSize) {
+        receiveComplete->status = kHyperVNetworkMessageStatusFailure;
+        receiveBuffer = NULL;
+      } else {
+        receiveSubAllocCount = receiveBufferSize / config.receiveSubAllocSize;
+        receiveComplete->status                   = kHyperVNetworkMessageStatusSuccess;
+        receiveComplete->numSections              = 1;
+        receiveComplete->sections[0].offset       = 0;
+        receiveComplete->sections[0].subAllocSize = config.receiveSubAllocSize;
+        receiveComplete->sections[0].numSubAllocs = receiveSubAllocCount;
+        receiveComplete->sections[0].endOffset    = receiveSubAllocCount * config.receiveSubAllocSize;
+
+        freeSubAllocs.clear();
+        for (UInt32 i = receiveSubAllocCount; i > 0; i--) {
+          freeSubAllocs.push_back(i - 1);
+        }
+      }
+      return writeCompletionToGuest(&response, sizeof (response), pktHeader->transactionId);
+    }
+
+    case kHyperVNetworkMessageTypeV1SendSendBuffer:
+      response.messageType = kHyperVNetworkMessageTypeV1SendSendBufferComplete;
+
+      sendBuffer = guestMemory->getGpadlBuffer(netMsg->v1.sendSendBuffer.gpadlHandle, &sendBufferSize);
+      if (sendBuffer == NULL || sendBufferSize < config.sendSectionSize) {
+        response.v1.sendSendBufferComplete.status = kHyperVNetworkMessageStatusFailure;
+        sendBuffer = NULL;
+      } else {
+        sendSectionCount = sendBufferSize / config.sendSectionSize;
+        response.v1.sendSendBufferComplete.status      = kHyperVNetworkMessageStatusSuccess;
+        response.v1.sendSendBufferComplete.sectionSize = config.sendSectionSize;
+      }
+      return writeCompletionToGuest(&response, sizeof (response), pktHeader->transactionId);
+
+    case kHyperVNetworkMessageTypeV1SendRNDISPacket: {
+      //
+      // Data packets are read from the send buffer section, the section is released by the completion.
+      //
+      UInt32 sendIndex = netMsg->v1.sendRNDISPacket.sendBufferSectionIndex;
+      UInt32 sendSize  = netMsg->v1.sendRNDISPacket.sendBufferSectionSize;
+      bool   isValid   = sendBuffer != NULL && sendIndex < sendSectionCount && sendSize <= config.sendSectionSize
+                         && handleRNDISDataPacket((HyperVNetworkRNDISMessage*)(sendBuffer + (sendIndex * config.sendSectionSize)), sendSize);
+      if (!isValid) {
+        txErrors++;
+      }
+
+      response.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacketComplete;
+      response.v1.sendRNDISPacketComplete.status = isValid ? kHyperVNetworkMessageStatusSuccess : kHyperVNetworkMessageStatusInvalidRNDISPacket;
+      return writeCompletionToGuest(&response, sizeof (response), pktHeader->transactionId);
+    }
+
+    default:
+      printf("host: unhandled message type %u\n", netMsg->messageType);
+      return false;
+  }
+}
+
+bool SimNetworkHost::handleGPADirectPacket(VMBusPacketSinglePageBuffer *pktPages, UInt8 *data, UInt32 dataLength) {
+  HyperVNetworkMessage *netMsg = (HyperVNetworkMessage*)data;
+  if (dataLength < sizeof (netMsg->messageType) + sizeof (netMsg->v1.sendRNDISPacket)
+      || netMsg->messageType != kHyperVNetworkMessageTypeV1SendRNDISPacket || pktPages->rangeCount != 1) {
+    printf("host: invalid page buffer packet\n");
+    return false;
+  }
+
+  //
+  // RNDIS control messages are passed by physical address and must be within a single page.
+  //
+  UInt8 *page = guestMemory->getPage(pktPages->ranges[0].pfn);
+  if (page == NULL || (UInt64)pktPages->ranges[0].offset + pktPages->ranges[0].length > PAGE_SIZE
+      || pktPages->ranges[0].length < 8 + sizeof (UInt32)) {
+    printf("host: invalid RNDIS control message page\n");
+    return false;
+  }
+
+  HyperVNetworkMessage response;
+  memset(&response, 0, sizeof (response));
+  response.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacketComplete;
+  response.v1.sendRNDISPacketComplete.status = kHyperVNetworkMessageStatusSuccess;
+  if (!writeCompletionToGuest(&response, sizeof (response), pktPages->header.transactionId)) {
+    return false;
+  }
+
+  handleRNDISControlMessage((HyperVNetworkRNDISMessage*)(page + pktPages->ranges[0].offset), pktPages->ranges[0].length);
+  return true;
+}
+
+void SimNetworkHost::handleCompletion(VMBusPacketHeader *pktHeader) {
+  //
+  // Guest has consumed a receive indication, its suballocations can be reused.
+  //
+  auto pending = pendingReceives.find(pktHeader->transactionId);
+  if (pending == pendingReceives.end()) {
+    printf("host: completion for unknown transaction %llu\n", (unsigned long long)pktHeader->transactionId);
+    return;
+  }
+  freeSubAllocs.insert(freeSubAllocs.end(), pending->second.begin(), pending->second.end());
+  pendingReceives.erase(pending);
+}
+
+bool SimNetworkHost::handleRNDISDataPacket(HyperVNetworkRNDISMessage *rndisMsg, UInt32 length) {
+  //
+  // Validate the packet the same way Hyper-V would before it is forwarded to the switch.
+  //
+  if (length < 8 + sizeof (HyperVNetworkRNDISMessageDataPacket) || rndisMsg->msgType != kHyperVNetworkRNDISMessageTypePacket
+      || rndisMsg->msgLength > length
+      || (UInt64)rndisMsg->dataPacket.dataOffset + rndisMsg->dataPacket.dataLength + 8 > rndisMsg->msgLength) {
+    return false;
+  }
+
+  if (rndisMsg->dataPacket.perPacketInfoLength != 0) {
+    if ((UInt64)rndisMsg->dataPacket.perPacketInfoOffset + rndisMsg->dataPacket.perPacketInfoLength + 8 > rndisMsg->msgLength) {
+      return false;
+    }
+
+    HyperVNetworkRNDISPerPacketInfo *ppi =
+      (HyperVNetworkRNDISPerPacketInfo*)((UInt8*)&rndisMsg->dataPacket + rndisMsg->dataPacket.perPacketInfoOffset);
+    if (ppi->size > rndisMsg->dataPacket.perPacketInfoLength || ppi->type != kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q) {
+      return false;
+    }
+  }
+
+  txPackets++;
+  txBytes += rndisMsg->dataPacket.dataLength;
+  return true;
+}
+
+void SimNetworkHost::handleRNDISControlMessage(HyperVNetworkRNDISMessage *rndisMsg, UInt32 length) {
+  UInt8 responseBuffer[sizeof (HyperVNetworkRNDISMessage) + 64];
+  HyperVNetworkRNDISMessage *response = (HyperVNetworkRNDISMessage*)responseBuffer;
+  memset(responseBuffer, 0, sizeof (responseBuffer));
+
+  switch (rndisMsg->msgType) {
+    case kHyperVNetworkRNDISMessageTypeInit:
+      response->msgType   = kHyperVNetworkRNDISMessageTypeInitComplete;
+      response->msgLength = 8 + sizeof (response->initComplete);
+      response->initComplete.requestId             = rndisMsg->initRequest.requestId;
+      response->initComplete.status                = kHyperVNetworkRNDISStatusSuccess;
+      response->initComplete.majorVersion          = kHyperVNetworkRNDISVersionMajor;
+      response->initComplete.minorVersion          = kHyperVNetworkRNDISVersionMinor;
+      response->initComplete.maxPacketsPerMessage  = kSimHostRNDISMaxPackets;
+      response->initComplete.maxTransferSize       = config.receiveSubAllocSize;
+      response->initComplete.packetAlignmentFactor = kSimHostRNDISAlignmentShift;
+      break;
+
+    case kHyperVNetworkRNDISMessageTypeQuery: {
+      //
+      // Information buffer directly follows the query completion.
+      //
+      UInt8  *info      = (UInt8*)&response->queryComplete + sizeof (response->queryComplete);
+      UInt32 infoLength = 0;
+      UInt32 value      = 0;
+
+      response->msgType = kHyperVNetworkRNDISMessageTypeQueryComplete;
+      response->queryComplete.requestId        = rndisMsg->queryRequest.requestId;
+      response->queryComplete.status           = kHyperVNetworkRNDISStatusSuccess;
+      response->queryComplete.infoBufferOffset = sizeof (response->queryComplete);
+
+      switch (rndisMsg->queryRequest.oid) {
+        case kHyperVNetworkRNDISOIDEthernetPermanentAddress:
+        case kHyperVNetworkRNDISOIDEthernetCurrentAddress:
+          memcpy(info, guestMACAddress, sizeof (guestMACAddress));
+          infoLength = sizeof (guestMACAddress);
+          break;
+
+        case kHyperVNetworkRNDISOIDGeneralMediaConnectStatus:
+          value = kHyperVNetworkRNDISLinkStateConnected;
+          break;
+
+        case kHyperVNetworkRNDISOIDGeneralMaximumFrameSize:
+          value = kSimHostMTU;
+          break;
+
+        case kHyperVNetworkRNDISOIDGeneralLinkSpeed:
+          value = kSimHostLinkSpeed;
+          break;
+
+        case kHyperVNetworkRNDISOIDGeneralVLANId:
+          if (config.vlanId != 0) {
+            value = config.vlanId;
+            break;
+          }
+          // Fall through.
+
+        default:
+          response->queryComplete.status = (HyperVNetworkRNDISStatus)kSimHostRNDISStatusNotSupported;
+          response->queryComplete.infoBufferOffset = 0;
+          break;
+      }
+
+      if (infoLength == 0 && response->queryComplete.status == kHyperVNetworkRNDISStatusSuccess) {
+        memcpy(info, &value, sizeof (value));
+        infoLength = sizeof (value);
+      }
+      response->queryComplete.infoBufferLength = infoLength;
+      response->msgLength = 8 + sizeof (response->queryComplete) + infoLength;
+      break;
+    }
+
+    case kHyperVNetworkRNDISMessageTypeSet:
+      //
+      // Settings such as the packet filter are accepted but have no effect on the simulated switch.
+      //
+      response->msgType   = kHyperVNetworkRNDISMessageTypeSetComplete;
+      response->msgLength = 8 + sizeof (response->setComplete);
+      response->setComplete.requestId = rndisMsg->setRequest.requestId;
+      response->setComplete.status    = kHyperVNetworkRNDISStatusSuccess;
+      break;
+
+    case kHyperVNetworkRNDISMessageTypeReset:
+      response->msgType   = kHyperVNetworkRNDISMessageTypeResetComplete;
+      response->msgLength = 8 + sizeof (response->resetComplete);
+      response->resetComplete.status = kHyperVNetworkRNDISStatusSuccess;
+      break;
+
+    case kHyperVNetworkRNDISMessageTypeKeepalive:
+      response->msgType   = kHyperVNetworkRNDISMessageTypeKeepaliveComplete;
+      response->msgLength = 8 + sizeof (response->keepaliveComplete);
+      response->keepaliveComplete.requestId = rndisMsg->keepaliveRequest.requestId;
+      response->keepaliveComplete.status    = kHyperVNetworkRNDISStatusSuccess;
+      break;
+
+    case kHyperVNetworkRNDISMessageTypeHalt:
+      return;
+
+    default:
+      printf("host: unhandled RNDIS message type 0x%X of %u bytes\n", rndisMsg->msgType, length);
+      return;
+  }
+
+  //
+  // Responses are indicated through the receive buffer like data packets.
+  //
+  pendingControlMessages.push_back(std::vector<UInt8>(responseBuffer, responseBuffer + response->msgLength));
+}
+
+bool SimNetworkHost::indicateReceives(const UInt32 *subAllocs, const UInt32 *lengths, UInt32 count,
+                                      HyperVNetworkRNDISChannelType channelType) {
+  //
+  // Transfer page packet header lists each range, followed by the network message.
+  //
+  UInt8 pktBuffer[sizeof (VMBusPacketTransferPages) + (sizeof (VMBusTransferPageRange) * (kSimHostMaxReceiveBatch - 1))];
+  VMBusPacketTransferPages *pktPages = (VMBusPacketTransferPages*)pktBuffer;
+  UInt32 pktHeaderLength = sizeof (VMBusPacketTransferPages) + (sizeof (VMBusTransferPageRange) * (count - 1));
+
+  HyperVNetworkMessage netMsg;
+  memset(&netMsg, 0, sizeof (netMsg));
+  netMsg.messageType = kHyperVNetworkMessageTypeV1SendRNDISPacket;
+  netMsg.v1.sendRNDISPacket.channelType            = channelType;
+  netMsg.v1.sendRNDISPacket.sendBufferSectionIndex = kHyperVNetworkRNDISSendSectionIndexInvalid;
+
+  UInt64 transactionId = nextTransId++;
+  pktPages->header.type          = kVMBusPacketTypeDataUsingTransferPages;
+  pktPages->header.flags         = kVMBusPacketResponseRequired;
+  pktPages->header.transactionId = transactionId;
+  pktPages->header.headerLength  = pktHeaderLength >> kVMBusPacketSizeShift;
+  pktPages->header.totalLength   = HV_PACKETALIGN(pktHeaderLength + sizeof (netMsg)) >> kVMBusPacketSizeShift;
+  pktPages->transferPagesetId    = kHyperVNetworkReceiveBufferID;
+  pktPages->senderOwnsSets       = 0;
+  pktPages->reserved             = 0;
+  pktPages->rangeCount           = count;
+  for (UInt32 i = 0; i < count; i++) {
+    pktPages->ranges[i].offset = subAllocs[i] * config.receiveSubAllocSize;
+    pktPages->ranges[i].count  = lengths[i];
+  }
+
+  if (!writeToGuest(pktBuffer, pktHeaderLength, &netMsg, sizeof (netMsg), channelType == kHyperVNetworkRNDISChannelTypeControl)) {
+    return false;
+  }
+  pendingReceives[transactionId] = std::vector<UInt32>(subAllocs, subAllocs + count);
+  return true;
+}
+
+bool SimNetworkHost::indicatePendingControlMessages() {
+  bool indicated = false;
+
+  while (!pendingControlMessages.empty()) {
+    std::vector<UInt8> &message = pendingControlMessages.front();
+    if (freeSubAllocs.empty() || message.size() > config.receiveSubAllocSize) {
+      break;
+    }
+
+    UInt32 subAlloc = freeSubAllocs.back();
+    UInt32 length   = (UInt32)message.size();
+    memcpy(receiveBuffer + (subAlloc * config.receiveSubAllocSize), message.data(), length);
+    if (!indicateReceives(&subAlloc, &length, 1, kHyperVNetworkRNDISChannelTypeControl)) {
+      break;
+    }
+    freeSubAllocs.pop_back();
+    pendingControlMessages.erase(pendingControlMessages.begin());
+    indicated = true;
+  }
+  return indicated;
+}
+
+bool SimNetworkHost::generateReceives() {
+  if (receiveBuffer == NULL) {
+    return false;
+  }
+
+  UInt32 count = config.receiveBatchSize;
+  if (count > freeSubAllocs.size()) {
+    count = (UInt32)freeSubAllocs.size();
+  }
+  if (count == 0) {
+    rxNoSubAllocCount++;
+    return false;
+  }
+
+  //
+  // Each frame is copied into its own suballocation behind an RNDIS data packet header,
+  // with 802.1Q per-packet info when a VLAN is configured.
+  //
+  UInt32 ppiLength  = config.vlanId != 0 ? sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q) : 0;
+  UInt32 msgLength  = 8 + sizeof (HyperVNetworkRNDISMessageDataPacket) + ppiLength + config.receiveFrameSize;
+  UInt32 subAllocs[kSimHostMaxReceiveBatch];
+  UInt32 lengths[kSimHostMaxReceiveBatch];
+
+  for (UInt32 i = 0; i < count; i++) {
+    subAllocs[i] = freeSubAllocs[freeSubAllocs.size() - 1 - i];
+    lengths[i]   = msgLength;
+
+    UInt8 *rndisBuffer = receiveBuffer + (subAllocs[i] * config.receiveSubAllocSize);
+    HyperVNetworkRNDISMessage *rndisMsg = (HyperVNetworkRNDISMessage*)rndisBuffer;
+    memset(rndisBuffer, 0, 8 + sizeof (HyperVNetworkRNDISMessageDataPacket));
+    rndisMsg->msgType                = kHyperVNetworkRNDISMessageTypePacket;
+    rndisMsg->msgLength              = msgLength;
+    rndisMsg->dataPacket.dataOffset  = sizeof (HyperVNetworkRNDISMessageDataPacket) + ppiLength;
+    rndisMsg->dataPacket.dataLength  = config.receiveFrameSize;
+
+    if (ppiLength != 0) {
+      rndisMsg->dataPacket.perPacketInfoOffset = sizeof (HyperVNetworkRNDISMessageDataPacket);
+      rndisMsg->dataPacket.perPacketInfoLength = ppiLength;
+
+      HyperVNetworkRNDISPerPacketInfoIEEE8021Q *ppiVLAN =
+        (HyperVNetworkRNDISPerPacketInfoIEEE8021Q*)(rndisBuffer + 8 + sizeof (HyperVNetworkRNDISMessageDataPacket));
+      ppiVLAN->header.size                = sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q);
+      ppiVLAN->header.type                = kHyperVNetworkRNDISPerPacketInfoTypeIEEE8021Q;
+      ppiVLAN->header.perPacketInfoOffset = sizeof (HyperVNetworkRNDISPerPacketInfo);
+      ppiVLAN->value                      = (config.vlanId & kHyperVNetworkRNDISIEEE8021QVLANIdMask) << kHyperVNetworkRNDISIEEE8021QVLANIdShift;
+    }
+    memcpy(rndisBuffer + 8 + rndisMsg->dataPacket.dataOffset, receiveFrame.data(), config.receiveFrameSize);
+  }
+
+  if (!indicateReceives(subAllocs, lengths, count, kHyperVNetworkRNDISChannelTypeData)) {
+    return false;
+  }
+  freeSubAllocs.resize(freeSubAllocs.size() - count);
+
+  rxPackets += count;
+  rxBytes   += (UInt64)count * config.receiveFrameSize;
+  return true;
+}
+
+void SimNetworkHost::run() {
+  std::vector<UInt8> pktBuffer(PAGE_SIZE);
+
+  while (isRunning) {
+    bool didWork = false;
+
+    //
+    // Handle everything the guest has sent so far.
+    //
+    VMBusPacketType type;
+    UInt32 headerLength;
+    UInt32 totalLength;
+    while (isRunning && channel->nextPacketAvailable(&type, &headerLength, &totalLength)) {
+      if (totalLength > pktBuffer.size()) {
+        pktBuffer.resize(totalLength);
+      }
+      channel->readRawPacket(pktBuffer.data(), totalLength);
+      didWork = true;
+
+      VMBusPacketHeader *pktHeader = (VMBusPacketHeader*)pktBuffer.data();
+      if (headerLength < sizeof (VMBusPacketHeader) || headerLength > totalLength) {
+        printf("host: invalid packet header length %u of %u\n", headerLength, totalLength);
+        continue;
+      }
+
+      switch (type) {
+        case kVMBusPacketTypeDataInband:
+          handleInbandPacket(pktHeader, pktBuffer.data() + headerLength, totalLength - headerLength);
+          break;
+
+        case kVMBusPacketTypeDataUsingGPADirect:
+          handleGPADirectPacket((VMBusPacketSinglePageBuffer*)pktHeader, pktBuffer.data() + headerLength, totalLength - headerLength);
+          break;
+
+        case kVMBusPacketTypeCompletion:
+          handleCompletion(pktHeader);
+          break;
+
+        default:
+          printf("host: unhandled packet type %u\n", type);
+          break;
+      }
+    }
+
+    if (indicatePendingControlMessages()) {
+      didWork = true;
+    }
+    if (isGeneratingReceives && pendingControlMessages.empty() && generateReceives()) {
+      didWork = true;
+    }
+
+    //
+    // Nothing more can be done until the guest sends something or frees ring space.
+    //
+    if (!didWork) {
+      channel->event.wait(100);
+    }
+  }
+}
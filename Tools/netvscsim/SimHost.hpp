@@ -0,0 +1,99 @@
+//
+//  SimHost.hpp
+//  Hyper-V network host simulator
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Userspace stand-in for the Hyper-V network VSP. Speaks NVSP initialization, receive and send buffer
+// setup, RNDIS control messages, and data packets in both directions.
+//
+
+#ifndef SimHost_hpp
+#define SimHost_hpp
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include "SimChannel.hpp"
+#include "Network/HyperVNetworkRegs.hpp"
+
+#define kSimHostMaxReceiveBatch   64
+
+typedef struct {
+  //
+  // Send section size offered to the guest, and receive buffer suballocation size.
+  //
+  UInt32  sendSectionSize;
+  UInt32  receiveSubAllocSize;
+  //
+  // Frames generated towards the guest, and maximum frames per transfer page packet.
+  //
+  UInt32  receiveFrameSize;
+  UInt32  receiveBatchSize;
+  UInt16  vlanId;
+} SimNetworkHostConfig;
+
+class SimNetworkHost {
+  SimVMBusChannel       *channel;
+  SimGuestMemory        *guestMemory;
+  SimNetworkHostConfig  config;
+
+  HyperVNetworkProtocolVersion netVersion = kHyperVNetworkProtocolVersion1;
+
+  UInt8                 *receiveBuffer = NULL;
+  UInt32                receiveBufferSize = 0;
+  UInt32                receiveSubAllocCount = 0;
+  UInt8                 *sendBuffer = NULL;
+  UInt32                sendBufferSize = 0;
+  UInt32                sendSectionCount = 0;
+
+  //
+  // Free receive buffer suballocations, and suballocations held by each transfer page packet until completed.
+  //
+  std::vector<UInt32>                         freeSubAllocs;
+  std::vector<UInt8>                          receiveFrame;
+  std::map<UInt64, std::vector<UInt32>>       pendingReceives;
+  UInt64                                      nextTransId = 1;
+
+  //
+  // Control messages waiting for ring space.
+  //
+  std::vector<std::vector<UInt8>>             pendingControlMessages;
+  bool                                        isPendingSendSizeSet = false;
+
+  bool writeToGuest(const void *header, UInt32 headerLength, const void *buffer, UInt32 bufferLength, bool wait);
+  bool writeCompletionToGuest(const void *buffer, UInt32 bufferLength, UInt64 transactionId);
+
+  bool handleInbandPacket(VMBusPacketHeader *pktHeader, UInt8 *data, UInt32 dataLength);
+  bool handleGPADirectPacket(VMBusPacketSinglePageBuffer *pktPages, UInt8 *data, UInt32 dataLength);
+  void handleCompletion(VMBusPacketHeader *pktHeader);
+
+  bool handleRNDISDataPacket(HyperVNetworkRNDISMessage *rndisMsg, UInt32 length);
+  void handleRNDISControlMessage(HyperVNetworkRNDISMessage *rndisMsg, UInt32 length);
+
+  bool indicateReceives(const UInt32 *subAllocs, const UInt32 *lengths, UInt32 count, HyperVNetworkRNDISChannelType channelType);
+  bool indicatePendingControlMessages();
+  bool generateReceives();
+
+public:
+  std::atomic<bool>     isRunning { true };
+  std::atomic<bool>     isGeneratingReceives { false };
+
+  //
+  // Statistics, only updated by the host thread.
+  //
+  UInt64                txPackets = 0;
+  UInt64                txBytes = 0;
+  UInt64                txErrors = 0;
+  UInt64                rxPackets = 0;
+  UInt64                rxBytes = 0;
+  UInt64                rxRingFullCount = 0;
+  UInt64                rxNoSubAllocCount = 0;
+
+  SimNetworkHost(SimVMBusChannel *channel, SimGuestMemory *guestMemory, const SimNetworkHostConfig &config);
+
+  void run();
+};
+
+#endif
@@ -0,0 +1,196 @@
+//
+//  netvscsim.cpp
+//  Hyper-V network host simulator
+//
+//  Copyright © 2021 Goldfish64. All rights reserved.
+//
+// Runs the network driver's TX and RX paths against a simulated Hyper-V host on Linux, and reports
+// packet and bit rates. Used for tuning send section sizes and batching without a Windows host.
+//
+// Build from this directory:
+//   g++ -std=c++17 -O2 -pthread -IInclude -I../../MacHyperVSupport *.cpp -o netvscsim
+//
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+
+#include "SimGuest.hpp"
+#include "SimHost.hpp"
+
+#define kDefaultDurationSeconds     5
+#define kDefaultFrameSize           1514
+#define kDefaultSendSectionSize     6144
+#define kDefaultReceiveSubAllocSize 1728
+#define kDefaultReceiveBatchSize    16
+
+static void usage() {
+  fprintf(stderr,
+          "usage: netvscsim [-m tx|rx|both] [-t seconds] [-f frame bytes] [-s send section bytes]\n"
+          "                 [-a receive suballocation bytes] [-b receive batch] [-r ring pages] [-v VLAN ID]\n");
+}
+
+static void printRate(const char *name, UInt64 packets, UInt64 bytes, double seconds) {
+  printf("%s: %llu packets, %.0f pps, %.3f Gbps\n", name, (unsigned long long)packets,
+         packets / seconds, (bytes * 8.0) / seconds / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+  bool   runTx         = true;
+  bool   runRx         = true;
+  UInt32 duration      = kDefaultDurationSeconds;
+  UInt32 frameSize     = kDefaultFrameSize;
+  UInt32 ringPages     = kHyperVNetworkRingBufferSize >> PAGE_SHIFT;
+
+  SimNetworkHostConfig config;
+  config.sendSectionSize      = kDefaultSendSectionSize;
+  config.receiveSubAllocSize  = kDefaultReceiveSubAllocSize;
+  config.receiveBatchSize     = kDefaultReceiveBatchSize;
+  config.vlanId               = 0;
+
+  int option;
+  while ((option = getopt(argc, argv, "m:t:f:s:a:b:r:v:h")) != -1) {
+    switch (option) {
+      case 'm':
+        runTx = strcmp(optarg, "rx") != 0;
+        runRx = strcmp(optarg, "tx") != 0;
+        break;
+      case 't':
+        duration = (UInt32)strtoul(optarg, NULL, 0);
+        break;
+      case 'f':
+        frameSize = (UInt32)strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        config.sendSectionSize = (UInt32)strtoul(optarg, NULL, 0);
+        break;
+      case 'a':
+        config.receiveSubAllocSize = (UInt32)strtoul(optarg, NULL, 0);
+        break;
+      case 'b':
+        config.receiveBatchSize = (UInt32)strtoul(optarg, NULL, 0);
+        break;
+      case 'r':
+        ringPages = (UInt32)strtoul(optarg, NULL, 0);
+        break;
+      case 'v':
+        config.vlanId = (UInt16)strtoul(optarg, NULL, 0);
+        break;
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+  config.receiveFrameSize = frameSize;
+
+  //
+  // Each received frame must fit in one suballocation, as Hyper-V does not split frames.
+  //
+  UInt32 receiveMsgLength = 8 + sizeof (HyperVNetworkRNDISMessageDataPacket)
+                            + (config.vlanId != 0 ? sizeof (HyperVNetworkRNDISPerPacketInfoIEEE8021Q) : 0) + frameSize;
+  if (duration == 0 || frameSize < 14 || ringPages == 0 || config.receiveBatchSize == 0
+      || config.receiveBatchSize > kSimHostMaxReceiveBatch || receiveMsgLength > config.receiveSubAllocSize
+      || config.sendSectionSize > kHyperVNetworkSendBufferSize || config.receiveSubAllocSize > kHyperVNetworkReceiveBufferSizeLegacy) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  SimGuestMemory  guestMemory;
+  SimVMBusChannel guestChannel;
+  SimVMBusChannel hostChannel;
+  if (!SimVMBusChannel::createChannelPair(ringPages << PAGE_SHIFT, ringPages << PAGE_SHIFT, &guestChannel, &hostChannel)) {
+    fprintf(stderr, "netvscsim: failed to allocate channel rings\n");
+    return EXIT_FAILURE;
+  }
+
+  SimNetworkHost  host(&hostChannel, &guestMemory, config);
+  SimNetworkGuest guest(&guestChannel, &guestMemory);
+
+  //
+  // Interrupt thread handles everything the host sends, including responses during setup.
+  //
+  std::atomic<bool> isInterruptRunning { true };
+  std::thread hostThread([&host] { host.run(); });
+  std::thread interruptThread([&guestChannel, &guest, &isInterruptRunning] {
+    while (isInterruptRunning) {
+      if (guestChannel.event.wait(100)) {
+        guest.handleInterrupt();
+      }
+    }
+  });
+
+  bool connected = guest.connectNetwork();
+  if (connected) {
+    printf("Protocol 0x%X, link %s, VLAN %u\n", guest.getProtocolVersion(), guest.isLinkUp ? "up" : "down", guest.vlanId);
+    printf("Send buffer: %u sections of %u bytes\n", guest.getSendSectionCount(), guest.getSendSectionSize());
+    printf("Receive buffer: %u suballocations of %u bytes, %u frames per indication\n",
+           guest.getReceiveSubAllocCount(), config.receiveSubAllocSize, config.receiveBatchSize);
+    printf("Ring size: %u bytes, frame size: %u bytes\n", ringPages << PAGE_SHIFT, frameSize);
+
+    guest.isEnabled = true;
+    UInt64 guestSignalsStart = guestChannel.getSignalCount();
+    UInt64 hostSignalsStart  = hostChannel.getSignalCount();
+    auto   startTime         = std::chrono::steady_clock::now();
+    auto   endTime           = startTime + std::chrono::seconds(duration);
+
+    if (runRx) {
+      host.isGeneratingReceives = true;
+    }
+
+    //
+    // TX thread acts as the output queue, a stalled packet is retried once a send section or ring space is freed.
+    //
+    std::vector<UInt8> frame(frameSize);
+    memset(frame.data(), 0xFF, 6);
+    for (UInt32 i = 6; i < frameSize; i++) {
+      frame[i] = (UInt8)i;
+    }
+
+    if (runTx) {
+      while (std::chrono::steady_clock::now() < endTime) {
+        for (UInt32 i = 0; i < 256; i++) {
+          UInt32 status = guest.sendRNDISDataPacket(frame.data(), frameSize, config.vlanId != 0, config.vlanId);
+          if (status == kSimOutputStall) {
+            guest.waitSendStall();
+          } else if (status == kSimOutputDropped) {
+            guest.outputErrors++;
+          }
+        }
+      }
+    } else {
+      std::this_thread::sleep_until(endTime);
+    }
+
+    host.isGeneratingReceives = false;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    if (runTx) {
+      printRate("TX", host.txPackets, host.txBytes, seconds);
+      printf("TX: %llu send stalls, %llu dropped on full ring, %llu errors, %llu host errors\n",
+             (unsigned long long)guest.sendStallCount, (unsigned long long)guest.txDroppedCount,
+             (unsigned long long)guest.outputErrors, (unsigned long long)host.txErrors);
+    }
+    if (runRx) {
+      printRate("RX", guest.inputPackets, guest.inputBytes, seconds);
+      printf("RX: %llu host ring full waits, %llu suballocation waits, %llu queued completions, %llu errors\n",
+             (unsigned long long)host.rxRingFullCount, (unsigned long long)host.rxNoSubAllocCount,
+             (unsigned long long)guest.rxCompletionQueuedCount, (unsigned long long)guest.inputErrors);
+      printf("RX ring: peak %u of %u bytes used, %llu passes above %u%%\n", guest.rxRingBytesUsedPeak,
+             guestChannel.getRxRingBufferSize(), (unsigned long long)guest.rxRingHighUsageCount, kHyperVNetworkRxRingHighUsage);
+    }
+    printf("Signals: %llu guest to host, %llu host to guest\n",
+           (unsigned long long)(guestChannel.getSignalCount() - guestSignalsStart),
+           (unsigned long long)(hostChannel.getSignalCount() - hostSignalsStart));
+  } else {
+    fprintf(stderr, "netvscsim: guest failed to connect\n");
+  }
+
+  host.isRunning = false;
+  hostThread.join();
+  isInterruptRunning = false;
+  interruptThread.join();
+
+  SimVMBusChannel::freeChannelPair(&guestChannel, &hostChannel);
+  return connected ? EXIT_SUCCESS : EXIT_FAILURE;
+}